@@ -14,11 +14,39 @@
 #include "wdc_defs.h"
 #include "../xdma_lib.h"
 
+/*************************************************************
+  Internal definitions
+ *************************************************************/
+/* Descriptors chains posted to an engine (KP_XDMA_MSG_CHAIN_POST), started
+ * one after the other by the interrupt DPC */
+typedef struct {
+    KP_XDMA_CHAIN_POST chains[KP_XDMA_CHAINS_MAX];
+    DWORD dwHead;               /* Index of the running chain */
+    DWORD dwCount;              /* Number of posted chains, including the
+                                   running one */
+} KP_XDMA_ENGINE_CHAINS;
+
+/* Kernel PlugIn driver context */
+typedef struct {
+    PWDC_DEVICE pDev;           /* Kernel copy of the device information */
+    DWORD dwConfigBarNum;
+    UINT32 u32IrqBitMasks[XDMA_CHANNELS_NUM * 2]; /* Interrupt request bit(s)
+                                                     of each engine */
+    KP_XDMA_SHARED *pShared;    /* Completion records shared with user mode.
+                                   NULL - completions are handled in user
+                                   mode */
+    KP_SPINLOCK *pChainsLock;   /* Protects engineChains and pShared, and
+                                   serializes the interrupt DPCs */
+    KP_XDMA_ENGINE_CHAINS engineChains[XDMA_CHANNELS_NUM * 2];
+} KP_XDMA_DRV_CTX;
+
 /*************************************************************
   Functions prototypes
  *************************************************************/
 BOOL __cdecl KP_XDMA_Open(KP_OPEN_CALL *kpOpenCall, HANDLE hWD, PVOID pOpenData,
     PVOID *ppDrvContext);
+BOOL __cdecl KP_XDMA_Open_32_64(KP_OPEN_CALL *kpOpenCall, HANDLE hWD,
+    PVOID pOpenData, PVOID *ppDrvContext);
 void __cdecl KP_XDMA_Close(PVOID pDrvContext);
 void __cdecl KP_XDMA_Call(PVOID pDrvContext, WD_KERNEL_PLUGIN_CALL *kpCall);
 BOOL __cdecl KP_XDMA_IntEnable(PVOID pDrvContext, WD_KERNEL_PLUGIN_CALL *kpCall,
@@ -37,6 +65,87 @@ static void KP_XDMA_Trace(const CHAR *sFormat, ...);
 /*************************************************************
   Functions implementation
  *************************************************************/
+/* Start a posted descriptors chain on an idle engine. Called with
+ * pChainsLock held */
+static void KP_XDMA_ChainStart(KP_XDMA_DRV_CTX *pDrvCtx, DWORD dwEngine,
+    const KP_XDMA_CHAIN_POST *pChain)
+{
+    PWDC_DEVICE pDev = pDrvCtx->pDev;
+    DWORD dwBar = pDrvCtx->dwConfigBarNum;
+    BOOL fToDevice = dwEngine < XDMA_CHANNELS_NUM;
+    DWORD dwChannel = dwEngine % XDMA_CHANNELS_NUM;
+    UINT32 u32Status;
+
+    /* Clear the status of the previous chain */
+    WDC_ReadAddr32(pDev, dwBar, XDMA_CHANNEL_OFFSET(dwChannel,
+        fToDevice ? XDMA_H2C_CHANNEL_STATUS_RC_OFFSET :
+        XDMA_C2H_CHANNEL_STATUS_RC_OFFSET), &u32Status);
+
+    WDC_WriteAddr32(pDev, dwBar, XDMA_CHANNEL_OFFSET(dwChannel,
+        fToDevice ? XDMA_H2C_SGDMA_DESC_LOW_OFFSET :
+        XDMA_C2H_SGDMA_DESC_LOW_OFFSET),
+        (UINT32)(pChain->u64DescAddr & 0xffffffff));
+    WDC_WriteAddr32(pDev, dwBar, XDMA_CHANNEL_OFFSET(dwChannel,
+        fToDevice ? XDMA_H2C_SGDMA_DESC_HIGH_OFFSET :
+        XDMA_C2H_SGDMA_DESC_HIGH_OFFSET),
+        (UINT32)(pChain->u64DescAddr >> 32));
+    WDC_WriteAddr32(pDev, dwBar, XDMA_CHANNEL_OFFSET(dwChannel,
+        fToDevice ? XDMA_H2C_SGDMA_DESC_ADJACENT_OFFSET :
+        XDMA_C2H_SGDMA_DESC_ADJACENT_OFFSET), pChain->u32Adjacent);
+
+    WDC_WriteAddr32(pDev, dwBar, XDMA_CHANNEL_OFFSET(dwChannel,
+        fToDevice ? XDMA_H2C_CHANNEL_CONTROL_OFFSET :
+        XDMA_C2H_CHANNEL_CONTROL_OFFSET), pChain->u32Control);
+
+    /* The interrupt DPC disabled the engine's interrupts */
+    WDC_WriteAddr32(pDev, dwBar,
+        XDMA_IRQ_BLOCK_CHANNEL_INT_ENABLE_MASK_W1S_OFFSET,
+        pDrvCtx->u32IrqBitMasks[dwEngine]);
+}
+
+/* Handle the completion interrupt of an engine with posted chains: Record
+ * the completed chain and start the next one. Returns FALSE if the engine
+ * has not completed its chain. Called with pChainsLock held */
+static BOOL KP_XDMA_ChainComplete(KP_XDMA_DRV_CTX *pDrvCtx, DWORD dwEngine)
+{
+    KP_XDMA_ENGINE_CHAINS *pChains = &pDrvCtx->engineChains[dwEngine];
+    KP_XDMA_ENGINE_RECORD *pRec = &pDrvCtx->pShared->engines[dwEngine];
+    PWDC_DEVICE pDev = pDrvCtx->pDev;
+    DWORD dwBar = pDrvCtx->dwConfigBarNum;
+    BOOL fToDevice = dwEngine < XDMA_CHANNELS_NUM;
+    DWORD dwChannel = dwEngine % XDMA_CHANNELS_NUM;
+    UINT32 u32Status;
+
+    WDC_ReadAddr32(pDev, dwBar, XDMA_CHANNEL_OFFSET(dwChannel,
+        fToDevice ? XDMA_H2C_CHANNEL_STATUS_RC_OFFSET :
+        XDMA_C2H_CHANNEL_STATUS_RC_OFFSET), &u32Status);
+    if ((u32Status & XDMA_STAT_BUSY) && !(u32Status & XDMA_STAT_ERR_MASK))
+    {
+        WDC_WriteAddr32(pDev, dwBar,
+            XDMA_IRQ_BLOCK_CHANNEL_INT_ENABLE_MASK_W1S_OFFSET,
+            pDrvCtx->u32IrqBitMasks[dwEngine]);
+        return FALSE;
+    }
+
+    WDC_WriteAddr32(pDev, dwBar, XDMA_CHANNEL_OFFSET(dwChannel,
+        fToDevice ? XDMA_H2C_CHANNEL_CONTROL_W1C_OFFSET :
+        XDMA_C2H_CHANNEL_CONTROL_W1C_OFFSET), XDMA_CTRL_RUN_STOP);
+
+    /* Published last: User mode reaps the chain by it */
+    pRec->u32ChainStatus[pRec->u32ChainsDone % KP_XDMA_CHAINS_MAX] =
+        u32Status;
+    pRec->u32ChainsDone++;
+
+    pChains->dwHead = (pChains->dwHead + 1) % KP_XDMA_CHAINS_MAX;
+    pChains->dwCount--;
+
+    /* A failed chain does not stop the following ones */
+    if (pChains->dwCount)
+        KP_XDMA_ChainStart(pDrvCtx, dwEngine,
+            &pChains->chains[pChains->dwHead]);
+
+    return TRUE;
+}
 
 /* KP_Init is called when the Kernel PlugIn driver is loaded.
    This function sets the name of the Kernel PlugIn driver and the driver's
@@ -54,9 +163,10 @@ BOOL __cdecl KP_Init(KP_INIT *kpInit)
         return FALSE;
     }
 
-    /* In this sample funcOpen and funcOpen_32_64 are identical */
+    /* A 32-bit application's device information is not copied, see
+       KP_XDMA_Open_32_64() */
     kpInit->funcOpen = KP_XDMA_Open;
-    kpInit->funcOpen_32_64 = KP_XDMA_Open;
+    kpInit->funcOpen_32_64 = KP_XDMA_Open_32_64;
 #if defined(WINNT)
     strcpy(kpInit->cDriverName, KP_XDMA_DRIVER_NAME);
 #else
@@ -68,17 +178,18 @@ BOOL __cdecl KP_Init(KP_INIT *kpInit)
     return TRUE;
 }
 
-/* KP_XDMA_Open is called when WD_KernelPlugInOpen() is called from the user
-   mode application to open a handle Kernel PlugIn.
-   In a scenario where a 32-bit user mode application calls a 64-bit Kernel
-   PlugIn, in this specific sample, no user-space data is copied to the
-   kernel-space, so there is no need to adjust 32bit data (pointers) to 64bit,
-   etc, thus funcOpen_32_64 is mapped the same as funcOpen.
-   pDrvContext will be passed to the rest of the Kernel PlugIn callback
-   functions (even though it is not used). */
-BOOL __cdecl KP_XDMA_Open(KP_OPEN_CALL *kpOpenCall, HANDLE hWD,
-    PVOID pOpenData, PVOID *ppDrvContext)
+/* Open the Kernel PlugIn driver context. With fCopyDevice a kernel copy of
+   the user mode device information, pointed to by pOpenData, is kept in the
+   driver context */
+static BOOL KP_XDMA_OpenCtx(KP_OPEN_CALL *kpOpenCall, PVOID pOpenData,
+    PVOID *ppDrvContext, BOOL fCopyDevice)
 {
+    KP_XDMA_DRV_CTX *pDrvCtx;
+    PWDC_DEVICE pDev;
+    WDC_ADDR_DESC *pAddrDesc;
+    PVOID pTemp;
+    DWORD dwSize;
+
     /* Initialize the XDMA library */
     if (WD_STATUS_SUCCESS != XDMA_LibInit(NULL))
     {
@@ -87,6 +198,52 @@ BOOL __cdecl KP_XDMA_Open(KP_OPEN_CALL *kpOpenCall, HANDLE hWD,
         return FALSE;
     }
 
+    pDrvCtx = (KP_XDMA_DRV_CTX *)malloc(sizeof(KP_XDMA_DRV_CTX));
+    if (!pDrvCtx)
+    {
+        KP_XDMA_Err("KP_XDMA_Open: Failed allocating driver context\n");
+        goto Error;
+    }
+    BZERO(*pDrvCtx);
+
+    if (!fCopyDevice)
+        goto Opened;
+
+    /* Create a copy of the device information in the driver context */
+    pDev = (PWDC_DEVICE)malloc(sizeof(WDC_DEVICE));
+    if (!pDev)
+    {
+        KP_XDMA_Err("KP_XDMA_Open: Failed allocating device information\n");
+        goto Error;
+    }
+    pDrvCtx->pDev = pDev;
+    COPY_FROM_USER(&pTemp, pOpenData, sizeof(PVOID));
+    COPY_FROM_USER(pDev, pTemp, sizeof(WDC_DEVICE));
+
+    dwSize = sizeof(WDC_ADDR_DESC) * pDev->dwNumAddrSpaces;
+    pAddrDesc = (WDC_ADDR_DESC *)malloc(dwSize);
+    if (!pAddrDesc)
+    {
+        KP_XDMA_Err("KP_XDMA_Open: Failed allocating address spaces "
+            "information\n");
+        pDev->pAddrDesc = NULL;
+        goto Error;
+    }
+    COPY_FROM_USER(pAddrDesc, pDev->pAddrDesc, dwSize);
+    pDev->pAddrDesc = pAddrDesc;
+
+    /* The user mode device context is not accessible from the Kernel
+     * PlugIn */
+    pDev->pCtx = NULL;
+
+Opened:
+    pDrvCtx->pChainsLock = kp_spinlock_init();
+    if (!pDrvCtx->pChainsLock)
+    {
+        KP_XDMA_Err("KP_XDMA_Open: Failed creating chains spinlock\n");
+        goto Error;
+    }
+
     KP_XDMA_Trace("KP_XDMA_Open: Entered. XDMA library initialized.\n");
 
     kpOpenCall->funcClose = KP_XDMA_Close;
@@ -99,20 +256,72 @@ BOOL __cdecl KP_XDMA_Open(KP_OPEN_CALL *kpOpenCall, HANDLE hWD,
     kpOpenCall->funcIntAtDpcMSI = KP_XDMA_IntAtDpcMSI;
     kpOpenCall->funcEvent = KP_XDMA_Event;
 
-    /* In this sample the driver context is not used. */
-    *ppDrvContext = NULL;
+    *ppDrvContext = pDrvCtx;
 
     KP_XDMA_Trace("KP_XDMA_Open: Kernel PlugIn driver opened successfully\n");
 
     return TRUE;
+
+Error:
+    if (pDrvCtx)
+    {
+        if (pDrvCtx->pChainsLock)
+            kp_spinlock_uninit(pDrvCtx->pChainsLock);
+        if (pDrvCtx->pDev && pDrvCtx->pDev->pAddrDesc)
+            free(pDrvCtx->pDev->pAddrDesc);
+        if (pDrvCtx->pDev)
+            free(pDrvCtx->pDev);
+        free(pDrvCtx);
+    }
+    XDMA_LibUninit();
+
+    return FALSE;
+}
+
+/* KP_XDMA_Open is called when WD_KernelPlugInOpen() is called from the user
+   mode application to open a handle Kernel PlugIn.
+   pOpenData is the user mode device handle: A kernel copy of the device
+   information is kept in the driver context, for accessing the device from
+   the interrupt DPC.
+   pDrvContext will be passed to the rest of the Kernel PlugIn callback
+   functions. */
+BOOL __cdecl KP_XDMA_Open(KP_OPEN_CALL *kpOpenCall, HANDLE hWD,
+    PVOID pOpenData, PVOID *ppDrvContext)
+{
+    return KP_XDMA_OpenCtx(kpOpenCall, pOpenData, ppDrvContext, TRUE);
+}
+
+/* KP_XDMA_Open_32_64 is called instead of KP_XDMA_Open when a 32-bit user
+   mode application opens a handle to the 64-bit Kernel PlugIn.
+   The 32-bit WDC_DEVICE layout (pointers) differs from the 64-bit one, so the
+   device information is not copied: The messages that access the device
+   (KP_XDMA_MSG_INT_INIT, KP_XDMA_MSG_REG_BATCH) fail, and the application
+   handles completions and register accesses in user mode. */
+BOOL __cdecl KP_XDMA_Open_32_64(KP_OPEN_CALL *kpOpenCall, HANDLE hWD,
+    PVOID pOpenData, PVOID *ppDrvContext)
+{
+    return KP_XDMA_OpenCtx(kpOpenCall, pOpenData, ppDrvContext, FALSE);
 }
 
 /* KP_XDMA_Close is called when WD_KernelPlugInClose() is called from the
    user mode */
 void __cdecl KP_XDMA_Close(PVOID pDrvContext)
 {
+    KP_XDMA_DRV_CTX *pDrvCtx = (KP_XDMA_DRV_CTX *)pDrvContext;
+
     KP_XDMA_Trace("KP_XDMA_Close entered\n");
 
+    if (pDrvCtx)
+    {
+        kp_spinlock_uninit(pDrvCtx->pChainsLock);
+        if (pDrvCtx->pDev)
+        {
+            free(pDrvCtx->pDev->pAddrDesc);
+            free(pDrvCtx->pDev);
+        }
+        free(pDrvCtx);
+    }
+
     /* Uninit the XDMA library */
     if (WD_STATUS_SUCCESS != XDMA_LibUninit())
     {
@@ -125,6 +334,8 @@ void __cdecl KP_XDMA_Close(PVOID pDrvContext)
    user mode */
 void __cdecl KP_XDMA_Call(PVOID pDrvContext, WD_KERNEL_PLUGIN_CALL *kpCall)
 {
+    KP_XDMA_DRV_CTX *pDrvCtx = (KP_XDMA_DRV_CTX *)pDrvContext;
+
     KP_XDMA_Trace("KP_XDMA_Call: Entered. Message [0x%lx]\n", kpCall->dwMessage);
 
     kpCall->dwResult = KP_XDMA_STATUS_OK;
@@ -145,6 +356,91 @@ void __cdecl KP_XDMA_Call(PVOID pDrvContext, WD_KERNEL_PLUGIN_CALL *kpCall)
         }
         break;
 
+    case KP_XDMA_MSG_INT_INIT: /* Set up completion handling in the DPC */
+        {
+            KP_XDMA_INT_INIT intInit;
+
+            COPY_FROM_USER(&intInit, kpCall->pData, sizeof(KP_XDMA_INT_INIT));
+            if (!pDrvCtx->pDev ||
+                intInit.dwConfigBarNum >= pDrvCtx->pDev->dwNumAddrSpaces)
+            {
+                kpCall->dwResult = KP_XDMA_STATUS_FAILED;
+                break;
+            }
+
+            /* Sent before interrupts are enabled, so the DPC does not run
+             * concurrently */
+            pDrvCtx->dwConfigBarNum = intInit.dwConfigBarNum;
+            memcpy(pDrvCtx->u32IrqBitMasks, intInit.u32IrqBitMasks,
+                sizeof(pDrvCtx->u32IrqBitMasks));
+            pDrvCtx->pShared =
+                (KP_XDMA_SHARED *)(UPTR)intInit.u64SharedKernelAddr;
+            kpCall->dwResult = KP_XDMA_STATUS_OK;
+        }
+        break;
+
+    case KP_XDMA_MSG_REG_BATCH: /* Run a batch of register accesses */
+        {
+            KP_XDMA_REG_BATCH batch;
+
+            COPY_FROM_USER(&batch, kpCall->pData, sizeof(KP_XDMA_REG_BATCH));
+            if (!pDrvCtx->pDev ||
+                batch.dwAddrSpace >= pDrvCtx->pDev->dwNumAddrSpaces ||
+                WD_STATUS_SUCCESS != XDMA_RegBatchExec(
+                (WDC_DEVICE_HANDLE)pDrvCtx->pDev, &batch))
+            {
+                kpCall->dwResult = KP_XDMA_STATUS_FAILED;
+                break;
+            }
+
+            /* Return the read values */
+            COPY_TO_USER(kpCall->pData, &batch, sizeof(KP_XDMA_REG_BATCH));
+            kpCall->dwResult = KP_XDMA_STATUS_OK;
+        }
+        break;
+
+    case KP_XDMA_MSG_CHAIN_POST: /* Post a chain to the interrupt DPC */
+        {
+            KP_XDMA_CHAIN_POST post;
+            KP_XDMA_ENGINE_CHAINS *pChains;
+
+            COPY_FROM_USER(&post, kpCall->pData, sizeof(KP_XDMA_CHAIN_POST));
+            if (post.dwEngine >= XDMA_CHANNELS_NUM * 2 ||
+                !pDrvCtx->u32IrqBitMasks[post.dwEngine])
+            {
+                kpCall->dwResult = KP_XDMA_STATUS_FAILED;
+                break;
+            }
+
+            pChains = &pDrvCtx->engineChains[post.dwEngine];
+            kp_spinlock_wait(pDrvCtx->pChainsLock);
+            if (!post.u64DescAddr)
+            {
+                /* Stop the engine and drop the posted chains */
+                WDC_WriteAddr32(pDrvCtx->pDev, pDrvCtx->dwConfigBarNum,
+                    XDMA_CHANNEL_OFFSET(post.dwEngine % XDMA_CHANNELS_NUM,
+                    post.dwEngine < XDMA_CHANNELS_NUM ?
+                    XDMA_H2C_CHANNEL_CONTROL_OFFSET :
+                    XDMA_C2H_CHANNEL_CONTROL_OFFSET), 0);
+                pChains->dwCount = 0;
+            }
+            else if (!pDrvCtx->pShared ||
+                pChains->dwCount == KP_XDMA_CHAINS_MAX)
+            {
+                kpCall->dwResult = KP_XDMA_STATUS_FAILED;
+            }
+            else
+            {
+                pChains->chains[(pChains->dwHead + pChains->dwCount) %
+                    KP_XDMA_CHAINS_MAX] = post;
+                /* An idle engine is started at once */
+                if (!pChains->dwCount++)
+                    KP_XDMA_ChainStart(pDrvCtx, post.dwEngine, &post);
+            }
+            kp_spinlock_release(pDrvCtx->pChainsLock);
+        }
+        break;
+
     default:
         kpCall->dwResult = KP_XDMA_STATUS_MSG_NO_IMPL;
     }
@@ -164,10 +460,9 @@ BOOL __cdecl KP_XDMA_IntEnable(PVOID pDrvContext, WD_KERNEL_PLUGIN_CALL *kpCall,
 {
     KP_XDMA_Trace("KP_XDMA_IntEnable: Entered\n");
 
-    /* You can allocate specific memory for each interrupt in *ppIntContext */
-
-    /* In this sample the interrupt context in not used */
-    *ppIntContext = NULL;
+    /* The interrupt functions access the device through the driver
+     * context */
+    *ppIntContext = pDrvContext;
 
     /* TODO: You can add code here to write to the device in order
              to physically enable the hardware interrupts */
@@ -179,7 +474,19 @@ BOOL __cdecl KP_XDMA_IntEnable(PVOID pDrvContext, WD_KERNEL_PLUGIN_CALL *kpCall,
    mode with a Kernel PlugIn handle */
 void __cdecl KP_XDMA_IntDisable(PVOID pIntContext)
 {
-    /* Free any memory allocated in KP_XDMA_IntEnable() here */
+    KP_XDMA_DRV_CTX *pDrvCtx = (KP_XDMA_DRV_CTX *)pIntContext;
+    DWORD i;
+
+    if (!pDrvCtx)
+        return;
+
+    /* The shared buffer is freed by user mode once interrupts are
+     * disabled. Posted chains can no longer be started */
+    kp_spinlock_wait(pDrvCtx->pChainsLock);
+    pDrvCtx->pShared = NULL;
+    for (i = 0; i < XDMA_CHANNELS_NUM * 2; i++)
+        pDrvCtx->engineChains[i].dwCount = 0;
+    kp_spinlock_release(pDrvCtx->pChainsLock);
 }
 
 /* KP_XDMA_IntAtIrql returns TRUE if deferred interrupt processing (DPC) for
@@ -257,7 +564,87 @@ BOOL __cdecl KP_XDMA_IntAtIrqlMSI(PVOID pIntContext, ULONG dwLastMessage,
 DWORD __cdecl KP_XDMA_IntAtDpcMSI(PVOID pIntContext, DWORD dwCount,
     ULONG dwLastMessage, DWORD dwReserved)
 {
-    return dwCount;
+    KP_XDMA_DRV_CTX *pDrvCtx = (KP_XDMA_DRV_CTX *)pIntContext;
+    PWDC_DEVICE pDev;
+    DWORD i, dwBar, dwNotify = 1;
+    UINT32 u32IntRequest;
+
+    if (!pDrvCtx)
+        return dwCount;
+
+    pDev = pDrvCtx->pDev;
+    dwBar = pDrvCtx->dwConfigBarNum;
+
+    /* The DPCs of different MSI-X vectors may run concurrently
+     * (XDMA_INT_OPT_PER_ENGINE), and each reads the requests of all the
+     * engines. Read and disable the requests under the lock, so that each
+     * request is handled by a single DPC */
+    kp_spinlock_wait(pDrvCtx->pChainsLock);
+    if (!pDrvCtx->pShared)
+    {
+        dwNotify = dwCount;
+        goto Exit;
+    }
+
+    WDC_ReadAddr32(pDev, dwBar, XDMA_IRQ_BLOCK_CHANNEL_INT_REQUEST_OFFSET,
+        &u32IntRequest);
+    if (!u32IntRequest)
+    {
+        dwNotify = 0;
+        goto Exit;
+    }
+
+    /* Disable interrupts of completed engines. User mode re-enables them when
+     * it next starts the engine */
+    WDC_WriteAddr32(pDev, dwBar,
+        XDMA_IRQ_BLOCK_CHANNEL_INT_ENABLE_MASK_W1C_OFFSET, u32IntRequest);
+
+    for (i = 0; i < XDMA_CHANNELS_NUM * 2; i++)
+    {
+        KP_XDMA_ENGINE_RECORD *pRec = &pDrvCtx->pShared->engines[i];
+        BOOL fToDevice = i < XDMA_CHANNELS_NUM;
+        DWORD dwChannel = i % XDMA_CHANNELS_NUM;
+
+        if (!(u32IntRequest & pDrvCtx->u32IrqBitMasks[i]))
+            continue;
+
+        /* Start the next posted chain before notifying user mode */
+        if (pDrvCtx->engineChains[i].dwCount)
+        {
+            if (KP_XDMA_ChainComplete(pDrvCtx, i))
+                pRec->u32Completions++;
+            continue;
+        }
+
+        if (pRec->u32Flags & KP_XDMA_ENGINE_KEEP_RUNNING)
+        {
+            WDC_ReadAddr32(pDev, dwBar, XDMA_CHANNEL_OFFSET(dwChannel,
+                fToDevice ? XDMA_H2C_CHANNEL_STATUS_OFFSET :
+                XDMA_C2H_CHANNEL_STATUS_OFFSET), &pRec->u32DmaStatus);
+        }
+        else
+        {
+            /* Read and clear the engine status, and stop the engine */
+            WDC_ReadAddr32(pDev, dwBar, XDMA_CHANNEL_OFFSET(dwChannel,
+                fToDevice ? XDMA_H2C_CHANNEL_STATUS_RC_OFFSET :
+                XDMA_C2H_CHANNEL_STATUS_RC_OFFSET), &pRec->u32DmaStatus);
+            WDC_WriteAddr32(pDev, dwBar, XDMA_CHANNEL_OFFSET(dwChannel,
+                fToDevice ? XDMA_H2C_CHANNEL_CONTROL_W1C_OFFSET :
+                XDMA_C2H_CHANNEL_CONTROL_W1C_OFFSET), XDMA_CTRL_RUN_STOP);
+        }
+
+        WDC_ReadAddr32(pDev, dwBar, XDMA_CHANNEL_OFFSET(dwChannel,
+            fToDevice ? XDMA_H2C_CHANNEL_COMPLETED_DESC_COUNT_OFFSET :
+            XDMA_C2H_CHANNEL_COMPLETED_DESC_COUNT_OFFSET),
+            &pRec->u32CompletedDescs);
+
+        /* Published last: User mode detects the completion by it */
+        pRec->u32Completions++;
+    }
+
+Exit:
+    kp_spinlock_release(pDrvCtx->pChainsLock);
+    return dwNotify;
 }
 
 /* KP_XDMA_Event is called when a Plug-and-Play/power management event for
@@ -0,0 +1,248 @@
+/* Jungo Connectivity Confidential. Copyright (c) 2023 Jungo Connectivity Ltd.  https://www.jungo.com */
+
+/****************************************************************************
+*  File: xdma_desc.c
+*
+*  Xilinx XDMA descriptors chain builder.
+*
+*  A chain is written in one pass over the DMA pages. Where SSE2/AVX is
+*  available (user mode x86/x64), every 32 byte descriptor is assembled in
+*  vector registers and written with a single wide store, which can be a
+*  non-temporal (streaming) store, since the descriptors are read by the
+*  engine and not by the CPU.
+*
+*  Note: This code sample is provided AS-IS and as a guiding sample only.
+*****************************************************************************/
+
+#include "xdma_desc.h"
+
+#if !defined(__KERNEL__) && (defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+    #include <emmintrin.h>
+    #define XDMA_DESC_SSE2
+    #if defined(__AVX__)
+        #include <immintrin.h>
+        #define XDMA_DESC_AVX
+    #endif
+#endif
+
+/* Alignment required for vector descriptor stores */
+#if defined(XDMA_DESC_AVX)
+    #define XDMA_DESC_STORE_ALIGN 32
+#else
+    #define XDMA_DESC_STORE_ALIGN 16
+#endif
+
+/*************************************************************
+  Static functions
+ *************************************************************/
+static inline UINT32 DescAdjacentGet(UINT64 u64NextPhys, DWORD dwRemaining)
+{
+    DWORD dwToBoundary, dwAdjacent;
+
+    if (dwRemaining <= 1)
+        return 0;
+
+    dwToBoundary = (XDMA_DESC_FETCH_BOUNDARY -
+        (DWORD)(u64NextPhys & (XDMA_DESC_FETCH_BOUNDARY - 1))) /
+        sizeof(XDMA_DMA_DESC);
+
+    dwAdjacent = dwRemaining - 1;
+    if (dwAdjacent > dwToBoundary - 1)
+        dwAdjacent = dwToBoundary - 1;
+    if (dwAdjacent > XDMA_MAX_ADJACENT)
+        dwAdjacent = XDMA_MAX_ADJACENT;
+
+    return dwAdjacent;
+}
+
+/* Write a complete descriptor */
+static inline void DescStore(XDMA_DMA_DESC *pDesc, UINT32 u32Control,
+    UINT32 u32Bytes, UINT64 u64SrcAddr, UINT64 u64DstAddr, UINT64 u64NextDesc,
+    BOOL fVector, BOOL fStream)
+{
+#if defined(XDMA_DESC_AVX)
+    if (fVector)
+    {
+        __m256i desc = _mm256_set_epi64x((long long)u64NextDesc,
+            (long long)u64DstAddr, (long long)u64SrcAddr,
+            (long long)(((UINT64)u32Bytes << 32) | u32Control));
+
+        if (fStream)
+            _mm256_stream_si256((__m256i *)pDesc, desc);
+        else
+            _mm256_store_si256((__m256i *)pDesc, desc);
+        return;
+    }
+#elif defined(XDMA_DESC_SSE2)
+    if (fVector)
+    {
+        __m128i lo = _mm_set_epi64x((long long)u64SrcAddr,
+            (long long)(((UINT64)u32Bytes << 32) | u32Control));
+        __m128i hi = _mm_set_epi64x((long long)u64NextDesc,
+            (long long)u64DstAddr);
+
+        if (fStream)
+        {
+            _mm_stream_si128((__m128i *)pDesc, lo);
+            _mm_stream_si128((__m128i *)pDesc + 1, hi);
+        }
+        else
+        {
+            _mm_store_si128((__m128i *)pDesc, lo);
+            _mm_store_si128((__m128i *)pDesc + 1, hi);
+        }
+        return;
+    }
+#else
+    UNUSED_VAR(fVector);
+    UNUSED_VAR(fStream);
+#endif
+
+    pDesc->u32Control = u32Control;
+    pDesc->u32Bytes = u32Bytes;
+    pDesc->u64SrcAddr = u64SrcAddr;
+    pDesc->u64DstAddr = u64DstAddr;
+    pDesc->u64NextDesc = u64NextDesc;
+}
+
+/*************************************************************
+  Functions implementation
+ *************************************************************/
+DWORD XDMA_DescCount(const WD_DMA_PAGE *pPages, DWORD dwPages,
+    DWORD dwMaxBytes)
+{
+    DWORD i, dwDescs = 0;
+
+    for (i = 0; i < dwPages; i++)
+    {
+        DWORD dwBytes = pPages[i].dwBytes;
+
+        dwDescs += dwBytes <= dwMaxBytes ? (dwBytes ? 1 : 0) :
+            (dwBytes + dwMaxBytes - 1) / dwMaxBytes;
+    }
+
+    return dwDescs;
+}
+
+UINT32 XDMA_DescAdjacentGet(UINT64 u64NextPhys, DWORD dwRemaining)
+{
+    return DescAdjacentGet(u64NextPhys, dwRemaining);
+}
+
+UINT32 XDMA_DescChainLink(XDMA_DMA_DESC *desc, DMA_ADDR desc_phys,
+    DWORD dwDescs, BOOL fRing)
+{
+    DWORD i, dwNext;
+    UINT64 u64NextPhys;
+
+    for (i = 0; i < dwDescs; i++)
+    {
+        desc[i].u32Control &= ~XDMA_DESC_ADJACENT_MASK;
+
+        dwNext = i + 1;
+        if (dwNext == dwDescs)
+        {
+            if (!fRing)
+            {
+                desc[i].u64NextDesc = 0;
+                break;
+            }
+            dwNext = 0;
+        }
+
+        u64NextPhys = (UINT64)(desc_phys + dwNext * sizeof(XDMA_DMA_DESC));
+        desc[i].u64NextDesc = u64NextPhys;
+        desc[i].u32Control |= DescAdjacentGet(u64NextPhys,
+            dwDescs - dwNext) << XDMA_DESC_ADJACENT_SHIFT;
+    }
+
+    return DescAdjacentGet((UINT64)desc_phys, dwDescs);
+}
+
+DWORD XDMA_DescChainBuild(XDMA_DMA_DESC *desc, DMA_ADDR desc_phys,
+    const WD_DMA_PAGE *pPages, DWORD dwPages, const XDMA_DESC_CHAIN *pChain,
+    UINT32 *pu32Adjacent)
+{
+    /* Chain parameters are copied to locals, as the descriptor stores may
+     * alias them */
+    DWORD dwMaxBytes = pChain->dwMaxBytes;
+    DWORD dwDescs = XDMA_DescCount(pPages, dwPages, dwMaxBytes);
+    UINT64 offset = pChain->u64FPGAOffset;
+    UINT64 u64Inc = pChain->fNonIncMode ? 0 : 1;
+    BOOL fToDevice = pChain->fToDevice;
+    BOOL fVector = !((UPTR)desc & (XDMA_DESC_STORE_ALIGN - 1));
+    BOOL fStream = fVector && pChain->fStream &&
+        dwDescs >= XDMA_DESC_STREAM_MIN_DESCS;
+    UINT64 u64NextPhys = (UINT64)desc_phys;
+    DWORD dwToBoundary, dwRemaining = dwDescs;
+    XDMA_DMA_DESC *pDesc = desc;
+    DWORD i;
+
+    *pu32Adjacent = 0;
+    if (!dwDescs)
+        return 0;
+
+    /* Number of descriptors up to the next fetch boundary, counted from the
+     * first descriptor, and kept up to date as descriptors are written */
+    dwToBoundary = (XDMA_DESC_FETCH_BOUNDARY -
+        (DWORD)(u64NextPhys & (XDMA_DESC_FETCH_BOUNDARY - 1))) /
+        sizeof(XDMA_DMA_DESC);
+
+    for (i = 0; i < dwPages; i++)
+    {
+        UINT64 addr = (UINT64)pPages[i].pPhysicalAddr;
+        DWORD dwLeft = pPages[i].dwBytes;
+
+        /* Split pages larger than a descriptor can transfer. This happens
+         * only when adjacent pages are merged */
+        while (dwLeft)
+        {
+            DWORD dwBytes = dwLeft < dwMaxBytes ? dwLeft : dwMaxBytes;
+            UINT32 u32Control = XDMA_DESC_MAGIC;
+            UINT64 u64Next = 0;
+
+            u64NextPhys += sizeof(XDMA_DMA_DESC);
+            if (!--dwToBoundary)
+                dwToBoundary = XDMA_DESC_FETCH_BOUNDARY / sizeof(XDMA_DMA_DESC);
+
+            if (!--dwRemaining)
+            {
+                /* Last descriptor */
+                u32Control |= XDMA_DESC_STOPPED | XDMA_DESC_EOP |
+                    XDMA_DESC_COMPLETED;
+            }
+            else
+            {
+                /* Same as DescAdjacentGet(u64Next, dwRemaining) */
+                DWORD dwAdjacent = dwRemaining - 1;
+
+                if (dwAdjacent > dwToBoundary - 1)
+                    dwAdjacent = dwToBoundary - 1;
+                if (dwAdjacent > XDMA_MAX_ADJACENT)
+                    dwAdjacent = XDMA_MAX_ADJACENT;
+
+                u64Next = u64NextPhys;
+                u32Control |= dwAdjacent << XDMA_DESC_ADJACENT_SHIFT;
+            }
+
+            DescStore(pDesc++, u32Control, dwBytes,
+                fToDevice ? addr : offset, fToDevice ? offset : addr, u64Next,
+                fVector, fStream);
+
+            offset += dwBytes * u64Inc;
+            addr += dwBytes;
+            dwLeft -= dwBytes;
+        }
+    }
+
+#if defined(XDMA_DESC_SSE2)
+    /* Order the non-temporal stores before the engine is started */
+    if (fStream)
+        _mm_sfence();
+#endif
+
+    *pu32Adjacent = DescAdjacentGet((UINT64)desc_phys, dwDescs);
+
+    return dwDescs;
+}
@@ -0,0 +1,79 @@
+/* Jungo Connectivity Confidential. Copyright (c) 2023 Jungo Connectivity Ltd.  https://www.jungo.com */
+
+/****************************************************************************
+*  File: xdma_desc.h
+*
+*  Header for the Xilinx XDMA descriptors chain builder, used by xdma_lib.c
+*  and by the descriptors build microbenchmark (xdma_desc_bench.c).
+*
+*  Note: This code sample is provided AS-IS and as a guiding sample only.
+*****************************************************************************/
+
+#ifndef _XDMA_DESC_H_
+#define _XDMA_DESC_H_
+
+#include "xdma_lib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define XDMA_MAX_ADJACENT 15
+#define XDMA_DESC_FETCH_BOUNDARY 0x1000 /* Adjacent descriptors fetch must not
+                                           cross a 4KB boundary */
+#define XDMA_DESC_MAX_BYTES 0x0FFFFFFF /* Maximal transfer size of a single
+                                          descriptor */
+
+/* Minimal chain length for non-temporal descriptor stores. The store fence
+ * that follows them costs more than the cache lines they save on shorter
+ * chains */
+#define XDMA_DESC_STREAM_MIN_DESCS 1024
+
+/* Descriptors chain build parameters */
+typedef struct {
+    UINT64 u64FPGAOffset;   /* FPGA offset of the first descriptor */
+    DWORD dwMaxBytes;       /* Maximal number of bytes per descriptor */
+    BOOL fToDevice;         /* Host to card (H2C) chain */
+    BOOL fNonIncMode;       /* All the descriptors use u64FPGAOffset */
+    BOOL fStream;           /* Write the descriptors with non-temporal stores,
+                               bypassing the CPU caches, when the CPU does
+                               not read the descriptors back. Applies to
+                               chains of XDMA_DESC_STREAM_MIN_DESCS
+                               descriptors or more */
+} XDMA_DESC_CHAIN;
+
+/* Returns the number of descriptors needed to describe dwPages pages, when
+ * a descriptor transfers up to dwMaxBytes bytes */
+DWORD XDMA_DescCount(const WD_DMA_PAGE *pPages, DWORD dwPages,
+    DWORD dwMaxBytes);
+
+/* Returns the number of descriptors, following the descriptor at
+ * u64NextPhys in the (physically contiguous) descriptors buffer, that the
+ * engine can fetch in the same burst. dwRemaining is the number of
+ * descriptors from u64NextPhys up to the end of the descriptors array */
+UINT32 XDMA_DescAdjacentGet(UINT64 u64NextPhys, DWORD dwRemaining);
+
+/* Link dwDescs consecutive descriptors into a chain and set the Nxt_adj
+ * field of each descriptor, so that the engine fetches runs of adjacent
+ * descriptors in bursts. If fRing is set, the last descriptor points back to
+ * the first one. Returns the adjacent descriptors count of the first
+ * descriptor */
+UINT32 XDMA_DescChainLink(XDMA_DMA_DESC *desc, DMA_ADDR desc_phys,
+    DWORD dwDescs, BOOL fRing);
+
+/* Build the linked descriptors chain of a transfer of dwPages pages into
+ * desc, in a single pass: Each descriptor is written once, complete with its
+ * next descriptor address and Nxt_adj field. The last descriptor stops the
+ * engine. Pages larger than pChain->dwMaxBytes are split. desc must have
+ * room for XDMA_DescCount() descriptors.
+ * Returns the number of descriptors. *pu32Adjacent is set to the adjacent
+ * descriptors count of the first descriptor */
+DWORD XDMA_DescChainBuild(XDMA_DMA_DESC *desc, DMA_ADDR desc_phys,
+    const WD_DMA_PAGE *pPages, DWORD dwPages, const XDMA_DESC_CHAIN *pChain,
+    UINT32 *pu32Adjacent);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _XDMA_DESC_H_ */
@@ -0,0 +1,236 @@
+/* Jungo Connectivity Confidential. Copyright (c) 2023 Jungo Connectivity Ltd.  https://www.jungo.com */
+
+/****************************************************************************
+*  File: xdma_desc_bench.c
+*
+*  Descriptors build microbenchmark (xdma_desc_bench). Measures the host CPU
+*  cost of building the descriptors chain of a transfer, for chains of
+*  increasing length, with:
+*    - reference: The former build of xdma_lib.c - clearing the descriptors
+*      area, filling the descriptors field by field and linking them in a
+*      second pass
+*    - single pass: XDMA_DescChainBuild() with regular stores
+*    - streaming: XDMA_DescChainBuild() with non-temporal stores, as used by
+*      xdma_lib.c (chains of XDMA_DESC_STREAM_MIN_DESCS descriptors or more)
+*  The chains built by XDMA_DescChainBuild() are verified against the
+*  reference chains. No device is needed.
+*
+*  Usage: xdma_desc_bench [descriptors ...]
+*
+*  Note: This code sample is provided AS-IS and as a guiding sample only.
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xdma_desc.h"
+
+#define BENCH_PAGE_SIZE 4096
+#define BENCH_MIN_NS 200000000ULL /* Minimal measurement time: 200 msec */
+#define BENCH_BATCH 16
+#define BENCH_DESC_MAX 0x100000
+#define BENCH_TXN_DESCS 4097 /* Transaction mode descriptors buffer */
+
+/* Transaction transfers are up to 4096 pages
+ * (XDMA_TRANSACTION_SAMPLE_MAX_TRANSFER_SIZE) */
+static const DWORD gdwDefaultDescs[] = { 1, 16, 256, 4096, 65536 };
+
+/* Fake host pages, at discontiguous addresses */
+static void BenchPagesInit(WD_DMA_PAGE *pPages, DWORD dwPages)
+{
+    DWORD i;
+
+    for (i = 0; i < dwPages; i++)
+    {
+        pPages[i].pPhysicalAddr = (DMA_ADDR)(0x100000000ULL +
+            (UINT64)i * 3 * BENCH_PAGE_SIZE);
+        pPages[i].dwBytes = BENCH_PAGE_SIZE;
+    }
+}
+
+/* The descriptors build of xdma_lib.c before XDMA_DescChainBuild(). The
+ * whole descriptors buffer was cleared: In transaction mode, the buffer has
+ * room for a transfer of XDMA_TRANSACTION_SAMPLE_MAX_TRANSFER_SIZE bytes */
+static DWORD BenchReferenceBuild(XDMA_DMA_DESC *desc, DMA_ADDR desc_phys,
+    const WD_DMA_PAGE *pPages, DWORD dwPages, const XDMA_DESC_CHAIN *pChain,
+    UINT32 *pu32Adjacent)
+{
+    UINT64 offset = pChain->u64FPGAOffset;
+    DWORD i, dwDescs = 0;
+
+    memset(desc, 0, (dwPages > BENCH_TXN_DESCS ? dwPages : BENCH_TXN_DESCS) *
+        sizeof(XDMA_DMA_DESC));
+
+    for (i = 0; i < dwPages; i++)
+    {
+        DMA_ADDR addr = pPages[i].pPhysicalAddr;
+        DWORD dwLeft = pPages[i].dwBytes;
+
+        while (dwLeft)
+        {
+            DWORD dwBytes = dwLeft < pChain->dwMaxBytes ? dwLeft :
+                pChain->dwMaxBytes;
+
+            desc[dwDescs].u32Control = XDMA_DESC_MAGIC;
+            if (pChain->fToDevice)
+            {
+                desc[dwDescs].u64SrcAddr = addr;
+                desc[dwDescs].u64DstAddr = offset;
+            }
+            else
+            {
+                desc[dwDescs].u64SrcAddr = offset;
+                desc[dwDescs].u64DstAddr = addr;
+            }
+
+            desc[dwDescs].u32Bytes = dwBytes;
+            if (!pChain->fNonIncMode)
+                offset += dwBytes;
+
+            addr += dwBytes;
+            dwLeft -= dwBytes;
+            dwDescs++;
+        }
+    }
+
+    desc[dwDescs - 1].u32Control |= XDMA_DESC_STOPPED | XDMA_DESC_EOP |
+        XDMA_DESC_COMPLETED;
+    *pu32Adjacent = XDMA_DescChainLink(desc, desc_phys, dwDescs, FALSE);
+
+    return dwDescs;
+}
+
+typedef DWORD (*BENCH_BUILD_FUNC)(XDMA_DMA_DESC *desc, DMA_ADDR desc_phys,
+    const WD_DMA_PAGE *pPages, DWORD dwPages, const XDMA_DESC_CHAIN *pChain,
+    UINT32 *pu32Adjacent);
+
+/* Returns the average time of building the chain, in nanoseconds per
+ * descriptor */
+static double BenchRun(BENCH_BUILD_FUNC funcBuild, XDMA_DMA_DESC *desc,
+    const WD_DMA_PAGE *pPages, DWORD dwPages, const XDMA_DESC_CHAIN *pChain)
+{
+    UINT64 u64Start, u64Elapsed, u64Iterations = 0;
+    UINT32 u32Adjacent;
+    DWORD dwDescs = 0;
+
+    /* Warm up */
+    funcBuild(desc, (DMA_ADDR)(UPTR)desc, pPages, dwPages, pChain,
+        &u32Adjacent);
+
+    u64Start = XDMA_TimestampNsGet();
+    do {
+        DWORD i;
+
+        /* Read the time once per batch, so short chains are not dominated
+         * by the clock read */
+        for (i = 0; i < BENCH_BATCH; i++)
+        {
+            dwDescs = funcBuild(desc, (DMA_ADDR)(UPTR)desc, pPages, dwPages,
+                pChain, &u32Adjacent);
+        }
+        u64Iterations += BENCH_BATCH;
+        u64Elapsed = XDMA_TimestampNsGet() - u64Start;
+    } while (u64Elapsed < BENCH_MIN_NS);
+
+    return (double)u64Elapsed / (double)(u64Iterations * dwDescs);
+}
+
+/* Verify that XDMA_DescChainBuild() builds the reference chain */
+static BOOL BenchVerify(XDMA_DMA_DESC *desc, XDMA_DMA_DESC *ref,
+    const WD_DMA_PAGE *pPages, DWORD dwPages, XDMA_DESC_CHAIN *pChain)
+{
+    UINT32 u32Adjacent, u32RefAdjacent;
+    DWORD dwDescs, dwRefDescs;
+
+    dwRefDescs = BenchReferenceBuild(ref, (DMA_ADDR)(UPTR)desc, pPages,
+        dwPages, pChain, &u32RefAdjacent);
+    dwDescs = XDMA_DescChainBuild(desc, (DMA_ADDR)(UPTR)desc, pPages,
+        dwPages, pChain, &u32Adjacent);
+
+    return dwDescs == dwRefDescs && u32Adjacent == u32RefAdjacent &&
+        !memcmp(desc, ref, dwDescs * sizeof(XDMA_DMA_DESC));
+}
+
+int main(int argc, char *argv[])
+{
+    DWORD dwDescsArr[16], dwTests = 0, i;
+    XDMA_DMA_DESC *desc = NULL, *ref = NULL;
+    WD_DMA_PAGE *pPages = NULL;
+    PVOID pDescAlloc = NULL;
+    XDMA_DESC_CHAIN chain;
+    int rc = EXIT_FAILURE;
+
+    for (i = 1; i < (DWORD)argc && dwTests < 16; i++)
+    {
+        dwDescsArr[dwTests] = (DWORD)strtoul(argv[i], NULL, 0);
+        if (!dwDescsArr[dwTests] || dwDescsArr[dwTests] > BENCH_DESC_MAX)
+        {
+            printf("Usage: %s [descriptors (1-%d) ...]\n", argv[0],
+                BENCH_DESC_MAX);
+            return EXIT_FAILURE;
+        }
+        dwTests++;
+    }
+    if (!dwTests)
+    {
+        dwTests = sizeof(gdwDefaultDescs) / sizeof(gdwDefaultDescs[0]);
+        memcpy(dwDescsArr, gdwDefaultDescs, sizeof(gdwDefaultDescs));
+    }
+
+    /* Descriptors buffers are page aligned, as the locked contiguous
+     * descriptors buffers of xdma_lib.c */
+    pDescAlloc = malloc(BENCH_DESC_MAX * sizeof(XDMA_DMA_DESC) +
+        BENCH_PAGE_SIZE);
+    ref = (XDMA_DMA_DESC *)malloc(BENCH_DESC_MAX * sizeof(XDMA_DMA_DESC));
+    pPages = (WD_DMA_PAGE *)malloc(BENCH_DESC_MAX * sizeof(WD_DMA_PAGE));
+    if (!pDescAlloc || !ref || !pPages)
+    {
+        printf("Failed allocating memory\n");
+        goto Exit;
+    }
+    desc = (XDMA_DMA_DESC *)__ALIGN_UP((UPTR)pDescAlloc, BENCH_PAGE_SIZE);
+    BenchPagesInit(pPages, BENCH_DESC_MAX);
+
+    chain.u64FPGAOffset = 0;
+    chain.dwMaxBytes = XDMA_DESC_MAX_BYTES;
+    chain.fToDevice = TRUE;
+    chain.fNonIncMode = FALSE;
+
+    printf("Descriptors build time, ns per descriptor (%d bytes pages)\n",
+        BENCH_PAGE_SIZE);
+    printf("%12s %12s %12s %12s\n", "descriptors", "reference",
+        "single pass", "streaming");
+
+    for (i = 0; i < dwTests; i++)
+    {
+        DWORD dwPages = dwDescsArr[i];
+        double dRef, dSinglePass, dStreaming;
+
+        chain.fStream = FALSE;
+        if (!BenchVerify(desc, ref, pPages, dwPages, &chain))
+        {
+            printf("Descriptors chain of %d descriptors differs from the "
+                "reference chain\n", dwPages);
+            goto Exit;
+        }
+
+        dRef = BenchRun(BenchReferenceBuild, desc, pPages, dwPages, &chain);
+        dSinglePass = BenchRun(XDMA_DescChainBuild, desc, pPages, dwPages,
+            &chain);
+        chain.fStream = TRUE;
+        dStreaming = BenchRun(XDMA_DescChainBuild, desc, pPages, dwPages,
+            &chain);
+
+        printf("%12d %12.2f %12.2f %12.2f\n", dwPages, dRef, dSinglePass,
+            dStreaming);
+    }
+
+    rc = EXIT_SUCCESS;
+
+Exit:
+    free(pPages);
+    free(ref);
+    free(pDescAlloc);
+
+    return rc;
+}
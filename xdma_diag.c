@@ -23,6 +23,10 @@ int XDMA_printf(char *fmt, ...)
 
 #define XDMA_ERR XDMA_printf
 
+/* Non-interactive benchmark: The standard output holds only its results, so
+ * messages are written to the standard error */
+static BOOL gfBenchMode = FALSE;
+
 /* --------------------------------------------------
     XDMA configuration registers information
    -------------------------------------------------- */
@@ -122,6 +126,7 @@ static WDC_REG gXDMA_ConfigRegs[] = {
     Main diagnostics menu
    ----------------------------------------------- */
 static DIAG_MENU_OPTION *MenuMainInit(WDC_DEVICE_HANDLE *phDev);
+static DWORD MenuMainExitCb(PVOID pCbCtx);
 
 /* -----------------------------------------------
    Device Open
@@ -187,12 +192,29 @@ static DWORD XDMA_Init(WDC_DEVICE_HANDLE *phDev)
     return dwStatus;
 }
 
-int main(void)
+int main(int argc, char *argv[])
 {
     WDC_DEVICE_HANDLE hDev = NULL;
     DIAG_MENU_OPTION *pMenuRoot;
     DWORD dwStatus;
 
+    /* Non-interactive benchmark: xdma_diag --bench [options]. Only the
+     * results are written to the standard output */
+    if (argc > 1 && !strcmp(argv[1], "--bench"))
+    {
+        int iResult;
+
+        gfBenchMode = TRUE;
+        dwStatus = XDMA_Init(&hDev);
+        if (dwStatus)
+            return dwStatus;
+
+        iResult = XDMA_DIAG_Bench(hDev, argc - 2, argv + 2);
+        MenuMainExitCb(&hDev);
+
+        return iResult;
+    }
+
     printf("\n");
     printf("XDMA diagnostic utility.\n");
     printf("Application accesses hardware using " WD_PROD_NAME ".\n");
@@ -507,6 +529,7 @@ static BOOL MenuDmaPerformanceGetInput(BOOL *pfPolling, DWORD *pdwBytes,
     DWORD *pdwSeconds)
 {
     DIAG_INPUT_RESULT inputResult;
+    DWORD dwAxiClockMHz;
 
     if (!MenuDmaCompletionMethodGetInput(pfPolling))
         return FALSE;
@@ -539,6 +562,21 @@ static BOOL MenuDmaPerformanceGetInput(BOOL *pfPolling, DWORD *pdwBytes,
         return FALSE;
     }
 
+    inputResult = DIAG_InputDWORD(&dwAxiClockMHz, "\nEnter the AXI clock "
+        "frequency of the design in MHz (0 - estimate it)", FALSE, 0, 0);
+    switch (inputResult)
+    {
+    case DIAG_INPUT_SUCCESS:
+        break;
+    case DIAG_INPUT_FAIL:
+        XDMA_ERR("\nInvalid AXI clock frequency\n");
+        return FALSE;
+    case DIAG_INPUT_CANCEL:
+        return FALSE;
+    }
+
+    XDMA_DIAG_AxiClockSet(dwAxiClockMHz * 1000000);
+
     printf("\n");
 
     return TRUE;
@@ -945,7 +983,7 @@ int XDMA_printf(char *fmt, ...)
     va_list args;
 
     va_start(args, fmt);
-    vprintf(fmt, args);
+    vfprintf(gfBenchMode ? stderr : stdout, fmt, args);
     va_end(args);
 
     return 0;
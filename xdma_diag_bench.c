@@ -0,0 +1,365 @@
+/* Jungo Connectivity Confidential. Copyright (c) 2023 Jungo Connectivity Ltd.  https://www.jungo.com */
+
+/****************************************************************************
+*  File: xdma_diag_bench.c
+*
+*  Non-interactive DMA benchmark of the XDMA diagnostics application
+*  (xdma_diag --bench). Runs the DMA performance test over every combination
+*  of the given transfer sizes, directions, channels, completion methods and
+*  thread counts, and writes one CSV or JSON record per direction of each
+*  run.
+*
+*  Note: This code sample is provided AS-IS and as a guiding sample only.
+*****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "xdma_diag_transfer.h"
+
+#define BENCH_LIST_MAX 16
+
+/* Completion methods */
+enum {
+    BENCH_MODE_POLL,
+    BENCH_MODE_INT,
+    BENCH_MODE_TXN,
+    BENCH_MODE_TXN_POLL,
+};
+
+static const char *gBenchModes[] = { "poll", "int", "txn", "txn-poll" };
+static const char *gBenchDirs[] = { "h2c", "c2h", "bidir" };
+
+typedef struct {
+    DWORD dwValues[BENCH_LIST_MAX];
+    DWORD dwCount;
+} BENCH_LIST;
+
+typedef struct {
+    BENCH_LIST sizes;
+    BENCH_LIST dirs;     /* Indexes into gBenchDirs */
+    BENCH_LIST channels;
+    BENCH_LIST modes;    /* Indexes into gBenchModes */
+    BENCH_LIST threads;
+    DWORD dwSeconds;
+    BOOL fJson;
+    FILE *fOut;
+    DWORD dwRecords;
+} BENCH_CFG;
+
+static void BenchUsage(void)
+{
+    fprintf(stderr,
+        "Usage: xdma_diag --bench [options]\n"
+        "  --sizes LIST     Transfer sizes in bytes, K and M suffixes are "
+        "allowed\n"
+        "                   (default 4K,64K,1M)\n"
+        "  --dirs LIST      h2c, c2h, bidir (default h2c,c2h)\n"
+        "  --channels LIST  First channel of each run (default 0)\n"
+        "  --modes LIST     poll, int, txn, txn-poll (default poll)\n"
+        "  --threads LIST   Channels to run in parallel, one thread per "
+        "direction\n"
+        "                   on each (default 1)\n"
+        "  --seconds N      Duration of each run (default 5)\n"
+        "  --format FMT     csv or json (default csv)\n"
+        "  --output FILE    Results file (default standard output)\n"
+        "LIST is a comma separated list of values.\n");
+}
+
+/* Parses a comma separated list of numbers, or of names out of pNames[] when
+ * pNames is not NULL */
+static BOOL BenchListParse(BENCH_LIST *pList, const char *sArg,
+    const char **pNames, DWORD dwNames, BOOL fSizes)
+{
+    char sBuf[256], *sToken, *sEnd;
+    unsigned long ulVal;
+    DWORD i;
+
+    if (strlen(sArg) >= sizeof(sBuf))
+        return FALSE;
+    strcpy(sBuf, sArg);
+
+    pList->dwCount = 0;
+    for (sToken = strtok(sBuf, ","); sToken; sToken = strtok(NULL, ","))
+    {
+        if (pList->dwCount == BENCH_LIST_MAX)
+            return FALSE;
+
+        if (pNames)
+        {
+            for (i = 0; i < dwNames && strcmp(sToken, pNames[i]); i++)
+                ;
+            if (i == dwNames)
+                return FALSE;
+            pList->dwValues[pList->dwCount++] = i;
+            continue;
+        }
+
+        ulVal = strtoul(sToken, &sEnd, 0);
+        if (sEnd == sToken)
+            return FALSE;
+        if (fSizes && (*sEnd == 'K' || *sEnd == 'k'))
+        {
+            ulVal *= 1024;
+            sEnd++;
+        }
+        else if (fSizes && (*sEnd == 'M' || *sEnd == 'm'))
+        {
+            ulVal *= 1024 * 1024;
+            sEnd++;
+        }
+        if (*sEnd || (!ulVal && fSizes))
+            return FALSE;
+        pList->dwValues[pList->dwCount++] = (DWORD)ulVal;
+    }
+
+    return pList->dwCount > 0;
+}
+
+static BOOL BenchArgsParse(BENCH_CFG *pCfg, int argc, char *argv[])
+{
+    const char *sOutput = NULL;
+    DWORD j;
+    int i;
+
+    BenchListParse(&pCfg->sizes, "4K,64K,1M", NULL, 0, TRUE);
+    pCfg->dirs.dwValues[0] = MENU_DMA_PERF_TO_DEV - 1;
+    pCfg->dirs.dwValues[1] = MENU_DMA_PERF_FROM_DEV - 1;
+    pCfg->dirs.dwCount = 2;
+    pCfg->channels.dwCount = 1;
+    pCfg->modes.dwValues[0] = BENCH_MODE_POLL;
+    pCfg->modes.dwCount = 1;
+    pCfg->threads.dwValues[0] = 1;
+    pCfg->threads.dwCount = 1;
+    pCfg->dwSeconds = 5;
+    pCfg->fOut = stdout;
+
+    for (i = 0; i < argc; i += 2)
+    {
+        const char *sOpt = argv[i], *sArg = i + 1 < argc ? argv[i + 1] : NULL;
+        BOOL fValid;
+
+        if (!sArg)
+        {
+            fprintf(stderr, "Missing value for %s\n", sOpt);
+            return FALSE;
+        }
+
+        if (!strcmp(sOpt, "--sizes"))
+        {
+            fValid = BenchListParse(&pCfg->sizes, sArg, NULL, 0, TRUE);
+        }
+        else if (!strcmp(sOpt, "--dirs"))
+        {
+            fValid = BenchListParse(&pCfg->dirs, sArg, gBenchDirs,
+                sizeof(gBenchDirs) / sizeof(gBenchDirs[0]), FALSE);
+        }
+        else if (!strcmp(sOpt, "--channels"))
+        {
+            fValid = BenchListParse(&pCfg->channels, sArg, NULL, 0, FALSE);
+        }
+        else if (!strcmp(sOpt, "--modes"))
+        {
+            fValid = BenchListParse(&pCfg->modes, sArg, gBenchModes,
+                sizeof(gBenchModes) / sizeof(gBenchModes[0]), FALSE);
+        }
+        else if (!strcmp(sOpt, "--threads"))
+        {
+            fValid = BenchListParse(&pCfg->threads, sArg, NULL, 0, FALSE);
+            for (j = 0; fValid && j < pCfg->threads.dwCount; j++)
+                fValid = pCfg->threads.dwValues[j] > 0;
+        }
+        else if (!strcmp(sOpt, "--seconds"))
+        {
+            pCfg->dwSeconds = (DWORD)strtoul(sArg, NULL, 0);
+            fValid = pCfg->dwSeconds > 0;
+        }
+        else if (!strcmp(sOpt, "--format"))
+        {
+            pCfg->fJson = !strcmp(sArg, "json");
+            fValid = pCfg->fJson || !strcmp(sArg, "csv");
+        }
+        else if (!strcmp(sOpt, "--output"))
+        {
+            sOutput = sArg;
+            fValid = TRUE;
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", sOpt);
+            return FALSE;
+        }
+
+        if (!fValid)
+        {
+            fprintf(stderr, "Invalid value for %s: %s\n", sOpt, sArg);
+            return FALSE;
+        }
+    }
+
+#ifndef HAS_INTS
+    for (i = 0; i < (int)pCfg->modes.dwCount; i++)
+    {
+        if (pCfg->modes.dwValues[i] != BENCH_MODE_POLL &&
+            pCfg->modes.dwValues[i] != BENCH_MODE_TXN_POLL)
+        {
+            fprintf(stderr, "Interrupt completion is not supported in this "
+                "build\n");
+            return FALSE;
+        }
+    }
+#endif /* ifndef HAS_INTS */
+
+    if (sOutput)
+    {
+        pCfg->fOut = fopen(sOutput, "w");
+        if (!pCfg->fOut)
+        {
+            fprintf(stderr, "Failed opening %s\n", sOutput);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static void BenchRecordWrite(BENCH_CFG *pCfg, DWORD dwBytes,
+    const char *sDir, DWORD dwChannel, DWORD dwThreads, DWORD dwMode,
+    XDMA_DIAG_PERF_RESULT *pResult)
+{
+    double dMBps = pResult->dSeconds ?
+        (double)pResult->u64Bytes / pResult->dSeconds / (1024 * 1024) : 0;
+
+    if (pCfg->fJson)
+    {
+        fprintf(pCfg->fOut, "%s\n  {\"size\": %u, \"direction\": \"%s\", "
+            "\"channel\": %u, \"threads\": %u, \"mode\": \"%s\", "
+            "\"seconds\": %.3f, \"bytes\": %llu, \"transfers\": %llu, "
+            "\"mb_per_sec\": %.2f, \"lat_min_us\": %.1f, "
+            "\"lat_p50_us\": %.1f, \"lat_p90_us\": %.1f, "
+            "\"lat_p99_us\": %.1f, \"lat_p999_us\": %.1f, "
+            "\"lat_max_us\": %.1f, \"status\": %u, \"status_str\": \"%s\"}",
+            pCfg->dwRecords ? "," : "[", dwBytes, sDir, dwChannel, dwThreads,
+            gBenchModes[dwMode], pResult->dSeconds, pResult->u64Bytes,
+            pResult->u64Transfers, dMBps, pResult->u64LatMinNs / 1000.0,
+            pResult->u64LatP50Ns / 1000.0, pResult->u64LatP90Ns / 1000.0,
+            pResult->u64LatP99Ns / 1000.0, pResult->u64LatP999Ns / 1000.0,
+            pResult->u64LatMaxNs / 1000.0, pResult->dwStatus,
+            Stat2Str(pResult->dwStatus));
+    }
+    else
+    {
+        if (!pCfg->dwRecords)
+        {
+            fprintf(pCfg->fOut, "size,direction,channel,threads,mode,seconds,"
+                "bytes,transfers,mb_per_sec,lat_min_us,lat_p50_us,lat_p90_us,"
+                "lat_p99_us,lat_p999_us,lat_max_us,status,status_str\n");
+        }
+        fprintf(pCfg->fOut, "%u,%s,%u,%u,%s,%.3f,%llu,%llu,%.2f,%.1f,%.1f,"
+            "%.1f,%.1f,%.1f,%.1f,%u,\"%s\"\n", dwBytes, sDir, dwChannel,
+            dwThreads, gBenchModes[dwMode], pResult->dSeconds,
+            pResult->u64Bytes, pResult->u64Transfers, dMBps,
+            pResult->u64LatMinNs / 1000.0, pResult->u64LatP50Ns / 1000.0,
+            pResult->u64LatP90Ns / 1000.0, pResult->u64LatP99Ns / 1000.0,
+            pResult->u64LatP999Ns / 1000.0, pResult->u64LatMaxNs / 1000.0,
+            pResult->dwStatus, Stat2Str(pResult->dwStatus));
+    }
+    fflush(pCfg->fOut);
+
+    pCfg->dwRecords++;
+}
+
+/* Returns the number of failed runs */
+static DWORD BenchRun(WDC_DEVICE_HANDLE hDev, BENCH_CFG *pCfg)
+{
+    XDMA_DIAG_PERF_RESULT toDev, fromDev;
+    DWORD s, d, c, m, t, dwFailures = 0;
+
+    for (s = 0; s < pCfg->sizes.dwCount; s++)
+    for (d = 0; d < pCfg->dirs.dwCount; d++)
+    for (c = 0; c < pCfg->channels.dwCount; c++)
+    for (m = 0; m < pCfg->modes.dwCount; m++)
+    for (t = 0; t < pCfg->threads.dwCount; t++)
+    {
+        DWORD dwBytes = pCfg->sizes.dwValues[s];
+        DWORD dwDir = pCfg->dirs.dwValues[d];
+        DWORD dwChannel = pCfg->channels.dwValues[c];
+        DWORD dwMode = pCfg->modes.dwValues[m];
+        DWORD dwThreads = pCfg->threads.dwValues[t];
+        DWORD dwStatus;
+
+        if (dwChannel + dwThreads > XDMA_CHANNELS_NUM)
+        {
+            fprintf(stderr, "Skipping %u threads from channel %u, the XDMA "
+                "has %d channels\n", dwThreads, dwChannel, XDMA_CHANNELS_NUM);
+            continue;
+        }
+
+        fprintf(stderr, "Running %s %u bytes, channel %u, %u threads, %s, "
+            "%u seconds...\n", gBenchDirs[dwDir], dwBytes, dwChannel,
+            dwThreads, gBenchModes[dwMode], pCfg->dwSeconds);
+
+        dwStatus = XDMA_DIAG_DmaPerfRun(hDev, dwDir + 1, dwChannel,
+            dwThreads, dwBytes,
+            dwMode == BENCH_MODE_POLL || dwMode == BENCH_MODE_TXN_POLL,
+            pCfg->dwSeconds,
+            dwMode == BENCH_MODE_TXN || dwMode == BENCH_MODE_TXN_POLL,
+            &toDev, &fromDev);
+        if (dwStatus != WD_STATUS_SUCCESS)
+        {
+            fprintf(stderr, "Run failed. Error 0x%x - %s\n", dwStatus,
+                Stat2Str(dwStatus));
+            dwFailures++;
+            /* Report runs that failed before starting too */
+            if (!toDev.dwStatus && !fromDev.dwStatus)
+                toDev.dwStatus = fromDev.dwStatus = dwStatus;
+        }
+
+        if (dwDir + 1 != MENU_DMA_PERF_FROM_DEV)
+        {
+            BenchRecordWrite(pCfg, dwBytes, gBenchDirs[0], dwChannel,
+                dwThreads, dwMode, &toDev);
+        }
+        if (dwDir + 1 != MENU_DMA_PERF_TO_DEV)
+        {
+            BenchRecordWrite(pCfg, dwBytes, gBenchDirs[1], dwChannel,
+                dwThreads, dwMode, &fromDev);
+        }
+    }
+
+    return dwFailures;
+}
+
+int XDMA_DIAG_Bench(WDC_DEVICE_HANDLE hDev, int argc, char *argv[])
+{
+    BENCH_CFG cfg;
+    DWORD dwFailures;
+
+    memset(&cfg, 0, sizeof(cfg));
+    if (argc == 1 && !strcmp(argv[0], "--help"))
+    {
+        BenchUsage();
+        return 0;
+    }
+    if (!BenchArgsParse(&cfg, argc, argv))
+    {
+        BenchUsage();
+        return 1;
+    }
+
+    if (!hDev)
+    {
+        fprintf(stderr, "No XDMA device was opened\n");
+        dwFailures = 1;
+        goto Exit;
+    }
+
+    dwFailures = BenchRun(hDev, &cfg);
+    if (cfg.fJson)
+        fprintf(cfg.fOut, cfg.dwRecords ? "\n]\n" : "[]\n");
+
+Exit:
+    if (cfg.fOut != stdout)
+        fclose(cfg.fOut);
+
+    return dwFailures ? 1 : 0;
+}
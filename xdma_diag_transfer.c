@@ -21,6 +21,16 @@ int XDMA_printf(char *fmt, ...)
 #define XDMA_OUT XDMA_printf
 #define XDMA_ERR XDMA_printf
 
+/* AXI clock frequency of the XDMA design, which the engine performance
+ * counters count cycles of. 0 - estimated from the cycles counted over the
+ * host run time (see XDMA_DIAG_AxiClockSet()) */
+static DWORD gdwAxiClockHz = 0;
+
+void XDMA_DIAG_AxiClockSet(DWORD dwHz)
+{
+    gdwAxiClockHz = dwHz;
+}
+
 /* Interrupt handler routine for DMA performance testing */
 void DiagXdmaDmaPerfIntHandler(WDC_DEVICE_HANDLE hDev,
     XDMA_INT_RESULT *pIntResult)
@@ -36,6 +46,117 @@ void DiagXdmaDmaPerfIntHandler(WDC_DEVICE_HANDLE hDev,
     UNUSED_VAR(hDev);
 }
 
+/* Transfer latency histogram: Each power of two range of nanoseconds is split
+ * into LAT_HIST_SUB_BUCKETS linear buckets, so a bucket is never wider than
+ * 1/LAT_HIST_SUB_BUCKETS of the values it holds */
+#define LAT_HIST_SUB_BITS 3
+#define LAT_HIST_SUB_BUCKETS (1 << LAT_HIST_SUB_BITS)
+#define LAT_HIST_BUCKETS (64 * LAT_HIST_SUB_BUCKETS)
+
+typedef struct {
+    UINT64 u64Counts[LAT_HIST_BUCKETS];
+    UINT64 u64Samples;
+    UINT64 u64MinNs;
+    UINT64 u64MaxNs;
+} LAT_HIST;
+
+static DWORD LatHistBucket(UINT64 u64Ns)
+{
+    DWORD dwMsb = 0, dwShift;
+
+    if (u64Ns < LAT_HIST_SUB_BUCKETS)
+        return (DWORD)u64Ns;
+
+    while (u64Ns >> (dwMsb + 1))
+        dwMsb++;
+    dwShift = dwMsb - LAT_HIST_SUB_BITS;
+
+    return (dwShift + 1) * LAT_HIST_SUB_BUCKETS +
+        (DWORD)((u64Ns >> dwShift) & (LAT_HIST_SUB_BUCKETS - 1));
+}
+
+/* Returns the highest value that falls into a bucket */
+static UINT64 LatHistBucketMax(DWORD dwBucket)
+{
+    DWORD dwShift;
+
+    if (dwBucket < LAT_HIST_SUB_BUCKETS)
+        return dwBucket;
+
+    dwShift = dwBucket / LAT_HIST_SUB_BUCKETS - 1;
+
+    return ((UINT64)(LAT_HIST_SUB_BUCKETS + dwBucket % LAT_HIST_SUB_BUCKETS) <<
+        dwShift) + ((UINT64)1 << dwShift) - 1;
+}
+
+static void LatHistReset(LAT_HIST *pHist)
+{
+    memset(pHist, 0, sizeof(*pHist));
+    pHist->u64MinNs = (UINT64)-1;
+}
+
+static void LatHistAdd(LAT_HIST *pHist, UINT64 u64Ns)
+{
+    pHist->u64Counts[LatHistBucket(u64Ns)]++;
+    pHist->u64Samples++;
+    if (u64Ns < pHist->u64MinNs)
+        pHist->u64MinNs = u64Ns;
+    if (u64Ns > pHist->u64MaxNs)
+        pHist->u64MaxNs = u64Ns;
+}
+
+static void LatHistMerge(LAT_HIST *pHist, LAT_HIST *pOther)
+{
+    DWORD i;
+
+    for (i = 0; i < LAT_HIST_BUCKETS; i++)
+        pHist->u64Counts[i] += pOther->u64Counts[i];
+    pHist->u64Samples += pOther->u64Samples;
+    if (pOther->u64MinNs < pHist->u64MinNs)
+        pHist->u64MinNs = pOther->u64MinNs;
+    if (pOther->u64MaxNs > pHist->u64MaxNs)
+        pHist->u64MaxNs = pOther->u64MaxNs;
+}
+
+/* Returns the latency below which the given fraction of the samples fall,
+ * rounded up to the end of its bucket */
+static UINT64 LatHistPercentile(LAT_HIST *pHist, double fraction)
+{
+    UINT64 u64Rank = (UINT64)(fraction * pHist->u64Samples + 0.999999);
+    UINT64 u64Count = 0;
+    DWORD i;
+
+    if (!u64Rank)
+        u64Rank = 1;
+
+    for (i = 0; i < LAT_HIST_BUCKETS; i++)
+    {
+        u64Count += pHist->u64Counts[i];
+        if (u64Count >= u64Rank)
+            break;
+    }
+
+    if (i == LAT_HIST_BUCKETS || LatHistBucketMax(i) > pHist->u64MaxNs)
+        return pHist->u64MaxNs;
+
+    return LatHistBucketMax(i);
+}
+
+static void LatHistPrint(LAT_HIST *pHist, const char *sName)
+{
+    if (!pHist->u64Samples)
+        return;
+
+    XDMA_OUT("%s latency (usec) over %llu transfers: min %.1f, p50 %.1f, "
+        "p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n", sName,
+        pHist->u64Samples, pHist->u64MinNs / 1000.0,
+        LatHistPercentile(pHist, 0.5) / 1000.0,
+        LatHistPercentile(pHist, 0.9) / 1000.0,
+        LatHistPercentile(pHist, 0.99) / 1000.0,
+        LatHistPercentile(pHist, 0.999) / 1000.0,
+        pHist->u64MaxNs / 1000.0);
+}
+
 typedef struct {
     WDC_DEVICE_HANDLE hDev;
     XDMA_DMA_HANDLE hDma;
@@ -45,6 +166,11 @@ typedef struct {
     DWORD dwSeconds;
     HANDLE hOsEvent;
     BOOL fIsTransaction;
+    BOOL fQuiet; /* Keep the results in the context instead of printing */
+    DWORD dwStatus;
+    UINT64 u64BytesTransferred;
+    double time_elapsed;
+    LAT_HIST latHist;
 } DMA_PERF_THREAD_CTX;
 
 void DmaPerfDevThread(void *pData)
@@ -52,20 +178,29 @@ void DmaPerfDevThread(void *pData)
     DMA_PERF_THREAD_CTX *ctx = (DMA_PERF_THREAD_CTX *)pData;
     TIME_TYPE time_start, time_end_temp;
     DWORD dwStatus = 0, restarts = 0;
+    XDMA_POLL_STATS pollStats;
+    XDMA_MMIO_STATS mmioStats;
+    XDMA_PERF_COUNTERS perf;
     UINT64 u64BytesTransferred = 0;
+    UINT64 u64PollIterations = 0, u64PollNs = 0, u64Polls = 0;
+    UINT64 u64StartNs;
     double time_elapsed = 0;
 
+    LatHistReset(&ctx->latHist);
+    XDMA_EnginePerfArm(ctx->hDma, FALSE);
     get_cur_time(&time_start);
     while (time_elapsed < ctx->dwSeconds * 1000)
     {
         if (ctx->fIsTransaction)
             XDMA_DmaTransactionExecute(ctx->hDma, FALSE, NULL);
 
+        u64StartNs = XDMA_TimestampNsGet();
         dwStatus = XDMA_DmaTransferStart(ctx->hDma);
         if (dwStatus != WD_STATUS_SUCCESS)
         {
             XDMA_ERR("\nFailed starting DMA transfer. Error 0x%x - %s\n",
                 dwStatus, Stat2Str(dwStatus));
+            ctx->dwStatus = dwStatus;
             break;
         }
 
@@ -76,8 +211,17 @@ void DmaPerfDevThread(void *pData)
             {
                 XDMA_ERR("\nFailed polling for DMA completion. "
                     "Error 0x%x - %s\n", dwStatus, Stat2Str(dwStatus));
+                ctx->dwStatus = dwStatus;
                 break;
             }
+            LatHistAdd(&ctx->latHist, XDMA_TimestampNsGet() - u64StartNs);
+            if (XDMA_DmaPollStatsGet(ctx->hDma, &pollStats) ==
+                WD_STATUS_SUCCESS)
+            {
+                u64PollIterations += pollStats.u64Iterations;
+                u64PollNs += pollStats.u64ElapsedNs;
+                u64Polls++;
+            }
         }
         else
         {
@@ -90,11 +234,14 @@ void DmaPerfDevThread(void *pData)
                 if (restarts++ >= MAX_RESTARTS)
                 {
                     XDMA_ERR("Timeout occurred\n");
+                    ctx->dwStatus = dwStatus;
                     break;
                 }
                 XDMA_DmaTransferStop(ctx->hDma);
                 time_elapsed = 0;
                 u64BytesTransferred = 0;
+                LatHistReset(&ctx->latHist);
+                XDMA_EnginePerfArm(ctx->hDma, FALSE);
                 get_cur_time(&time_start);
                 continue;
             }
@@ -102,8 +249,10 @@ void DmaPerfDevThread(void *pData)
             {
                 XDMA_ERR("\nFailed waiting for completion event. "
                     "Error 0x%x - %s\n", dwStatus, Stat2Str(dwStatus));
+                ctx->dwStatus = dwStatus;
                 break;
             }
+            LatHistAdd(&ctx->latHist, XDMA_TimestampNsGet() - u64StartNs);
             if (ctx->fIsTransaction)
             {
                 dwStatus = XDMA_DmaTransactionTransferEnded(ctx->hDma);
@@ -118,10 +267,17 @@ void DmaPerfDevThread(void *pData)
         if (time_elapsed == -1)
         {
             XDMA_ERR("Performance test failed\n");
+            ctx->dwStatus = WD_OPERATION_FAILED;
             return;
         }
     }
-     if (!time_elapsed)
+    XDMA_EnginePerfFreeze(ctx->hDma);
+    ctx->u64BytesTransferred = u64BytesTransferred;
+    ctx->time_elapsed = time_elapsed;
+    if (ctx->fQuiet)
+        return;
+
+    if (!time_elapsed)
     {
         XDMA_OUT("DMA %s performance test failed\n",
                 ctx->fToDevice ? "host-to-device" : "device-to-host");
@@ -131,6 +287,40 @@ void DmaPerfDevThread(void *pData)
     XDMA_OUT("\n\n");
 
     DIAG_PrintPerformance(u64BytesTransferred, &time_start);
+    if (u64Polls)
+    {
+        XDMA_OUT("Average poll: %llu iterations, %llu ns\n",
+            u64PollIterations / u64Polls, u64PollNs / u64Polls);
+    }
+    LatHistPrint(&ctx->latHist,
+        ctx->fToDevice ? "Host-to-device" : "Device-to-host");
+
+    /* Device side: Throughput while counting, and the fraction of the
+     * engine clock cycles that moved data */
+    if (XDMA_EnginePerfRead(ctx->hDma, &perf) == WD_STATUS_SUCCESS &&
+        perf.u64Cycles)
+    {
+        /* The counters were armed and frozen around the timed run */
+        double seconds = gdwAxiClockHz ?
+            (double)perf.u64Cycles / gdwAxiClockHz : time_elapsed / 1000;
+
+        if (!gdwAxiClockHz && !perf.fMaxed)
+        {
+            XDMA_OUT("Device: AXI clock %.1f MHz (estimated)\n",
+                (double)perf.u64Cycles / seconds / 1000000);
+        }
+        XDMA_OUT("Device: %.2f MB/sec, bus utilization %.1f%% (%llu data "
+            "cycles of %llu)%s\n",
+            (double)perf.u64DataBeats * perf.dwBeatBytes / seconds /
+            (1024 * 1024),
+            100.0 * perf.u64DataBeats / perf.u64Cycles, perf.u64DataBeats,
+            perf.u64Cycles, perf.fMaxed ? ", counters maxed out" : "");
+    }
+    if (XDMA_DmaMmioStatsGet(ctx->hDma, &mmioStats) == WD_STATUS_SUCCESS)
+    {
+        XDMA_OUT("Register accesses per transfer start: %d reads, %d writes\n",
+            mmioStats.dwStartReads, mmioStats.dwStartWrites);
+    }
 }
 
 HANDLE DmaPerformanceThreadStart(DMA_PERF_THREAD_CTX *ctx)
@@ -150,8 +340,8 @@ HANDLE DmaPerformanceThreadStart(DMA_PERF_THREAD_CTX *ctx)
 }
 
 DMA_PERF_THREAD_CTX *DmaPerfThreadInit(WDC_DEVICE_HANDLE hDev,
-    DWORD dwBytes, UINT64 u64Offset, BOOL fPolling, DWORD dwSeconds,
-    DWORD fToDevice, BOOL fIsTransaction)
+    DWORD dwChannel, DWORD dwBytes, UINT64 u64Offset, BOOL fPolling,
+    DWORD dwSeconds, DWORD fToDevice, BOOL fIsTransaction, BOOL fQuiet)
 {
     DMA_PERF_THREAD_CTX *ctx = NULL;
     DWORD dwStatus;
@@ -190,8 +380,17 @@ DMA_PERF_THREAD_CTX *DmaPerfThreadInit(WDC_DEVICE_HANDLE hDev,
     }
 #endif /* ifdef HAS_INTS */
 
-    dwStatus = XDMA_DmaOpen(hDev, &ctx->hDma, dwBytes, u64Offset, fToDevice, 0,
-        fPolling, FALSE, ctx->hOsEvent, fIsTransaction);
+    if (fIsTransaction)
+    {
+        dwStatus = XDMA_DmaOpen(hDev, &ctx->hDma, dwBytes, u64Offset, fToDevice,
+            dwChannel, fPolling, FALSE, ctx->hOsEvent, TRUE);
+    }
+    else
+    {
+        dwStatus = XDMA_DmaOpenEx(hDev, &ctx->hDma, dwBytes, u64Offset,
+            fToDevice, dwChannel, fPolling, FALSE, ctx->hOsEvent,
+            XDMA_DMA_OPT_MERGE_PAGES);
+    }
     if (dwStatus != WD_STATUS_SUCCESS)
     {
         XDMA_ERR("\nFailed to open DMA handle. Error 0x%x - %s\n", dwStatus,
@@ -199,12 +398,20 @@ DMA_PERF_THREAD_CTX *DmaPerfThreadInit(WDC_DEVICE_HANDLE hDev,
         goto Error;
     }
 
+    if (!fIsTransaction && !fQuiet)
+    {
+        XDMA_OUT("%s: %d bytes in %d descriptors\n",
+            fToDevice ? "Host-to-device" : "Device-to-host", dwBytes,
+            XDMA_DmaDescCountGet(ctx->hDma));
+    }
+
     ctx->hDev = hDev;
     ctx->fPolling = fPolling;
     ctx->dwBytes = dwBytes;
     ctx->fToDevice = fToDevice;
     ctx->dwSeconds = dwSeconds;
     ctx->fIsTransaction = fIsTransaction;
+    ctx->fQuiet = fQuiet;
 
     return ctx;
 
@@ -250,8 +457,8 @@ void DmaPerformanceSingleDir(WDC_DEVICE_HANDLE hDev, DWORD dwBytes,
     HANDLE hThread;
     DMA_PERF_THREAD_CTX *ctx;
 
-    ctx = DmaPerfThreadInit(hDev, dwBytes, 0, fPolling, dwSeconds, fToDevice,
-        fIsTransaction);
+    ctx = DmaPerfThreadInit(hDev, 0, dwBytes, 0, fPolling, dwSeconds,
+        fToDevice, fIsTransaction, FALSE);
     if (!ctx)
     {
         XDMA_ERR("Failed initializing performance thread context\n");
@@ -277,16 +484,16 @@ void DmaPerformanceBiDir(WDC_DEVICE_HANDLE hDev, DWORD dwBytes,
     HANDLE hThreadToDev, hThreadFromDev;
     DMA_PERF_THREAD_CTX *pCtxToDev = NULL, *pCtxFromDev = NULL;
 
-    pCtxToDev = DmaPerfThreadInit(hDev, dwBytes, 0, fPolling, dwSeconds, TRUE,
-        fIsTransaction);
+    pCtxToDev = DmaPerfThreadInit(hDev, 0, dwBytes, 0, fPolling, dwSeconds,
+        TRUE, fIsTransaction, FALSE);
     if (!pCtxToDev)
     {
         XDMA_ERR("Failed initializing performance thread context\n");
         return;
     }
 
-    pCtxFromDev = DmaPerfThreadInit(hDev, dwBytes, (UINT64)(dwBytes * 2),
-        fPolling, dwSeconds, FALSE, fIsTransaction);
+    pCtxFromDev = DmaPerfThreadInit(hDev, 0, dwBytes, (UINT64)(dwBytes * 2),
+        fPolling, dwSeconds, FALSE, fIsTransaction, FALSE);
     if (!pCtxFromDev)
     {
         XDMA_ERR("Failed initializing performance thread context\n");
@@ -361,6 +568,114 @@ void XDMA_DIAG_DmaPerformance(WDC_DEVICE_HANDLE hDev, DWORD dwOption,
     }
 }
 
+static void DmaPerfResultAdd(XDMA_DIAG_PERF_RESULT *pResult, LAT_HIST *pHist,
+    DMA_PERF_THREAD_CTX *ctx)
+{
+    if (ctx->dwStatus && !pResult->dwStatus)
+        pResult->dwStatus = ctx->dwStatus;
+    pResult->u64Bytes += ctx->u64BytesTransferred;
+    if (ctx->time_elapsed / 1000 > pResult->dSeconds)
+        pResult->dSeconds = ctx->time_elapsed / 1000;
+    LatHistMerge(pHist, &ctx->latHist);
+}
+
+static void DmaPerfResultLatencySet(XDMA_DIAG_PERF_RESULT *pResult,
+    LAT_HIST *pHist)
+{
+    pResult->u64Transfers = pHist->u64Samples;
+    if (!pHist->u64Samples)
+        return;
+
+    pResult->u64LatMinNs = pHist->u64MinNs;
+    pResult->u64LatP50Ns = LatHistPercentile(pHist, 0.5);
+    pResult->u64LatP90Ns = LatHistPercentile(pHist, 0.9);
+    pResult->u64LatP99Ns = LatHistPercentile(pHist, 0.99);
+    pResult->u64LatP999Ns = LatHistPercentile(pHist, 0.999);
+    pResult->u64LatMaxNs = pHist->u64MaxNs;
+}
+
+DWORD XDMA_DIAG_DmaPerfRun(WDC_DEVICE_HANDLE hDev, DWORD dwOption,
+    DWORD dwChannel, DWORD dwThreads, DWORD dwBytes, BOOL fPolling,
+    DWORD dwSeconds, BOOL fIsTransaction, XDMA_DIAG_PERF_RESULT *pToDev,
+    XDMA_DIAG_PERF_RESULT *pFromDev)
+{
+    DMA_PERF_THREAD_CTX *ctxs[XDMA_CHANNELS_NUM * 2] = { 0 };
+    HANDLE hThreads[XDMA_CHANNELS_NUM * 2] = { 0 };
+    static LAT_HIST histToDev, histFromDev;
+    DWORD i, dwCtxs = 0, dwStatus = WD_STATUS_SUCCESS;
+
+    if (!dwThreads || dwChannel + dwThreads > XDMA_CHANNELS_NUM ||
+        !pToDev || !pFromDev)
+    {
+        return WD_INVALID_PARAMETER;
+    }
+
+    memset(pToDev, 0, sizeof(*pToDev));
+    memset(pFromDev, 0, sizeof(*pFromDev));
+    LatHistReset(&histToDev);
+    LatHistReset(&histFromDev);
+
+    /* One thread per direction on each of the channels. Every engine gets
+     * its own card memory range */
+    for (i = 0; i < dwThreads; i++)
+    {
+        if (dwOption != MENU_DMA_PERF_FROM_DEV)
+        {
+            ctxs[dwCtxs] = DmaPerfThreadInit(hDev, dwChannel + i, dwBytes,
+                (UINT64)dwBytes * 4 * i, fPolling, dwSeconds, TRUE,
+                fIsTransaction, TRUE);
+            if (!ctxs[dwCtxs])
+            {
+                dwStatus = WD_OPERATION_FAILED;
+                goto Exit;
+            }
+            dwCtxs++;
+        }
+        if (dwOption != MENU_DMA_PERF_TO_DEV)
+        {
+            ctxs[dwCtxs] = DmaPerfThreadInit(hDev, dwChannel + i, dwBytes,
+                (UINT64)dwBytes * (4 * i + 2), fPolling, dwSeconds, FALSE,
+                fIsTransaction, TRUE);
+            if (!ctxs[dwCtxs])
+            {
+                dwStatus = WD_OPERATION_FAILED;
+                goto Exit;
+            }
+            dwCtxs++;
+        }
+    }
+
+    for (i = 0; i < dwCtxs; i++)
+    {
+        hThreads[i] = DmaPerformanceThreadStart(ctxs[i]);
+        if (!hThreads[i])
+            ctxs[i]->dwStatus = WD_OPERATION_FAILED;
+    }
+    for (i = 0; i < dwCtxs; i++)
+    {
+        if (hThreads[i])
+            ThreadWait(hThreads[i]);
+    }
+
+    for (i = 0; i < dwCtxs; i++)
+    {
+        if (ctxs[i]->fToDevice)
+            DmaPerfResultAdd(pToDev, &histToDev, ctxs[i]);
+        else
+            DmaPerfResultAdd(pFromDev, &histFromDev, ctxs[i]);
+    }
+    DmaPerfResultLatencySet(pToDev, &histToDev);
+    DmaPerfResultLatencySet(pFromDev, &histFromDev);
+
+    dwStatus = pToDev->dwStatus ? pToDev->dwStatus : pFromDev->dwStatus;
+
+Exit:
+    for (i = 0; i < dwCtxs; i++)
+        DmaPerfThreadUninit(ctxs[i]);
+
+    return dwStatus;
+}
+
 /* DMA Transfer functions */
 
 static VOID DumpBuffer(UINT32 *buf, DWORD dwBytes)
@@ -40,6 +40,20 @@ enum {
     MENU_DMA_PERF_EXIT = DIAG_EXIT_MENU
 };
 
+/* Results of a DMA performance run in one direction, over all its threads */
+typedef struct {
+    DWORD dwStatus;         /* First failure of any of the threads */
+    UINT64 u64Bytes;        /* Bytes transferred by all the threads */
+    double dSeconds;        /* Run time of the longest running thread */
+    UINT64 u64Transfers;
+    UINT64 u64LatMinNs;     /* Transfer latency percentiles */
+    UINT64 u64LatP50Ns;
+    UINT64 u64LatP90Ns;
+    UINT64 u64LatP99Ns;
+    UINT64 u64LatP999Ns;
+    UINT64 u64LatMaxNs;
+} XDMA_DIAG_PERF_RESULT;
+
 /* DMA performance common functions */
 void DmaPerformanceBiDir(WDC_DEVICE_HANDLE hDev, DWORD dwBytes,
     BOOL fPolling, DWORD dwSeconds, BOOL fIsTransaction);
@@ -48,6 +62,18 @@ void DmaPerformanceSingleDir(WDC_DEVICE_HANDLE hDev, DWORD dwBytes,
 void XDMA_DIAG_DmaPerformance(WDC_DEVICE_HANDLE hDev, DWORD dwOption,
     DWORD dwBytes, BOOL fPolling, DWORD dwSeconds, BOOL fIsTransaction);
 void XDMA_DIAG_DumpDmaBuffer(XDMA_DMA_HANDLE hDma);
+/* Set the AXI clock frequency of the design, for the device side
+ * performance results. 0 - estimate it from the host run time */
+void XDMA_DIAG_AxiClockSet(DWORD dwHz);
+/* Run a DMA performance test without printing, on dwThreads channels from
+ * dwChannel, and return the results of each direction */
+DWORD XDMA_DIAG_DmaPerfRun(WDC_DEVICE_HANDLE hDev, DWORD dwOption,
+    DWORD dwChannel, DWORD dwThreads, DWORD dwBytes, BOOL fPolling,
+    DWORD dwSeconds, BOOL fIsTransaction, XDMA_DIAG_PERF_RESULT *pToDev,
+    XDMA_DIAG_PERF_RESULT *pFromDev);
+
+/* Non-interactive DMA benchmark, see xdma_diag_bench.c */
+int XDMA_DIAG_Bench(WDC_DEVICE_HANDLE hDev, int argc, char *argv[]);
 
 /* DMA transfer common functions */
 XDMA_DMA_HANDLE XDMA_DIAG_DmaOpen(WDC_DEVICE_HANDLE hDev, BOOL fPolling,
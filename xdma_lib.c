@@ -15,6 +15,15 @@
 #include "utils.h"
 #include "status_strings.h"
 #include "xdma_lib.h"
+#include "xdma_desc.h"
+#if defined(XDMA_SIM) && !defined(__KERNEL__)
+    #include "xdma_sim.h"
+#endif
+#if defined(LINUX) && !defined(__KERNEL__)
+    #include <sys/mman.h>
+    #include <sched.h>
+    #include <time.h>
+#endif
 
 /*************************************************************
   Internal definitions
@@ -34,36 +43,198 @@
 
 #define XDMA_TRANSACTION_SAMPLE_MAX_TRANSFER_SIZE 0x00FFFFFF
 
+/* Default polling policy (see XDMA_DmaPollPolicySet()) */
+#define XDMA_POLL_DEFAULT_SPIN_NS     20000     /* 20 usec */
+#define XDMA_POLL_DEFAULT_YIELD_NS    200000    /* 200 usec */
+#define XDMA_POLL_DEFAULT_SLEEP_USEC  50
+#define XDMA_POLL_DEFAULT_TIMEOUT_NS  10000000000ULL /* 10 sec */
+
+/* Default hybrid completion policy (see XDMA_DmaHybridPolicySet()) */
+#define XDMA_HYBRID_DEFAULT_BUSY_TRANSFERS  8
+#define XDMA_HYBRID_DEFAULT_IDLE_NS         50000   /* 50 usec */
+
+/* CPU spin-wait hint */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define CPU_PAUSE() __builtin_ia32_pause()
+#elif defined(__GNUC__) && (defined(__aarch64__) || defined(__arm__))
+    #define CPU_PAUSE() __asm__ __volatile__("yield")
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    #include <intrin.h>
+    #define CPU_PAUSE() _mm_pause()
+#else
+    #define CPU_PAUSE()
+#endif
+
+/* Atomic 64-bit counter addition */
+#if defined(__GNUC__)
+    #define ATOMIC_ADD64(p, n) ((void)__sync_fetch_and_add((p), (UINT64)(n)))
+#elif defined(_MSC_VER)
+    #define ATOMIC_ADD64(p, n) \
+        ((void)InterlockedExchangeAdd64((volatile LONG64 *)(p), (LONG64)(n)))
+#else
+    #define ATOMIC_ADD64(p, n) ((void)(*(p) += (n)))
+#endif
 
-typedef struct {
-#define XDMA_DESC_MAGIC   0xAD4B0000
-#define XDMA_MAX_ADJACENT 15
-    UINT32 u32Control;
-    UINT32 u32Bytes;    /* Transfer length in bytes */
-    UINT64 u64SrcAddr;  /* Source address */
-    UINT64 u64DstAddr;  /* Destination address */
-    UINT64 u64NextDesc; /* Next descriptor address */
-} XDMA_DMA_DESC;
+/* Atomic 32-bit exchange. Returns the previous value */
+#if defined(__GNUC__)
+    #define ATOMIC_XCHG32(p, v) __sync_lock_test_and_set((p), (UINT32)(v))
+#elif defined(_MSC_VER)
+    #define ATOMIC_XCHG32(p, v) \
+        ((UINT32)InterlockedExchange((volatile LONG *)(p), (LONG)(v)))
+#else
+    static UINT32 AtomicXchg32(volatile UINT32 *p, UINT32 v)
+    {
+        UINT32 old = *p;
+
+        *p = v;
+        return old;
+    }
+    #define ATOMIC_XCHG32(p, v) AtomicXchg32((p), (UINT32)(v))
+#endif
 
 typedef struct {
     UINT32 u32CompletedDescs; /* Completed descriptors count */
     UINT32 Reserved[7];
 } XDMA_DMA_POLL_WB;
 
+/* Striped DMA handle: A single transfer split across all the free enabled
+ * engines of one direction */
+typedef struct {
+    WDC_DEVICE_HANDLE hDev;
+    PVOID pBuf;             /* Host buffer, shared by all stripes */
+    DWORD dwBytes;
+    DWORD dwBufPageSize;    /* Size of the pages that back pBuf */
+    BOOL fToDevice;
+    BOOL fPolling;
+    PVOID pData;
+    DWORD dwStripes;        /* Number of stripes (engines) in use */
+    XDMA_DMA_STRUCT *pStripesArr[XDMA_CHANNELS_NUM];
+    HANDLE hMutex;          /* Protects dwPending and u32DmaStatus */
+    DWORD dwPending;        /* Stripes of the current transfer not yet
+                               completed */
+    UINT32 u32DmaStatus;    /* Accumulated status of the completed stripes */
+} XDMA_DMA_STRIPE;
+
+/* In-flight transfer of a submission queue */
+typedef struct {
+    XDMA_DMA_STRUCT *pEntry;    /* Queued DMA handle */
+    UINT64 u64Token;            /* Request token returned on submission */
+    PVOID pCtx;                 /* Caller context of the request */
+} XDMA_DMA_QUEUE_SLOT;
+
+/* Per-engine submission queue of queued DMA handles (XDMA_DMA_OPT_QUEUED).
+ * pSlots is a circular array of the in-flight transfers, chained in
+ * submission order */
+typedef struct {
+    XDMA_DMA_STRUCT *pEngine;   /* Engine owned by the queue */
+    DWORD dwDepth;              /* Maximal number of in-flight transfers */
+    XDMA_DMA_QUEUE_SLOT *pSlots;
+    DWORD dwHead;               /* Index of the oldest in-flight transfer */
+    DWORD dwCount;              /* Number of in-flight transfers */
+    UINT32 u32DescsDone;        /* Descriptors of the reaped transfers since
+                                   the engine was last started */
+    UINT32 u32DmaStatus;        /* Last engine status */
+    UINT32 u32PendingStatus;    /* Error bits of the engine status read (and
+                                   cleared) by the interrupt handler, not yet
+                                   reaped */
+    BOOL fPolling;              /* Completions are polled (no interrupts) */
+    XDMA_DMA_COMPLETION_HANDLER funcCompletion; /* Completion callback */
+    UINT64 u64NextToken;        /* Token of the next submitted request */
+    HANDLE hMutex;              /* Protects the queue state */
+    DWORD dwCoalesce;           /* Interrupt on every dwCoalesce-th transfer
+                                   (and on the queue tail) */
+    UINT64 u64CoalesceDelayNs;  /* Maximal time between interrupting
+                                   transfers */
+    DWORD dwUnflagged;          /* Transfers chained without a completion
+                                   interrupt since the last interrupting one */
+    UINT64 u64FlagNs;           /* Submission time of the last interrupting
+                                   transfer */
+    BOOL fKpChain;              /* Transfers are started by the Kernel PlugIn
+                                   (XDMA_QUEUE_OPT_KP_CHAIN) */
+    UINT32 u32ChainsReaped;     /* Posted chains reaped so far */
+    HANDLE hCoalesceThread;     /* Delivers the completions held back by
+                                   coalescing (see DmaQueueCoalesceThread()) */
+    BOOL fCoalesceStop;
+} XDMA_DMA_QUEUE;
+
+/* Interrupt thread of a single engine (XDMA_INT_OPT_PER_ENGINE) */
+typedef struct {
+    XDMA_DMA_STRUCT *pEngine;
+    HANDLE hThread;
+    HANDLE hEvent;              /* Signaled by XDMA_IntHandler() */
+    volatile UINT32 u32IntRequest; /* Interrupt request of the last signal,
+                                      not yet handled. Exchanged atomically
+                                      (ATOMIC_XCHG32()) */
+    BOOL fStop;
+} XDMA_ENGINE_THREAD;
+
+/* Device DMA pool (see DmaPoolCreate()) */
+#define XDMA_POOL_BLOCK_SIZE 0x1000 /* Descriptors area allocation unit. Same
+                                       as XDMA_DESC_FETCH_BOUNDARY, so pooled
+                                       descriptors are fetched in the same
+                                       bursts as page aligned ones */
+#define XDMA_POOL_DESC_BLOCKS 512   /* 2MB descriptors area */
+#define XDMA_POOL_WB_SLOT_SIZE 64   /* Cache line sized write-back slot */
+
+/* Contiguous DMA memory locked once per device, from which the descriptors
+ * buffers and the polling write-back buffers of the DMA handles are carved
+ * out */
+typedef struct {
+    WD_DMA *pDescDma;           /* Descriptors area */
+    PVOID pDescBuf;
+    UINT32 u32DescMap[XDMA_POOL_DESC_BLOCKS / 32]; /* Allocated blocks */
+    HANDLE hMutex;              /* Protects u32DescMap */
+    WD_DMA *pWBDma;             /* Write-back slots, one per engine */
+    PVOID pWBBuf;
+} XDMA_DMA_POOL;
+
+#define XDMA_SG_POOL_DEFAULT_LOW_WATERMARK 2
+#define XDMA_SG_POOL_DEFAULT_HIGH_WATERMARK 8
+
+/* Locked buffer of the SG DMA buffers pool */
+typedef struct XDMA_SG_POOL_BUF {
+    struct XDMA_SG_POOL_BUF *pNext; /* Next free buffer of the size class */
+    DWORD dwGeneration;         /* Generation of the pool that locked the
+                                   buffer */
+    DWORD dwClass;              /* Size class */
+    PVOID pBuf;
+    WD_DMA *pDma;
+} XDMA_SG_POOL_BUF;
+
+/* SG DMA buffers pool (see XDMA_SGPoolCreate()) */
+typedef struct {
+    XDMA_SG_POOL_CFG cfg;
+    DWORD dwGeneration;         /* Identifies the pool among the pools of the
+                                   device (dwSGPoolGeneration). Unlike the
+                                   pool's address, never reused */
+    XDMA_SG_POOL_BUF *pFreeArr[XDMA_SG_POOL_CLASSES]; /* Free buffers of
+                                                          each size class */
+    XDMA_SG_POOL_STATS statsArr[XDMA_SG_POOL_CLASSES];
+} XDMA_SG_POOL;
+
 #define ENGINE_IDX(dwChannel, fToDevice) \
     (fToDevice ? dwChannel : dwChannel + XDMA_CHANNELS_NUM)
 
 /* Last error information string */
 static CHAR gsXDMA_LastErr[256];
+#if defined(DEBUG)
+static BOOL gfXDMA_DescDump; /* Trace the descriptors of built transfers */
+#endif
 
 /*************************************************************
   Static functions prototypes and inline implementation
  *************************************************************/
 #if !defined(__KERNEL__)
 static BOOL DeviceValidate(const PWDC_DEVICE pDev);
+static void DmaPoolCreate(WDC_DEVICE_HANDLE hDev);
+static void DmaPoolDestroy(WDC_DEVICE_HANDLE hDev);
 #endif
 static void DLLCALLCONV XDMA_IntHandler(PVOID pData);
 static void XDMA_EventHandler(WD_EVENT *pEvent, PVOID pData);
+#if !defined(__KERNEL__) && defined(HAS_INTS)
+static void DmaQueueIntHandler(XDMA_DMA_QUEUE *pQueue);
+static UINT32 DmaCtrlStopValGet(XDMA_DMA_STRUCT *pXdmaDma);
+#endif
 static void ErrLog(const CHAR *sFormat, ...);
 static void TraceLog(const CHAR *sFormat, ...);
 
@@ -97,6 +268,124 @@ static void __vfree(void *p)
     free(p);
 #endif
 }
+
+#define XDMA_HUGE_PAGE_2MB 0x200000
+#define XDMA_HUGE_PAGE_1GB 0x40000000
+
+#if defined(LINUX)
+#ifndef MAP_HUGE_SHIFT
+    #define MAP_HUGE_SHIFT 26
+#endif
+#define XDMA_MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#define XDMA_MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+
+/* Map an anonymous buffer backed by huge pages of dwPageSize bytes */
+static void *HugePagesMap(UINT64 u64Bytes, DWORD dwPageSize)
+{
+    void *p = mmap(NULL, (size_t)u64Bytes, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+        (dwPageSize == XDMA_HUGE_PAGE_1GB ? XDMA_MAP_HUGE_1GB :
+        XDMA_MAP_HUGE_2MB), -1, 0);
+
+    return p == MAP_FAILED ? NULL : p;
+}
+#endif
+
+/* Allocate a buffer backed by huge pages. Tries 1GB pages (for buffers of at
+ * least 1GB) and then 2MB pages. Falls back to a page aligned buffer (using
+ * transparent huge pages where available) if no huge pages are reserved.
+ * *pdwPageSize receives the size of the pages that back the buffer */
+static void *__hvalloc(DWORD dwBytes, DWORD *pdwPageSize)
+{
+    void *p = NULL;
+#if defined(LINUX)
+    UINT64 u64Bytes;
+
+    if (dwBytes >= XDMA_HUGE_PAGE_1GB)
+    {
+        u64Bytes = __ALIGN_UP((UINT64)dwBytes, (UINT64)XDMA_HUGE_PAGE_1GB);
+        p = HugePagesMap(u64Bytes, XDMA_HUGE_PAGE_1GB);
+        if (p)
+        {
+            *pdwPageSize = XDMA_HUGE_PAGE_1GB;
+            return p;
+        }
+    }
+
+    u64Bytes = __ALIGN_UP((UINT64)dwBytes, (UINT64)XDMA_HUGE_PAGE_2MB);
+    p = HugePagesMap(u64Bytes, XDMA_HUGE_PAGE_2MB);
+    if (p)
+    {
+        *pdwPageSize = XDMA_HUGE_PAGE_2MB;
+        return p;
+    }
+
+    TraceLog("__hvalloc: No huge pages available, using transparent huge "
+        "pages\n");
+
+    /* Transparent huge pages: The kernel may still back the buffer with base
+     * pages, so only the base page size is reported */
+    if (posix_memalign(&p, XDMA_HUGE_PAGE_2MB, dwBytes))
+        return NULL;
+#if defined(MADV_HUGEPAGE)
+    madvise(p, dwBytes, MADV_HUGEPAGE);
+#endif
+    *pdwPageSize = GetPageSize();
+    return p;
+#elif defined(WIN32)
+    SIZE_T large_page_size = GetLargePageMinimum();
+
+    /* Requires the "Lock pages in memory" (SeLockMemoryPrivilege) privilege */
+    if (large_page_size)
+    {
+        p = VirtualAlloc(NULL, __ALIGN_UP((SIZE_T)dwBytes, large_page_size),
+            MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (p)
+        {
+            *pdwPageSize = (DWORD)large_page_size;
+            return p;
+        }
+    }
+
+    TraceLog("__hvalloc: Large pages not available\n");
+#endif
+
+    p = __valloc(dwBytes);
+    if (p)
+        *pdwPageSize = GetPageSize();
+
+    return p;
+}
+
+/* Yield the processor to another ready thread */
+static void ThreadYield(void)
+{
+#if defined(WIN32)
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+/* Free buffer allocated by __hvalloc() */
+static void __hvfree(void *p, DWORD dwBytes, DWORD dwPageSize)
+{
+    if (dwPageSize == GetPageSize())
+    {
+#if defined(LINUX)
+        free(p);
+#else
+        __vfree(p);
+#endif
+        return;
+    }
+
+#if defined(LINUX)
+    munmap(p, (size_t)__ALIGN_UP((UINT64)dwBytes, (UINT64)dwPageSize));
+#elif defined(WIN32)
+    VirtualFree(p, 0, MEM_RELEASE);
+#endif
+}
 #endif
 
 /* Validate a WDC device handle */
@@ -170,8 +459,168 @@ DWORD XDMA_LibUninit(void)
     return dwStatus;
 }
 
+/* Run a batch of register accesses. The batch may come from user mode: It
+ * is rejected as a whole, before any access, if any of its operations is
+ * invalid or outside the address space */
+DWORD XDMA_RegBatchExec(WDC_DEVICE_HANDLE hDev, KP_XDMA_REG_BATCH *pBatch)
+{
+    PWDC_DEVICE pDev = (PWDC_DEVICE)hDev;
+    DWORD i, dwStatus = WD_STATUS_SUCCESS;
+    UINT64 qwBytes;
+
+    if (pBatch->dwOps > KP_XDMA_REG_BATCH_MAX ||
+        pBatch->dwAddrSpace >= pDev->dwNumAddrSpaces)
+    {
+        return WD_INVALID_PARAMETER;
+    }
+
+    qwBytes = pDev->pAddrDesc[pBatch->dwAddrSpace].qwBytes;
+    for (i = 0; i < pBatch->dwOps; i++)
+    {
+        const KP_XDMA_REG_OP *pOp = &pBatch->ops[i];
+
+        if (pOp->dwOp != KP_XDMA_REG_READ && pOp->dwOp != KP_XDMA_REG_WRITE &&
+            pOp->dwOp != KP_XDMA_REG_MODIFY)
+        {
+            return WD_INVALID_PARAMETER;
+        }
+
+        if (qwBytes < sizeof(UINT32) || (pOp->dwOffset & 0x3) ||
+            (UINT64)pOp->dwOffset > qwBytes - sizeof(UINT32))
+        {
+            return WD_INVALID_PARAMETER;
+        }
+    }
+
+    for (i = 0; i < pBatch->dwOps && dwStatus == WD_STATUS_SUCCESS; i++)
+    {
+        KP_XDMA_REG_OP *pOp = &pBatch->ops[i];
+        UINT32 val;
+
+        switch (pOp->dwOp)
+        {
+        case KP_XDMA_REG_READ:
+            dwStatus = WDC_ReadAddr32(hDev, pBatch->dwAddrSpace,
+                pOp->dwOffset, &pOp->u32Val);
+            break;
+
+        case KP_XDMA_REG_WRITE:
+            dwStatus = WDC_WriteAddr32(hDev, pBatch->dwAddrSpace,
+                pOp->dwOffset, pOp->u32Val);
+            break;
+
+        case KP_XDMA_REG_MODIFY:
+            dwStatus = WDC_ReadAddr32(hDev, pBatch->dwAddrSpace,
+                pOp->dwOffset, &val);
+            if (dwStatus == WD_STATUS_SUCCESS)
+            {
+                dwStatus = WDC_WriteAddr32(hDev, pBatch->dwAddrSpace,
+                    pOp->dwOffset, (val & ~pOp->u32Mask) | pOp->u32Val);
+            }
+            break;
+
+        default:
+            dwStatus = WD_INVALID_PARAMETER;
+        }
+    }
+
+    return dwStatus;
+}
+
 #if !defined(__KERNEL__)
 
+/* Start a batch of register accesses on the configuration BAR */
+static void RegBatchInit(WDC_DEVICE_HANDLE hDev, KP_XDMA_REG_BATCH *pBatch)
+{
+    PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(hDev);
+
+    pBatch->dwAddrSpace = pDevCtx->dwConfigBarNum;
+    pBatch->dwOps = 0;
+}
+
+/* Add a register access to a batch. Returns the index of the operation,
+ * for reading its result once the batch has run successfully, or
+ * REG_BATCH_OP_NONE if the batch is full: The batch is then marked as
+ * overflowed, and RegBatchRun() fails without running it */
+#define REG_BATCH_OP_NONE ((DWORD)-1)
+static DWORD RegBatchAdd(KP_XDMA_REG_BATCH *pBatch, DWORD dwOp,
+    DWORD dwOffset, UINT32 u32Val)
+{
+    KP_XDMA_REG_OP *pOp;
+
+    if (pBatch->dwOps >= KP_XDMA_REG_BATCH_MAX)
+    {
+        ErrLog("RegBatchAdd: Register batch is full\n");
+        pBatch->dwOps = KP_XDMA_REG_BATCH_MAX + 1;
+        return REG_BATCH_OP_NONE;
+    }
+
+    pOp = &pBatch->ops[pBatch->dwOps];
+    pOp->dwOp = dwOp;
+    pOp->dwOffset = dwOffset;
+    pOp->u32Val = u32Val;
+    pOp->u32Mask = 0;
+
+    return pBatch->dwOps++;
+}
+
+/* Run a batch of register accesses: In a single Kernel PlugIn call if the
+ * device was opened with the Kernel PlugIn, directly otherwise */
+static DWORD RegBatchRun(WDC_DEVICE_HANDLE hDev, KP_XDMA_REG_BATCH *pBatch)
+{
+    PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(hDev);
+    DWORD dwStatus, dwResult;
+
+    /* None of the overflowed batch's accesses is run */
+    if (pBatch->dwOps > KP_XDMA_REG_BATCH_MAX)
+    {
+        ErrLog("RegBatchRun: Register batch overflowed\n");
+        pBatch->dwOps = 0;
+        return WD_INSUFFICIENT_RESOURCES;
+    }
+
+    if (!pDevCtx->fKpRegBatch)
+        return XDMA_RegBatchExec(hDev, pBatch);
+
+    dwStatus = WDC_CallKerPlug(hDev, KP_XDMA_MSG_REG_BATCH, pBatch,
+        &dwResult);
+    if (dwStatus == WD_STATUS_SUCCESS && dwResult != KP_XDMA_STATUS_OK)
+        dwStatus = WD_OPERATION_FAILED;
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        ErrLog("RegBatchRun: Kernel PlugIn register batch failed. "
+            "Error 0x%x - %s\n", dwStatus, Stat2Str(dwStatus));
+    }
+
+    return dwStatus;
+}
+
+/* Add register accesses to the counters of pXdmaDma. The caller's thread
+ * and the interrupt thread count the accesses of the same handle */
+static void DmaMmioCount(XDMA_DMA_STRUCT *pXdmaDma, UINT64 u64Reads,
+    UINT64 u64Writes)
+{
+    if (u64Reads)
+        ATOMIC_ADD64(&pXdmaDma->mmioStats.u64Reads, u64Reads);
+    if (u64Writes)
+        ATOMIC_ADD64(&pXdmaDma->mmioStats.u64Writes, u64Writes);
+}
+
+/* Count the register accesses of a batch run into pCount */
+static void RegBatchCount(const KP_XDMA_REG_BATCH *pBatch,
+    XDMA_MMIO_STATS *pCount)
+{
+    DWORD i;
+
+    for (i = 0; i < pBatch->dwOps; i++)
+    {
+        if (pBatch->ops[i].dwOp != KP_XDMA_REG_WRITE)
+            pCount->u64Reads++;
+        if (pBatch->ops[i].dwOp != KP_XDMA_REG_READ)
+            pCount->u64Writes++;
+    }
+}
+
 static DWORD getConfigBar(WDC_DEVICE_HANDLE hDev)
 {
     UINT32 i, irqId, configId;
@@ -230,16 +679,54 @@ static BOOL EngineExists(WDC_DEVICE_HANDLE hDev, BOOL fToDevice,
     return (u32EngineID & XDMA_ID_MASK) == XDMA_ID;
 }
 
+/* Resolve the register addresses of an engine in the mapped configuration
+ * BAR */
+static void EngineRegsInit(XDMA_DMA_STRUCT *pXdmaDma, UPTR pBar,
+    DWORD dwChannel, BOOL fToDevice)
+{
+    XDMA_ENGINE_REGS *pRegs = &pXdmaDma->regs;
+
+#define ENGINE_REG(h2c, c2h) ((volatile UINT32 *)(pBar + \
+    XDMA_CHANNEL_OFFSET(dwChannel, fToDevice ? (h2c) : (c2h))))
+
+    pRegs->pControl = ENGINE_REG(XDMA_H2C_CHANNEL_CONTROL_OFFSET,
+        XDMA_C2H_CHANNEL_CONTROL_OFFSET);
+    pRegs->pStatus = ENGINE_REG(XDMA_H2C_CHANNEL_STATUS_OFFSET,
+        XDMA_C2H_CHANNEL_STATUS_OFFSET);
+    pRegs->pStatusRC = ENGINE_REG(XDMA_H2C_CHANNEL_STATUS_RC_OFFSET,
+        XDMA_C2H_CHANNEL_STATUS_RC_OFFSET);
+    pRegs->pCompletedDescs = ENGINE_REG(
+        XDMA_H2C_CHANNEL_COMPLETED_DESC_COUNT_OFFSET,
+        XDMA_C2H_CHANNEL_COMPLETED_DESC_COUNT_OFFSET);
+    pRegs->pIntEnableMask = ENGINE_REG(
+        XDMA_H2C_CHANNEL_INT_ENABLE_MASK_OFFSET,
+        XDMA_C2H_CHANNEL_INT_ENABLE_MASK_OFFSET);
+#undef ENGINE_REG
+
+    pRegs->pChannelIntEnableW1S = (volatile UINT32 *)(pBar +
+        XDMA_IRQ_BLOCK_CHANNEL_INT_ENABLE_MASK_W1S_OFFSET);
+    pRegs->pChannelIntRequest = (volatile UINT32 *)(pBar +
+        XDMA_IRQ_BLOCK_CHANNEL_INT_REQUEST_OFFSET);
+}
+
 /* This function prepares the DMA context using the number of active DMA
  * engines */
 static void EnginesCreate(WDC_DEVICE_HANDLE hDev)
 {
     PWDC_DEVICE pDev = (PWDC_DEVICE)hDev;
     PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(pDev);
+    WDC_ADDR_DESC *pAddrDesc = WDC_GET_ADDR_DESC(pDev,
+        pDevCtx->dwConfigBarNum);
     XDMA_DMA_STRUCT *pXdmaDma;
     UINT32 i, u32EngineIndex = 0;
     BOOL fToDevice;
     DWORD dwChannel;
+    UPTR pBar = 0;
+
+    /* Hot path registers are accessed directly if the configuration BAR is
+     * mapped to user mode */
+    if (WDC_ADDR_IS_MEM(pAddrDesc))
+        pBar = WDC_MEM_DIRECT_ADDR(pAddrDesc);
 
     for (i = 0; i < XDMA_CHANNELS_NUM * 2; i++)
     {
@@ -252,14 +739,50 @@ static void EnginesCreate(WDC_DEVICE_HANDLE hDev)
             pXdmaDma->u32IrqBitMask = (1 << XDMA_ENG_IRQ_NUM) - 1;
             pXdmaDma->u32IrqBitMask <<= (u32EngineIndex * XDMA_ENG_IRQ_NUM);
             pXdmaDma->fIsEnabled = TRUE;
+            if (pBar)
+                EngineRegsInit(pXdmaDma, pBar, dwChannel, fToDevice);
+            if (OsMutexCreate(&pXdmaDma->hQueueMutex) != WD_STATUS_SUCCESS)
+                pXdmaDma->hQueueMutex = NULL;
             u32EngineIndex++;
         }
     }
 }
 
+static void EnginesDestroy(WDC_DEVICE_HANDLE hDev)
+{
+    PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(hDev);
+    DWORD i;
+
+    if (!pDevCtx)
+        return;
+
+    for (i = 0; i < XDMA_CHANNELS_NUM * 2; i++)
+    {
+        XDMA_DMA_STRUCT *pXdmaDma = &pDevCtx->pEnginesArr[i];
+
+        if (pXdmaDma->hQueueMutex)
+        {
+            OsMutexClose(pXdmaDma->hQueueMutex);
+            pXdmaDma->hQueueMutex = NULL;
+        }
+    }
+}
+
+/* Returns the engine of a DMA handle, which holds the engine's registers
+ * state shared by all the handles of the engine */
+static XDMA_DMA_STRUCT *DmaEngineGet(XDMA_DMA_STRUCT *pXdmaDma)
+{
+    PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(pXdmaDma->hDev);
+
+    return &pDevCtx->pEnginesArr[ENGINE_IDX(pXdmaDma->dwChannel,
+        pXdmaDma->fToDevice)];
+}
+
 BOOL DeviceInit(WDC_DEVICE_HANDLE hDev)
 {
     PXDMA_DEV_CTX pDevCtx;
+    WDC_ADDR_DESC *pAddrDesc;
+    DWORD dwStatus;
 
     if (!hDev)
         return FALSE;
@@ -276,7 +799,34 @@ BOOL DeviceInit(WDC_DEVICE_HANDLE hDev)
     if (!DeviceValidate((PWDC_DEVICE)hDev))
         return FALSE;
 
+    dwStatus = OsMutexCreate(&pDevCtx->hSGPoolMutex);
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        ErrLog("Failed creating SG DMA buffers pool mutex. Error 0x%x - %s\n",
+            dwStatus, Stat2Str(dwStatus));
+        return FALSE;
+    }
+
     EnginesCreate(hDev);
+    DmaPoolCreate(hDev);
+
+    /* Run multi-register sequences in the Kernel PlugIn, if it supports
+     * it. A configuration BAR mapped to user mode is accessed directly,
+     * which is cheaper than a Kernel PlugIn call */
+    pAddrDesc = WDC_GET_ADDR_DESC(hDev, pDevCtx->dwConfigBarNum);
+    if (WDC_IS_KP(hDev) &&
+        !(WDC_ADDR_IS_MEM(pAddrDesc) && WDC_MEM_DIRECT_ADDR(pAddrDesc)))
+    {
+        KP_XDMA_REG_BATCH batch;
+        DWORD dwResult;
+
+        RegBatchInit(hDev, &batch);
+        pDevCtx->fKpRegBatch = WDC_CallKerPlug(hDev, KP_XDMA_MSG_REG_BATCH,
+            &batch, &dwResult) == WD_STATUS_SUCCESS &&
+            dwResult == KP_XDMA_STATUS_OK;
+        TraceLog("DeviceInit: Kernel PlugIn register batches %s\n",
+            pDevCtx->fKpRegBatch ? "enabled" : "not supported");
+    }
 
     return TRUE;
 }
@@ -305,6 +855,7 @@ Error:
 /* Close a device handle */
 BOOL XDMA_DeviceClose(WDC_DEVICE_HANDLE hDev)
 {
+    PXDMA_DEV_CTX pDevCtx;
 
     TraceLog("XDMA_DeviceClose: Entered. Device handle [0x%p]\n", hDev);
 
@@ -314,6 +865,7 @@ BOOL XDMA_DeviceClose(WDC_DEVICE_HANDLE hDev)
         ErrLog("XDMA_DeviceClose: Error - NULL device handle\n");
         return FALSE;
     }
+    pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(hDev);
 #ifdef HAS_INTS
     /* Disable interrupts (if enabled) */
     if (XDMA_IntIsEnabled(hDev))
@@ -327,6 +879,15 @@ BOOL XDMA_DeviceClose(WDC_DEVICE_HANDLE hDev)
     }
 #endif /* ifdef HAS_INTS */
 
+    XDMA_SGPoolDestroy(hDev);
+    if (pDevCtx->hSGPoolMutex)
+    {
+        OsMutexClose(pDevCtx->hSGPoolMutex);
+        pDevCtx->hSGPoolMutex = NULL;
+    }
+    DmaPoolDestroy(hDev);
+    EnginesDestroy(hDev);
+
     return WDC_DIAG_DeviceClose(hDev);
 }
 
@@ -357,26 +918,105 @@ static void HandleEngineInterrupt(XDMA_DMA_STRUCT *pXdmaDma, UINT32 val)
 {
     PWDC_DEVICE pDev = (PWDC_DEVICE)pXdmaDma->hDev;
     PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(pDev);
+    KP_XDMA_ENGINE_RECORD *pRec = NULL;
     XDMA_INT_RESULT intResult;
+    XDMA_MMIO_STATS count;
+    UINT32 u32CompletedDescs;
 
     BZERO(intResult);
+    BZERO(count);
     intResult.u32IntStatus = val;
 
     if (!pXdmaDma->fToDevice)
         WDC_DMASyncIo(pXdmaDma->pDma);
 
-    XDMA_EngineStatusRead(pXdmaDma, TRUE, &intResult.u32DmaStatus);
-    XDMA_DmaTransferStop(pXdmaDma);
+    /* The Kernel PlugIn has already read and cleared the engine status and
+     * stopped the engine */
+    if (pDevCtx->pKpShared)
+    {
+        pRec = &pDevCtx->pKpShared->engines[ENGINE_IDX(pXdmaDma->dwChannel,
+            pXdmaDma->fToDevice)];
+        intResult.u32DmaStatus = pRec->u32DmaStatus;
+        u32CompletedDescs = pRec->u32CompletedDescs;
+    }
+    else if (pXdmaDma->regs.pControl)
+    {
+        XDMA_ENGINE_REGS *pRegs = &pXdmaDma->regs;
+
+        intResult.u32DmaStatus = *pRegs->pStatusRC;
+        *pRegs->pControl = DmaCtrlStopValGet(pXdmaDma);
+        u32CompletedDescs = *pRegs->pCompletedDescs;
+        count.u64Reads = 2;
+        count.u64Writes = 1;
+    }
+    else
+    {
+        KP_XDMA_REG_BATCH batch;
+        DWORD dwStatusOp, dwCountOp;
+
+        /* Read and clear the status, stop the engine and read the completed
+         * descriptors count */
+        RegBatchInit(pDev, &batch);
+        dwStatusOp = RegBatchAdd(&batch, KP_XDMA_REG_READ,
+            XDMA_CHANNEL_OFFSET(pXdmaDma->dwChannel, pXdmaDma->fToDevice ?
+            XDMA_H2C_CHANNEL_STATUS_RC_OFFSET :
+            XDMA_C2H_CHANNEL_STATUS_RC_OFFSET), 0);
+        RegBatchAdd(&batch, KP_XDMA_REG_WRITE,
+            XDMA_CHANNEL_OFFSET(pXdmaDma->dwChannel, pXdmaDma->fToDevice ?
+            XDMA_H2C_CHANNEL_CONTROL_OFFSET : XDMA_C2H_CHANNEL_CONTROL_OFFSET),
+            DmaCtrlStopValGet(pXdmaDma));
+        dwCountOp = RegBatchAdd(&batch, KP_XDMA_REG_READ,
+            XDMA_CHANNEL_OFFSET(pXdmaDma->dwChannel, pXdmaDma->fToDevice ?
+            XDMA_H2C_CHANNEL_COMPLETED_DESC_COUNT_OFFSET :
+            XDMA_C2H_CHANNEL_COMPLETED_DESC_COUNT_OFFSET), 0);
+        u32CompletedDescs = 0;
+        if (RegBatchRun(pDev, &batch) == WD_STATUS_SUCCESS)
+        {
+            intResult.u32DmaStatus = batch.ops[dwStatusOp].u32Val;
+            u32CompletedDescs = batch.ops[dwCountOp].u32Val;
+        }
+        RegBatchCount(&batch, &count);
+    }
+    DmaMmioCount(pXdmaDma, count.u64Reads, count.u64Writes);
+    pXdmaDma->mmioStats.dwCompletionReads = (DWORD)count.u64Reads;
+    pXdmaDma->mmioStats.dwCompletionWrites = (DWORD)count.u64Writes;
+
+    /* XDMA_IntHandler() disabled the engine's channel interrupts */
+    pXdmaDma->fDmaIntsEnabled = FALSE;
+
+    /* Hybrid handles report their completion to XDMA_DmaWaitCompletion() */
+    if (pXdmaDma->fHybrid)
+    {
+        pXdmaDma->u32HybridDmaStatus = intResult.u32DmaStatus;
+        OsEventSignal(pXdmaDma->hHybridEvent);
+        return;
+    }
 
     intResult.hDma = pXdmaDma;
+    intResult.pData = pXdmaDma->pData;
 
-    WDC_ReadAddr32(pDev, pDevCtx->dwConfigBarNum,
-        XDMA_CHANNEL_OFFSET(pXdmaDma->dwChannel,
-        pXdmaDma->fToDevice ?  XDMA_H2C_CHANNEL_COMPLETED_DESC_COUNT_OFFSET :
-        XDMA_C2H_CHANNEL_COMPLETED_DESC_COUNT_OFFSET),
-        &val);
+    if (pXdmaDma->pStripe)
+    {
+        XDMA_DMA_STRIPE *pStripe = (XDMA_DMA_STRIPE *)pXdmaDma->pStripe;
+        DWORD dwPending;
+
+        /* Report the striped transfer only once all of its stripes are
+         * done */
+        OsMutexLock(pStripe->hMutex);
+        pStripe->u32DmaStatus |= intResult.u32DmaStatus;
+        dwPending = --pStripe->dwPending;
+        intResult.u32DmaStatus = pStripe->u32DmaStatus;
+        OsMutexUnlock(pStripe->hMutex);
+
+        if (dwPending)
+            return;
+
+        intResult.hStripe = pStripe;
+        intResult.pData = pStripe->pData;
+    }
 
-    TraceLog("XDMA_IntHandler: Completed DMA descriptors %d\n", val);
+    TraceLog("XDMA_IntHandler: Completed DMA descriptors %d\n",
+        u32CompletedDescs);
 
     intResult.dwCounter = pDev->Int.dwCounter;
     intResult.dwLost = pDev->Int.dwLost;
@@ -387,70 +1027,301 @@ static void HandleEngineInterrupt(XDMA_DMA_STRUCT *pXdmaDma, UINT32 val)
         WDC_GET_ENABLED_INT_TYPE(pDev) == INTERRUPT_MESSAGE_X) ?
         TRUE : FALSE;
     intResult.dwLastMessage = WDC_GET_ENABLED_INT_LAST_MSG(pDev);
-    intResult.pData = pXdmaDma->pData;
 
     /* Execute the diagnostics application's interrupt handler routine */
     pDevCtx->funcDiagIntHandler((WDC_DEVICE_HANDLE)pDev, &intResult);
 }
 
-/* Interrupt handler routine */
-static void DLLCALLCONV XDMA_IntHandler(PVOID pData)
+/* Handle a completion interrupt of a single engine */
+static void EngineIntDispatch(XDMA_DMA_STRUCT *pXdmaDma, UINT32 u32IntRequest)
 {
-    PWDC_DEVICE pDev = (PWDC_DEVICE)pData;
-    PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(pDev);
-    XDMA_DMA_STRUCT *pXdmaDma = NULL;
-    UINT32 i, u32IntRequest = pDevCtx->pTrans[0].Data.Dword;
-
-    /* Disable interrupts of completed engines. If level sensitive interrupts
-     * are used, interrupts should be disabled by transfer commands or by
-     * kernel plugin */
-    XDMA_ChannelInterruptsDisable(pDev, u32IntRequest);
-
-    for (i = 0; i < XDMA_CHANNELS_NUM * 2; i++)
+    /* XDMA_DmaQueueClose() does not free the queue while it is handled.
+     * Queues are not opened on engines without the mutex */
+    if (pXdmaDma->hQueueMutex)
     {
-        pXdmaDma = &(pDevCtx->pEnginesArr[i]);
-
-        if (u32IntRequest & pXdmaDma->u32IrqBitMask)
+        OsMutexLock(pXdmaDma->hQueueMutex);
+        if (pXdmaDma->pQueue)
         {
-            if (pXdmaDma->fIsEnabled)
-                HandleEngineInterrupt(pXdmaDma, u32IntRequest);
-            else
-                ErrLog("Engine [%d] is disabled\n", i);
+            DmaQueueIntHandler((XDMA_DMA_QUEUE *)pXdmaDma->pQueue);
+            OsMutexUnlock(pXdmaDma->hQueueMutex);
+            return;
         }
+        OsMutexUnlock(pXdmaDma->hQueueMutex);
     }
+
+    HandleEngineInterrupt(pXdmaDma, u32IntRequest);
 }
 
-/* Enable interrupts */
-DWORD XDMA_IntEnable(WDC_DEVICE_HANDLE hDev, XDMA_INT_HANDLER funcIntHandler)
+/* Interrupt thread of a single engine (XDMA_INT_OPT_PER_ENGINE) */
+static void EngineIntThread(void *pData)
 {
-    DWORD dwStatus;
-    PWDC_DEVICE pDev = (PWDC_DEVICE)hDev;
-    PXDMA_DEV_CTX pDevCtx;
-    WDC_ADDR_DESC *pAddrDesc;
-    WD_TRANSFER *pTrans = NULL;
+    XDMA_ENGINE_THREAD *pThread = (XDMA_ENGINE_THREAD *)pData;
 
-    TraceLog("XDMA_IntEnable: Entered. Device handle [0x%p]\n", hDev);
+    for (;;)
+    {
+        UINT32 u32IntRequest;
 
-    /* Validate the WDC device handle */
-    if (!IsValidDevice(pDev, "XDMA_IntEnable"))
-        return WD_INVALID_PARAMETER;
+        OsEventWait(pThread->hEvent, INFINITE);
+        if (pThread->fStop)
+            break;
 
-    pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(pDev);
+        /* 0 - the request of this signal was taken with an earlier one */
+        u32IntRequest = ATOMIC_XCHG32(&pThread->u32IntRequest, 0);
+        if (u32IntRequest)
+            EngineIntDispatch(pThread->pEngine, u32IntRequest);
+    }
+}
 
-    /* Check whether interrupts are already enabled */
-    if (WDC_IntIsEnabled(hDev))
+/* Stop and free the per-engine interrupt threads of a device */
+static void EngineIntThreadsStop(PXDMA_DEV_CTX pDevCtx)
+{
+    XDMA_ENGINE_THREAD *pThreads =
+        (XDMA_ENGINE_THREAD *)pDevCtx->pEngineThreads;
+    DWORD i;
+
+    if (!pThreads)
+        return;
+
+    for (i = 0; i < XDMA_CHANNELS_NUM * 2; i++)
     {
-        ErrLog("Interrupts are already enabled ...\n");
-        return WD_OPERATION_ALREADY_DONE;
+        if (!pThreads[i].hThread)
+            continue;
+
+        pThreads[i].fStop = TRUE;
+        OsEventSignal(pThreads[i].hEvent);
+        ThreadWait(pThreads[i].hThread);
+        OsEventClose(pThreads[i].hEvent);
     }
 
-#if 0
-    /* TODO: Uncomment in case level sensitive interrupts are used */
-    #define NUM_TRANS_CMDS 3
-    pTrans = (WD_TRANSFER *)calloc(NUM_TRANS_CMDS, sizeof(WD_TRANSFER));
-    if (!pTrans)
+    free(pThreads);
+    pDevCtx->pEngineThreads = NULL;
+}
+
+/* Start an interrupt thread for each enabled engine of a device */
+static DWORD EngineIntThreadsStart(PXDMA_DEV_CTX pDevCtx)
+{
+    XDMA_ENGINE_THREAD *pThreads;
+    DWORD i, dwStatus;
+
+    pThreads = (XDMA_ENGINE_THREAD *)calloc(XDMA_CHANNELS_NUM * 2,
+        sizeof(XDMA_ENGINE_THREAD));
+    if (!pThreads)
     {
-        ErrLog("Failed allocating memory for interrupt transfer commands\n");
+        ErrLog("Failed allocating memory for engine interrupt threads\n");
+        return WD_INSUFFICIENT_RESOURCES;
+    }
+    pDevCtx->pEngineThreads = pThreads;
+
+    for (i = 0; i < XDMA_CHANNELS_NUM * 2; i++)
+    {
+        if (!pDevCtx->pEnginesArr[i].fIsEnabled)
+            continue;
+
+        pThreads[i].pEngine = &pDevCtx->pEnginesArr[i];
+        dwStatus = OsEventCreate(&pThreads[i].hEvent);
+        if (dwStatus != WD_STATUS_SUCCESS)
+            goto Error;
+
+        dwStatus = ThreadStart(&pThreads[i].hThread,
+            (HANDLER_FUNC)EngineIntThread, &pThreads[i]);
+        if (dwStatus != WD_STATUS_SUCCESS)
+        {
+            OsEventClose(pThreads[i].hEvent);
+            goto Error;
+        }
+    }
+
+    return WD_STATUS_SUCCESS;
+
+Error:
+    ErrLog("Failed starting engine [%d] interrupt thread. Error 0x%x - %s\n",
+        i, dwStatus, Stat2Str(dwStatus));
+    EngineIntThreadsStop(pDevCtx);
+
+    return dwStatus;
+}
+
+/* Returns the interrupt request bits of the engines whose Kernel PlugIn
+ * completion records changed since the last call */
+static UINT32 KpIntRequestGet(PXDMA_DEV_CTX pDevCtx)
+{
+    UINT32 i, u32IntRequest = 0;
+
+    for (i = 0; i < XDMA_CHANNELS_NUM * 2; i++)
+    {
+        UINT32 u32Completions = pDevCtx->pKpShared->engines[i].u32Completions;
+
+        if (u32Completions == pDevCtx->u32KpCompletions[i])
+            continue;
+
+        pDevCtx->u32KpCompletions[i] = u32Completions;
+        u32IntRequest |= pDevCtx->pEnginesArr[i].u32IrqBitMask;
+    }
+
+    return u32IntRequest;
+}
+
+/* Hand completion handling over to the Kernel PlugIn interrupt DPC. On
+ * failure, completions are handled in user mode */
+static DWORD KpIntInit(WDC_DEVICE_HANDLE hDev)
+{
+    PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(hDev);
+    KP_XDMA_SHARED *pShared;
+    KP_XDMA_INT_INIT intInit;
+    DWORD i, dwStatus, dwResult;
+
+    dwStatus = WDC_SharedBufferAlloc(sizeof(KP_XDMA_SHARED),
+        KER_BUF_ALLOC_NON_CONTIG, &pDevCtx->pKpSharedBuf);
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        ErrLog("Failed allocating Kernel PlugIn shared buffer. "
+            "Error 0x%x - %s\n", dwStatus, Stat2Str(dwStatus));
+        return dwStatus;
+    }
+
+    pShared = (KP_XDMA_SHARED *)pDevCtx->pKpSharedBuf->pUserAddr;
+    memset(pShared, 0, sizeof(KP_XDMA_SHARED));
+
+    BZERO(intInit);
+    intInit.dwConfigBarNum = pDevCtx->dwConfigBarNum;
+    intInit.u64SharedKernelAddr = (UINT64)pDevCtx->pKpSharedBuf->pKernelAddr;
+    for (i = 0; i < XDMA_CHANNELS_NUM * 2; i++)
+    {
+        XDMA_DMA_STRUCT *pEngine = &pDevCtx->pEnginesArr[i];
+
+        if (!pEngine->fIsEnabled)
+            continue;
+
+        intInit.u32IrqBitMasks[i] = pEngine->u32IrqBitMask;
+        if (pEngine->pQueue &&
+            !((XDMA_DMA_QUEUE *)pEngine->pQueue)->fKpChain)
+        {
+            pShared->engines[i].u32Flags = KP_XDMA_ENGINE_KEEP_RUNNING;
+        }
+        pDevCtx->u32KpCompletions[i] = 0;
+    }
+
+    dwStatus = WDC_CallKerPlug(hDev, KP_XDMA_MSG_INT_INIT, &intInit,
+        &dwResult);
+    if (dwStatus != WD_STATUS_SUCCESS || dwResult != KP_XDMA_STATUS_OK)
+    {
+        ErrLog("Kernel PlugIn completion handling is not available. "
+            "Error 0x%x - %s, result 0x%x\n", dwStatus, Stat2Str(dwStatus),
+            dwResult);
+        WDC_SharedBufferFree(pDevCtx->pKpSharedBuf);
+        pDevCtx->pKpSharedBuf = NULL;
+        return dwStatus != WD_STATUS_SUCCESS ? dwStatus :
+            WD_OPERATION_FAILED;
+    }
+
+    pDevCtx->pKpShared = pShared;
+    TraceLog("KpIntInit: Completions are handled by the Kernel PlugIn\n");
+
+    return WD_STATUS_SUCCESS;
+}
+
+/* Stop Kernel PlugIn completion handling. Called after interrupts are
+ * disabled */
+static void KpIntUninit(WDC_DEVICE_HANDLE hDev)
+{
+    PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(hDev);
+
+    if (!pDevCtx->pKpSharedBuf)
+        return;
+
+    pDevCtx->pKpShared = NULL;
+    WDC_SharedBufferFree(pDevCtx->pKpSharedBuf);
+    pDevCtx->pKpSharedBuf = NULL;
+}
+
+/* Interrupt handler routine */
+static void DLLCALLCONV XDMA_IntHandler(PVOID pData)
+{
+    PWDC_DEVICE pDev = (PWDC_DEVICE)pData;
+    PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(pDev);
+    XDMA_ENGINE_THREAD *pThreads =
+        (XDMA_ENGINE_THREAD *)pDevCtx->pEngineThreads;
+    XDMA_DMA_STRUCT *pXdmaDma = NULL;
+    UINT32 i, u32IntRequest = pDevCtx->pTrans[0].Data.Dword;
+
+    if (pDevCtx->pKpShared)
+    {
+        /* The Kernel PlugIn has already disabled the interrupts of the
+         * completed engines: Find them by their completion records */
+        u32IntRequest = KpIntRequestGet(pDevCtx);
+    }
+    else
+    {
+        /* Disable interrupts of completed engines. If level sensitive
+         * interrupts are used, interrupts should be disabled by transfer
+         * commands or by kernel plugin */
+        XDMA_ChannelInterruptsDisable(pDev, u32IntRequest);
+    }
+
+    for (i = 0; i < XDMA_CHANNELS_NUM * 2; i++)
+    {
+        pXdmaDma = &(pDevCtx->pEnginesArr[i]);
+
+        if (u32IntRequest & pXdmaDma->u32IrqBitMask)
+        {
+            if (!pXdmaDma->fIsEnabled)
+            {
+                ErrLog("Engine [%d] is disabled\n", i);
+            }
+            else if (pThreads && pThreads[i].hThread)
+            {
+                /* Hand the engine over to its own thread, so that the
+                 * completions of different engines are not serialized */
+                ATOMIC_XCHG32(&pThreads[i].u32IntRequest, u32IntRequest);
+                OsEventSignal(pThreads[i].hEvent);
+            }
+            else
+            {
+                EngineIntDispatch(pXdmaDma, u32IntRequest);
+            }
+        }
+    }
+}
+
+/* Enable interrupts */
+DWORD XDMA_IntEnable(WDC_DEVICE_HANDLE hDev, XDMA_INT_HANDLER funcIntHandler)
+{
+    return XDMA_IntEnableEx(hDev, funcIntHandler, 0);
+}
+
+/* Enable interrupts with XDMA_INT_OPT_XXX options */
+DWORD XDMA_IntEnableEx(WDC_DEVICE_HANDLE hDev, XDMA_INT_HANDLER funcIntHandler,
+    DWORD dwOptions)
+{
+    DWORD dwStatus;
+    PWDC_DEVICE pDev = (PWDC_DEVICE)hDev;
+    PXDMA_DEV_CTX pDevCtx;
+    WDC_ADDR_DESC *pAddrDesc;
+    WD_TRANSFER *pTrans = NULL;
+
+    TraceLog("XDMA_IntEnable: Entered. Device handle [0x%p], dwOptions "
+        "[0x%x]\n", hDev, dwOptions);
+
+    /* Validate the WDC device handle */
+    if (!IsValidDevice(pDev, "XDMA_IntEnable"))
+        return WD_INVALID_PARAMETER;
+
+    pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(pDev);
+
+    /* Check whether interrupts are already enabled */
+    if (WDC_IntIsEnabled(hDev))
+    {
+        ErrLog("Interrupts are already enabled ...\n");
+        return WD_OPERATION_ALREADY_DONE;
+    }
+
+#if 0
+    /* TODO: Uncomment in case level sensitive interrupts are used */
+    #define NUM_TRANS_CMDS 3
+    pTrans = (WD_TRANSFER *)calloc(NUM_TRANS_CMDS, sizeof(WD_TRANSFER));
+    if (!pTrans)
+    {
+        ErrLog("Failed allocating memory for interrupt transfer commands\n");
         return WD_INSUFFICIENT_RESOURCES;
     }
 
@@ -496,6 +1367,24 @@ DWORD XDMA_IntEnable(WDC_DEVICE_HANDLE hDev, XDMA_INT_HANDLER funcIntHandler)
     /* Store the diag interrupt handler routine, which will be executed by
        XDMA_IntHandler() when an interrupt is received */
     pDevCtx->funcDiagIntHandler = funcIntHandler;
+    pDevCtx->dwIntOptions = dwOptions;
+
+    /* The Kernel PlugIn starts handling completions with the first
+     * interrupt */
+    if (WDC_IS_KP(hDev))
+        KpIntInit(hDev);
+
+    /* The engine threads must be running before the first interrupt */
+    if (dwOptions & XDMA_INT_OPT_PER_ENGINE)
+    {
+        dwStatus = EngineIntThreadsStart(pDevCtx);
+        if (dwStatus != WD_STATUS_SUCCESS)
+        {
+            KpIntUninit(hDev);
+            free(pTrans);
+            return dwStatus;
+        }
+    }
 
     /* Enable interrupts */
     dwStatus = WDC_IntEnable(hDev, pTrans, NUM_TRANS_CMDS, INTERRUPT_CMD_COPY,
@@ -505,6 +1394,8 @@ DWORD XDMA_IntEnable(WDC_DEVICE_HANDLE hDev, XDMA_INT_HANDLER funcIntHandler)
     {
         ErrLog("Failed enabling interrupts. Error 0x%x - %s\n",
             dwStatus, Stat2Str(dwStatus));
+        EngineIntThreadsStop(pDevCtx);
+        KpIntUninit(hDev);
         free(pTrans);
         return dwStatus;
     }
@@ -538,6 +1429,32 @@ DWORD XDMA_IntEnable(WDC_DEVICE_HANDLE hDev, XDMA_INT_HANDLER funcIntHandler)
         WDC_WriteAddr32(hDev, pDevCtx->dwConfigBarNum,
             XDMA_IRQ_BLOCK_CHANNEL_VECTOR_2_OFFSET, u32WriteVal);
     }
+    else if (pDevCtx->dwEnabledIntType == INTERRUPT_MESSAGE_X &&
+        (dwOptions & XDMA_INT_OPT_PER_ENGINE))
+    {
+        DWORD dwVectors = WDC_GET_ENABLED_INT_LAST_MSG(hDev) + 1;
+        UINT32 u32Vectors[2] = { 0, 0 };
+        DWORD i;
+
+        /* Steer each engine to its own MSI-X vector: The vector number of
+         * each channel interrupt request bit is the bit number, one byte per
+         * bit. Bits without an allocated vector stay on vector 0; the handler
+         * reads the channel interrupt request register, so no completion is
+         * lost */
+        for (i = 0; i < 8 && i < dwVectors; i++)
+            u32Vectors[i / 4] |= (UINT32)i << ((i % 4) * 8);
+
+        if (dwVectors < 8)
+        {
+            TraceLog("XDMA_IntEnable: %d MSI-X vectors allocated, engines "
+                "beyond them share vector 0\n", dwVectors);
+        }
+
+        WDC_WriteAddr32(hDev, pDevCtx->dwConfigBarNum,
+            XDMA_IRQ_BLOCK_CHANNEL_VECTOR_1_OFFSET, u32Vectors[0]);
+        WDC_WriteAddr32(hDev, pDevCtx->dwConfigBarNum,
+            XDMA_IRQ_BLOCK_CHANNEL_VECTOR_2_OFFSET, u32Vectors[1]);
+    }
 
     return WD_STATUS_SUCCESS;
 
@@ -548,6 +1465,8 @@ Error:
         ErrLog("Failed disabling interrupts. Error 0x%x - %s\n",
             dwStatus, Stat2Str(dwStatus));
     }
+    EngineIntThreadsStop(pDevCtx);
+    KpIntUninit(hDev);
 
     return dwStatus;
 }
@@ -585,6 +1504,11 @@ DWORD XDMA_IntDisable(WDC_DEVICE_HANDLE hDev)
             dwStatus, Stat2Str(dwStatus));
     }
 
+    /* No more interrupts are delivered: The engine threads may be stopped,
+     * and the Kernel PlugIn no longer accesses the shared records */
+    EngineIntThreadsStop(pDevCtx);
+    KpIntUninit(hDev);
+
     if (pDevCtx->pTrans)
         free(pDevCtx->pTrans);
 
@@ -642,9 +1566,18 @@ BOOL XDMA_IntIsEnabled(WDC_DEVICE_HANDLE hDev)
 DWORD XDMA_EngineStatusRead(XDMA_DMA_HANDLE hDma, BOOL fClear, UINT32 *pStatus)
 {
     XDMA_DMA_STRUCT *pXdmaDma = (XDMA_DMA_STRUCT *)hDma;
-    PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(pXdmaDma->hDev);
+    PXDMA_DEV_CTX pDevCtx;
     DWORD dwOffset;
 
+    DmaMmioCount(pXdmaDma, 1, 0);
+    if (pXdmaDma->regs.pStatus)
+    {
+        *pStatus = fClear ? *pXdmaDma->regs.pStatusRC :
+            *pXdmaDma->regs.pStatus;
+        return WD_STATUS_SUCCESS;
+    }
+
+    pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(pXdmaDma->hDev);
     if (fClear)
     {
         dwOffset = XDMA_CHANNEL_OFFSET(pXdmaDma->dwChannel,
@@ -662,6 +1595,109 @@ DWORD XDMA_EngineStatusRead(XDMA_DMA_HANDLE hDma, BOOL fClear, UINT32 *pStatus)
         pStatus);
 }
 
+/* Clear the engine performance monitor counters and start counting */
+DWORD XDMA_EnginePerfArm(XDMA_DMA_HANDLE hDma, BOOL fAuto)
+{
+    XDMA_DMA_STRUCT *pXdmaDma = (XDMA_DMA_STRUCT *)hDma;
+    PXDMA_DEV_CTX pDevCtx;
+    DWORD dwOffset, dwStatus;
+
+    if (!pXdmaDma)
+        return WD_INVALID_PARAMETER;
+
+    pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(pXdmaDma->hDev);
+    dwOffset = XDMA_CHANNEL_OFFSET(pXdmaDma->dwChannel, pXdmaDma->fToDevice ?
+        XDMA_H2C_CHANNEL_PERFORMANCE_MONITOR_CONTROL_OFFSET :
+        XDMA_C2H_CHANNEL_PERFORMANCE_MONITOR_CONTROL_OFFSET);
+
+    dwStatus = WDC_WriteAddr32(pXdmaDma->hDev, pDevCtx->dwConfigBarNum,
+        dwOffset, XDMA_PERF_CTRL_CLEAR);
+    if (dwStatus != WD_STATUS_SUCCESS)
+        return dwStatus;
+
+    return WDC_WriteAddr32(pXdmaDma->hDev, pDevCtx->dwConfigBarNum, dwOffset,
+        fAuto ? XDMA_PERF_CTRL_AUTO : XDMA_PERF_CTRL_RUN);
+}
+
+/* Stop the engine performance monitor counters, keeping their values */
+DWORD XDMA_EnginePerfFreeze(XDMA_DMA_HANDLE hDma)
+{
+    XDMA_DMA_STRUCT *pXdmaDma = (XDMA_DMA_STRUCT *)hDma;
+    PXDMA_DEV_CTX pDevCtx;
+
+    if (!pXdmaDma)
+        return WD_INVALID_PARAMETER;
+
+    pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(pXdmaDma->hDev);
+
+    return WDC_WriteAddr32(pXdmaDma->hDev, pDevCtx->dwConfigBarNum,
+        XDMA_CHANNEL_OFFSET(pXdmaDma->dwChannel, pXdmaDma->fToDevice ?
+        XDMA_H2C_CHANNEL_PERFORMANCE_MONITOR_CONTROL_OFFSET :
+        XDMA_C2H_CHANNEL_PERFORMANCE_MONITOR_CONTROL_OFFSET), 0);
+}
+
+/* Read a 42 bit performance counter. Returns TRUE if it is maxed out */
+static BOOL EnginePerfCounterRead(XDMA_DMA_STRUCT *pXdmaDma, DWORD dwBar,
+    DWORD dwLowOffset, DWORD dwHighOffset, UINT64 *pu64Count)
+{
+    UINT32 u32Low, u32High;
+
+    WDC_ReadAddr32(pXdmaDma->hDev, dwBar,
+        XDMA_CHANNEL_OFFSET(pXdmaDma->dwChannel, dwHighOffset), &u32High);
+    WDC_ReadAddr32(pXdmaDma->hDev, dwBar,
+        XDMA_CHANNEL_OFFSET(pXdmaDma->dwChannel, dwLowOffset), &u32Low);
+
+    *pu64Count = ((UINT64)(u32High & XDMA_PERF_COUNT_HIGH_MASK) << 32) |
+        u32Low;
+
+    return (u32High & XDMA_PERF_COUNT_MAXED) ? TRUE : FALSE;
+}
+
+/* Read the engine performance monitor counters. Freeze the counters first
+ * (XDMA_EnginePerfFreeze()) for a consistent reading */
+DWORD XDMA_EnginePerfRead(XDMA_DMA_HANDLE hDma, XDMA_PERF_COUNTERS *pCounters)
+{
+    XDMA_DMA_STRUCT *pXdmaDma = (XDMA_DMA_STRUCT *)hDma;
+    PXDMA_DEV_CTX pDevCtx;
+    UINT32 u32DataWidth;
+    BOOL fToDevice;
+    DWORD dwStatus;
+
+    if (!pXdmaDma || !pCounters)
+        return WD_INVALID_PARAMETER;
+
+    pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(pXdmaDma->hDev);
+    fToDevice = pXdmaDma->fToDevice;
+
+    /* 0 - 64 bit, 1 - 128 bit, 2 - 256 bit, 3 - 512 bit */
+    dwStatus = WDC_ReadAddr32(pXdmaDma->hDev, pDevCtx->dwConfigBarNum,
+        XDMA_CONFIG_BLOCK_PCIE_DATA_WIDTH_OFFSET, &u32DataWidth);
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        ErrLog("XDMA_EnginePerfRead: Failed reading PCIe data width. "
+            "Error 0x%x - %s\n", dwStatus, Stat2Str(dwStatus));
+        return dwStatus;
+    }
+    pCounters->dwBeatBytes = 8 << (u32DataWidth & 0x7);
+
+    pCounters->fMaxed = EnginePerfCounterRead(pXdmaDma,
+        pDevCtx->dwConfigBarNum, fToDevice ?
+        XDMA_H2C_CHANNEL_PERFORMANCE_CYCLE_COUNT_OFFSET :
+        XDMA_C2H_CHANNEL_PERFORMANCE_CYCLE_COUNT_OFFSET, fToDevice ?
+        XDMA_H2C_CHANNEL_PERFORMANCE_CYCLE_COUNT_HIGH_OFFSET :
+        XDMA_C2H_CHANNEL_PERFORMANCE_CYCLE_COUNT_HIGH_OFFSET,
+        &pCounters->u64Cycles);
+    pCounters->fMaxed |= EnginePerfCounterRead(pXdmaDma,
+        pDevCtx->dwConfigBarNum, fToDevice ?
+        XDMA_H2C_CHANNEL_PERFORMANCE_DATA_COUNT_OFFSET :
+        XDMA_C2H_CHANNEL_PERFORMANCE_DATA_COUNT_OFFSET, fToDevice ?
+        XDMA_H2C_CHANNEL_PERFORMANCE_DATA_COUNT_HIGH_OFFSET :
+        XDMA_C2H_CHANNEL_PERFORMANCE_DATA_COUNT_HIGH_OFFSET,
+        &pCounters->u64DataBeats);
+
+    return WD_STATUS_SUCCESS;
+}
+
 static DWORD ValidateTransferParams(WDC_DEVICE_HANDLE hDev, BOOL fToDevice,
     DWORD dwChannel)
 {
@@ -717,15 +1753,30 @@ static BOOL EngineIsStreaming(WDC_DEVICE_HANDLE hDev, DWORD dwChannel,
 }
 
 static DWORD LockDmaBuffer(WDC_DEVICE_HANDLE hDev, BOOL fToDevice, PVOID *ppBuf,
-    DWORD dwBytes, WD_DMA **ppDma, BOOL fIsTransaction)
+    DWORD dwBytes, WD_DMA **ppDma, BOOL fIsTransaction, BOOL fMergePages,
+    BOOL fHugePages, DWORD *pdwPageSize)
 {
     DWORD dwStatus, dwOptions;
+    BOOL fExtBuf = *ppBuf != NULL;
 
-    *ppBuf = __valloc(dwBytes); /* Make sure that the buffer is aligned */
-    if (!*ppBuf)
+    /* Make sure that the buffer is aligned. A buffer provided by the caller
+     * (*ppBuf) is only locked */
+    if (!fExtBuf)
     {
-        ErrLog("Memory allocation failure\n");
-        return WD_INSUFFICIENT_RESOURCES;
+        if (fHugePages)
+        {
+            *ppBuf = __hvalloc(dwBytes, pdwPageSize);
+        }
+        else
+        {
+            *ppBuf = __valloc(dwBytes);
+            *pdwPageSize = GetPageSize();
+        }
+        if (!*ppBuf)
+        {
+            ErrLog("Memory allocation failure\n");
+            return WD_INSUFFICIENT_RESOURCES;
+        }
     }
 
     dwOptions = DMA_ALLOW_64BIT_ADDRESS |
@@ -733,10 +1784,12 @@ static DWORD LockDmaBuffer(WDC_DEVICE_HANDLE hDev, BOOL fToDevice, PVOID *ppBuf,
 
     if (!fIsTransaction)
     {
-        /* DMA_DISABLE_MERGE_ADJACENT_PAGES is needed to make sure that each SG
-         * page is not larger than 0x0FFFFFFF */
-        dwStatus = WDC_DMASGBufLock(hDev, *ppBuf,
-            dwOptions | DMA_DISABLE_MERGE_ADJACENT_PAGES, dwBytes, ppDma);
+        /* DMA_DISABLE_MERGE_ADJACENT_PAGES keeps each SG page smaller than
+         * XDMA_DESC_MAX_BYTES. Merged pages are split by DmaTransferBuild() */
+        if (!fMergePages)
+            dwOptions |= DMA_DISABLE_MERGE_ADJACENT_PAGES;
+
+        dwStatus = WDC_DMASGBufLock(hDev, *ppBuf, dwOptions, dwBytes, ppDma);
     }
     else
     {
@@ -754,64 +1807,280 @@ static DWORD LockDmaBuffer(WDC_DEVICE_HANDLE hDev, BOOL fToDevice, PVOID *ppBuf,
     return WD_STATUS_SUCCESS;
 
 Error:
-    free(*ppBuf);
-    *ppBuf = NULL;
+    if (!fExtBuf)
+    {
+        __hvfree(*ppBuf, dwBytes, *pdwPageSize);
+        *ppBuf = NULL;
+    }
 
     return dwStatus;
 }
 
-static DWORD EngineCtrlRegisterSet(WDC_DEVICE_HANDLE hDev, DWORD dwChannel,
-    BOOL fToDevice, UINT32 val)
+#define SG_POOL_CLASS_BYTES(dwClass) (1UL << (XDMA_SG_POOL_MIN_SHIFT + \
+    (dwClass)))
+
+/* Returns the smallest SG DMA buffers pool size class of dwBytes bytes, or
+ * XDMA_SG_POOL_CLASSES if dwBytes is larger than the largest class */
+static DWORD SGPoolClassGet(DWORD dwBytes)
 {
-    PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(hDev);
-    DWORD offset = XDMA_CHANNEL_OFFSET(dwChannel,
-        fToDevice ? XDMA_H2C_CHANNEL_CONTROL_OFFSET :
-        XDMA_C2H_CHANNEL_CONTROL_OFFSET);
+    DWORD dwClass = 0;
 
-    return WDC_WriteAddr32(hDev, pDevCtx->dwConfigBarNum, offset, val);
+    while (dwClass < XDMA_SG_POOL_CLASSES &&
+        SG_POOL_CLASS_BYTES(dwClass) < dwBytes)
+    {
+        dwClass++;
+    }
+
+    return dwClass;
 }
 
-#ifdef HAS_INTS
-static DWORD EnableDmaInterrupts(WDC_DEVICE_HANDLE hDev, DWORD dwChannel,
-    BOOL fStreaming, BOOL fToDevice)
+/* Allocate and lock a buffer of a size class. Pooled buffers are locked for
+ * both directions, so that they can be used by any engine */
+static XDMA_SG_POOL_BUF *SGPoolBufLock(WDC_DEVICE_HANDLE hDev,
+    DWORD dwGeneration, DWORD dwClass)
 {
-    PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(hDev);
-    DWORD offset;
-    UINT32 val;
-
-    /* Error interrupts */
-    val = XDMA_CTRL_IE_DESC_ALIGN_MISMATCH |
-        XDMA_CTRL_IE_MAGIC_STOPPED |
-        XDMA_CTRL_IE_READ_ERROR |
-        XDMA_CTRL_IE_DESC_ERROR;
+    XDMA_SG_POOL_BUF *pPoolBuf;
+    DWORD dwStatus;
 
-    /* Enable completion interrupts */
-    val |= XDMA_CTRL_IE_DESC_STOPPED | XDMA_CTRL_IE_DESC_COMPLETED;
-    if (fStreaming)
-        val |= XDMA_CTRL_IE_IDLE_STOPPED;
+    pPoolBuf = (XDMA_SG_POOL_BUF *)calloc(1, sizeof(XDMA_SG_POOL_BUF));
+    if (!pPoolBuf)
+        return NULL;
 
-    offset = XDMA_CHANNEL_OFFSET(dwChannel, fToDevice ?
-        XDMA_H2C_CHANNEL_INT_ENABLE_MASK_OFFSET :
-        XDMA_C2H_CHANNEL_INT_ENABLE_MASK_OFFSET);
+    pPoolBuf->dwGeneration = dwGeneration;
+    pPoolBuf->dwClass = dwClass;
+    pPoolBuf->pBuf = __valloc(SG_POOL_CLASS_BYTES(dwClass));
+    if (!pPoolBuf->pBuf)
+    {
+        ErrLog("Memory allocation failure\n");
+        goto Error;
+    }
 
-    WDC_WriteAddr32(hDev, pDevCtx->dwConfigBarNum, offset, val);
+    dwStatus = WDC_DMASGBufLock(hDev, pPoolBuf->pBuf,
+        DMA_ALLOW_64BIT_ADDRESS | DMA_TO_FROM_DEVICE |
+        DMA_DISABLE_MERGE_ADJACENT_PAGES, SG_POOL_CLASS_BYTES(dwClass),
+        &pPoolBuf->pDma);
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        ErrLog("Failed locking DMA buffer. Error 0x%x - %s\n", dwStatus,
+            Stat2Str(dwStatus));
+        goto Error;
+    }
 
-    /* Make sure channel interrupts are enabled */
-    XDMA_ChannelInterruptsEnable(hDev, 0xFFFFFFFF);
+    return pPoolBuf;
 
-    return WD_STATUS_SUCCESS;
+Error:
+    if (pPoolBuf->pBuf)
+        __vfree(pPoolBuf->pBuf);
+    free(pPoolBuf);
+    return NULL;
 }
-#endif /* ifdef HAS_INTS */
 
-static void DmaDescDump(XDMA_DMA_STRUCT *pXdmaDma)
+static void SGPoolBufUnlock(XDMA_SG_POOL_BUF *pPoolBuf)
 {
-    XDMA_DMA_DESC *desc = (XDMA_DMA_DESC *)pXdmaDma->pDescBuf;
-    DWORD i;
+    WDC_DMABufUnlock(pPoolBuf->pDma);
+    __vfree(pPoolBuf->pBuf);
+    free(pPoolBuf);
+}
 
-    for (i = 0; i < pXdmaDma->pDma->dwPages; i++)
+/* Unlock and free a list of pooled buffers */
+static void SGPoolBufListUnlock(XDMA_SG_POOL_BUF *pPoolBuf)
+{
+    while (pPoolBuf)
     {
-        TraceLog("DmaDescDump: desc[%d].u32Control 0x%x\n", i,
-            desc[i].u32Control);
+        XDMA_SG_POOL_BUF *pNext = pPoolBuf->pNext;
+
+        SGPoolBufUnlock(pPoolBuf);
+        pPoolBuf = pNext;
+    }
+}
+
+/* Take a buffer of at least dwBytes bytes from the SG DMA buffers pool of
+ * the device. If the size class has no free buffer, a new one is locked.
+ * Returns NULL if the device has no pool, dwBytes is larger than the
+ * largest size class, or the allocation fails */
+static XDMA_SG_POOL_BUF *SGPoolGet(WDC_DEVICE_HANDLE hDev, DWORD dwBytes)
+{
+    PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(hDev);
+    DWORD dwClass = SGPoolClassGet(dwBytes), dwGeneration;
+    XDMA_SG_POOL *pPool;
+    XDMA_SG_POOL_STATS *pStats;
+    XDMA_SG_POOL_BUF *pPoolBuf;
+
+    if (dwClass == XDMA_SG_POOL_CLASSES)
+        return NULL;
+
+    OsMutexLock(pDevCtx->hSGPoolMutex);
+    pPool = (XDMA_SG_POOL *)pDevCtx->pSGPool;
+    if (!pPool)
+    {
+        OsMutexUnlock(pDevCtx->hSGPoolMutex);
+        return NULL;
+    }
+
+    pStats = &pPool->statsArr[dwClass];
+    pPoolBuf = pPool->pFreeArr[dwClass];
+    if (pPoolBuf)
+    {
+        pPool->pFreeArr[dwClass] = pPoolBuf->pNext;
+        pStats->u64Hits++;
+        pStats->dwFree--;
+        pStats->dwInUse++;
+    }
+    else
+    {
+        pStats->u64Misses++;
+    }
+    dwGeneration = pPool->dwGeneration;
+    OsMutexUnlock(pDevCtx->hSGPoolMutex);
+
+    if (pPoolBuf)
+        return pPoolBuf;
+
+    /* Lock outside of the pool lock: Locking is the slow path. The pool may
+     * be destroyed meanwhile - the buffer is then of a destroyed pool, and
+     * SGPoolPut() unlocks it */
+    pPoolBuf = SGPoolBufLock(hDev, dwGeneration, dwClass);
+    if (pPoolBuf)
+    {
+        OsMutexLock(pDevCtx->hSGPoolMutex);
+        pPool = (XDMA_SG_POOL *)pDevCtx->pSGPool;
+        if (pPool && pPool->dwGeneration == dwGeneration)
+            pPool->statsArr[dwClass].dwInUse++;
+        OsMutexUnlock(pDevCtx->hSGPoolMutex);
+    }
+
+    return pPoolBuf;
+}
+
+/* Return a buffer taken by SGPoolGet() to the pool. Free buffers above the
+ * high watermark of the size class are unlocked, down to its low
+ * watermark. Buffers of a destroyed pool are unlocked */
+static void SGPoolPut(WDC_DEVICE_HANDLE hDev, XDMA_SG_POOL_BUF *pPoolBuf)
+{
+    PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(hDev);
+    XDMA_SG_POOL *pPool;
+    XDMA_SG_POOL_BUF *pTrimmed = NULL;
+    XDMA_SG_POOL_STATS *pStats;
+    DWORD dwClass = pPoolBuf->dwClass;
+
+    OsMutexLock(pDevCtx->hSGPoolMutex);
+    pPool = (XDMA_SG_POOL *)pDevCtx->pSGPool;
+    if (!pPool || pPoolBuf->dwGeneration != pPool->dwGeneration)
+    {
+        OsMutexUnlock(pDevCtx->hSGPoolMutex);
+        SGPoolBufUnlock(pPoolBuf);
+        return;
+    }
+
+    pStats = &pPool->statsArr[dwClass];
+    pPoolBuf->pNext = pPool->pFreeArr[dwClass];
+    pPool->pFreeArr[dwClass] = pPoolBuf;
+    pStats->dwInUse--;
+    pStats->dwFree++;
+
+    if (pStats->dwFree > pPool->cfg.dwHighWatermark)
+    {
+        /* Detach the buffers below the low watermark, and unlock them
+         * outside of the pool lock */
+        XDMA_SG_POOL_BUF **ppLast = &pPool->pFreeArr[dwClass];
+        DWORD i;
+
+        for (i = 0; i < pPool->cfg.dwLowWatermark; i++)
+            ppLast = &(*ppLast)->pNext;
+
+        pTrimmed = *ppLast;
+        *ppLast = NULL;
+        pStats->u64Trimmed += pStats->dwFree - pPool->cfg.dwLowWatermark;
+        pStats->dwFree = pPool->cfg.dwLowWatermark;
+    }
+    OsMutexUnlock(pDevCtx->hSGPoolMutex);
+
+    SGPoolBufListUnlock(pTrimmed);
+}
+
+static DWORD EngineCtrlRegisterSet(WDC_DEVICE_HANDLE hDev, DWORD dwChannel,
+    BOOL fToDevice, UINT32 val)
+{
+    PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(hDev);
+    DWORD offset = XDMA_CHANNEL_OFFSET(dwChannel,
+        fToDevice ? XDMA_H2C_CHANNEL_CONTROL_OFFSET :
+        XDMA_C2H_CHANNEL_CONTROL_OFFSET);
+
+    return WDC_WriteAddr32(hDev, pDevCtx->dwConfigBarNum, offset, val);
+}
+
+#ifdef HAS_INTS
+/* Returns the interrupt enable mask of an engine */
+static UINT32 DmaIntsEnableValGet(BOOL fStreaming)
+{
+    UINT32 val;
+
+    /* Error interrupts */
+    val = XDMA_CTRL_IE_DESC_ALIGN_MISMATCH |
+        XDMA_CTRL_IE_MAGIC_STOPPED |
+        XDMA_CTRL_IE_READ_ERROR |
+        XDMA_CTRL_IE_DESC_ERROR;
+
+    /* Enable completion interrupts */
+    val |= XDMA_CTRL_IE_DESC_STOPPED | XDMA_CTRL_IE_DESC_COMPLETED;
+    if (fStreaming)
+        val |= XDMA_CTRL_IE_IDLE_STOPPED;
+
+    return val;
+}
+
+/* Add the register writes that enable the interrupts of an engine to a
+ * batch */
+static void DmaIntsEnableOpsAdd(KP_XDMA_REG_BATCH *pBatch, DWORD dwChannel,
+    BOOL fStreaming, BOOL fToDevice)
+{
+    RegBatchAdd(pBatch, KP_XDMA_REG_WRITE, XDMA_CHANNEL_OFFSET(dwChannel,
+        fToDevice ? XDMA_H2C_CHANNEL_INT_ENABLE_MASK_OFFSET :
+        XDMA_C2H_CHANNEL_INT_ENABLE_MASK_OFFSET),
+        DmaIntsEnableValGet(fStreaming));
+
+    /* Make sure channel interrupts are enabled */
+    RegBatchAdd(pBatch, KP_XDMA_REG_WRITE,
+        XDMA_IRQ_BLOCK_CHANNEL_INT_ENABLE_MASK_W1S_OFFSET, 0xFFFFFFFF);
+}
+
+static DWORD EnableDmaInterrupts(WDC_DEVICE_HANDLE hDev, DWORD dwChannel,
+    BOOL fStreaming, BOOL fToDevice)
+{
+    KP_XDMA_REG_BATCH batch;
+
+    RegBatchInit(hDev, &batch);
+    DmaIntsEnableOpsAdd(&batch, dwChannel, fStreaming, fToDevice);
+
+    return RegBatchRun(hDev, &batch);
+}
+#endif /* ifdef HAS_INTS */
+
+/* Returns TRUE if the descriptors of built transfers are traced (see
+ * XDMA_DescDumpEnable()) */
+static BOOL DmaDescDumpEnabled(void)
+{
+#if defined(DEBUG)
+    return gfXDMA_DescDump;
+#else
+    return FALSE;
+#endif
+}
+
+static void DmaDescDump(XDMA_DMA_STRUCT *pXdmaDma)
+{
+    XDMA_DMA_DESC *desc = (XDMA_DMA_DESC *)pXdmaDma->pDescBuf;
+    DWORD i;
+
+    if (!DmaDescDumpEnabled())
+        return;
+
+    TraceLog("DmaDescDump: dwPages %d, dwDescs %d\n",
+        pXdmaDma->pDma->dwPages, pXdmaDma->dwDescs);
+    for (i = 0; i < pXdmaDma->dwDescs; i++)
+    {
+        TraceLog("DmaDescDump: desc[%d].u32Control 0x%x\n", i,
+            desc[i].u32Control);
         TraceLog("DmaDescDump: desc[%d].dwBytes 0x%x\n", i, desc[i].u32Bytes);
         TraceLog("DmaDescDump: desc[%d].u64SrcAddr 0x%llx\n", i,
             desc[i].u64SrcAddr);
@@ -822,22 +2091,150 @@ static void DmaDescDump(XDMA_DMA_STRUCT *pXdmaDma)
     }
 }
 
-static DWORD DmaBuildDescBuffer(XDMA_DMA_STRUCT *pXdmaDma, BOOL fIsTransaction)
+/* Returns the maximal number of bytes a single descriptor may transfer,
+ * keeping the start address of the following descriptor aligned to the engine
+ * address alignment */
+static DWORD DmaDescMaxBytes(XDMA_DMA_STRUCT *pXdmaDma)
 {
-    DWORD dwStatus = WD_STATUS_SUCCESS;
-    DWORD dwPages, dwSize;
+    UINT32 u32Align = pXdmaDma->u32AddrAlign ? pXdmaDma->u32AddrAlign : 1;
 
-    if (fIsTransaction)
+    return XDMA_DESC_MAX_BYTES & ~(u32Align - 1);
+}
+
+/* Returns the number of descriptors needed to describe the SG DMA buffer */
+static DWORD DmaDescCount(XDMA_DMA_STRUCT *pXdmaDma)
+{
+    return XDMA_DescCount(pXdmaDma->pDma->Page, pXdmaDma->pDma->dwPages,
+        DmaDescMaxBytes(pXdmaDma));
+}
+
+/* Lock the device DMA pool. The descriptors buffers and the polling
+ * write-back buffers of the DMA handles are then taken from the pool, instead
+ * of each handle locking (and pinning) contiguous pages of its own.
+ * Without the pool, the handles lock their own buffers */
+static void DmaPoolCreate(WDC_DEVICE_HANDLE hDev)
+{
+    PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(hDev);
+    XDMA_DMA_POOL *pPool;
+    DWORD dwStatus;
+
+    pPool = (XDMA_DMA_POOL *)calloc(1, sizeof(XDMA_DMA_POOL));
+    if (!pPool)
+        return;
+
+    dwStatus = OsMutexCreate(&pPool->hMutex);
+    if (dwStatus != WD_STATUS_SUCCESS)
+        goto Error;
+
+    dwStatus = WDC_DMAContigBufLock(hDev, &pPool->pDescBuf,
+        DMA_ALLOW_64BIT_ADDRESS | DMA_TO_DEVICE,
+        XDMA_POOL_DESC_BLOCKS * XDMA_POOL_BLOCK_SIZE, &pPool->pDescDma);
+    if (dwStatus != WD_STATUS_SUCCESS)
+        goto Error;
+
+    dwStatus = WDC_DMAContigBufLock(hDev, &pPool->pWBBuf,
+        DMA_FROM_DEVICE | DMA_ALLOW_64BIT_ADDRESS,
+        XDMA_CHANNELS_NUM * 2 * XDMA_POOL_WB_SLOT_SIZE, &pPool->pWBDma);
+    if (dwStatus != WD_STATUS_SUCCESS)
+        goto Error;
+
+    pDevCtx->pDmaPool = pPool;
+    return;
+
+Error:
+    TraceLog("DmaPoolCreate: DMA handles lock their own descriptors and "
+        "write-back buffers. Error 0x%x - %s\n", dwStatus, Stat2Str(dwStatus));
+    if (pPool->pDescDma)
+        WDC_DMABufUnlock(pPool->pDescDma);
+    if (pPool->hMutex)
+        OsMutexClose(pPool->hMutex);
+    free(pPool);
+}
+
+static void DmaPoolDestroy(WDC_DEVICE_HANDLE hDev)
+{
+    PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(hDev);
+    XDMA_DMA_POOL *pPool = (XDMA_DMA_POOL *)pDevCtx->pDmaPool;
+
+    if (!pPool)
+        return;
+
+    WDC_DMABufUnlock(pPool->pWBDma);
+    WDC_DMABufUnlock(pPool->pDescDma);
+    OsMutexClose(pPool->hMutex);
+    free(pPool);
+    pDevCtx->pDmaPool = NULL;
+}
+
+/* Allocate dwBlocks consecutive blocks of the pool's descriptors area
+ * (first fit). Returns the index of the first block, or (DWORD)-1 if the
+ * area has no such free run */
+static DWORD DmaPoolBlocksGet(XDMA_DMA_POOL *pPool, DWORD dwBlocks)
+{
+    DWORD i, dwRun = 0, dwFirst = (DWORD)-1;
+
+    OsMutexLock(pPool->hMutex);
+    for (i = 0; i < XDMA_POOL_DESC_BLOCKS; i++)
     {
-        dwPages = ((XDMA_TRANSACTION_SAMPLE_MAX_TRANSFER_SIZE +
-            GetPageSize() - 1) / GetPageSize()) + 1;
+        if (pPool->u32DescMap[i / 32] & (1U << (i % 32)))
+        {
+            dwRun = 0;
+            continue;
+        }
+
+        if (++dwRun == dwBlocks)
+        {
+            dwFirst = i + 1 - dwBlocks;
+            break;
+        }
     }
-    else
+
+    for (i = 0; dwFirst != (DWORD)-1 && i < dwBlocks; i++)
+        pPool->u32DescMap[(dwFirst + i) / 32] |= 1U << ((dwFirst + i) % 32);
+    OsMutexUnlock(pPool->hMutex);
+
+    return dwFirst;
+}
+
+static void DmaPoolBlocksPut(XDMA_DMA_POOL *pPool, DWORD dwFirst,
+    DWORD dwBlocks)
+{
+    DWORD i;
+
+    OsMutexLock(pPool->hMutex);
+    for (i = dwFirst; i < dwFirst + dwBlocks; i++)
+        pPool->u32DescMap[i / 32] &= ~(1U << (i % 32));
+    OsMutexUnlock(pPool->hMutex);
+}
+
+/* Allocate a contiguous descriptors buffer of dwSize bytes for pXdmaDma:
+ * From the device DMA pool when it has room, otherwise locked on its own */
+static DWORD DmaDescBufAlloc(XDMA_DMA_STRUCT *pXdmaDma, DWORD dwSize)
+{
+    PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(pXdmaDma->hDev);
+    XDMA_DMA_POOL *pPool = (XDMA_DMA_POOL *)pDevCtx->pDmaPool;
+    DWORD dwBlocks = (dwSize + XDMA_POOL_BLOCK_SIZE - 1) /
+        XDMA_POOL_BLOCK_SIZE;
+    DWORD dwStatus, dwFirst;
+
+    if (pPool && dwBlocks <= XDMA_POOL_DESC_BLOCKS)
     {
-        dwPages = pXdmaDma->pDma->dwPages;
-    }
+        dwFirst = DmaPoolBlocksGet(pPool, dwBlocks);
+        if (dwFirst != (DWORD)-1)
+        {
+            DWORD dwOffset = dwFirst * XDMA_POOL_BLOCK_SIZE;
 
-    dwSize = dwPages * sizeof(XDMA_DMA_DESC);
+            pXdmaDma->pDmaDesc = pPool->pDescDma;
+            pXdmaDma->pDescBuf = (BYTE *)pPool->pDescBuf + dwOffset;
+            pXdmaDma->pDescPhysAddr =
+                pPool->pDescDma->Page[0].pPhysicalAddr + dwOffset;
+            pXdmaDma->dwDescPoolBlocks = dwBlocks;
+
+            /* As a newly locked buffer */
+            memset(pXdmaDma->pDescBuf, 0, dwBlocks * XDMA_POOL_BLOCK_SIZE);
+            return WD_STATUS_SUCCESS;
+        }
+    }
 
     dwStatus = WDC_DMAContigBufLock(pXdmaDma->hDev, &pXdmaDma->pDescBuf,
         DMA_ALLOW_64BIT_ADDRESS | DMA_TO_DEVICE, dwSize, &pXdmaDma->pDmaDesc);
@@ -845,83 +2242,279 @@ static DWORD DmaBuildDescBuffer(XDMA_DMA_STRUCT *pXdmaDma, BOOL fIsTransaction)
     {
         ErrLog("Failed locking DMA descriptors buffer. Error 0x%x - %s\n",
             dwStatus, Stat2Str(dwStatus));
+        return dwStatus;
     }
 
-    return dwStatus;
+    pXdmaDma->pDescPhysAddr = pXdmaDma->pDmaDesc->Page[0].pPhysicalAddr;
+    pXdmaDma->dwDescPoolBlocks = 0;
+
+    return WD_STATUS_SUCCESS;
 }
 
-static void DLLCALLCONV DmaTransferBuild(PVOID pData)
+/* Free a descriptors buffer allocated by DmaDescBufAlloc() */
+static DWORD DmaDescBufFree(WDC_DEVICE_HANDLE hDev, WD_DMA *pDmaDesc,
+    PVOID pDescBuf, DWORD dwDescPoolBlocks)
 {
-    XDMA_DMA_STRUCT *pXdmaDma = (XDMA_DMA_STRUCT *)pData;
-    PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(pXdmaDma->hDev);
-    XDMA_DMA_DESC *desc = (XDMA_DMA_DESC *)pXdmaDma->pDescBuf;
-    XDMA_DMA_DESC *desc_virt = (XDMA_DMA_DESC *)pXdmaDma->pDescBuf;
-    UINT64 offset = pXdmaDma->u64FPGAOffset;
-    DWORD dwPages = pXdmaDma->pDma->dwPages;
-    DWORD dwSize = dwPages * sizeof(XDMA_DMA_DESC);
-    DMA_ADDR desc_phys = pXdmaDma->pDmaDesc->Page[0].pPhysicalAddr;
-    DWORD i;
-
-    TraceLog("DmaTransferBuild: dwPages %d\n", dwPages);
+    PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(hDev);
+    XDMA_DMA_POOL *pPool = (XDMA_DMA_POOL *)pDevCtx->pDmaPool;
 
-    memset(desc_virt, 0, dwSize);
+    if (!dwDescPoolBlocks)
+        return WDC_DMABufUnlock(pDmaDesc);
 
-    for (i = 0; i < dwPages; i++)
-    {
-        desc_phys += sizeof(XDMA_DMA_DESC);
-        desc_virt[i].u32Control = XDMA_DESC_MAGIC; /* Descriptor magic number */
+    DmaPoolBlocksPut(pPool, (DWORD)(((BYTE *)pDescBuf -
+        (BYTE *)pPool->pDescBuf) / XDMA_POOL_BLOCK_SIZE), dwDescPoolBlocks);
 
-        if (pXdmaDma->fToDevice)
-        {
-            desc[i].u64SrcAddr = pXdmaDma->pDma->Page[i].pPhysicalAddr;
-            desc[i].u64DstAddr = offset;
-        }
-        else
-        {
-            desc[i].u64SrcAddr = offset;
-            desc[i].u64DstAddr = pXdmaDma->pDma->Page[i].pPhysicalAddr;
-        }
+    return WD_STATUS_SUCCESS;
+}
 
-        /* Buffer size should not exceed 0x0FFFFFFF bytes, but this should not
-         * happen when using s/g DMA buffer */
-        desc[i].u32Bytes = pXdmaDma->pDma->Page[i].dwBytes;
-        if (!pXdmaDma->fNonIncMode)
-            offset += desc[i].u32Bytes;
+static DWORD DmaBuildDescBuffer(XDMA_DMA_STRUCT *pXdmaDma, BOOL fIsTransaction)
+{
+    DWORD dwPages, dwSize;
 
-        if (i < dwPages - 1)
-        {
-            desc_virt[i].u64NextDesc = (UINT64)desc_phys;
-        }
-        else /* Last descriptor */
-        {
-            desc[i].u32Control |= XDMA_DESC_STOPPED | XDMA_DESC_EOP |
-                XDMA_DESC_COMPLETED;
-        }
+    if (fIsTransaction)
+    {
+        dwPages = ((XDMA_TRANSACTION_SAMPLE_MAX_TRANSFER_SIZE +
+            GetPageSize() - 1) / GetPageSize()) + 1;
+    }
+    else
+    {
+        dwPages = DmaDescCount(pXdmaDma);
     }
 
+    /* Each ring slot boundary may split a page into two descriptors */
+    if (pXdmaDma->fRing)
+        dwPages += pXdmaDma->dwRingSlots;
 
-    WDC_WriteAddr32(pXdmaDma->hDev, pDevCtx->dwConfigBarNum,
+    dwSize = dwPages * sizeof(XDMA_DMA_DESC);
+    pXdmaDma->dwDescsAlloc = dwPages;
+
+    return DmaDescBufAlloc(pXdmaDma, dwSize);
+}
+
+/* Add the register writes that point the engine of pXdmaDma at its first
+ * descriptor to a batch */
+static void DmaDescAddrOpsAdd(KP_XDMA_REG_BATCH *pBatch,
+    XDMA_DMA_STRUCT *pXdmaDma, UINT32 u32Adjacent)
+{
+    RegBatchAdd(pBatch, KP_XDMA_REG_WRITE,
         XDMA_CHANNEL_OFFSET(pXdmaDma->dwChannel,
         pXdmaDma->fToDevice ? XDMA_H2C_SGDMA_DESC_LOW_OFFSET :
         XDMA_C2H_SGDMA_DESC_LOW_OFFSET),
-        DMA_ADDR_LOW(pXdmaDma->pDmaDesc->Page[0].pPhysicalAddr));
-    WDC_WriteAddr32(pXdmaDma->hDev, pDevCtx->dwConfigBarNum,
+        DMA_ADDR_LOW(pXdmaDma->pDescPhysAddr));
+    RegBatchAdd(pBatch, KP_XDMA_REG_WRITE,
         XDMA_CHANNEL_OFFSET(pXdmaDma->dwChannel,
         pXdmaDma->fToDevice ? XDMA_H2C_SGDMA_DESC_HIGH_OFFSET :
         XDMA_C2H_SGDMA_DESC_HIGH_OFFSET),
-        DMA_ADDR_HIGH(pXdmaDma->pDmaDesc->Page[0].pPhysicalAddr));
+        DMA_ADDR_HIGH(pXdmaDma->pDescPhysAddr));
 
-    WDC_WriteAddr32(pXdmaDma->hDev, pDevCtx->dwConfigBarNum,
+    RegBatchAdd(pBatch, KP_XDMA_REG_WRITE,
         XDMA_CHANNEL_OFFSET(pXdmaDma->dwChannel,
         pXdmaDma->fToDevice ? XDMA_H2C_SGDMA_DESC_ADJACENT_OFFSET :
         XDMA_C2H_SGDMA_DESC_ADJACENT_OFFSET),
-        0);
+        u32Adjacent);
+}
+
+/* Program the engine with the address and the adjacent descriptors count of
+ * the first descriptor */
+static void DmaDescAddrSet(XDMA_DMA_STRUCT *pXdmaDma, UINT32 u32Adjacent)
+{
+    KP_XDMA_REG_BATCH batch;
+
+    RegBatchInit(pXdmaDma->hDev, &batch);
+    DmaDescAddrOpsAdd(&batch, pXdmaDma, u32Adjacent);
+    RegBatchRun(pXdmaDma->hDev, &batch);
+}
+
+/* Patch the whole buffer descriptors chain of pXdmaDma to transfer
+ * dwXferBytes bytes to/from u64FPGAOffset. Moves the end of transfer flags
+ * from the last transferred descriptor to the descriptor holding the last
+ * byte, and patches the FPGA addresses of the transferred descriptors if
+ * fOffsetChanged is set, or else only of the descriptors that were not
+ * transferred so far. Returns the adjacent descriptors count of the first
+ * descriptor */
+static UINT32 DmaChainPatch(XDMA_DMA_STRUCT *pXdmaDma, BOOL fOffsetChanged)
+{
+    XDMA_DMA_DESC *desc = (XDMA_DMA_DESC *)pXdmaDma->pDescBuf;
+    DMA_ADDR desc_phys = pXdmaDma->pDescPhysAddr;
+    DWORD dwOldStop = pXdmaDma->dwDescs - 1;
+    DWORD dwLeft = pXdmaDma->dwXferBytes;
+    UINT64 u64FPGAAddr = pXdmaDma->u64FPGAOffset;
+    DWORD i, dwStop, dwFirst;
+
+    /* Restore the last transferred descriptor */
+    desc[dwOldStop].u32Bytes = pXdmaDma->dwStopDescBytes;
+    desc[dwOldStop].u32Control &= ~(XDMA_DESC_STOPPED | XDMA_DESC_EOP |
+        XDMA_DESC_COMPLETED);
+    if (dwOldStop + 1 < pXdmaDma->dwChainDescs)
+    {
+        desc[dwOldStop].u64NextDesc = (UINT64)(desc_phys +
+            (dwOldStop + 1) * sizeof(XDMA_DMA_DESC));
+    }
+
+    /* Find the descriptor of the last byte, patching the FPGA addresses on
+     * the way */
+    for (i = 0; ; i++)
+    {
+        DWORD dwBytes = desc[i].u32Bytes;
+
+        if (fOffsetChanged || i > dwOldStop)
+        {
+            if (pXdmaDma->fToDevice)
+                desc[i].u64DstAddr = u64FPGAAddr;
+            else
+                desc[i].u64SrcAddr = u64FPGAAddr;
+        }
+
+        if (dwBytes >= dwLeft || i + 1 == pXdmaDma->dwChainDescs)
+            break;
+
+        dwLeft -= dwBytes;
+        if (!pXdmaDma->fNonIncMode)
+            u64FPGAAddr += dwBytes;
+    }
+    dwStop = i;
+
+    pXdmaDma->dwStopDescBytes = desc[dwStop].u32Bytes;
+    desc[dwStop].u32Bytes = dwLeft;
+    desc[dwStop].u32Control |= XDMA_DESC_STOPPED | XDMA_DESC_EOP |
+        XDMA_DESC_COMPLETED;
+    desc[dwStop].u64NextDesc = 0;
+    pXdmaDma->dwDescs = dwStop + 1;
+
+    /* Fix the adjacent descriptors counts that reach the old or the new end
+     * of the transfer */
+    dwFirst = dwStop < dwOldStop ? dwStop : dwOldStop;
+    dwFirst = dwFirst > XDMA_MAX_ADJACENT ? dwFirst - XDMA_MAX_ADJACENT : 0;
+    for (i = dwFirst; i <= dwStop; i++)
+    {
+        desc[i].u32Control = (desc[i].u32Control & ~XDMA_DESC_ADJACENT_MASK) |
+            (XDMA_DescAdjacentGet((UINT64)(desc_phys +
+            (i + 1) * sizeof(XDMA_DMA_DESC)), dwStop - i) <<
+            XDMA_DESC_ADJACENT_SHIFT);
+    }
+
+    return XDMA_DescAdjacentGet((UINT64)desc_phys, pXdmaDma->dwDescs);
+}
+
+/* Build the descriptors chain of the current transfer. In transaction mode
+ * this is the WDC_DMATransactionExecute() callback, run for every transfer
+ * of the transaction */
+static void DLLCALLCONV DmaTransferBuild(PVOID pData)
+{
+    XDMA_DMA_STRUCT *pXdmaDma = (XDMA_DMA_STRUCT *)pData;
+    XDMA_DESC_CHAIN chain;
+    UINT32 u32Adjacent;
+    /* Transfer only the first part of the buffer, if retargeted so or if
+     * the buffer is a pooled buffer larger than the handle. The transfers of
+     * transactions are the size of their pages */
+    BOOL fPatch = !pXdmaDma->fIsTransaction && pXdmaDma->dwXferBytes &&
+        pXdmaDma->dwXferBytes < pXdmaDma->pDma->dwBytes;
+
+    chain.u64FPGAOffset = pXdmaDma->u64FPGAOffset;
+    chain.dwMaxBytes = DmaDescMaxBytes(pXdmaDma);
+    chain.fToDevice = pXdmaDma->fToDevice;
+    chain.fNonIncMode = pXdmaDma->fNonIncMode;
+    /* Stream the descriptors past the CPU caches unless the CPU reads them
+     * back: A patched chain is read and rewritten by DmaChainPatch(), and a
+     * dumped one is read in full. Otherwise only the last descriptor is read
+     * back, for dwStopDescBytes */
+    chain.fStream = !fPatch && !DmaDescDumpEnabled();
+
+    pXdmaDma->dwDescs = XDMA_DescChainBuild(
+        (XDMA_DMA_DESC *)pXdmaDma->pDescBuf,
+        pXdmaDma->pDescPhysAddr, pXdmaDma->pDma->Page,
+        pXdmaDma->pDma->dwPages, &chain, &u32Adjacent);
+    pXdmaDma->dwChainDescs = pXdmaDma->dwDescs;
+    if (pXdmaDma->dwDescs)
+    {
+        pXdmaDma->dwStopDescBytes = ((XDMA_DMA_DESC *)pXdmaDma->pDescBuf +
+            pXdmaDma->dwDescs - 1)->u32Bytes;
+    }
+
+    if (fPatch)
+        u32Adjacent = DmaChainPatch(pXdmaDma, FALSE);
+    pXdmaDma->u32DescAdjacent = u32Adjacent;
+
+    /* A queued transfer is pointed to by its queue when started */
+    if (!pXdmaDma->fQueued)
+        DmaDescAddrSet(pXdmaDma, u32Adjacent);
 
     DmaDescDump(pXdmaDma);
 
-    /* TODO: Set adjacent descriptors */
+    WDC_DMASyncCpu(pXdmaDma->pDmaDesc);
+}
+
+/* Build a circular descriptors chain over the ring slots. Slot boundaries
+ * always end a descriptor, so that a slot is complete once all of its
+ * descriptors are counted by the engine's completed descriptors counter. The
+ * last descriptor points back to the first one and no descriptor carries the
+ * STOPPED bit, so the engine never idles between slots */
+static DWORD DmaRingBuild(XDMA_DMA_STRUCT *pXdmaDma)
+{
+    XDMA_DMA_DESC *desc = (XDMA_DMA_DESC *)pXdmaDma->pDescBuf;
+    DMA_ADDR desc_phys = pXdmaDma->pDescPhysAddr;
+    DWORD i, dwDescs = 0, dwSlot = 0;
+    DWORD dwSlotLeft = pXdmaDma->dwRingSlotBytes;
+    DWORD dwMaxBytes = DmaDescMaxBytes(pXdmaDma);
+    UINT32 u32Adjacent;
+
+    pXdmaDma->pdwRingSlotDescs = (DWORD *)calloc(pXdmaDma->dwRingSlots,
+        sizeof(DWORD));
+    if (!pXdmaDma->pdwRingSlotDescs)
+    {
+        ErrLog("Failed allocating memory for ring slots\n");
+        return WD_INSUFFICIENT_RESOURCES;
+    }
+
+    memset(desc, 0, pXdmaDma->dwDescsAlloc * sizeof(XDMA_DMA_DESC));
+
+    for (i = 0; i < pXdmaDma->pDma->dwPages; i++)
+    {
+        DMA_ADDR addr = pXdmaDma->pDma->Page[i].pPhysicalAddr;
+        DWORD dwLeft = pXdmaDma->pDma->Page[i].dwBytes;
+
+        while (dwLeft)
+        {
+            DWORD dwBytes = dwLeft < dwSlotLeft ? dwLeft : dwSlotLeft;
+
+            if (dwBytes > dwMaxBytes)
+                dwBytes = dwMaxBytes;
+
+            desc[dwDescs].u32Control = XDMA_DESC_MAGIC;
+            desc[dwDescs].u32Bytes = dwBytes;
+            /* Every slot captures the same FPGA window */
+            desc[dwDescs].u64SrcAddr = pXdmaDma->u64FPGAOffset +
+                (pXdmaDma->dwRingSlotBytes - dwSlotLeft);
+            desc[dwDescs].u64DstAddr = addr;
+
+            addr += dwBytes;
+            dwLeft -= dwBytes;
+            dwSlotLeft -= dwBytes;
+            pXdmaDma->pdwRingSlotDescs[dwSlot]++;
+            dwDescs++;
+
+            if (!dwSlotLeft)
+            {
+                desc[dwDescs - 1].u32Control |= XDMA_DESC_EOP;
+                dwSlot++;
+                dwSlotLeft = pXdmaDma->dwRingSlotBytes;
+            }
+        }
+    }
+
+    u32Adjacent = XDMA_DescChainLink(desc, desc_phys, dwDescs, TRUE);
+    pXdmaDma->dwDescs = dwDescs;
+
+    TraceLog("DmaRingBuild: dwSlots %d, dwDescs %d\n", pXdmaDma->dwRingSlots,
+        dwDescs);
+
+    DmaDescAddrSet(pXdmaDma, u32Adjacent);
+
+    DmaDescDump(pXdmaDma);
 
     WDC_DMASyncCpu(pXdmaDma->pDmaDesc);
+
+    return WD_STATUS_SUCCESS;
 }
 
 static DWORD ConfigureDmaDesc(XDMA_DMA_STRUCT *pXdmaDma)
@@ -932,7 +2525,10 @@ static DWORD ConfigureDmaDesc(XDMA_DMA_STRUCT *pXdmaDma)
     if (dwStatus != WD_STATUS_SUCCESS)
         goto Exit;
 
-    DmaTransferBuild(pXdmaDma);
+    if (pXdmaDma->fRing)
+        dwStatus = DmaRingBuild(pXdmaDma);
+    else
+        DmaTransferBuild(pXdmaDma);
 
 Exit:
     return dwStatus;
@@ -959,6 +2555,7 @@ static DWORD CheckAlignment(XDMA_DMA_STRUCT *pXdmaDma)
 
     TraceLog("u32AlignmentsReg 0x%x\n", u32AlignmentsReg);
 
+    pXdmaDma->u32AddrAlign = 1;
     if (!u32AlignmentsReg)
     {
         TraceLog("Alignments register not set\n");
@@ -968,6 +2565,8 @@ static DWORD CheckAlignment(XDMA_DMA_STRUCT *pXdmaDma)
     u32Align = (u32AlignmentsReg & 0x00FF0000) >> 16;
     u32Granularity = (u32AlignmentsReg & 0x0000FF00) >> 8;
     TraceLog("u32Align %d, u32Granularity %d\n", u32Align, u32Granularity);
+    if (u32Align)
+        pXdmaDma->u32AddrAlign = u32Align;
 
     u32BufLsb = (UINT32)((UPTR)pXdmaDma->pBuf & (u32Align - 1));
     u32OffsetLsb = (UINT32)(pXdmaDma->u64FPGAOffset) & (u32Align - 1);
@@ -1004,82 +2603,72 @@ static DWORD CheckAlignment(XDMA_DMA_STRUCT *pXdmaDma)
     return WD_STATUS_SUCCESS;
 }
 
-DWORD XDMA_DmaTransferStart(XDMA_DMA_HANDLE hDma)
+/* Select the completion mode of a hybrid DMA handle's next transfer: Poll
+ * once transfers keep being started right after the previous completion,
+ * and use interrupts again once the engine was left idle */
+static void DmaHybridModeUpdate(XDMA_DMA_STRUCT *pXdmaDma)
 {
-    XDMA_DMA_STRUCT *pXdmaDma = (XDMA_DMA_STRUCT *)hDma;
-    PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(pXdmaDma->hDev);
-    UINT32 val;
-    DWORD dwStatus;
+    XDMA_HYBRID_POLICY *pPolicy = &pXdmaDma->hybridPolicy;
+    UINT64 u64Idle = XDMA_TimestampNsGet() - pXdmaDma->u64LastDoneNs;
 
-#ifdef HAS_INTS
-    if (!pXdmaDma->fPolling)
+    if (u64Idle > pPolicy->u64IdleNs)
     {
-        dwStatus = EnableDmaInterrupts(pXdmaDma->hDev, pXdmaDma->dwChannel,
-            pXdmaDma->fStreaming, pXdmaDma->fToDevice);
-        if (dwStatus != WD_STATUS_SUCCESS)
+        pXdmaDma->dwHybridBusy = 0;
+        if (pXdmaDma->fPolling)
         {
-            ErrLog("Failed enabling DMA interrupts. Error 0x%x - %s\n",
-                dwStatus, Stat2Str(dwStatus));
-            return dwStatus;
+            TraceLog("DmaHybridModeUpdate: Idle %llu ns, switching to "
+                "interrupts\n", u64Idle);
+            pXdmaDma->fPolling = FALSE;
+            pXdmaDma->fDmaIntsEnabled = FALSE;
         }
-
-        /* Dummy read to flush pending writes */
-        WDC_ReadAddr32(pXdmaDma->hDev, pDevCtx->dwConfigBarNum,
-            XDMA_IRQ_BLOCK_CHANNEL_INT_REQUEST_OFFSET, &val);
+        return;
     }
-    else
-#endif /* ifdef HAS_INTS */
+
+    if (!pXdmaDma->fPolling &&
+        ++pXdmaDma->dwHybridBusy >= pPolicy->dwBusyTransfers)
     {
-        XDMA_DMA_POLL_WB *pWB = (XDMA_DMA_POLL_WB *)pXdmaDma->pWBBuf;
-        pWB->u32CompletedDescs = 0;
+        TraceLog("DmaHybridModeUpdate: %d busy transfers, switching to "
+            "polling\n", pXdmaDma->dwHybridBusy);
+        pXdmaDma->fPolling = TRUE;
     }
+}
 
-    if (pXdmaDma->fToDevice)
-        WDC_DMASyncCpu(pXdmaDma->pDma);
-
-    val = XDMA_CTRL_RUN_STOP |
+/* Returns the control register value that starts the engine of pXdmaDma */
+static UINT32 DmaCtrlStartValGet(XDMA_DMA_STRUCT *pXdmaDma)
+{
+    UINT32 val = XDMA_CTRL_RUN_STOP |
         XDMA_CTRL_IE_READ_ERROR |
         XDMA_CTRL_IE_DESC_ERROR |
         XDMA_CTRL_IE_DESC_ALIGN_MISMATCH |
         XDMA_CTRL_IE_MAGIC_STOPPED;
 
-#ifdef HAS_INTS
-    if (pXdmaDma->fPolling)
+    /* The ring reader polls the completed descriptors count register, so
+     * a ring needs neither completion interrupts nor writeback */
+    if (!pXdmaDma->fRing)
     {
-        val |= XDMA_CTRL_POLL_MODE_WB;
-    }
-    else
+#ifdef HAS_INTS
+        if (pXdmaDma->fPolling)
+        {
+            val |= XDMA_CTRL_POLL_MODE_WB;
+        }
+        else
 #endif /* ifdef HAS_INTS */
-    {
-        val |= XDMA_CTRL_IE_DESC_STOPPED | XDMA_CTRL_IE_DESC_COMPLETED;
-        if (pXdmaDma->fStreaming && !pXdmaDma->fToDevice)
-            val |= XDMA_CTRL_IE_IDLE_STOPPED;
+        {
+            val |= XDMA_CTRL_IE_DESC_STOPPED | XDMA_CTRL_IE_DESC_COMPLETED;
+            if (pXdmaDma->fStreaming && !pXdmaDma->fToDevice)
+                val |= XDMA_CTRL_IE_IDLE_STOPPED;
+        }
     }
 
     if (pXdmaDma->fNonIncMode)
         val |= XDMA_CTRL_NON_INCR_ADDR;
 
-    dwStatus = EngineCtrlRegisterSet(pXdmaDma->hDev, pXdmaDma->dwChannel,
-        pXdmaDma->fToDevice, val);
-    if (dwStatus != WD_STATUS_SUCCESS)
-    {
-        ErrLog("Failed starting DMA transfer\n");
-        return dwStatus;
-    }
-
-    /* Dummy read to flush all previous writes */
-    WDC_ReadAddr32(pXdmaDma->hDev, pDevCtx->dwConfigBarNum,
-        XDMA_CHANNEL_OFFSET(pXdmaDma->dwChannel,
-        pXdmaDma->fToDevice ? XDMA_H2C_CHANNEL_STATUS_OFFSET :
-        XDMA_C2H_CHANNEL_STATUS_OFFSET),
-        &val);
-
-    return WD_STATUS_SUCCESS;
+    return val;
 }
 
-DWORD XDMA_DmaTransferStop(XDMA_DMA_HANDLE hDma)
+/* Returns the control register value that stops the engine of pXdmaDma */
+static UINT32 DmaCtrlStopValGet(XDMA_DMA_STRUCT *pXdmaDma)
 {
-    XDMA_DMA_STRUCT *pXdmaDma = (XDMA_DMA_STRUCT *)hDma;
     UINT32 val = XDMA_CTRL_IE_DESC_ALIGN_MISMATCH |
         XDMA_CTRL_IE_MAGIC_STOPPED |
         XDMA_CTRL_IE_READ_ERROR |
@@ -1096,14 +2685,202 @@ DWORD XDMA_DmaTransferStop(XDMA_DMA_HANDLE hDma)
              val |= XDMA_CTRL_IE_IDLE_STOPPED;
     }
 
+    return val;
+}
+
+#define ENGINE_REG_OFFSET(pXdmaDma, h2c, c2h) \
+    XDMA_CHANNEL_OFFSET((pXdmaDma)->dwChannel, (pXdmaDma)->fToDevice ? \
+    (h2c) : (c2h))
+
+/* Write an engine register: Directly if its address is resolved (pReg),
+ * otherwise by adding it to pBatch. The write is counted in pCount */
+static inline void DmaRegWrite(XDMA_MMIO_STATS *pCount,
+    KP_XDMA_REG_BATCH *pBatch, volatile UINT32 *pReg, DWORD dwOffset,
+    UINT32 val)
+{
+    pCount->u64Writes++;
+    if (pReg)
+        *pReg = val;
+    else
+        RegBatchAdd(pBatch, KP_XDMA_REG_WRITE, dwOffset, val);
+}
+
+/* Dummy register read, to flush the preceding posted writes */
+static inline void DmaRegFlush(XDMA_MMIO_STATS *pCount,
+    KP_XDMA_REG_BATCH *pBatch, volatile UINT32 *pReg, DWORD dwOffset)
+{
+    pCount->u64Reads++;
+    if (pReg)
+        (void)*pReg;
+    else
+        RegBatchAdd(pBatch, KP_XDMA_REG_READ, dwOffset, 0);
+}
+
+DWORD XDMA_DmaTransferStart(XDMA_DMA_HANDLE hDma)
+{
+    XDMA_DMA_STRUCT *pXdmaDma = (XDMA_DMA_STRUCT *)hDma;
+    XDMA_ENGINE_REGS *pRegs = &pXdmaDma->regs;
+    XDMA_DMA_STRUCT *pEngine = DmaEngineGet(pXdmaDma);
+    XDMA_MMIO_STATS count;
+    BOOL fFast = (pXdmaDma->dwOptions & XDMA_DMA_OPT_FAST_START) ? TRUE :
+        FALSE;
+    KP_XDMA_REG_BATCH batch;
+#ifdef HAS_INTS
+    BOOL fInts = FALSE;
+#endif /* ifdef HAS_INTS */
+    DWORD dwStatus = WD_STATUS_SUCCESS;
+
+    if (pXdmaDma->fQueued)
+    {
+        ErrLog("XDMA_DmaTransferStart: Queued DMA handles are started by "
+            "XDMA_DmaQueueSubmit()\n");
+        return WD_INVALID_PARAMETER;
+    }
+
+    /* Restore the whole buffer descriptors chain after a batch */
+    if (pXdmaDma->fBatchChain)
+    {
+        DmaTransferBuild(pXdmaDma);
+        pXdmaDma->fBatchChain = FALSE;
+    }
+
+    if (pXdmaDma->fHybrid)
+        DmaHybridModeUpdate(pXdmaDma);
+
+    if (pXdmaDma->fToDevice)
+        WDC_DMASyncCpu(pXdmaDma->pDma);
+
+    if (pXdmaDma->fRing)
+    {
+        /* The engine resets its completed descriptors count when started */
+        pXdmaDma->dwRingHead = 0;
+        pXdmaDma->u32RingDescsDone = 0;
+    }
+#ifdef HAS_INTS
+    else if (!pXdmaDma->fPolling)
+    {
+        fInts = TRUE;
+    }
+#endif /* ifdef HAS_INTS */
+    else
+    {
+        XDMA_DMA_POLL_WB *pWB = (XDMA_DMA_POLL_WB *)pXdmaDma->pWBBuf;
+        pWB->u32CompletedDescs = 0;
+    }
+
+    /* Registers without a resolved address are accessed in a single
+     * register batch */
+    if (!pRegs->pControl)
+        RegBatchInit(pXdmaDma->hDev, &batch);
+    BZERO(count);
+
+#ifdef HAS_INTS
+    if (fInts)
+    {
+        /* A fast start programs the engine interrupt mask once, and only
+         * re-enables the engine's channel interrupts, disabled by the
+         * interrupt handler */
+        if (!fFast || !pEngine->fIntMaskSet)
+        {
+            DmaRegWrite(&count, &batch, pRegs->pIntEnableMask,
+                ENGINE_REG_OFFSET(pXdmaDma,
+                XDMA_H2C_CHANNEL_INT_ENABLE_MASK_OFFSET,
+                XDMA_C2H_CHANNEL_INT_ENABLE_MASK_OFFSET),
+                DmaIntsEnableValGet(pXdmaDma->fStreaming));
+            pEngine->fIntMaskSet = TRUE;
+        }
+
+        if (!fFast)
+        {
+            DmaRegWrite(&count, &batch, pRegs->pChannelIntEnableW1S,
+                XDMA_IRQ_BLOCK_CHANNEL_INT_ENABLE_MASK_W1S_OFFSET,
+                0xFFFFFFFF);
+            DmaRegFlush(&count, &batch, pRegs->pChannelIntRequest,
+                XDMA_IRQ_BLOCK_CHANNEL_INT_REQUEST_OFFSET);
+        }
+        else if (!pXdmaDma->fDmaIntsEnabled)
+        {
+            DmaRegWrite(&count, &batch, pRegs->pChannelIntEnableW1S,
+                XDMA_IRQ_BLOCK_CHANNEL_INT_ENABLE_MASK_W1S_OFFSET,
+                pXdmaDma->u32IrqBitMask);
+        }
+        pXdmaDma->fDmaIntsEnabled = TRUE;
+    }
+#endif /* ifdef HAS_INTS */
+
+    DmaRegWrite(&count, &batch, pRegs->pControl,
+        ENGINE_REG_OFFSET(pXdmaDma, XDMA_H2C_CHANNEL_CONTROL_OFFSET,
+        XDMA_C2H_CHANNEL_CONTROL_OFFSET),
+        DmaCtrlStartValGet(pXdmaDma));
+
+    if (!fFast)
+    {
+        DmaRegFlush(&count, &batch, pRegs->pStatus,
+            ENGINE_REG_OFFSET(pXdmaDma, XDMA_H2C_CHANNEL_STATUS_OFFSET,
+            XDMA_C2H_CHANNEL_STATUS_OFFSET));
+    }
+
+    if (!pRegs->pControl)
+        dwStatus = RegBatchRun(pXdmaDma->hDev, &batch);
+
+    DmaMmioCount(pXdmaDma, count.u64Reads, count.u64Writes);
+    pXdmaDma->mmioStats.dwStartReads = (DWORD)count.u64Reads;
+    pXdmaDma->mmioStats.dwStartWrites = (DWORD)count.u64Writes;
+
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        /* The registers state is unknown: Rewrite all of them next time */
+        pEngine->fIntMaskSet = FALSE;
+        pXdmaDma->fDmaIntsEnabled = FALSE;
+        ErrLog("Failed starting DMA transfer\n");
+    }
+
+    return dwStatus;
+}
+
+DWORD XDMA_DmaTransferStop(XDMA_DMA_HANDLE hDma)
+{
+    XDMA_DMA_STRUCT *pXdmaDma = (XDMA_DMA_STRUCT *)hDma;
+
+    DmaMmioCount(pXdmaDma, 0, 1);
+    if (pXdmaDma->regs.pControl)
+    {
+        *pXdmaDma->regs.pControl = DmaCtrlStopValGet(pXdmaDma);
+        return WD_STATUS_SUCCESS;
+    }
+
     return EngineCtrlRegisterSet(pXdmaDma->hDev, pXdmaDma->dwChannel,
-        pXdmaDma->fToDevice, val);
+        pXdmaDma->fToDevice, DmaCtrlStopValGet(pXdmaDma));
+}
+
+/* Read an engine register, to flush the preceding register writes */
+DWORD XDMA_DmaFlush(XDMA_DMA_HANDLE hDma)
+{
+    UINT32 u32Status;
+
+    if (!hDma)
+        return WD_INVALID_PARAMETER;
+
+    return XDMA_EngineStatusRead(hDma, FALSE, &u32Status);
+}
+
+/* Get the register access counters of a DMA handle */
+DWORD XDMA_DmaMmioStatsGet(XDMA_DMA_HANDLE hDma, XDMA_MMIO_STATS *pStats)
+{
+    if (!hDma || !pStats)
+        return WD_INVALID_PARAMETER;
+
+    *pStats = ((XDMA_DMA_STRUCT *)hDma)->mmioStats;
+
+    return WD_STATUS_SUCCESS;
 }
 
 DWORD XDMA_DmaPollCompletion(XDMA_DMA_HANDLE hDma)
 {
     XDMA_DMA_STRUCT *pXdmaDma = (XDMA_DMA_STRUCT *)hDma;
+    XDMA_POLL_POLICY *pPolicy = &pXdmaDma->pollPolicy;
     XDMA_DMA_POLL_WB *pWB;
+    UINT64 u64Start, u64Now;
     DWORD dwStatus = WD_STATUS_SUCCESS;
 
     if (!pXdmaDma->pWBDma || !pXdmaDma->pWBBuf)
@@ -1113,8 +2890,32 @@ DWORD XDMA_DmaPollCompletion(XDMA_DMA_HANDLE hDma)
     }
 
     pWB = (XDMA_DMA_POLL_WB *)pXdmaDma->pWBBuf;
-    while (pWB->u32CompletedDescs < pXdmaDma->pDma->dwPages)
+    u64Start = XDMA_TimestampNsGet();
+    u64Now = u64Start;
+    pXdmaDma->pollStats.u64Iterations = 0;
+
+    /* Spin with a CPU pause for the spin budget, then yield, then sleep
+     * between polls, until the timeout expires */
+    while (pWB->u32CompletedDescs < pXdmaDma->dwDescs)
     {
+        UINT64 u64Elapsed = u64Now - u64Start;
+
+        if (pPolicy->u64TimeoutNs && u64Elapsed >= pPolicy->u64TimeoutNs)
+        {
+            ErrLog("XDMA_DmaPollCompletion: Timeout expired, completed descs "
+                "%d of %d\n", pWB->u32CompletedDescs, pXdmaDma->dwDescs);
+            dwStatus = WD_TIME_OUT_EXPIRED;
+            break;
+        }
+
+        if (u64Elapsed < pPolicy->u64SpinNs)
+            CPU_PAUSE();
+        else if (u64Elapsed < pPolicy->u64SpinNs + pPolicy->u64YieldNs)
+            ThreadYield();
+        else
+            SleepWrapper(pPolicy->dwSleepUsec);
+
+        pXdmaDma->pollStats.u64Iterations++;
         WDC_DMASyncIo(pXdmaDma->pWBDma);
 
         if (pWB->u32CompletedDescs & XDMA_WB_ERR_MASK)
@@ -1127,33 +2928,172 @@ DWORD XDMA_DmaPollCompletion(XDMA_DMA_HANDLE hDma)
             dwStatus = WD_OPERATION_FAILED;
             break;
         }
+
+        u64Now = XDMA_TimestampNsGet();
     }
 
+    pXdmaDma->pollStats.u64ElapsedNs = XDMA_TimestampNsGet() - u64Start;
+
     XDMA_DmaTransferStop(pXdmaDma);
 
     if (!pXdmaDma->fToDevice)
         WDC_DMASyncIo(pXdmaDma->pDma);
 
-    TraceLog("XDMA_DmaPollCompletion: completed descs %d\n",
-        pWB->u32CompletedDescs);
+    TraceLog("XDMA_DmaPollCompletion: completed descs %d, iterations %llu, "
+        "elapsed %llu ns\n", pWB->u32CompletedDescs,
+        pXdmaDma->pollStats.u64Iterations, pXdmaDma->pollStats.u64ElapsedNs);
+
+    return dwStatus;
+}
+
+/* Set the polling policy of XDMA_DmaPollCompletion() */
+DWORD XDMA_DmaPollPolicySet(XDMA_DMA_HANDLE hDma,
+    const XDMA_POLL_POLICY *pPolicy)
+{
+    XDMA_DMA_STRUCT *pXdmaDma = (XDMA_DMA_STRUCT *)hDma;
+
+    if (!pXdmaDma || !pPolicy)
+        return WD_INVALID_PARAMETER;
+
+    pXdmaDma->pollPolicy = *pPolicy;
+
+    return WD_STATUS_SUCCESS;
+}
+
+/* Get the polling statistics of the last XDMA_DmaPollCompletion() */
+DWORD XDMA_DmaPollStatsGet(XDMA_DMA_HANDLE hDma, XDMA_POLL_STATS *pStats)
+{
+    XDMA_DMA_STRUCT *pXdmaDma = (XDMA_DMA_STRUCT *)hDma;
+
+    if (!pXdmaDma || !pStats)
+        return WD_INVALID_PARAMETER;
+
+    *pStats = pXdmaDma->pollStats;
+
+    return WD_STATUS_SUCCESS;
+}
+
+/* Returns a monotonic timestamp in nanoseconds */
+UINT64 XDMA_TimestampNsGet(void)
+{
+#if defined(WIN32)
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER counter;
+
+    if (!freq.QuadPart)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&counter);
+
+    return (UINT64)(counter.QuadPart / freq.QuadPart) * 1000000000ULL +
+        (UINT64)(counter.QuadPart % freq.QuadPart) * 1000000000ULL /
+        freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (UINT64)ts.tv_sec * 1000000000ULL + (UINT64)ts.tv_nsec;
+#endif
+}
+
+DWORD XDMA_DmaWaitCompletion(XDMA_DMA_HANDLE hDma)
+{
+    XDMA_DMA_STRUCT *pXdmaDma = (XDMA_DMA_STRUCT *)hDma;
+    DWORD dwStatus;
+
+    if (!pXdmaDma)
+        return WD_INVALID_PARAMETER;
+
+    if (pXdmaDma->fPolling)
+    {
+        dwStatus = XDMA_DmaPollCompletion(hDma);
+    }
+#ifdef HAS_INTS
+    else if (pXdmaDma->fHybrid)
+    {
+        UINT64 u64TimeoutNs = pXdmaDma->pollPolicy.u64TimeoutNs;
+
+        /* OsEventWait() timeout is in seconds */
+        dwStatus = OsEventWait(pXdmaDma->hHybridEvent, u64TimeoutNs ?
+            (DWORD)((u64TimeoutNs + 999999999ULL) / 1000000000ULL) :
+            INFINITE);
+        if (dwStatus == WD_TIME_OUT_EXPIRED)
+        {
+            ErrLog("XDMA_DmaWaitCompletion: Timeout expired\n");
+            XDMA_DmaTransferStop(hDma);
+        }
+        else if (dwStatus == WD_STATUS_SUCCESS &&
+            (pXdmaDma->u32HybridDmaStatus & XDMA_STAT_ERR_MASK))
+        {
+            ErrLog("XDMA_DmaWaitCompletion: DMA Transfer failed, "
+                "DMA status 0x%08x\n", pXdmaDma->u32HybridDmaStatus);
+            dwStatus = WD_OPERATION_FAILED;
+        }
+    }
+#endif /* ifdef HAS_INTS */
+    else
+    {
+        ErrLog("XDMA_DmaWaitCompletion: Interrupt-driven DMA handles report "
+            "their completion to the interrupt handler\n");
+        return WD_INVALID_PARAMETER;
+    }
+
+    pXdmaDma->u64LastDoneNs = XDMA_TimestampNsGet();
 
     return dwStatus;
 }
 
+DWORD XDMA_DmaHybridPolicySet(XDMA_DMA_HANDLE hDma,
+    const XDMA_HYBRID_POLICY *pPolicy)
+{
+    XDMA_DMA_STRUCT *pXdmaDma = (XDMA_DMA_STRUCT *)hDma;
+
+    if (!pXdmaDma || !pPolicy || !pXdmaDma->fHybrid)
+        return WD_INVALID_PARAMETER;
+
+    pXdmaDma->hybridPolicy = *pPolicy;
+
+    return WD_STATUS_SUCCESS;
+}
+
+BOOL XDMA_DmaIsPolling(XDMA_DMA_HANDLE hDma)
+{
+    return ((XDMA_DMA_STRUCT *)hDma)->fPolling;
+}
+
 static DWORD ConfigureWriteBackAddress(XDMA_DMA_STRUCT *pXdmaDma)
 {
     DWORD dwStatus;
     PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(pXdmaDma->hDev);
+    XDMA_DMA_POOL *pPool = (XDMA_DMA_POOL *)pDevCtx->pDmaPool;
 
-    dwStatus = WDC_DMAContigBufLock(pXdmaDma->hDev,
-        &pXdmaDma->pWBBuf,
-        DMA_FROM_DEVICE | DMA_ALLOW_64BIT_ADDRESS,
-        sizeof(XDMA_DMA_POLL_WB),
-        &pXdmaDma->pWBDma);
-    if (dwStatus != WD_STATUS_SUCCESS)
+    if (pPool)
     {
-        ErrLog("Failed allocating DMA for polling WB\n");
-        return dwStatus;
+        /* Only the handle that owns the engine polls its write-back */
+        DWORD dwOffset = ENGINE_IDX(pXdmaDma->dwChannel, pXdmaDma->fToDevice) *
+            XDMA_POOL_WB_SLOT_SIZE;
+
+        pXdmaDma->pWBDma = pPool->pWBDma;
+        pXdmaDma->pWBBuf = (BYTE *)pPool->pWBBuf + dwOffset;
+        pXdmaDma->pWBPhysAddr = pPool->pWBDma->Page[0].pPhysicalAddr +
+            dwOffset;
+        pXdmaDma->fWBPooled = TRUE;
+        BZERO(*(XDMA_DMA_POLL_WB *)pXdmaDma->pWBBuf);
+    }
+    else
+    {
+        dwStatus = WDC_DMAContigBufLock(pXdmaDma->hDev,
+            &pXdmaDma->pWBBuf,
+            DMA_FROM_DEVICE | DMA_ALLOW_64BIT_ADDRESS,
+            sizeof(XDMA_DMA_POLL_WB),
+            &pXdmaDma->pWBDma);
+        if (dwStatus != WD_STATUS_SUCCESS)
+        {
+            ErrLog("Failed allocating DMA for polling WB\n");
+            return dwStatus;
+        }
+        pXdmaDma->pWBPhysAddr = pXdmaDma->pWBDma->Page[0].pPhysicalAddr;
+        pXdmaDma->fWBPooled = FALSE;
     }
 
     WDC_WriteAddr32(pXdmaDma->hDev,
@@ -1161,26 +3101,27 @@ static DWORD ConfigureWriteBackAddress(XDMA_DMA_STRUCT *pXdmaDma)
         XDMA_CHANNEL_OFFSET(pXdmaDma->dwChannel,
         pXdmaDma->fToDevice ? XDMA_H2C_CHANNEL_POLL_LOW_WRITE_BACK_ADDR_OFFSET :
         XDMA_C2H_CHANNEL_POLL_LOW_WRITE_BACK_ADDR_OFFSET),
-        DMA_ADDR_LOW(pXdmaDma->pWBDma->Page[0].pPhysicalAddr));
+        DMA_ADDR_LOW(pXdmaDma->pWBPhysAddr));
     WDC_WriteAddr32(pXdmaDma->hDev,
         pDevCtx->dwConfigBarNum,
         XDMA_CHANNEL_OFFSET(pXdmaDma->dwChannel,
         pXdmaDma->fToDevice ? XDMA_H2C_CHANNEL_POLL_HIGH_WRITE_BACK_ADDR_OFFSET :
         XDMA_C2H_CHANNEL_POLL_HIGH_WRITE_BACK_ADDR_OFFSET),
-        DMA_ADDR_HIGH(pXdmaDma->pWBDma->Page[0].pPhysicalAddr));
+        DMA_ADDR_HIGH(pXdmaDma->pWBPhysAddr));
 
     return WD_STATUS_SUCCESS;
 }
 
-/* Open a DMA handle: Allocate and initialize a XDMA DMA information structure,
- * including allocation of a scatter/gather DMA buffer */
-DWORD XDMA_DmaOpen(WDC_DEVICE_HANDLE hDev, XDMA_DMA_HANDLE *phDma,
+static DWORD DmaOpen(WDC_DEVICE_HANDLE hDev, XDMA_DMA_HANDLE *phDma,
     DWORD dwBytes, UINT64 u64FPGAOffset, BOOL fToDevice, DWORD dwChannel,
-    BOOL fPolling, BOOL fNonIncMode, PVOID pData, BOOL fIsTransaction)
+    BOOL fPolling, BOOL fNonIncMode, PVOID pData, BOOL fIsTransaction,
+    DWORD dwRingSlots, DWORD dwOptions, PVOID pExtBuf)
 {
     PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(hDev);
     DWORD idx = ENGINE_IDX(dwChannel, fToDevice);
     XDMA_DMA_STRUCT *pXdmaDma = &(pDevCtx->pEnginesArr[idx]);
+    BOOL fQueued = (dwOptions & XDMA_DMA_OPT_QUEUED) ? TRUE : FALSE;
+    BOOL fHybrid = (dwOptions & XDMA_DMA_OPT_HYBRID) ? TRUE : FALSE;
     DWORD dwStatus;
 
     TraceLog("XDMA_DmaOpen: Entered. Device handle [0x%p], dwBytes [%d], "
@@ -1205,7 +3146,45 @@ DWORD XDMA_DmaOpen(WDC_DEVICE_HANDLE hDev, XDMA_DMA_HANDLE *phDma,
         return WD_INVALID_PARAMETER;
     }
 
-    if (pXdmaDma->fIsInitialized)
+    if (fHybrid && (fPolling || fQueued || fIsTransaction || dwRingSlots ||
+        pExtBuf))
+    {
+        ErrLog("Hybrid DMA handles must be interrupt-driven, and support "
+            "neither queues, transactions, rings nor stripes\n");
+        return WD_INVALID_PARAMETER;
+    }
+#ifndef HAS_INTS
+    /* Without interrupts a hybrid handle is always polled */
+    if (fHybrid)
+    {
+        fPolling = TRUE;
+        fHybrid = FALSE;
+    }
+#endif /* ifndef HAS_INTS */
+
+    if (fQueued)
+    {
+        if (fIsTransaction || fNonIncMode || dwRingSlots)
+        {
+            ErrLog("Queued DMA handles support neither transactions, "
+                "non-incrementing address mode nor rings\n");
+            return WD_INVALID_PARAMETER;
+        }
+
+        /* Queued handles do not own the engine: Any number of them may be
+         * open and submitted to the engine's queue */
+        pXdmaDma = (XDMA_DMA_STRUCT *)calloc(1, sizeof(XDMA_DMA_STRUCT));
+        if (!pXdmaDma)
+        {
+            ErrLog("Failed allocating memory for queued DMA handle\n");
+            return WD_INSUFFICIENT_RESOURCES;
+        }
+        pXdmaDma->fQueued = TRUE;
+        pXdmaDma->fIsEnabled = TRUE;
+        pXdmaDma->u32IrqBitMask = pDevCtx->pEnginesArr[idx].u32IrqBitMask;
+        pXdmaDma->regs = pDevCtx->pEnginesArr[idx].regs;
+    }
+    else if (pXdmaDma->fIsInitialized)
     {
         ErrLog("DMA handle already open for this channel\n");
         *phDma = &pXdmaDma;
@@ -1213,208 +3192,2003 @@ DWORD XDMA_DmaOpen(WDC_DEVICE_HANDLE hDev, XDMA_DMA_HANDLE *phDma,
     }
 
     pXdmaDma->fStreaming = EngineIsStreaming(hDev, dwChannel, fToDevice);
+    pXdmaDma->pBuf = pExtBuf;
+    pXdmaDma->fExtBuf = pExtBuf != NULL;
+    pXdmaDma->pSGPoolBuf = NULL;
+
+    /* The chain of a pooled buffer covers its whole size class, and is cut
+     * to dwBytes as a retargeted chain (see DmaTransferBuild()) */
+    if (!fIsTransaction && !dwRingSlots && !pExtBuf &&
+        !(dwOptions & (XDMA_DMA_OPT_MERGE_PAGES | XDMA_DMA_OPT_HUGE_PAGES)))
+    {
+        pXdmaDma->pSGPoolBuf = SGPoolGet(hDev, dwBytes);
+    }
 
-    dwStatus = LockDmaBuffer(hDev, fToDevice, &pXdmaDma->pBuf, dwBytes,
-        &pXdmaDma->pDma, fIsTransaction);
-    if (dwStatus != WD_STATUS_SUCCESS)
-        goto Error;
+    if (pXdmaDma->pSGPoolBuf)
+    {
+        XDMA_SG_POOL_BUF *pPoolBuf = (XDMA_SG_POOL_BUF *)pXdmaDma->pSGPoolBuf;
+
+        pXdmaDma->pBuf = pPoolBuf->pBuf;
+        pXdmaDma->pDma = pPoolBuf->pDma;
+        pXdmaDma->dwBufPageSize = GetPageSize();
+    }
+    else
+    {
+        /* Huge pages are physically contiguous, so they are always merged */
+        dwStatus = LockDmaBuffer(hDev, fToDevice, &pXdmaDma->pBuf, dwBytes,
+            &pXdmaDma->pDma, fIsTransaction,
+            (dwOptions & (XDMA_DMA_OPT_MERGE_PAGES |
+            XDMA_DMA_OPT_HUGE_PAGES)) ? TRUE : FALSE,
+            (dwOptions & XDMA_DMA_OPT_HUGE_PAGES) ? TRUE : FALSE,
+            &pXdmaDma->dwBufPageSize);
+        if (dwStatus != WD_STATUS_SUCCESS)
+            goto Error;
+    }
 
     pXdmaDma->hDev = hDev;
     pXdmaDma->dwBytes = dwBytes;
+    pXdmaDma->dwXferBytes = dwBytes;
     pXdmaDma->dwChannel = dwChannel;
     pXdmaDma->u64FPGAOffset = u64FPGAOffset;
     pXdmaDma->fPolling = fPolling;
     pXdmaDma->fToDevice = fToDevice;
     pXdmaDma->fNonIncMode = fNonIncMode;
     pXdmaDma->pData = pData;
+    pXdmaDma->fRing = dwRingSlots != 0;
+    pXdmaDma->dwRingSlots = dwRingSlots;
+    pXdmaDma->dwRingSlotBytes = dwRingSlots ? dwBytes / dwRingSlots : 0;
+    pXdmaDma->dwOptions = dwOptions;
+    pXdmaDma->fIsTransaction = fIsTransaction;
+    pXdmaDma->pollPolicy.u64SpinNs = XDMA_POLL_DEFAULT_SPIN_NS;
+    pXdmaDma->pollPolicy.u64YieldNs = XDMA_POLL_DEFAULT_YIELD_NS;
+    pXdmaDma->pollPolicy.dwSleepUsec = XDMA_POLL_DEFAULT_SLEEP_USEC;
+    pXdmaDma->pollPolicy.u64TimeoutNs = XDMA_POLL_DEFAULT_TIMEOUT_NS;
+    BZERO(pXdmaDma->pollStats);
+    BZERO(pXdmaDma->mmioStats);
+    pXdmaDma->fHybrid = fHybrid;
+    pXdmaDma->hybridPolicy.dwBusyTransfers =
+        XDMA_HYBRID_DEFAULT_BUSY_TRANSFERS;
+    pXdmaDma->hybridPolicy.u64IdleNs = XDMA_HYBRID_DEFAULT_IDLE_NS;
+    pXdmaDma->dwHybridBusy = 0;
+    pXdmaDma->u64LastDoneNs = 0;
     *phDma = (XDMA_DMA_HANDLE)pXdmaDma;
 
-    WDC_WriteAddr32(hDev, pDevCtx->dwConfigBarNum,
-        XDMA_CHANNEL_OFFSET(dwChannel, fToDevice ?
-        XDMA_H2C_CHANNEL_CONTROL_W1C_OFFSET :
-        XDMA_C2H_CHANNEL_CONTROL_W1C_OFFSET),
-        XDMA_CTRL_NON_INCR_ADDR);
+    /* The engine of a queued handle may already be running its queue */
+    if (!fQueued)
+    {
+        WDC_WriteAddr32(hDev, pDevCtx->dwConfigBarNum,
+            XDMA_CHANNEL_OFFSET(dwChannel, fToDevice ?
+            XDMA_H2C_CHANNEL_CONTROL_W1C_OFFSET :
+            XDMA_C2H_CHANNEL_CONTROL_W1C_OFFSET),
+            XDMA_CTRL_NON_INCR_ADDR);
+    }
+
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        ErrLog("Failed %s non-incrementing address mode\n",
+            fNonIncMode ? "setting" : "clearing");
+        goto Error;
+    }
+
+    dwStatus = CheckAlignment(pXdmaDma);
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        ErrLog("Alignment validation failed\n");
+        goto Error;
+    }
+
+    if (fHybrid)
+    {
+        dwStatus = OsEventCreate(&pXdmaDma->hHybridEvent);
+        if (dwStatus != WD_STATUS_SUCCESS)
+        {
+            ErrLog("Failed creating hybrid completion event. "
+                "Error 0x%x - %s\n", dwStatus, Stat2Str(dwStatus));
+            goto Error;
+        }
+    }
+
+    /* Queues track completion by the completed descriptors count */
+    if ((fPolling || fHybrid) && !fQueued)
+    {
+        dwStatus = ConfigureWriteBackAddress(pXdmaDma);
+        if (dwStatus != WD_STATUS_SUCCESS)
+        {
+            ErrLog("Failed configuring WriteBack address. Error 0x%x - %s\n",
+                dwStatus, Stat2Str(dwStatus));
+            goto Error;
+        }
+    }
+
+    if (fIsTransaction)
+        dwStatus = DmaBuildDescBuffer(pXdmaDma, TRUE);
+    else
+        dwStatus = ConfigureDmaDesc(pXdmaDma);
+
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        ErrLog("Failed configuring DMA descriptors buffer. Error 0x%x - %s\n",
+            dwStatus, Stat2Str(dwStatus));
+        goto Error;
+    }
+
+    TraceLog("Opened DMA: handle %p, fPolling %d, fToDevice %d, dwChannel %d, "
+        "dwBytes %d, u64FPGAOffset %d, fStreaming %d, fNonIncMode %d, "
+        "dwDescs %d, dwBufPageSize 0x%x\n", pXdmaDma, pXdmaDma->fPolling,
+        pXdmaDma->fToDevice, pXdmaDma->dwChannel, pXdmaDma->dwBytes,
+        pXdmaDma->u64FPGAOffset, pXdmaDma->fStreaming, pXdmaDma->fNonIncMode,
+        pXdmaDma->dwDescs, pXdmaDma->dwBufPageSize);
+
+    pXdmaDma->fIsInitialized = TRUE;
+    return WD_STATUS_SUCCESS;
+
+Error:
+    if (pXdmaDma->hHybridEvent)
+    {
+        OsEventClose(pXdmaDma->hHybridEvent);
+        pXdmaDma->hHybridEvent = NULL;
+    }
+    pXdmaDma->fHybrid = FALSE;
+    if (pXdmaDma->pWBDma)
+    {
+        if (!pXdmaDma->fWBPooled)
+            WDC_DMABufUnlock(pXdmaDma->pWBDma);
+        pXdmaDma->pWBDma = NULL;
+        pXdmaDma->pWBBuf = NULL;
+        pXdmaDma->fWBPooled = FALSE;
+    }
+    if (pXdmaDma->pDmaDesc)
+    {
+        DmaDescBufFree(hDev, pXdmaDma->pDmaDesc, pXdmaDma->pDescBuf,
+            pXdmaDma->dwDescPoolBlocks);
+        pXdmaDma->pDmaDesc = NULL;
+        pXdmaDma->pDescBuf = NULL;
+        pXdmaDma->dwDescPoolBlocks = 0;
+    }
+    if (pXdmaDma->pSGPoolBuf)
+    {
+        SGPoolPut(hDev, (XDMA_SG_POOL_BUF *)pXdmaDma->pSGPoolBuf);
+        pXdmaDma->pSGPoolBuf = NULL;
+        pXdmaDma->pDma = NULL;
+        pXdmaDma->pBuf = NULL;
+    }
+    else if (pXdmaDma->pDma)
+    {
+        WDC_DMABufUnlock(pXdmaDma->pDma);
+        pXdmaDma->pDma = NULL;
+    }
+    if (pXdmaDma->pBuf && !pXdmaDma->fExtBuf)
+        __hvfree(pXdmaDma->pBuf, dwBytes, pXdmaDma->dwBufPageSize);
+    pXdmaDma->pBuf = NULL;
+    if (pXdmaDma->pdwRingSlotDescs)
+    {
+        free(pXdmaDma->pdwRingSlotDescs);
+        pXdmaDma->pdwRingSlotDescs = NULL;
+    }
+    pXdmaDma->dwDescs = 0;
+
+    pXdmaDma->fIsInitialized = FALSE;
+    if (fQueued)
+        free(pXdmaDma);
+
+    return dwStatus;
+}
+
+/* Open a DMA handle: Allocate and initialize a XDMA DMA information structure,
+ * including allocation of a scatter/gather DMA buffer */
+DWORD XDMA_DmaOpen(WDC_DEVICE_HANDLE hDev, XDMA_DMA_HANDLE *phDma,
+    DWORD dwBytes, UINT64 u64FPGAOffset, BOOL fToDevice, DWORD dwChannel,
+    BOOL fPolling, BOOL fNonIncMode, PVOID pData, BOOL fIsTransaction)
+{
+    return DmaOpen(hDev, phDma, dwBytes, u64FPGAOffset, fToDevice, dwChannel,
+        fPolling, fNonIncMode, pData, fIsTransaction, 0, 0, NULL);
+}
+
+/* Open a DMA handle with XDMA_DMA_OPT_XXX options */
+DWORD XDMA_DmaOpenEx(WDC_DEVICE_HANDLE hDev, XDMA_DMA_HANDLE *phDma,
+    DWORD dwBytes, UINT64 u64FPGAOffset, BOOL fToDevice, DWORD dwChannel,
+    BOOL fPolling, BOOL fNonIncMode, PVOID pData, DWORD dwOptions)
+{
+    return DmaOpen(hDev, phDma, dwBytes, u64FPGAOffset, fToDevice, dwChannel,
+        fPolling, fNonIncMode, pData, FALSE, 0, dwOptions, NULL);
+}
+
+DWORD XDMA_DmaTransactionExecute(XDMA_DMA_HANDLE hDma, BOOL fNewContext,
+    PVOID pData)
+{
+    XDMA_DMA_STRUCT *pXdmaDma = (XDMA_DMA_STRUCT *)hDma;
+    DWORD dwStatus = WD_STATUS_SUCCESS;
+    WD_DMA *pDma = pXdmaDma->pDma;
+
+    TraceLog("\n%s: Executing DMA transaction for channel %d.\n", __FUNCTION__,
+        pXdmaDma->dwChannel);
+
+    if (fNewContext)
+        pXdmaDma->pData = pData;
+
+    dwStatus = WDC_DMATransactionExecute(pDma, DmaTransferBuild, hDma);
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        ErrLog("%s: Failed to execute DMA transaction for channel %d. Error "
+            "0x%x - %s\n", __FUNCTION__, pXdmaDma->dwChannel, dwStatus,
+            Stat2Str(dwStatus));
+    }
+
+    return dwStatus;
+}
+
+DWORD XDMA_DmaTransactionTransferEnded(XDMA_DMA_HANDLE hDma)
+{
+    XDMA_DMA_STRUCT *pxdmaDma = (XDMA_DMA_STRUCT *)hDma;
+
+    DWORD dwStatus = WDC_DMATransferCompletedAndCheck(pxdmaDma->pDma, TRUE);
+    if (dwStatus == WD_STATUS_SUCCESS)
+        TraceLog("DMA transaction completed");
+    else if (dwStatus != (DWORD)WD_MORE_PROCESSING_REQUIRED)
+        ErrLog("DMA transfer failed\n");
+
+    return dwStatus;
+}
+
+DWORD XDMA_DmaTransactionRelease(XDMA_DMA_HANDLE hDma)
+{
+    XDMA_DMA_STRUCT *pXdmaDma = (XDMA_DMA_STRUCT *)hDma;
+    DWORD dwStatus = WD_STATUS_SUCCESS;
+    WD_DMA* pDma = pXdmaDma->pDma;
+
+    dwStatus = WDC_DMATransactionRelease(pDma);
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        ErrLog("%s: Failed to release DMA transaction for channel %d. Error "
+            "0x%x - %s\n", __FUNCTION__, pXdmaDma->dwChannel, dwStatus,
+            Stat2Str(dwStatus));
+    }
+    else
+    {
+        TraceLog("%s: DMA transaction of channel %d was released. \n",
+            __FUNCTION__, pXdmaDma->dwChannel);
+    }
+
+    return dwStatus;
+}
+
+
+DWORD XDMA_DmaClose(XDMA_DMA_HANDLE hDma)
+{
+    XDMA_DMA_STRUCT *pXdmaDma = (XDMA_DMA_STRUCT *)hDma;
+    PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(pXdmaDma->hDev);
+    DWORD idx = ENGINE_IDX(pXdmaDma->dwChannel, pXdmaDma->fToDevice);
+    DWORD dwStatus = WD_STATUS_SUCCESS;
+
+    if (pXdmaDma->fInQueue)
+    {
+        ErrLog("XDMA_DmaClose: DMA handle is still queued\n");
+        return WD_OPERATION_FAILED;
+    }
+
+    if (pXdmaDma->pWBDma)
+    {
+        if (!pXdmaDma->fWBPooled)
+        {
+            dwStatus = WDC_DMABufUnlock(pXdmaDma->pWBDma);
+            if (dwStatus != WD_STATUS_SUCCESS)
+            {
+                ErrLog("Failed unlocking DMA polling WB buffer. "
+                    "Error 0x%x - %s\n", dwStatus, Stat2Str(dwStatus));
+            }
+        }
+        pXdmaDma->pWBDma = NULL;
+        pXdmaDma->pWBBuf = NULL;
+        pXdmaDma->fWBPooled = FALSE;
+    }
+
+    if (pXdmaDma->pDmaDesc)
+    {
+        dwStatus = DmaDescBufFree(pXdmaDma->hDev, pXdmaDma->pDmaDesc,
+            pXdmaDma->pDescBuf, pXdmaDma->dwDescPoolBlocks);
+        if (dwStatus != WD_STATUS_SUCCESS)
+        {
+            ErrLog("Failed unlocking DMA descriptors buffer. "
+                "Error 0x%x - %s\n", dwStatus, Stat2Str(dwStatus));
+        }
+        pXdmaDma->pDmaDesc = NULL;
+        pXdmaDma->pDescBuf = NULL;
+        pXdmaDma->dwDescPoolBlocks = 0;
+    }
+
+    /* A pooled buffer stays locked for the next DMA handle */
+    if (pXdmaDma->pSGPoolBuf)
+    {
+        SGPoolPut(pXdmaDma->hDev, (XDMA_SG_POOL_BUF *)pXdmaDma->pSGPoolBuf);
+        pXdmaDma->pSGPoolBuf = NULL;
+        pXdmaDma->pDma = NULL;
+        pXdmaDma->pBuf = NULL;
+    }
+    else if (pXdmaDma->pDma)
+    {
+        dwStatus = WDC_DMABufUnlock(pXdmaDma->pDma);
+        if (dwStatus != WD_STATUS_SUCCESS)
+        {
+            ErrLog("Failed unlocking DMA buffer. Error 0x%x - %s\n", dwStatus,
+                Stat2Str(dwStatus));
+        }
+        pXdmaDma->pDma = NULL;
+    }
+
+    /* A buffer provided by a striped handle is freed by its owner */
+    if (pXdmaDma->pBuf && !pXdmaDma->fExtBuf)
+        __hvfree(pXdmaDma->pBuf, pXdmaDma->dwBytes, pXdmaDma->dwBufPageSize);
+    pXdmaDma->pBuf = NULL;
+    pXdmaDma->pStripe = NULL;
+
+    if (pXdmaDma->pdwRingSlotDescs)
+    {
+        free(pXdmaDma->pdwRingSlotDescs);
+        pXdmaDma->pdwRingSlotDescs = NULL;
+    }
+    pXdmaDma->fRing = FALSE;
+
+    if (pXdmaDma->pdwPageOffsets)
+    {
+        free(pXdmaDma->pdwPageOffsets);
+        pXdmaDma->pdwPageOffsets = NULL;
+    }
+    pXdmaDma->fBatchChain = FALSE;
+    pXdmaDma->fDmaIntsEnabled = FALSE;
+
+    if (pXdmaDma->hHybridEvent)
+    {
+        OsEventClose(pXdmaDma->hHybridEvent);
+        pXdmaDma->hHybridEvent = NULL;
+    }
+    pXdmaDma->fHybrid = FALSE;
+
+    if (pXdmaDma->fQueued)
+        free(pXdmaDma);
+    else
+        pDevCtx->pEnginesArr[idx].fIsInitialized = FALSE;
+
+    return dwStatus;
+}
+
+/* Returns DMA direction. TRUE - host to device, FALSE - device to host */
+BOOL XDMA_DmaIsToDevice(XDMA_DMA_HANDLE hDma)
+{
+    return ((XDMA_DMA_STRUCT *)hDma)->fToDevice;
+}
+
+/* Returns pointer to the allocated virtual buffer and buffer size in bytes */
+PVOID XDMA_DmaBufferGet(XDMA_DMA_HANDLE hDma, DWORD *pBytes)
+{
+    XDMA_DMA_STRUCT *pXdmaDma = (XDMA_DMA_STRUCT *)hDma;
+
+    if (!hDma || !pBytes)
+        return NULL;
+
+    *pBytes = pXdmaDma->dwBytes;
+    return pXdmaDma->pBuf;
+}
+
+/* Returns the number of descriptors in the DMA handle's descriptors chain */
+DWORD XDMA_DmaDescCountGet(XDMA_DMA_HANDLE hDma)
+{
+    if (!hDma)
+        return 0;
+
+    return ((XDMA_DMA_STRUCT *)hDma)->dwDescs;
+}
+
+/* Returns TRUE if the DMA handle's descriptors were carved out of the device
+ * DMA pool */
+BOOL XDMA_DmaDescIsPooled(XDMA_DMA_HANDLE hDma)
+{
+    if (!hDma)
+        return FALSE;
+
+    return ((XDMA_DMA_STRUCT *)hDma)->dwDescPoolBlocks != 0;
+}
+
+DWORD XDMA_DmaRetarget(XDMA_DMA_HANDLE hDma, UINT64 u64FPGAOffset,
+    DWORD dwBytes)
+{
+    XDMA_DMA_STRUCT *pXdmaDma = (XDMA_DMA_STRUCT *)hDma;
+    BOOL fOffsetChanged;
+    UINT32 u32Adjacent, u32Status;
+
+    if (!pXdmaDma || !dwBytes || dwBytes > pXdmaDma->dwBytes)
+        return WD_INVALID_PARAMETER;
+
+    if (pXdmaDma->fRing || pXdmaDma->fIsTransaction || pXdmaDma->fInQueue ||
+        !pXdmaDma->dwDescs)
+    {
+        ErrLog("XDMA_DmaRetarget: The DMA handle cannot be retargeted\n");
+        return WD_INVALID_PARAMETER;
+    }
+
+    /* The engine of a pending transfer may be fetching the descriptors that
+     * would be patched. A queued handle that is not in its queue does not
+     * own the engine */
+    if (!pXdmaDma->fQueued &&
+        (XDMA_EngineStatusRead(hDma, FALSE, &u32Status) != WD_STATUS_SUCCESS ||
+        (u32Status & XDMA_STAT_BUSY)))
+    {
+        ErrLog("XDMA_DmaRetarget: A transfer of the DMA handle is pending\n");
+        return WD_TRY_AGAIN;
+    }
+
+    fOffsetChanged = u64FPGAOffset != pXdmaDma->u64FPGAOffset;
+    if (!fOffsetChanged && dwBytes == pXdmaDma->dwXferBytes)
+        return WD_STATUS_SUCCESS;
+
+    pXdmaDma->u64FPGAOffset = u64FPGAOffset;
+    pXdmaDma->dwXferBytes = dwBytes;
+
+    /* The chain of a batch is replaced by the whole buffer chain on the
+     * next start: Rebuild it now */
+    if (pXdmaDma->fBatchChain)
+    {
+        DmaTransferBuild(pXdmaDma);
+        pXdmaDma->fBatchChain = FALSE;
+        return WD_STATUS_SUCCESS;
+    }
+
+    u32Adjacent = DmaChainPatch(pXdmaDma, fOffsetChanged);
+    WDC_DMASyncCpu(pXdmaDma->pDmaDesc);
+
+    TraceLog("XDMA_DmaRetarget: FPGA offset 0x%llx, %d bytes, dwDescs %d\n",
+        u64FPGAOffset, dwBytes, pXdmaDma->dwDescs);
+
+    /* The first fetch changes only for short transfers */
+    if (u32Adjacent != pXdmaDma->u32DescAdjacent)
+    {
+        pXdmaDma->u32DescAdjacent = u32Adjacent;
+        if (!pXdmaDma->fQueued)
+            DmaDescAddrSet(pXdmaDma, u32Adjacent);
+    }
+
+    return WD_STATUS_SUCCESS;
+}
+
+/* Returns the size of the pages that back the DMA buffer */
+DWORD XDMA_DmaBufPageSizeGet(XDMA_DMA_HANDLE hDma)
+{
+    if (!hDma)
+        return 0;
+
+    return ((XDMA_DMA_STRUCT *)hDma)->dwBufPageSize;
+}
+
+/* -----------------------------------------------
+    Continuous C2H capture ring
+   ----------------------------------------------- */
+/* Open a device-to-host DMA handle whose descriptors form a ring over dwSlots
+ * host buffer slots */
+DWORD XDMA_DmaRingOpen(WDC_DEVICE_HANDLE hDev, XDMA_DMA_HANDLE *phDma,
+    DWORD dwSlotBytes, DWORD dwSlots, UINT64 u64FPGAOffset, DWORD dwChannel,
+    PVOID pData)
+{
+    TraceLog("XDMA_DmaRingOpen: Entered. Device handle [0x%p], dwSlotBytes "
+        "[%d], dwSlots [%d], dwChannel [%d]\n", hDev, dwSlotBytes, dwSlots,
+        dwChannel);
+
+    if (!dwSlotBytes || dwSlots < 2 || dwSlotBytes > (DWORD)-1 / dwSlots)
+    {
+        ErrLog("XDMA_DmaRingOpen: Invalid ring size (%d slots of %d bytes)\n",
+            dwSlots, dwSlotBytes);
+        return WD_INVALID_PARAMETER;
+    }
+
+    return DmaOpen(hDev, phDma, dwSlotBytes * dwSlots, u64FPGAOffset, FALSE,
+        dwChannel, FALSE, FALSE, pData, FALSE, dwSlots,
+        XDMA_DMA_OPT_MERGE_PAGES, NULL);
+}
+
+/* Get the oldest filled ring slot */
+DWORD XDMA_DmaRingSlotGet(XDMA_DMA_HANDLE hDma, PVOID *ppSlot, DWORD *pdwSlot,
+    DWORD *pdwLost)
+{
+    XDMA_DMA_STRUCT *pXdmaDma = (XDMA_DMA_STRUCT *)hDma;
+    PXDMA_DEV_CTX pDevCtx;
+    UINT32 u32Completed, u32Ready;
+    DWORD dwStatus, dwLost = 0;
+
+    if (!pXdmaDma || !pXdmaDma->fRing || !ppSlot)
+        return WD_INVALID_PARAMETER;
+
+    pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(pXdmaDma->hDev);
+    dwStatus = WDC_ReadAddr32(pXdmaDma->hDev, pDevCtx->dwConfigBarNum,
+        XDMA_CHANNEL_OFFSET(pXdmaDma->dwChannel,
+        XDMA_C2H_CHANNEL_COMPLETED_DESC_COUNT_OFFSET), &u32Completed);
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        ErrLog("XDMA_DmaRingSlotGet: Failed reading completed descriptors "
+            "count. Error 0x%x - %s\n", dwStatus, Stat2Str(dwStatus));
+        return dwStatus;
+    }
+
+    /* Once the engine is a full ring ahead of the reader it is overwriting
+     * the head slot: skip the slots that were lost */
+    u32Ready = u32Completed - pXdmaDma->u32RingDescsDone;
+    while (u32Ready >= pXdmaDma->dwDescs)
+    {
+        XDMA_DmaRingSlotRelease(pXdmaDma);
+        u32Ready = u32Completed - pXdmaDma->u32RingDescsDone;
+        dwLost++;
+    }
+
+    if (pdwLost)
+        *pdwLost = dwLost;
+    if (dwLost)
+    {
+        TraceLog("XDMA_DmaRingSlotGet: %d slots overwritten before being "
+            "consumed\n", dwLost);
+    }
+
+    if (u32Ready < pXdmaDma->pdwRingSlotDescs[pXdmaDma->dwRingHead])
+        return WD_TRY_AGAIN;
+
+    WDC_DMASyncIo(pXdmaDma->pDma);
+
+    *ppSlot = (PVOID)((UPTR)pXdmaDma->pBuf +
+        (UPTR)pXdmaDma->dwRingHead * pXdmaDma->dwRingSlotBytes);
+    if (pdwSlot)
+        *pdwSlot = pXdmaDma->dwRingHead;
+
+    return WD_STATUS_SUCCESS;
+}
+
+/* Return the slot obtained by XDMA_DmaRingSlotGet() to the engine */
+DWORD XDMA_DmaRingSlotRelease(XDMA_DMA_HANDLE hDma)
+{
+    XDMA_DMA_STRUCT *pXdmaDma = (XDMA_DMA_STRUCT *)hDma;
+
+    if (!pXdmaDma || !pXdmaDma->fRing)
+        return WD_INVALID_PARAMETER;
+
+    pXdmaDma->u32RingDescsDone +=
+        pXdmaDma->pdwRingSlotDescs[pXdmaDma->dwRingHead];
+    pXdmaDma->dwRingHead = (pXdmaDma->dwRingHead + 1) % pXdmaDma->dwRingSlots;
+
+    return WD_STATUS_SUCCESS;
+}
+
+/* -----------------------------------------------
+    Multi-channel striped DMA
+   ----------------------------------------------- */
+/* Open a striped DMA handle over all the free enabled engines of one
+ * direction */
+DWORD XDMA_DmaStripeOpen(WDC_DEVICE_HANDLE hDev,
+    XDMA_DMA_STRIPE_HANDLE *phStripe, DWORD dwBytes, UINT64 u64FPGAOffset,
+    BOOL fToDevice, BOOL fPolling, PVOID pData, DWORD dwOptions)
+{
+    PXDMA_DEV_CTX pDevCtx;
+    XDMA_DMA_STRIPE *pStripe;
+    DWORD dwStatus, dwChannel, dwStripeBytes, dwOffset = 0;
+    DWORD dwEngines = 0;
+
+    TraceLog("XDMA_DmaStripeOpen: Entered. Device handle [0x%p], dwBytes [%d], "
+        "fToDevice [%d], fPolling [%d]\n", hDev, dwBytes, fToDevice, fPolling);
+
+    if (!IsValidDevice((PWDC_DEVICE)hDev, "XDMA_DmaStripeOpen"))
+        return WD_INVALID_PARAMETER;
+
+    if (!phStripe || !dwBytes)
+        return WD_INVALID_PARAMETER;
+
+    pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(hDev);
+    for (dwChannel = 0; dwChannel < XDMA_CHANNELS_NUM; dwChannel++)
+    {
+        XDMA_DMA_STRUCT *pXdmaDma =
+            &pDevCtx->pEnginesArr[ENGINE_IDX(dwChannel, fToDevice)];
+
+        if (pXdmaDma->fIsEnabled && !pXdmaDma->fIsInitialized)
+            dwEngines++;
+    }
+
+    if (!dwEngines)
+    {
+        ErrLog("XDMA_DmaStripeOpen: No free %s engines\n",
+            fToDevice ? "host-to-device" : "device-to-host");
+        return WD_OPERATION_FAILED;
+    }
+
+    pStripe = (XDMA_DMA_STRIPE *)calloc(1, sizeof(XDMA_DMA_STRIPE));
+    if (!pStripe)
+    {
+        ErrLog("Failed allocating memory for striped DMA handle\n");
+        return WD_INSUFFICIENT_RESOURCES;
+    }
+
+    pStripe->hDev = hDev;
+    pStripe->dwBytes = dwBytes;
+    pStripe->fToDevice = fToDevice;
+    pStripe->fPolling = fPolling;
+    pStripe->pData = pData;
+
+    dwStatus = OsMutexCreate(&pStripe->hMutex);
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        ErrLog("Failed creating striped DMA handle mutex. Error 0x%x - %s\n",
+            dwStatus, Stat2Str(dwStatus));
+        goto Error;
+    }
+
+    /* The stripes share a single buffer, each engine locks its own part */
+    if (dwOptions & XDMA_DMA_OPT_HUGE_PAGES)
+    {
+        pStripe->pBuf = __hvalloc(dwBytes, &pStripe->dwBufPageSize);
+    }
+    else
+    {
+        pStripe->pBuf = __valloc(dwBytes);
+        pStripe->dwBufPageSize = GetPageSize();
+    }
+    if (!pStripe->pBuf)
+    {
+        ErrLog("Memory allocation failure\n");
+        dwStatus = WD_INSUFFICIENT_RESOURCES;
+        goto Error;
+    }
+
+    /* Stripes start on a page boundary, to keep the buffer and FPGA offset
+     * alignments of every stripe identical */
+    dwStripeBytes = (DWORD)__ALIGN_UP((UINT64)(dwBytes / dwEngines),
+        (UINT64)GetPageSize());
+    if (!dwStripeBytes)
+        dwStripeBytes = GetPageSize();
+
+    for (dwChannel = 0; dwChannel < XDMA_CHANNELS_NUM && dwOffset < dwBytes;
+        dwChannel++)
+    {
+        XDMA_DMA_STRUCT *pXdmaDma =
+            &pDevCtx->pEnginesArr[ENGINE_IDX(dwChannel, fToDevice)];
+        XDMA_DMA_HANDLE hDma;
+        DWORD dwLen = dwBytes - dwOffset < dwStripeBytes ?
+            dwBytes - dwOffset : dwStripeBytes;
+
+        if (!pXdmaDma->fIsEnabled || pXdmaDma->fIsInitialized)
+            continue;
+
+        /* The buffer is already allocated: Keep only the page merging
+         * implied by XDMA_DMA_OPT_HUGE_PAGES */
+        dwStatus = DmaOpen(hDev, &hDma, dwLen, u64FPGAOffset + dwOffset,
+            fToDevice, dwChannel, fPolling, FALSE, pData, FALSE, 0,
+            (dwOptions & ~XDMA_DMA_OPT_HUGE_PAGES) |
+            ((dwOptions & XDMA_DMA_OPT_HUGE_PAGES) ?
+            XDMA_DMA_OPT_MERGE_PAGES : 0),
+            (PVOID)((UPTR)pStripe->pBuf + dwOffset));
+        if (dwStatus != WD_STATUS_SUCCESS)
+        {
+            ErrLog("XDMA_DmaStripeOpen: Failed opening stripe on channel %d. "
+                "Error 0x%x - %s\n", dwChannel, dwStatus, Stat2Str(dwStatus));
+            goto Error;
+        }
+
+        ((XDMA_DMA_STRUCT *)hDma)->pStripe = pStripe;
+        pStripe->pStripesArr[pStripe->dwStripes++] = (XDMA_DMA_STRUCT *)hDma;
+        dwOffset += dwLen;
+    }
+
+    TraceLog("XDMA_DmaStripeOpen: Opened %d stripes of up to %d bytes\n",
+        pStripe->dwStripes, dwStripeBytes);
+
+    *phStripe = (XDMA_DMA_STRIPE_HANDLE)pStripe;
+    return WD_STATUS_SUCCESS;
+
+Error:
+    XDMA_DmaStripeClose(pStripe);
+    return dwStatus;
+}
+
+/* Close a striped DMA handle */
+DWORD XDMA_DmaStripeClose(XDMA_DMA_STRIPE_HANDLE hStripe)
+{
+    XDMA_DMA_STRIPE *pStripe = (XDMA_DMA_STRIPE *)hStripe;
+    DWORD i, dwStatus = WD_STATUS_SUCCESS;
+
+    if (!pStripe)
+        return WD_INVALID_PARAMETER;
+
+    for (i = 0; i < pStripe->dwStripes; i++)
+    {
+        DWORD dwCloseStatus = XDMA_DmaClose(pStripe->pStripesArr[i]);
+
+        if (dwCloseStatus != WD_STATUS_SUCCESS)
+            dwStatus = dwCloseStatus;
+    }
+
+    if (pStripe->pBuf)
+        __hvfree(pStripe->pBuf, pStripe->dwBytes, pStripe->dwBufPageSize);
+    if (pStripe->hMutex)
+        OsMutexClose(pStripe->hMutex);
+    free(pStripe);
+
+    return dwStatus;
+}
+
+/* Start a striped DMA transfer on all of its engines */
+DWORD XDMA_DmaStripeTransferStart(XDMA_DMA_STRIPE_HANDLE hStripe)
+{
+    XDMA_DMA_STRIPE *pStripe = (XDMA_DMA_STRIPE *)hStripe;
+    DWORD i, dwStatus;
+
+    if (!pStripe)
+        return WD_INVALID_PARAMETER;
+
+    OsMutexLock(pStripe->hMutex);
+    pStripe->dwPending = pStripe->dwStripes;
+    pStripe->u32DmaStatus = 0;
+    OsMutexUnlock(pStripe->hMutex);
+
+    for (i = 0; i < pStripe->dwStripes; i++)
+    {
+        dwStatus = XDMA_DmaTransferStart(pStripe->pStripesArr[i]);
+        if (dwStatus != WD_STATUS_SUCCESS)
+        {
+            ErrLog("XDMA_DmaStripeTransferStart: Failed starting stripe %d. "
+                "Error 0x%x - %s\n", i, dwStatus, Stat2Str(dwStatus));
+            XDMA_DmaStripeTransferStop(hStripe);
+            return dwStatus;
+        }
+    }
+
+    return WD_STATUS_SUCCESS;
+}
+
+/* Stop a striped DMA transfer on all of its engines */
+DWORD XDMA_DmaStripeTransferStop(XDMA_DMA_STRIPE_HANDLE hStripe)
+{
+    XDMA_DMA_STRIPE *pStripe = (XDMA_DMA_STRIPE *)hStripe;
+    DWORD i, dwStatus = WD_STATUS_SUCCESS;
+
+    if (!pStripe)
+        return WD_INVALID_PARAMETER;
+
+    for (i = 0; i < pStripe->dwStripes; i++)
+    {
+        DWORD dwStopStatus = XDMA_DmaTransferStop(pStripe->pStripesArr[i]);
+
+        if (dwStopStatus != WD_STATUS_SUCCESS)
+            dwStatus = dwStopStatus;
+    }
+
+    return dwStatus;
+}
+
+/* Poll for striped DMA transfer completion: Returns once all the stripes are
+ * completed */
+DWORD XDMA_DmaStripePollCompletion(XDMA_DMA_STRIPE_HANDLE hStripe)
+{
+    XDMA_DMA_STRIPE *pStripe = (XDMA_DMA_STRIPE *)hStripe;
+    DWORD i, dwStatus = WD_STATUS_SUCCESS;
+
+    if (!pStripe)
+        return WD_INVALID_PARAMETER;
+
+    for (i = 0; i < pStripe->dwStripes; i++)
+    {
+        DWORD dwPollStatus = XDMA_DmaPollCompletion(pStripe->pStripesArr[i]);
+
+        if (dwPollStatus != WD_STATUS_SUCCESS)
+            dwStatus = dwPollStatus;
+    }
+
+    OsMutexLock(pStripe->hMutex);
+    pStripe->dwPending = 0;
+    OsMutexUnlock(pStripe->hMutex);
+
+    return dwStatus;
+}
+
+/* Returns pointer to the striped handle's virtual buffer and buffer size in
+ * bytes */
+PVOID XDMA_DmaStripeBufferGet(XDMA_DMA_STRIPE_HANDLE hStripe, DWORD *pBytes)
+{
+    XDMA_DMA_STRIPE *pStripe = (XDMA_DMA_STRIPE *)hStripe;
+
+    if (!pStripe || !pBytes)
+        return NULL;
+
+    *pBytes = pStripe->dwBytes;
+    return pStripe->pBuf;
+}
+
+/* Returns the number of stripes (engines) of a striped DMA handle */
+DWORD XDMA_DmaStripeCountGet(XDMA_DMA_STRIPE_HANDLE hStripe)
+{
+    if (!hStripe)
+        return 0;
+
+    return ((XDMA_DMA_STRIPE *)hStripe)->dwStripes;
+}
+
+/* -----------------------------------------------
+    Batched DMA transfers
+   ----------------------------------------------- */
+/* Returns the index of the SG page that holds byte dwOffset of the DMA
+ * buffer. pdwPageOffsets[i] is the buffer offset of page i */
+static DWORD DmaPageFind(XDMA_DMA_STRUCT *pXdmaDma, DWORD dwOffset)
+{
+    DWORD dwLow = 0, dwHigh = pXdmaDma->pDma->dwPages - 1;
+
+    while (dwLow < dwHigh)
+    {
+        DWORD dwMid = (dwLow + dwHigh + 1) / 2;
+
+        if (pXdmaDma->pdwPageOffsets[dwMid] <= dwOffset)
+            dwLow = dwMid;
+        else
+            dwHigh = dwMid - 1;
+    }
+
+    return dwLow;
+}
+
+/* Build the descriptors chain of a batch into desc. If desc is NULL, only
+ * count the descriptors. Returns the number of descriptors */
+static DWORD DmaBatchBuild(XDMA_DMA_STRUCT *pXdmaDma,
+    const XDMA_DMA_BATCH_ENTRY *pEntries, DWORD dwEntries,
+    XDMA_DMA_DESC *desc)
+{
+    DWORD dwMaxBytes = DmaDescMaxBytes(pXdmaDma);
+    DWORD i, dwDescs = 0;
+
+    for (i = 0; i < dwEntries; i++)
+    {
+        DWORD dwOffset = pEntries[i].dwBufOffset;
+        DWORD dwLeft = pEntries[i].dwBytes;
+        UINT64 u64FPGAOffset = pEntries[i].u64FPGAOffset;
+        DWORD dwPage = DmaPageFind(pXdmaDma, dwOffset);
+
+        while (dwLeft)
+        {
+            WD_DMA_PAGE *pPage = &pXdmaDma->pDma->Page[dwPage];
+            DWORD dwInPage = dwOffset - pXdmaDma->pdwPageOffsets[dwPage];
+            DWORD dwBytes = pPage->dwBytes - dwInPage;
+
+            if (dwBytes > dwLeft)
+                dwBytes = dwLeft;
+            if (dwBytes > dwMaxBytes)
+                dwBytes = dwMaxBytes;
+
+            if (desc)
+            {
+                DMA_ADDR addr = pPage->pPhysicalAddr + dwInPage;
+
+                desc[dwDescs].u32Control = XDMA_DESC_MAGIC;
+                desc[dwDescs].u32Bytes = dwBytes;
+                desc[dwDescs].u64SrcAddr = pXdmaDma->fToDevice ?
+                    (UINT64)addr : u64FPGAOffset;
+                desc[dwDescs].u64DstAddr = pXdmaDma->fToDevice ?
+                    u64FPGAOffset : (UINT64)addr;
+            }
+
+            if (!pXdmaDma->fNonIncMode)
+                u64FPGAOffset += dwBytes;
+            dwOffset += dwBytes;
+            dwLeft -= dwBytes;
+            dwDescs++;
+
+            if (dwOffset - pXdmaDma->pdwPageOffsets[dwPage] == pPage->dwBytes)
+                dwPage++;
+        }
+
+        /* Every entry is a separate packet of a streaming engine */
+        if (desc)
+            desc[dwDescs - 1].u32Control |= XDMA_DESC_EOP;
+    }
+
+    return dwDescs;
+}
+
+/* Replace the descriptors buffer by a buffer of at least dwDescs
+ * descriptors */
+static DWORD DmaDescBufferGrow(XDMA_DMA_STRUCT *pXdmaDma, DWORD dwDescs)
+{
+    WD_DMA *pDmaDesc = pXdmaDma->pDmaDesc;
+    PVOID pDescBuf = pXdmaDma->pDescBuf;
+    DMA_ADDR pDescPhysAddr = pXdmaDma->pDescPhysAddr;
+    DWORD dwDescPoolBlocks = pXdmaDma->dwDescPoolBlocks;
+    DWORD dwStatus;
+
+    dwStatus = DmaDescBufAlloc(pXdmaDma, dwDescs * sizeof(XDMA_DMA_DESC));
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        pXdmaDma->pDmaDesc = pDmaDesc;
+        pXdmaDma->pDescBuf = pDescBuf;
+        pXdmaDma->pDescPhysAddr = pDescPhysAddr;
+        pXdmaDma->dwDescPoolBlocks = dwDescPoolBlocks;
+        return dwStatus;
+    }
+
+    DmaDescBufFree(pXdmaDma->hDev, pDmaDesc, pDescBuf, dwDescPoolBlocks);
+    pXdmaDma->dwDescsAlloc = dwDescs;
+
+    return WD_STATUS_SUCCESS;
+}
+
+/* Link the batch entries into a single descriptors chain and start it with a
+ * single control register write */
+DWORD XDMA_DmaBatchStart(XDMA_DMA_HANDLE hDma,
+    const XDMA_DMA_BATCH_ENTRY *pEntries, DWORD dwEntries)
+{
+    XDMA_DMA_STRUCT *pXdmaDma = (XDMA_DMA_STRUCT *)hDma;
+    KP_XDMA_REG_BATCH batch;
+    XDMA_MMIO_STATS count;
+    XDMA_DMA_DESC *desc;
+    DMA_ADDR desc_phys;
+    UINT32 u32Adjacent;
+    DWORD i, dwDescs, dwStatus;
+    BOOL fDescAddrSet = FALSE;
+
+    if (!pXdmaDma || !pEntries || !dwEntries)
+        return WD_INVALID_PARAMETER;
+
+    if (pXdmaDma->fRing || pXdmaDma->fQueued || pXdmaDma->fIsTransaction ||
+        !pXdmaDma->pDmaDesc)
+    {
+        ErrLog("XDMA_DmaBatchStart: Batches are not supported by this DMA "
+            "handle\n");
+        return WD_INVALID_PARAMETER;
+    }
+
+    for (i = 0; i < dwEntries; i++)
+    {
+        if (!pEntries[i].dwBytes ||
+            pEntries[i].dwBufOffset > pXdmaDma->dwBytes ||
+            pEntries[i].dwBytes > pXdmaDma->dwBytes - pEntries[i].dwBufOffset)
+        {
+            ErrLog("XDMA_DmaBatchStart: Entry %d is out of the DMA buffer\n",
+                i);
+            return WD_INVALID_PARAMETER;
+        }
+    }
+
+    /* Buffer offsets of the SG pages, for locating the entries */
+    if (!pXdmaDma->pdwPageOffsets)
+    {
+        DWORD dwOffset = 0;
+
+        pXdmaDma->pdwPageOffsets = (DWORD *)malloc(pXdmaDma->pDma->dwPages *
+            sizeof(DWORD));
+        if (!pXdmaDma->pdwPageOffsets)
+        {
+            ErrLog("Failed allocating memory for DMA pages offsets\n");
+            return WD_INSUFFICIENT_RESOURCES;
+        }
+
+        for (i = 0; i < pXdmaDma->pDma->dwPages; i++)
+        {
+            pXdmaDma->pdwPageOffsets[i] = dwOffset;
+            dwOffset += pXdmaDma->pDma->Page[i].dwBytes;
+        }
+    }
+
+    dwDescs = DmaBatchBuild(pXdmaDma, pEntries, dwEntries, NULL);
+    if (dwDescs > pXdmaDma->dwDescsAlloc)
+    {
+        dwStatus = DmaDescBufferGrow(pXdmaDma, dwDescs);
+        if (dwStatus != WD_STATUS_SUCCESS)
+            return dwStatus;
+        fDescAddrSet = TRUE;
+    }
+
+    desc = (XDMA_DMA_DESC *)pXdmaDma->pDescBuf;
+    desc_phys = pXdmaDma->pDescPhysAddr;
+
+    DmaBatchBuild(pXdmaDma, pEntries, dwEntries, desc);
+    desc[dwDescs - 1].u32Control |= XDMA_DESC_STOPPED | XDMA_DESC_COMPLETED;
+    u32Adjacent = XDMA_DescChainLink(desc, desc_phys, dwDescs, FALSE);
+    WDC_DMASyncCpu(pXdmaDma->pDmaDesc);
+
+    if (pXdmaDma->fHybrid)
+        DmaHybridModeUpdate(pXdmaDma);
+
+    if (pXdmaDma->fPolling)
+        ((XDMA_DMA_POLL_WB *)pXdmaDma->pWBBuf)->u32CompletedDescs = 0;
+
+    if (pXdmaDma->fToDevice)
+        WDC_DMASyncCpu(pXdmaDma->pDma);
+
+    /* The descriptors address registers keep their value: Rewrite them only
+     * if the chain moved or its first fetch changed */
+    RegBatchInit(pXdmaDma->hDev, &batch);
+    if (fDescAddrSet || u32Adjacent != pXdmaDma->u32DescAdjacent)
+        DmaDescAddrOpsAdd(&batch, pXdmaDma, u32Adjacent);
+    pXdmaDma->u32DescAdjacent = u32Adjacent;
+    pXdmaDma->dwDescs = dwDescs;
+    pXdmaDma->fBatchChain = TRUE;
+
+#ifdef HAS_INTS
+    /* The engine interrupts mask keeps its value between batches */
+    if (!pXdmaDma->fPolling && !pXdmaDma->fDmaIntsEnabled)
+    {
+        DmaIntsEnableOpsAdd(&batch, pXdmaDma->dwChannel,
+            pXdmaDma->fStreaming, pXdmaDma->fToDevice);
+        pXdmaDma->fDmaIntsEnabled = TRUE;
+        DmaEngineGet(pXdmaDma)->fIntMaskSet = TRUE;
+    }
+#endif /* ifdef HAS_INTS */
+
+    TraceLog("XDMA_DmaBatchStart: %d entries, %d descriptors\n", dwEntries,
+        dwDescs);
+
+    RegBatchAdd(&batch, KP_XDMA_REG_WRITE,
+        XDMA_CHANNEL_OFFSET(pXdmaDma->dwChannel,
+        pXdmaDma->fToDevice ? XDMA_H2C_CHANNEL_CONTROL_OFFSET :
+        XDMA_C2H_CHANNEL_CONTROL_OFFSET),
+        DmaCtrlStartValGet(pXdmaDma));
+
+    BZERO(count);
+    RegBatchCount(&batch, &count);
+    dwStatus = RegBatchRun(pXdmaDma->hDev, &batch);
+    DmaMmioCount(pXdmaDma, count.u64Reads, count.u64Writes);
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        /* The registers state is unknown: Rewrite all of them next time */
+        pXdmaDma->u32DescAdjacent = (UINT32)-1;
+        pXdmaDma->fDmaIntsEnabled = FALSE;
+        DmaEngineGet(pXdmaDma)->fIntMaskSet = FALSE;
+        ErrLog("Failed starting DMA batch\n");
+    }
+
+    return dwStatus;
+}
+
+/* -----------------------------------------------
+    DMA submission queue
+   ----------------------------------------------- */
+/* Returns the queue engine's control register value, without the run bit */
+static UINT32 DmaQueueCtrlValGet(XDMA_DMA_QUEUE *pQueue)
+{
+    UINT32 val = XDMA_CTRL_IE_READ_ERROR |
+        XDMA_CTRL_IE_DESC_ERROR |
+        XDMA_CTRL_IE_DESC_ALIGN_MISMATCH |
+        XDMA_CTRL_IE_MAGIC_STOPPED;
+
+    if (!pQueue->fPolling)
+        val |= XDMA_CTRL_IE_DESC_STOPPED | XDMA_CTRL_IE_DESC_COMPLETED;
+
+    return val;
+}
+
+/* Stop the queue's engine and restart it at the first descriptor of pEntry.
+ * The engine resets its completed descriptors count when started */
+static DWORD DmaQueueEngineStart(XDMA_DMA_QUEUE *pQueue,
+    XDMA_DMA_STRUCT *pEntry)
+{
+    XDMA_DMA_STRUCT *pEngine = pQueue->pEngine;
+    KP_XDMA_REG_BATCH batch;
+    DWORD dwCtrlOffset = XDMA_CHANNEL_OFFSET(pEngine->dwChannel,
+        pEngine->fToDevice ? XDMA_H2C_CHANNEL_CONTROL_OFFSET :
+        XDMA_C2H_CHANNEL_CONTROL_OFFSET);
+    UINT32 val = DmaQueueCtrlValGet(pQueue);
+    DWORD dwStatus, dwStatusOp;
+
+    /* Stop, clear the status, point at the entry and run, in a single
+     * register batch */
+    RegBatchInit(pEngine->hDev, &batch);
+    RegBatchAdd(&batch, KP_XDMA_REG_WRITE, dwCtrlOffset, val);
+    dwStatusOp = RegBatchAdd(&batch, KP_XDMA_REG_READ,
+        XDMA_CHANNEL_OFFSET(pEngine->dwChannel, pEngine->fToDevice ?
+        XDMA_H2C_CHANNEL_STATUS_RC_OFFSET :
+        XDMA_C2H_CHANNEL_STATUS_RC_OFFSET), 0);
+    DmaDescAddrOpsAdd(&batch, pEntry, pEntry->u32DescAdjacent);
+    RegBatchAdd(&batch, KP_XDMA_REG_WRITE, dwCtrlOffset,
+        val | XDMA_CTRL_RUN_STOP);
+    pQueue->u32DescsDone = 0;
+    pQueue->u32PendingStatus = 0;
+
+    dwStatus = RegBatchRun(pEngine->hDev, &batch);
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        ErrLog("DmaQueueEngineStart: Failed starting DMA engine. "
+            "Error 0x%x - %s\n", dwStatus, Stat2Str(dwStatus));
+        return dwStatus;
+    }
+    pQueue->u32DmaStatus = batch.ops[dwStatusOp].u32Val;
+
+    return dwStatus;
+}
+
+/* Post the descriptors chain of pEntry to the Kernel PlugIn
+ * (XDMA_QUEUE_OPT_KP_CHAIN). pEntry NULL - stop the engine and drop the
+ * posted chains */
+static DWORD DmaQueueChainPost(XDMA_DMA_QUEUE *pQueue,
+    XDMA_DMA_STRUCT *pEntry)
+{
+    XDMA_DMA_STRUCT *pEngine = pQueue->pEngine;
+    KP_XDMA_CHAIN_POST post;
+    DWORD dwStatus, dwResult;
+
+    BZERO(post);
+    post.dwEngine = ENGINE_IDX(pEngine->dwChannel, pEngine->fToDevice);
+    if (pEntry)
+    {
+        post.u64DescAddr = (UINT64)pEntry->pDescPhysAddr;
+        post.u32Adjacent = pEntry->u32DescAdjacent;
+        post.u32Control = DmaQueueCtrlValGet(pQueue) | XDMA_CTRL_RUN_STOP;
+    }
+
+    dwStatus = WDC_CallKerPlug(pEngine->hDev, KP_XDMA_MSG_CHAIN_POST, &post,
+        &dwResult);
+    if (dwStatus == WD_STATUS_SUCCESS && dwResult != KP_XDMA_STATUS_OK)
+        dwStatus = WD_OPERATION_FAILED;
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        ErrLog("DmaQueueChainPost: Failed posting to the Kernel PlugIn. "
+            "Error 0x%x - %s\n", dwStatus, Stat2Str(dwStatus));
+    }
+
+    return dwStatus;
+}
+
+/* Returns TRUE if the queue tail, about to be followed by another
+ * transfer, should keep its completion interrupt: Every dwCoalesce-th
+ * transfer does, and so does the first one chained u64CoalesceDelayNs after
+ * the last interrupting transfer. The queue tail always interrupts, so
+ * every transfer is eventually reported. Called with the queue mutex held */
+static BOOL DmaQueueTailCompletedKeep(XDMA_DMA_QUEUE *pQueue)
+{
+    UINT64 u64Now;
+
+    if (pQueue->dwCoalesce <= 1)
+        return TRUE;
+
+    u64Now = XDMA_TimestampNsGet();
+    if (++pQueue->dwUnflagged < pQueue->dwCoalesce &&
+        (!pQueue->u64CoalesceDelayNs ||
+        u64Now - pQueue->u64FlagNs < pQueue->u64CoalesceDelayNs))
+    {
+        return FALSE;
+    }
+
+    pQueue->dwUnflagged = 0;
+    pQueue->u64FlagNs = u64Now;
+
+    return TRUE;
+}
+
+/* Link pEntry after the last descriptor of pTail, so that the engine
+ * continues to pEntry instead of stopping. Unless fCompleted is set, the
+ * completion interrupt of pTail is coalesced into that of a later
+ * transfer */
+static void DmaQueueChain(XDMA_DMA_STRUCT *pTail, XDMA_DMA_STRUCT *pEntry,
+    BOOL fCompleted)
+{
+    XDMA_DMA_DESC *last = (XDMA_DMA_DESC *)pTail->pDescBuf +
+        (pTail->dwDescs - 1);
+
+    last->u64NextDesc = (UINT64)pEntry->pDescPhysAddr;
+    last->u32Control = (last->u32Control & ~(XDMA_DESC_STOPPED |
+        XDMA_DESC_ADJACENT_MASK)) |
+        (pEntry->u32DescAdjacent << XDMA_DESC_ADJACENT_SHIFT);
+    if (!fCompleted)
+        last->u32Control &= ~XDMA_DESC_COMPLETED;
+    WDC_DMASyncCpu(pTail->pDmaDesc);
+}
+
+/* Restore the last descriptor of a completed entry, so that it may be
+ * submitted again */
+static void DmaQueueUnchain(XDMA_DMA_STRUCT *pEntry)
+{
+    XDMA_DMA_DESC *last = (XDMA_DMA_DESC *)pEntry->pDescBuf +
+        (pEntry->dwDescs - 1);
+
+    last->u64NextDesc = 0;
+    last->u32Control = (last->u32Control & ~XDMA_DESC_ADJACENT_MASK) |
+        XDMA_DESC_STOPPED | XDMA_DESC_COMPLETED;
+    WDC_DMASyncCpu(pEntry->pDmaDesc);
+}
+
+/* Remove the oldest request from the queue and fill its completion
+ * information. Called with the queue mutex held */
+static void DmaQueuePop(XDMA_DMA_QUEUE *pQueue,
+    XDMA_DMA_COMPLETION *pCompletion, DWORD dwStatus)
+{
+    XDMA_DMA_QUEUE_SLOT *pSlot = &pQueue->pSlots[pQueue->dwHead];
+    XDMA_DMA_STRUCT *pEntry = pSlot->pEntry;
+
+    pQueue->dwHead = (pQueue->dwHead + 1) % pQueue->dwDepth;
+    pQueue->dwCount--;
+
+    DmaQueueUnchain(pEntry);
+    pEntry->fInQueue = FALSE;
+    if (!pEntry->fToDevice && dwStatus == WD_STATUS_SUCCESS)
+        WDC_DMASyncIo(pEntry->pDma);
+
+    BZERO(*pCompletion);
+    pCompletion->u64Token = pSlot->u64Token;
+    pCompletion->hDma = (XDMA_DMA_HANDLE)pEntry;
+    pCompletion->pCtx = pSlot->pCtx;
+    pCompletion->dwStatus = dwStatus;
+    if (dwStatus != WD_STATUS_SUCCESS)
+        pCompletion->u32DmaStatus = pQueue->u32DmaStatus;
+}
+
+/* Reap the oldest request of a XDMA_QUEUE_OPT_KP_CHAIN queue, by the
+ * Kernel PlugIn completion record of its engine. Called with the queue
+ * mutex held */
+static DWORD DmaQueueChainReap(XDMA_DMA_QUEUE *pQueue,
+    XDMA_DMA_COMPLETION *pCompletion)
+{
+    XDMA_DMA_STRUCT *pEngine = pQueue->pEngine;
+    PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(pEngine->hDev);
+    KP_XDMA_ENGINE_RECORD *pRec;
+    UINT32 u32Status;
+
+    if (!pDevCtx->pKpShared)
+    {
+        ErrLog("DmaQueueChainReap: Kernel PlugIn completion handling is not "
+            "enabled\n");
+        return WD_OPERATION_FAILED;
+    }
+
+    pRec = &pDevCtx->pKpShared->engines[ENGINE_IDX(pEngine->dwChannel,
+        pEngine->fToDevice)];
+    if (!pQueue->dwCount || pRec->u32ChainsDone == pQueue->u32ChainsReaped)
+        return WD_TRY_AGAIN;
+
+    u32Status = pRec->u32ChainStatus[pQueue->u32ChainsReaped %
+        KP_XDMA_CHAINS_MAX];
+    pQueue->u32ChainsReaped++;
+
+    /* The Kernel PlugIn has already started the next chain, failed or
+     * not */
+    if (u32Status & XDMA_STAT_ERR_MASK)
+    {
+        ErrLog("DmaQueueChainReap: DMA transfer failed, DMA status 0x%08x\n",
+            u32Status);
+        pQueue->u32DmaStatus = u32Status;
+        DmaQueuePop(pQueue, pCompletion, WD_OPERATION_FAILED);
+    }
+    else
+    {
+        DmaQueuePop(pQueue, pCompletion, WD_STATUS_SUCCESS);
+    }
+
+    return WD_STATUS_SUCCESS;
+}
+
+/* Reap the oldest request of the queue. Called with the queue mutex held */
+static DWORD DmaQueueReap(XDMA_DMA_QUEUE *pQueue,
+    XDMA_DMA_COMPLETION *pCompletion)
+{
+    XDMA_DMA_STRUCT *pEngine = pQueue->pEngine;
+    XDMA_DMA_STRUCT *pEntry;
+    PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(pEngine->hDev);
+    UINT32 u32Status, u32Completed;
+    DWORD dwStatus;
+
+    if (pQueue->fKpChain)
+        return DmaQueueChainReap(pQueue, pCompletion);
+
+    if (!pQueue->dwCount)
+        return WD_TRY_AGAIN;
+
+    pEntry = pQueue->pSlots[pQueue->dwHead].pEntry;
+
+    /* Read the status before the count: An idle engine whose count does not
+     * cover the head entry has stopped at a chain end */
+    dwStatus = XDMA_EngineStatusRead(pEngine, FALSE, &u32Status);
+    if (dwStatus == WD_STATUS_SUCCESS)
+    {
+        dwStatus = WDC_ReadAddr32(pEngine->hDev, pDevCtx->dwConfigBarNum,
+            XDMA_CHANNEL_OFFSET(pEngine->dwChannel, pEngine->fToDevice ?
+            XDMA_H2C_CHANNEL_COMPLETED_DESC_COUNT_OFFSET :
+            XDMA_C2H_CHANNEL_COMPLETED_DESC_COUNT_OFFSET), &u32Completed);
+    }
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        ErrLog("DmaQueueReap: Failed reading engine registers. "
+            "Error 0x%x - %s\n", dwStatus, Stat2Str(dwStatus));
+        return dwStatus;
+    }
+
+    /* The interrupt handler's read has cleared the error bits of the
+     * status */
+    u32Status |= pQueue->u32PendingStatus;
+    if (u32Status & XDMA_STAT_ERR_MASK)
+    {
+        ErrLog("DmaQueueReap: DMA transfer failed, DMA status 0x%08x\n",
+            u32Status);
+
+        /* Fail the head request and go on with the next one */
+        pQueue->u32PendingStatus = 0;
+        pQueue->u32DmaStatus = u32Status;
+        DmaQueuePop(pQueue, pCompletion, WD_OPERATION_FAILED);
+        if (pQueue->dwCount)
+        {
+            DmaQueueEngineStart(pQueue, pQueue->pSlots[pQueue->dwHead].pEntry);
+        }
+        else
+        {
+            EngineCtrlRegisterSet(pEngine->hDev, pEngine->dwChannel,
+                pEngine->fToDevice, 0);
+        }
+
+        return WD_STATUS_SUCCESS;
+    }
+
+    if (u32Completed - pQueue->u32DescsDone < pEntry->dwDescs)
+    {
+        if (!(u32Status & XDMA_STAT_BUSY))
+        {
+            TraceLog("DmaQueueReap: Engine stopped before [%p], "
+                "restarting\n", pEntry);
+            DmaQueueEngineStart(pQueue, pEntry);
+        }
+
+        return WD_TRY_AGAIN;
+    }
+
+    pQueue->u32DescsDone += pEntry->dwDescs;
+    DmaQueuePop(pQueue, pCompletion, WD_STATUS_SUCCESS);
+
+    return WD_STATUS_SUCCESS;
+}
+
+/* Reap the completed requests and call the completion callback for each of
+ * them */
+static DWORD DmaQueueProcess(XDMA_DMA_QUEUE *pQueue)
+{
+    XDMA_DMA_COMPLETION completion;
+    DWORD dwStatus, dwCompleted = 0;
+
+    for (;;)
+    {
+        OsMutexLock(pQueue->hMutex);
+        dwStatus = DmaQueueReap(pQueue, &completion);
+        OsMutexUnlock(pQueue->hMutex);
+
+        if (dwStatus != WD_STATUS_SUCCESS)
+            break;
+
+        /* The callback may submit new requests */
+        pQueue->funcCompletion(&completion);
+        dwCompleted++;
+    }
+
+    return dwCompleted;
+}
+
+#ifdef HAS_INTS
+/* Completion interrupt of a queue's engine */
+static void DmaQueueIntHandler(XDMA_DMA_QUEUE *pQueue)
+{
+    XDMA_DMA_STRUCT *pEngine = pQueue->pEngine;
+    UINT32 u32Status;
+
+    /* The Kernel PlugIn has already handled the engine and started its next
+     * chain */
+    if (pQueue->fKpChain)
+    {
+        if (pQueue->funcCompletion)
+            DmaQueueProcess(pQueue);
+        return;
+    }
+
+    /* Clear the engine's interrupt sources, keeping its errors for
+     * DmaQueueReap(). Under the queue mutex, so that the errors are not of
+     * a run that a concurrent DmaQueueReap() has already failed */
+    OsMutexLock(pQueue->hMutex);
+    if (XDMA_EngineStatusRead(pEngine, TRUE, &u32Status) == WD_STATUS_SUCCESS)
+        pQueue->u32PendingStatus |= u32Status & XDMA_STAT_ERR_MASK;
+    OsMutexUnlock(pQueue->hMutex);
+
+    if (pQueue->funcCompletion)
+        DmaQueueProcess(pQueue);
+
+    /* Interrupts of the engine were disabled by XDMA_IntHandler() */
+    XDMA_ChannelInterruptsEnable(pEngine->hDev, pEngine->u32IrqBitMask);
+}
+
+/* Coalescing timer of an interrupt driven queue: Delivers the completions
+ * that coalescing holds back, every u64CoalesceDelayNs */
+static void DmaQueueCoalesceThread(void *pData)
+{
+    XDMA_DMA_QUEUE *pQueue = (XDMA_DMA_QUEUE *)pData;
+    XDMA_DMA_STRUCT *pEngine = pQueue->pEngine;
+
+    while (!pQueue->fCoalesceStop)
+    {
+        SleepWrapper((DWORD)(pQueue->u64CoalesceDelayNs / 1000));
+        if (!pQueue->dwCount)
+            continue;
+
+        /* Serialized with the interrupt dispatch, so that the completions
+         * are reported in order */
+        OsMutexLock(pEngine->hQueueMutex);
+        DmaQueueProcess(pQueue);
+        OsMutexUnlock(pEngine->hQueueMutex);
+    }
+}
+
+static void DmaQueueCoalesceTimerStop(XDMA_DMA_QUEUE *pQueue)
+{
+    if (!pQueue->hCoalesceThread)
+        return;
+
+    pQueue->fCoalesceStop = TRUE;
+    ThreadWait(pQueue->hCoalesceThread);
+    pQueue->hCoalesceThread = NULL;
+}
+#endif /* ifdef HAS_INTS */
+
+/* Open a submission queue of up to dwDepth in-flight transfers on a DMA
+ * engine */
+DWORD XDMA_DmaQueueOpen(WDC_DEVICE_HANDLE hDev, XDMA_DMA_QUEUE_HANDLE *phQueue,
+    DWORD dwChannel, BOOL fToDevice, DWORD dwDepth, BOOL fPolling,
+    XDMA_DMA_COMPLETION_HANDLER funcCompletion)
+{
+    return XDMA_DmaQueueOpenEx(hDev, phQueue, dwChannel, fToDevice, dwDepth,
+        fPolling, funcCompletion, 0);
+}
+
+/* Open a submission queue with XDMA_QUEUE_OPT_XXX options */
+DWORD XDMA_DmaQueueOpenEx(WDC_DEVICE_HANDLE hDev,
+    XDMA_DMA_QUEUE_HANDLE *phQueue, DWORD dwChannel, BOOL fToDevice,
+    DWORD dwDepth, BOOL fPolling, XDMA_DMA_COMPLETION_HANDLER funcCompletion,
+    DWORD dwOptions)
+{
+    PXDMA_DEV_CTX pDevCtx;
+    XDMA_DMA_STRUCT *pEngine;
+    XDMA_DMA_QUEUE *pQueue;
+    BOOL fKpChain = (dwOptions & XDMA_QUEUE_OPT_KP_CHAIN) ? TRUE : FALSE;
+    DWORD dwStatus;
+
+    TraceLog("XDMA_DmaQueueOpen: Entered. Device handle [0x%p], dwChannel "
+        "[%d], fToDevice [%d], dwDepth [%d], fPolling [%d], dwOptions "
+        "[0x%x]\n", hDev, dwChannel, fToDevice, dwDepth, fPolling, dwOptions);
+
+    if (!phQueue || !dwDepth)
+        return WD_INVALID_PARAMETER;
+
+#ifndef HAS_INTS
+    if (!fPolling)
+    {
+        ErrLog("XDMA_DmaQueueOpen: Interrupts are not supported\n");
+        return WD_INVALID_PARAMETER;
+    }
+#endif /* ifndef HAS_INTS */
+
+    dwStatus = ValidateTransferParams(hDev, fToDevice, dwChannel);
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        ErrLog("Failed validating transfer params. Error 0x%x - %s\n",
+            dwStatus, Stat2Str(dwStatus));
+        return dwStatus;
+    }
+
+    pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(hDev);
+    pEngine = &pDevCtx->pEnginesArr[ENGINE_IDX(dwChannel, fToDevice)];
+    if (!pEngine->fIsEnabled)
+    {
+        ErrLog("DMA engine channel [%d] for [%s] is disabled\n", dwChannel,
+            fToDevice ? "writing" : "reading");
+        return WD_INVALID_PARAMETER;
+    }
+
+    if (pEngine->fIsInitialized)
+    {
+        ErrLog("DMA engine channel [%d] for [%s] is already in use\n",
+            dwChannel, fToDevice ? "writing" : "reading");
+        return WD_OPERATION_ALREADY_DONE;
+    }
+
+    if (!pEngine->hQueueMutex)
+    {
+        ErrLog("XDMA_DmaQueueOpen: Engine mutex was not created\n");
+        return WD_INSUFFICIENT_RESOURCES;
+    }
+
+    if (fKpChain && (fPolling || !pDevCtx->pKpShared ||
+        dwDepth > KP_XDMA_CHAINS_MAX))
+    {
+        ErrLog("XDMA_DmaQueueOpen: Kernel PlugIn chaining requires an "
+            "interrupt driven queue of up to %d transfers, with Kernel PlugIn "
+            "completion handling enabled\n", KP_XDMA_CHAINS_MAX);
+        return WD_INVALID_PARAMETER;
+    }
 
-    if (dwStatus != WD_STATUS_SUCCESS)
+    pQueue = (XDMA_DMA_QUEUE *)calloc(1, sizeof(XDMA_DMA_QUEUE));
+    if (!pQueue)
     {
-        ErrLog("Failed %s non-incrementing address mode\n",
-            fNonIncMode ? "setting" : "clearing");
+        ErrLog("Failed allocating memory for DMA queue\n");
+        return WD_INSUFFICIENT_RESOURCES;
+    }
+
+    pQueue->pSlots = (XDMA_DMA_QUEUE_SLOT *)calloc(dwDepth,
+        sizeof(XDMA_DMA_QUEUE_SLOT));
+    if (!pQueue->pSlots)
+    {
+        ErrLog("Failed allocating memory for DMA queue entries\n");
+        dwStatus = WD_INSUFFICIENT_RESOURCES;
         goto Error;
     }
 
-    dwStatus = CheckAlignment(pXdmaDma);
+    dwStatus = OsMutexCreate(&pQueue->hMutex);
     if (dwStatus != WD_STATUS_SUCCESS)
     {
-        ErrLog("Alignment validation failed\n");
+        ErrLog("Failed creating DMA queue mutex. Error 0x%x - %s\n",
+            dwStatus, Stat2Str(dwStatus));
         goto Error;
     }
 
-    if (fPolling)
+    /* The queue owns the engine */
+    pEngine->hDev = hDev;
+    pEngine->dwChannel = dwChannel;
+    pEngine->fToDevice = fToDevice;
+    pEngine->fStreaming = EngineIsStreaming(hDev, dwChannel, fToDevice);
+
+#ifdef HAS_INTS
+    if (!fPolling)
     {
-        dwStatus = ConfigureWriteBackAddress(pXdmaDma);
+        dwStatus = EnableDmaInterrupts(hDev, dwChannel, pEngine->fStreaming,
+            fToDevice);
         if (dwStatus != WD_STATUS_SUCCESS)
         {
-            ErrLog("Failed configuring WriteBack address. Error 0x%x - %s\n",
+            ErrLog("Failed enabling DMA interrupts. Error 0x%x - %s\n",
                 dwStatus, Stat2Str(dwStatus));
             goto Error;
         }
+        pEngine->fIntMaskSet = TRUE;
     }
+#endif /* ifdef HAS_INTS */
 
-    if (fIsTransaction)
-        dwStatus = DmaBuildDescBuffer(pXdmaDma, TRUE);
-    else
-        dwStatus = ConfigureDmaDesc(pXdmaDma);
+    pQueue->pEngine = pEngine;
+    pQueue->dwDepth = dwDepth;
+    pQueue->fPolling = fPolling;
+    pQueue->funcCompletion = funcCompletion;
+    pQueue->u64NextToken = 1;
+    pQueue->fKpChain = fKpChain;
 
-    if (dwStatus != WD_STATUS_SUCCESS)
+    if (fKpChain)
     {
-        ErrLog("Failed configuring DMA descriptors buffer. Error 0x%x - %s\n",
-            dwStatus, Stat2Str(dwStatus));
-        goto Error;
+        /* Drop chains left over by a previous queue */
+        dwStatus = DmaQueueChainPost(pQueue, NULL);
+        if (dwStatus != WD_STATUS_SUCCESS)
+            goto Error;
+
+        pQueue->u32ChainsReaped = pDevCtx->pKpShared->engines[
+            ENGINE_IDX(dwChannel, fToDevice)].u32ChainsDone;
     }
 
-    TraceLog("Opened DMA: handle %p, fPolling %d, fToDevice %d, dwChannel %d, "
-        "dwBytes %d, u64FPGAOffset %d, fStreaming %d, fNonIncMode %d\n",
-        pXdmaDma, pXdmaDma->fPolling, pXdmaDma->fToDevice, pXdmaDma->dwChannel,
-        pXdmaDma->dwBytes, pXdmaDma->u64FPGAOffset, pXdmaDma->fStreaming,
-        pXdmaDma->fNonIncMode);
+    OsMutexLock(pEngine->hQueueMutex);
+    pEngine->pQueue = pQueue;
+    OsMutexUnlock(pEngine->hQueueMutex);
+    pEngine->fIsInitialized = TRUE;
+    *phQueue = (XDMA_DMA_QUEUE_HANDLE)pQueue;
+
+    /* The queue's engine keeps running through its chained transfers */
+    if (pDevCtx->pKpShared && !fKpChain)
+    {
+        pDevCtx->pKpShared->engines[ENGINE_IDX(dwChannel, fToDevice)].u32Flags
+            = KP_XDMA_ENGINE_KEEP_RUNNING;
+    }
 
-    pXdmaDma->fIsInitialized = TRUE;
     return WD_STATUS_SUCCESS;
 
 Error:
-    if (pXdmaDma->pDmaDesc)
-        WDC_DMABufUnlock(pXdmaDma->pDmaDesc);
-    if (pXdmaDma->pDma)
-        WDC_DMABufUnlock(pXdmaDma->pDma);
-    if (pXdmaDma->pBuf)
-        __vfree(pXdmaDma->pBuf);
-
-    pXdmaDma->fIsInitialized = FALSE;
+    if (pQueue->hMutex)
+        OsMutexClose(pQueue->hMutex);
+    if (pQueue->pSlots)
+        free(pQueue->pSlots);
+    free(pQueue);
 
     return dwStatus;
 }
 
-DWORD XDMA_DmaTransactionExecute(XDMA_DMA_HANDLE hDma, BOOL fNewContext,
-    PVOID pData)
+/* Close a DMA submission queue. Transfers still in flight are aborted */
+DWORD XDMA_DmaQueueClose(XDMA_DMA_QUEUE_HANDLE hQueue)
 {
-    XDMA_DMA_STRUCT *pXdmaDma = (XDMA_DMA_STRUCT *)hDma;
-    DWORD dwStatus = WD_STATUS_SUCCESS;
-    WD_DMA *pDma = pXdmaDma->pDma;
+    XDMA_DMA_QUEUE *pQueue = (XDMA_DMA_QUEUE *)hQueue;
+    XDMA_DMA_STRUCT *pEngine;
+    PXDMA_DEV_CTX pDevCtx;
+    DWORD dwStatus;
 
-    TraceLog("\n%s: Executing DMA transaction for channel %d.\n", __FUNCTION__,
-        pXdmaDma->dwChannel);
+    if (!pQueue)
+        return WD_INVALID_PARAMETER;
 
-    if (fNewContext)
-        pXdmaDma->pData = pData;
+    pEngine = pQueue->pEngine;
 
-    dwStatus = WDC_DMATransactionExecute(pDma, DmaTransferBuild, hDma);
-    if (dwStatus != WD_STATUS_SUCCESS)
+#ifdef HAS_INTS
+    DmaQueueCoalesceTimerStop(pQueue);
+#endif /* ifdef HAS_INTS */
+
+    OsMutexLock(pQueue->hMutex);
+    if (pQueue->fKpChain)
     {
-        ErrLog("%s: Failed to execute DMA transaction for channel %d. Error "
-            "0x%x - %s\n", __FUNCTION__, pXdmaDma->dwChannel, dwStatus,
-            Stat2Str(dwStatus));
+        dwStatus = DmaQueueChainPost(pQueue, NULL);
     }
+    else
+    {
+        dwStatus = EngineCtrlRegisterSet(pEngine->hDev, pEngine->dwChannel,
+            pEngine->fToDevice, 0);
+    }
+    OsMutexUnlock(pQueue->hMutex);
 
-    return dwStatus;
-}
+    /* Wait for an interrupt dispatch that may already be handling the
+     * queue */
+    OsMutexLock(pEngine->hQueueMutex);
+    pEngine->pQueue = NULL;
+    OsMutexUnlock(pEngine->hQueueMutex);
 
-DWORD XDMA_DmaTransactionTransferEnded(XDMA_DMA_HANDLE hDma)
-{
-    XDMA_DMA_STRUCT *pxdmaDma = (XDMA_DMA_STRUCT *)hDma;
+    OsMutexLock(pQueue->hMutex);
+    pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(pEngine->hDev);
+    if (pDevCtx->pKpShared)
+    {
+        pDevCtx->pKpShared->engines[ENGINE_IDX(pEngine->dwChannel,
+            pEngine->fToDevice)].u32Flags = 0;
+    }
 
-    DWORD dwStatus = WDC_DMATransferCompletedAndCheck(pxdmaDma->pDma, TRUE);
-    if (dwStatus == WD_STATUS_SUCCESS)
-        TraceLog("DMA transaction completed");
-    else if (dwStatus != (DWORD)WD_MORE_PROCESSING_REQUIRED)
-        ErrLog("DMA transfer failed\n");
+    for (; pQueue->dwCount; pQueue->dwCount--)
+    {
+        XDMA_DMA_STRUCT *pEntry = pQueue->pSlots[pQueue->dwHead].pEntry;
+
+        DmaQueueUnchain(pEntry);
+        pEntry->fInQueue = FALSE;
+        pQueue->dwHead = (pQueue->dwHead + 1) % pQueue->dwDepth;
+    }
+    OsMutexUnlock(pQueue->hMutex);
+
+    pEngine->fIsInitialized = FALSE;
+    OsMutexClose(pQueue->hMutex);
+    free(pQueue->pSlots);
+    free(pQueue);
 
     return dwStatus;
 }
 
-DWORD XDMA_DmaTransactionRelease(XDMA_DMA_HANDLE hDma)
+/* Submit a transfer to the queue without waiting for it */
+DWORD XDMA_DmaQueueSubmit(XDMA_DMA_QUEUE_HANDLE hQueue, XDMA_DMA_HANDLE hDma,
+    PVOID pCtx, UINT64 *pu64Token)
 {
-    XDMA_DMA_STRUCT *pXdmaDma = (XDMA_DMA_STRUCT *)hDma;
+    XDMA_DMA_QUEUE *pQueue = (XDMA_DMA_QUEUE *)hQueue;
+    XDMA_DMA_STRUCT *pEntry = (XDMA_DMA_STRUCT *)hDma;
+    XDMA_DMA_STRUCT *pEngine;
+    XDMA_DMA_QUEUE_SLOT *pSlot;
     DWORD dwStatus = WD_STATUS_SUCCESS;
-    WD_DMA* pDma = pXdmaDma->pDma;
 
-    dwStatus = WDC_DMATransactionRelease(pDma);
-    if (dwStatus != WD_STATUS_SUCCESS)
+    if (!pQueue || !pEntry)
+        return WD_INVALID_PARAMETER;
+
+    pEngine = pQueue->pEngine;
+    if (!pEntry->fQueued || pEntry->dwChannel != pEngine->dwChannel ||
+        pEntry->fToDevice != pEngine->fToDevice)
     {
-        ErrLog("%s: Failed to release DMA transaction for channel %d. Error "
-            "0x%x - %s\n", __FUNCTION__, pXdmaDma->dwChannel, dwStatus,
-            Stat2Str(dwStatus));
+        ErrLog("XDMA_DmaQueueSubmit: DMA handle [%p] can not be submitted to "
+            "this queue\n", pEntry);
+        return WD_INVALID_PARAMETER;
+    }
+
+    OsMutexLock(pQueue->hMutex);
+
+    if (pEntry->fInQueue)
+    {
+        ErrLog("XDMA_DmaQueueSubmit: DMA handle [%p] is already queued\n",
+            pEntry);
+        dwStatus = WD_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    if (pQueue->dwCount == pQueue->dwDepth)
+    {
+        dwStatus = WD_TRY_AGAIN;
+        goto Exit;
+    }
+
+    if (pEntry->fToDevice)
+        WDC_DMASyncCpu(pEntry->pDma);
+
+    if (pQueue->fKpChain)
+    {
+        /* Each transfer keeps its own chain, started by the Kernel PlugIn
+         * when the previous one completes */
+        dwStatus = DmaQueueChainPost(pQueue, pEntry);
+        if (dwStatus != WD_STATUS_SUCCESS)
+            goto Exit;
+    }
+    else if (!pQueue->dwCount)
+    {
+        dwStatus = DmaQueueEngineStart(pQueue, pEntry);
+        if (dwStatus != WD_STATUS_SUCCESS)
+            goto Exit;
+
+        pQueue->dwUnflagged = 0;
+        pQueue->u64FlagNs = XDMA_TimestampNsGet();
     }
     else
     {
-        TraceLog("%s: DMA transaction of channel %d was released. \n",
-            __FUNCTION__, pXdmaDma->dwChannel);
+        /* If the engine has already fetched the tail's last descriptor it
+         * stops there, and is restarted when the queue is next reaped */
+        DmaQueueChain(pQueue->pSlots[(pQueue->dwHead + pQueue->dwCount - 1) %
+            pQueue->dwDepth].pEntry, pEntry,
+            DmaQueueTailCompletedKeep(pQueue));
     }
 
+    pSlot = &pQueue->pSlots[(pQueue->dwHead + pQueue->dwCount) %
+        pQueue->dwDepth];
+    pSlot->pEntry = pEntry;
+    pSlot->pCtx = pCtx;
+    pSlot->u64Token = pQueue->u64NextToken++;
+    if (pu64Token)
+        *pu64Token = pSlot->u64Token;
+
+    pQueue->dwCount++;
+    pEntry->fInQueue = TRUE;
+
+Exit:
+    OsMutexUnlock(pQueue->hMutex);
     return dwStatus;
 }
 
+/* Reap the oldest request of the queue */
+DWORD XDMA_DmaQueueReap(XDMA_DMA_QUEUE_HANDLE hQueue,
+    XDMA_DMA_COMPLETION *pCompletion)
+{
+    XDMA_DMA_QUEUE *pQueue = (XDMA_DMA_QUEUE *)hQueue;
+    DWORD dwStatus;
 
-DWORD XDMA_DmaClose(XDMA_DMA_HANDLE hDma)
+    if (!pQueue || !pCompletion)
+        return WD_INVALID_PARAMETER;
+
+    OsMutexLock(pQueue->hMutex);
+    dwStatus = DmaQueueReap(pQueue, pCompletion);
+    OsMutexUnlock(pQueue->hMutex);
+
+    return dwStatus;
+}
+
+/* Reap all the completed requests of a polled queue and call the completion
+ * callback for each of them */
+DWORD XDMA_DmaQueueProcess(XDMA_DMA_QUEUE_HANDLE hQueue)
 {
-    XDMA_DMA_STRUCT *pXdmaDma = (XDMA_DMA_STRUCT *)hDma;
-    PXDMA_DEV_CTX pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(pXdmaDma->hDev);
-    DWORD idx = ENGINE_IDX(pXdmaDma->dwChannel, pXdmaDma->fToDevice);
-    DWORD dwStatus = WD_STATUS_SUCCESS;
+    XDMA_DMA_QUEUE *pQueue = (XDMA_DMA_QUEUE *)hQueue;
 
-    if (pXdmaDma->pWBDma)
+    if (!pQueue || !pQueue->funcCompletion)
+        return 0;
+
+    return DmaQueueProcess(pQueue);
+}
+
+/* Set the interrupt coalescing of a DMA submission queue */
+DWORD XDMA_DmaQueueCoalesceSet(XDMA_DMA_QUEUE_HANDLE hQueue,
+    DWORD dwCoalesce, DWORD dwMaxDelayUsec)
+{
+    XDMA_DMA_QUEUE *pQueue = (XDMA_DMA_QUEUE *)hQueue;
+
+    if (!pQueue)
+        return WD_INVALID_PARAMETER;
+
+#ifdef HAS_INTS
+    DmaQueueCoalesceTimerStop(pQueue);
+#endif /* ifdef HAS_INTS */
+
+    OsMutexLock(pQueue->hMutex);
+    pQueue->dwCoalesce = dwCoalesce;
+    pQueue->u64CoalesceDelayNs = (UINT64)dwMaxDelayUsec * 1000;
+    pQueue->dwUnflagged = 0;
+    OsMutexUnlock(pQueue->hMutex);
+
+#ifdef HAS_INTS
+    /* Polled queues and queues without a callback reap the completions
+     * themselves */
+    if (dwCoalesce > 1 && dwMaxDelayUsec && !pQueue->fPolling &&
+        pQueue->funcCompletion)
     {
-        dwStatus = WDC_DMABufUnlock(pXdmaDma->pWBDma);
+        DWORD dwStatus;
+
+        pQueue->fCoalesceStop = FALSE;
+        dwStatus = ThreadStart(&pQueue->hCoalesceThread,
+            (HANDLER_FUNC)DmaQueueCoalesceThread, pQueue);
         if (dwStatus != WD_STATUS_SUCCESS)
         {
-            ErrLog("Failed unlocking DMA polling WB buffer. Error 0x%x - %s\n",
-                dwStatus, Stat2Str(dwStatus));
+            ErrLog("Failed starting DMA queue coalescing timer. "
+                "Error 0x%x - %s\n", dwStatus, Stat2Str(dwStatus));
+            pQueue->hCoalesceThread = NULL;
+            return dwStatus;
         }
     }
+#endif /* ifdef HAS_INTS */
 
-    if (pXdmaDma->pDmaDesc)
+    TraceLog("XDMA_DmaQueueCoalesceSet: Queue [%p], dwCoalesce [%d], "
+        "dwMaxDelayUsec [%d]\n", pQueue, dwCoalesce, dwMaxDelayUsec);
+
+    return WD_STATUS_SUCCESS;
+}
+
+/* Returns the number of requests in flight in the queue */
+DWORD XDMA_DmaQueueCountGet(XDMA_DMA_QUEUE_HANDLE hQueue)
+{
+    if (!hQueue)
+        return 0;
+
+    return ((XDMA_DMA_QUEUE *)hQueue)->dwCount;
+}
+
+/* -----------------------------------------------
+    SG DMA buffers pool
+   ----------------------------------------------- */
+/* Create the SG DMA buffers pool of the device */
+DWORD XDMA_SGPoolCreate(WDC_DEVICE_HANDLE hDev, const XDMA_SG_POOL_CFG *pCfg)
+{
+    PXDMA_DEV_CTX pDevCtx;
+    XDMA_SG_POOL *pPool;
+
+    if (!IsValidDevice((PWDC_DEVICE)hDev, "XDMA_SGPoolCreate"))
+        return WD_INVALID_PARAMETER;
+
+    if (pCfg && (!pCfg->dwHighWatermark ||
+        pCfg->dwLowWatermark > pCfg->dwHighWatermark))
     {
-        dwStatus = WDC_DMABufUnlock(pXdmaDma->pDmaDesc);
-        if (dwStatus != WD_STATUS_SUCCESS)
-        {
-            ErrLog("Failed unlocking DMA descriptors buffer. "
-                "Error 0x%x - %s\n", dwStatus, Stat2Str(dwStatus));
-        }
+        ErrLog("XDMA_SGPoolCreate: The low watermark must not exceed the "
+            "(non-zero) high watermark\n");
+        return WD_INVALID_PARAMETER;
     }
 
-    if (pXdmaDma->pDma)
+    pPool = (XDMA_SG_POOL *)calloc(1, sizeof(XDMA_SG_POOL));
+    if (!pPool)
     {
-        dwStatus = WDC_DMABufUnlock(pXdmaDma->pDma);
-        if (dwStatus != WD_STATUS_SUCCESS)
-        {
-            ErrLog("Failed unlocking DMA buffer. Error 0x%x - %s\n", dwStatus,
-                Stat2Str(dwStatus));
-        }
+        ErrLog("Failed allocating memory for SG DMA buffers pool\n");
+        return WD_INSUFFICIENT_RESOURCES;
+    }
+
+    if (pCfg)
+    {
+        pPool->cfg = *pCfg;
+    }
+    else
+    {
+        pPool->cfg.dwLowWatermark = XDMA_SG_POOL_DEFAULT_LOW_WATERMARK;
+        pPool->cfg.dwHighWatermark = XDMA_SG_POOL_DEFAULT_HIGH_WATERMARK;
     }
 
-    if (pXdmaDma->pBuf)
-        __vfree(pXdmaDma->pBuf);
+    pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(hDev);
+    OsMutexLock(pDevCtx->hSGPoolMutex);
+    if (pDevCtx->pSGPool)
+    {
+        OsMutexUnlock(pDevCtx->hSGPoolMutex);
+        free(pPool);
+        return WD_OPERATION_ALREADY_DONE;
+    }
 
-    pDevCtx->pEnginesArr[idx].fIsInitialized = FALSE;
+    pPool->dwGeneration = ++pDevCtx->dwSGPoolGeneration;
+    pDevCtx->pSGPool = pPool;
+    OsMutexUnlock(pDevCtx->hSGPoolMutex);
+    TraceLog("XDMA_SGPoolCreate: Generation %d, watermarks low %d, high %d\n",
+        pPool->dwGeneration, pPool->cfg.dwLowWatermark,
+        pPool->cfg.dwHighWatermark);
 
-    return dwStatus;
+    return WD_STATUS_SUCCESS;
 }
 
-/* Returns DMA direction. TRUE - host to device, FALSE - device to host */
-BOOL XDMA_DmaIsToDevice(XDMA_DMA_HANDLE hDma)
+/* Destroy the SG DMA buffers pool of the device */
+DWORD XDMA_SGPoolDestroy(WDC_DEVICE_HANDLE hDev)
 {
-    return ((XDMA_DMA_STRUCT *)hDma)->fToDevice;
+    PXDMA_DEV_CTX pDevCtx;
+    XDMA_SG_POOL *pPool;
+    DWORD i;
+
+    if (!IsValidDevice((PWDC_DEVICE)hDev, "XDMA_SGPoolDestroy"))
+        return WD_INVALID_PARAMETER;
+
+    pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(hDev);
+    if (!pDevCtx->hSGPoolMutex) /* The device initialization failed */
+        return WD_STATUS_SUCCESS;
+
+    /* Once detached, the pool is not reachable by SGPoolGet() and
+     * SGPoolPut() */
+    OsMutexLock(pDevCtx->hSGPoolMutex);
+    pPool = (XDMA_SG_POOL *)pDevCtx->pSGPool;
+    pDevCtx->pSGPool = NULL;
+    OsMutexUnlock(pDevCtx->hSGPoolMutex);
+    if (!pPool)
+        return WD_STATUS_SUCCESS;
+
+    for (i = 0; i < XDMA_SG_POOL_CLASSES; i++)
+        SGPoolBufListUnlock(pPool->pFreeArr[i]);
+    free(pPool);
+
+    return WD_STATUS_SUCCESS;
 }
 
-/* Returns pointer to the allocated virtual buffer and buffer size in bytes */
-PVOID XDMA_DmaBufferGet(XDMA_DMA_HANDLE hDma, DWORD *pBytes)
+/* Lock free buffers of a size class in advance */
+DWORD XDMA_SGPoolFill(WDC_DEVICE_HANDLE hDev, DWORD dwBytes, DWORD dwBuffers)
 {
-    XDMA_DMA_STRUCT *pXdmaDma = (XDMA_DMA_STRUCT *)hDma;
+    PXDMA_DEV_CTX pDevCtx;
+    XDMA_SG_POOL *pPool;
+    DWORD dwClass = SGPoolClassGet(dwBytes), dwGeneration = 0;
 
-    if (!hDma || !pBytes)
-        return NULL;
+    if (!IsValidDevice((PWDC_DEVICE)hDev, "XDMA_SGPoolFill"))
+        return WD_INVALID_PARAMETER;
 
-    *pBytes = pXdmaDma->dwBytes;
-    return pXdmaDma->pBuf;
+    if (!dwBytes || dwClass == XDMA_SG_POOL_CLASSES)
+        return WD_INVALID_PARAMETER;
+
+    pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(hDev);
+    OsMutexLock(pDevCtx->hSGPoolMutex);
+    pPool = (XDMA_SG_POOL *)pDevCtx->pSGPool;
+    if (pPool)
+        dwGeneration = pPool->dwGeneration;
+    OsMutexUnlock(pDevCtx->hSGPoolMutex);
+    if (!pPool)
+        return WD_INVALID_PARAMETER;
+
+    for (; dwBuffers; dwBuffers--)
+    {
+        XDMA_SG_POOL_BUF *pPoolBuf = SGPoolBufLock(hDev, dwGeneration,
+            dwClass);
+        BOOL fFull;
+
+        if (!pPoolBuf)
+            return WD_INSUFFICIENT_RESOURCES;
+
+        /* The pool may have been destroyed while the buffer was locked */
+        OsMutexLock(pDevCtx->hSGPoolMutex);
+        pPool = (XDMA_SG_POOL *)pDevCtx->pSGPool;
+        fFull = !pPool || pPool->dwGeneration != dwGeneration ||
+            pPool->statsArr[dwClass].dwFree >= pPool->cfg.dwHighWatermark;
+        if (!fFull)
+        {
+            pPoolBuf->pNext = pPool->pFreeArr[dwClass];
+            pPool->pFreeArr[dwClass] = pPoolBuf;
+            pPool->statsArr[dwClass].dwFree++;
+        }
+        OsMutexUnlock(pDevCtx->hSGPoolMutex);
+
+        if (fFull)
+        {
+            SGPoolBufUnlock(pPoolBuf);
+            break;
+        }
+    }
+
+    return WD_STATUS_SUCCESS;
+}
+
+/* Get the SG DMA buffers pool statistics */
+DWORD XDMA_SGPoolStatsGet(WDC_DEVICE_HANDLE hDev, XDMA_SG_POOL_STATS *pTotal,
+    XDMA_SG_POOL_STATS *pClassesArr)
+{
+    PXDMA_DEV_CTX pDevCtx;
+    XDMA_SG_POOL *pPool;
+    DWORD i;
+
+    if (!IsValidDevice((PWDC_DEVICE)hDev, "XDMA_SGPoolStatsGet"))
+        return WD_INVALID_PARAMETER;
+
+    pDevCtx = (PXDMA_DEV_CTX)WDC_GetDevContext(hDev);
+    OsMutexLock(pDevCtx->hSGPoolMutex);
+    pPool = (XDMA_SG_POOL *)pDevCtx->pSGPool;
+    if (!pPool)
+    {
+        OsMutexUnlock(pDevCtx->hSGPoolMutex);
+        return WD_INVALID_PARAMETER;
+    }
+
+    if (pTotal)
+        BZERO(*pTotal);
+
+    for (i = 0; i < XDMA_SG_POOL_CLASSES; i++)
+    {
+        const XDMA_SG_POOL_STATS *pStats = &pPool->statsArr[i];
+
+        if (pClassesArr)
+            pClassesArr[i] = *pStats;
+
+        if (pTotal)
+        {
+            pTotal->u64Hits += pStats->u64Hits;
+            pTotal->u64Misses += pStats->u64Misses;
+            pTotal->u64Trimmed += pStats->u64Trimmed;
+            pTotal->dwFree += pStats->dwFree;
+            pTotal->dwInUse += pStats->dwInUse;
+        }
+    }
+    OsMutexUnlock(pDevCtx->hSGPoolMutex);
+
+    return WD_STATUS_SUCCESS;
 }
 
 /* -----------------------------------------------
@@ -1578,6 +5352,23 @@ static void TraceLog(const CHAR *sFormat, ...)
 #endif
 }
 
+/* Enable/disable tracing of the descriptors of built transfers */
+DWORD XDMA_DescDumpEnable(BOOL fEnable)
+{
+#if defined(DEBUG)
+    gfXDMA_DescDump = fEnable;
+
+    return WD_STATUS_SUCCESS;
+#else
+    if (!fEnable)
+        return WD_STATUS_SUCCESS;
+
+    ErrLog("XDMA_DescDumpEnable: Descriptors are dumped only in DEBUG "
+        "builds\n");
+    return WD_NOT_IMPLEMENTED;
+#endif
+}
+
 /* Get last error */
 const char *XDMA_GetLastErr(void)
 {
@@ -28,14 +28,47 @@ extern "C" {
  * KP_XDMA_Call() (kernel mode) */
 enum {
     KP_XDMA_MSG_VERSION = 1, /* Query the version of the Kernel PlugIn */
+    KP_XDMA_MSG_INT_INIT = 2, /* Set up completion handling in the Kernel
+                                 PlugIn interrupt DPC (see KP_XDMA_INT_INIT) */
+    KP_XDMA_MSG_REG_BATCH = 3, /* Run a batch of register accesses (see
+                                  KP_XDMA_REG_BATCH) */
+    KP_XDMA_MSG_CHAIN_POST = 4, /* Post a descriptors chain to be started by
+                                   the interrupt DPC (see
+                                   KP_XDMA_CHAIN_POST) */
 };
 
 /* Kernel PlugIn messages status */
 enum {
     KP_XDMA_STATUS_OK = 0x1,
     KP_XDMA_STATUS_MSG_NO_IMPL = 0x1000,
+    KP_XDMA_STATUS_FAILED = 0x2000,
 };
 
+/* KP_XDMA_REG_OP operations */
+enum {
+    KP_XDMA_REG_READ = 1,   /* u32Val = register */
+    KP_XDMA_REG_WRITE = 2,  /* register = u32Val */
+    KP_XDMA_REG_MODIFY = 3, /* register = (register & ~u32Mask) | u32Val */
+};
+
+/* Single 32 bit register access of a KP_XDMA_REG_BATCH */
+typedef struct {
+    DWORD dwOp;             /* KP_XDMA_REG_XXX operation */
+    DWORD dwOffset;         /* Register offset in the address space */
+    UINT32 u32Val;
+    UINT32 u32Mask;
+} KP_XDMA_REG_OP;
+
+#define KP_XDMA_REG_BATCH_MAX 16
+
+/* KP_XDMA_MSG_REG_BATCH message data: Register accesses of one address
+ * space, run in order */
+typedef struct {
+    DWORD dwAddrSpace;
+    DWORD dwOps;            /* Number of operations in ops */
+    KP_XDMA_REG_OP ops[KP_XDMA_REG_BATCH_MAX];
+} KP_XDMA_REG_BATCH;
+
 /* Default vendor and device IDs (0 == all) */
 #define XDMA_DEFAULT_VENDOR_ID 0x10EE    /* Vendor ID */
 #define XDMA_DEFAULT_DEVICE_ID 0x0       /* All Xilinx devices */
@@ -63,6 +96,28 @@ typedef struct {
 } XDMA_ADDR_SPACE_INFO;
 
 typedef void *XDMA_DMA_HANDLE;
+typedef void *XDMA_DMA_STRIPE_HANDLE;
+typedef void *XDMA_DMA_QUEUE_HANDLE;
+
+/* DMA batch entry: A range of the DMA handle's buffer and its FPGA
+ * address */
+typedef struct {
+    DWORD dwBufOffset;      /* Offset in the DMA buffer */
+    UINT64 u64FPGAOffset;   /* FPGA offset */
+    DWORD dwBytes;          /* Transfer size in bytes */
+} XDMA_DMA_BATCH_ENTRY;
+
+/* DMA request completion information struct */
+typedef struct {
+    UINT64 u64Token;        /* Token returned by XDMA_DmaQueueSubmit() */
+    XDMA_DMA_HANDLE hDma;   /* Completed DMA handle */
+    PVOID pCtx;             /* Context passed to XDMA_DmaQueueSubmit() */
+    DWORD dwStatus;         /* WD_STATUS_SUCCESS or WD_OPERATION_FAILED */
+    UINT32 u32DmaStatus;    /* Engine status, on failure */
+} XDMA_DMA_COMPLETION;
+
+/* DMA request completion callback function type */
+typedef void (*XDMA_DMA_COMPLETION_HANDLER)(XDMA_DMA_COMPLETION *pCompletion);
 
 /* Interrupt result information struct */
 typedef struct
@@ -77,13 +132,23 @@ typedef struct
                              * interrupts) */
     UINT32 u32DmaStatus;    /* Status of the completed DMA transfer */
     UINT32 u32IntStatus;    /* Interrupt status */
-    XDMA_DMA_HANDLE hDma;   /* Completed DMA handle */
+    XDMA_DMA_HANDLE hDma;   /* Completed DMA handle (for a striped transfer,
+                               the handle of its last completed stripe) */
+    XDMA_DMA_STRIPE_HANDLE hStripe; /* Completed striped DMA handle. NULL -
+                                       not a striped transfer */
     PVOID pData;            /* Custom context */
 } XDMA_INT_RESULT;
 /* TODO: You can add fields to XDMA_INT_RESULT to store any additional
          information that you wish to pass to your diagnostics interrupt
          handler routine (DiagIntHandler() in xdma_diag.c). */
 
+/* XDMA_IntEnableEx() options */
+enum {
+    XDMA_INT_OPT_PER_ENGINE = 0x1,  /* Handle the completions of each engine in
+                                       its own thread, and, with MSI-X, steer
+                                       each engine to its own vector */
+};
+
 /* XDMA diagnostics interrupt handler function type */
 typedef void (*XDMA_INT_HANDLER)(WDC_DEVICE_HANDLE hDev,
     XDMA_INT_RESULT *pIntResult);
@@ -122,10 +187,34 @@ typedef void (*XDMA_EVENT_HANDLER)(WDC_DEVICE_HANDLE hDev, DWORD dwAction);
 #define XDMA_CTRL_NON_INCR_ADDR                 (1 << 25)
 #define XDMA_CTRL_POLL_MODE_WB                  (1 << 26)
 
+/* H2C/C2H performance monitor control register bits */
+#define XDMA_PERF_CTRL_RUN                      (1 << 0)
+#define XDMA_PERF_CTRL_CLEAR                    (1 << 1)
+#define XDMA_PERF_CTRL_AUTO                     (1 << 2) /* Count while the
+                                                            engine runs */
+
+/* H2C/C2H performance count high registers bits */
+#define XDMA_PERF_COUNT_HIGH_MASK               0x3FF /* Bits [41:32] */
+#define XDMA_PERF_COUNT_MAXED                   (1 << 16)
+
 /* SGDMA descriptor control field bits */
 #define XDMA_DESC_STOPPED       (1 << 0)
 #define XDMA_DESC_COMPLETED     (1 << 1)
 #define XDMA_DESC_EOP           (1 << 4)
+#define XDMA_DESC_ADJACENT_SHIFT 8 /* Nxt_adj: Number of additional adjacent
+                                      descriptors after the next one */
+#define XDMA_DESC_ADJACENT_MASK (0x3F << XDMA_DESC_ADJACENT_SHIFT)
+#define XDMA_DESC_MAGIC         0xAD4B0000
+
+/* SGDMA descriptor */
+typedef struct {
+    UINT32 u32Control;  /* XDMA_DESC_MAGIC, adjacent count and XDMA_DESC_XXX
+                           bits */
+    UINT32 u32Bytes;    /* Transfer length in bytes */
+    UINT64 u64SrcAddr;  /* Source address */
+    UINT64 u64DstAddr;  /* Destination address */
+    UINT64 u64NextDesc; /* Next descriptor address */
+} XDMA_DMA_DESC;
 
 /* DMA status register bits */
 #define XDMA_STAT_BUSY                  (1 << 0)
@@ -137,9 +226,188 @@ typedef void (*XDMA_EVENT_HANDLER)(WDC_DEVICE_HANDLE hDev, DWORD dwAction);
 #define XDMA_STAT_IDLE_STOPPED          (1 << 6)
 #define XDMA_STAT_READ_ERROR            (0x1F << 9)
 #define XDMA_STAT_DESC_ERROR            (0x1F << 19)
+#define XDMA_STAT_ERR_MASK              (XDMA_STAT_ALIGN_MISMATCH | \
+                                         XDMA_STAT_MAGIC_STOPPED | \
+                                         XDMA_STAT_READ_ERROR | \
+                                         XDMA_STAT_DESC_ERROR)
 
 #define XDMA_WB_ERR_MASK                (1 << 31)
 
+/* Maximal number of descriptors chains posted to an engine at once */
+#define KP_XDMA_CHAINS_MAX 16
+
+/* Per-engine completion record, updated by the Kernel PlugIn interrupt DPC
+ * in memory shared with user mode */
+typedef struct {
+    UINT32 u32Completions;      /* Incremented on every completion interrupt
+                                   of the engine */
+    UINT32 u32DmaStatus;        /* Engine status of the last completion */
+    UINT32 u32CompletedDescs;   /* Completed descriptors count of the last
+                                   completion */
+    UINT32 u32Flags;            /* KP_XDMA_ENGINE_XXX flags, set by user
+                                   mode */
+    UINT32 u32ChainsDone;       /* Incremented on every completed posted
+                                   chain (KP_XDMA_MSG_CHAIN_POST) */
+    UINT32 u32ChainStatus[KP_XDMA_CHAINS_MAX]; /* Engine status of the
+                                                  completed chain number N,
+                                                  at N % KP_XDMA_CHAINS_MAX */
+} KP_XDMA_ENGINE_RECORD;
+
+/* KP_XDMA_ENGINE_RECORD flags */
+enum {
+    KP_XDMA_ENGINE_KEEP_RUNNING = 0x1, /* Neither stop the engine nor clear
+                                          its status (submission queues) */
+};
+
+/* Kernel PlugIn completion records, indexed like XDMA_DEV_CTX.pEnginesArr */
+typedef struct {
+    KP_XDMA_ENGINE_RECORD engines[XDMA_CHANNELS_NUM * 2];
+} KP_XDMA_SHARED;
+
+/* KP_XDMA_MSG_INT_INIT message data */
+typedef struct {
+    DWORD dwConfigBarNum;
+    UINT32 u32IrqBitMasks[XDMA_CHANNELS_NUM * 2]; /* Interrupt request bit(s)
+                                                     of each engine, 0 if the
+                                                     engine is disabled */
+    UINT64 u64SharedKernelAddr; /* Kernel address of a KP_XDMA_SHARED shared
+                                   buffer. 0 - stop completion handling */
+} KP_XDMA_INT_INIT;
+
+/* KP_XDMA_MSG_CHAIN_POST message data: A descriptors chain, ending with a
+ * XDMA_DESC_STOPPED | XDMA_DESC_COMPLETED descriptor. The Kernel PlugIn
+ * starts it at once if the engine is idle, otherwise from the interrupt DPC
+ * when the previously posted chain completes */
+typedef struct {
+    DWORD dwEngine;         /* Engine index, as in XDMA_DEV_CTX.pEnginesArr */
+    UINT32 u32Adjacent;     /* Adjacent descriptors of the first descriptor */
+    UINT32 u32Control;      /* Control register value that runs the engine */
+    UINT64 u64DescAddr;     /* Bus address of the first descriptor. 0 - stop
+                               the engine and drop the posted chains */
+} KP_XDMA_CHAIN_POST;
+
+/* XDMA_DmaOpenEx() options */
+enum {
+    XDMA_DMA_OPT_MERGE_PAGES = 0x1, /* Merge physically contiguous pages of the
+                                       DMA buffer into a single descriptor */
+    XDMA_DMA_OPT_HUGE_PAGES = 0x2,  /* Allocate the DMA buffer from huge pages
+                                       (implies XDMA_DMA_OPT_MERGE_PAGES). See
+                                       XDMA_DmaBufPageSizeGet() */
+    XDMA_DMA_OPT_QUEUED = 0x4,      /* Open a handle that does not own the
+                                       engine, to be submitted to the engine's
+                                       queue (see XDMA_DmaQueueOpen()) */
+    XDMA_DMA_OPT_HYBRID = 0x8,      /* Hybrid interrupt/polling completion:
+                                       Use completion interrupts, and switch to
+                                       writeback polling under sustained load.
+                                       Requires fPolling == FALSE. See
+                                       XDMA_DmaWaitCompletion() */
+    XDMA_DMA_OPT_FAST_START = 0x10, /* Start transfers with the minimal
+                                       register accesses: Program the engine
+                                       interrupt mask once, re-enable only
+                                       the engine's channel interrupts, and
+                                       skip the flush reads (see
+                                       XDMA_DmaFlush()) */
+};
+
+/* XDMA_DmaQueueOpenEx() options */
+enum {
+    XDMA_QUEUE_OPT_KP_CHAIN = 0x1,  /* Post each submitted transfer to the
+                                       Kernel PlugIn, whose interrupt DPC
+                                       starts it as soon as the previous one
+                                       completes. Requires an interrupt driven
+                                       queue, and interrupts enabled with
+                                       Kernel PlugIn completion handling for
+                                       as long as the queue is open. dwDepth
+                                       is limited to KP_XDMA_CHAINS_MAX */
+};
+
+/* Polling policy of XDMA_DmaPollCompletion(): Spin with a CPU pause for
+ * u64SpinNs, then yield the CPU between polls for u64YieldNs, then sleep
+ * dwSleepUsec between polls. Fail with WD_TIME_OUT_EXPIRED after
+ * u64TimeoutNs (0 - no timeout) */
+typedef struct {
+    UINT64 u64SpinNs;
+    UINT64 u64YieldNs;
+    DWORD dwSleepUsec;
+    UINT64 u64TimeoutNs;
+} XDMA_POLL_POLICY;
+
+/* Hybrid completion policy (XDMA_DMA_OPT_HYBRID): Switch to polling after
+ * dwBusyTransfers consecutive transfers, each started within u64IdleNs of
+ * the previous completion. Switch back to interrupts once a transfer is
+ * started later than that */
+typedef struct {
+    DWORD dwBusyTransfers;
+    UINT64 u64IdleNs;
+} XDMA_HYBRID_POLICY;
+
+/* Register (MMIO) accesses of a DMA handle. Every register read is a
+ * non-posted PCIe round trip. u64Reads and u64Writes are counted atomically,
+ * by both the caller's thread and the interrupt thread */
+typedef struct {
+    UINT64 u64Reads;            /* Register reads since the handle was
+                                   opened */
+    UINT64 u64Writes;           /* Register writes since the handle was
+                                   opened */
+    DWORD dwStartReads;         /* Of the last XDMA_DmaTransferStart() */
+    DWORD dwStartWrites;
+    DWORD dwCompletionReads;    /* Of the last completion interrupt */
+    DWORD dwCompletionWrites;
+} XDMA_MMIO_STATS;
+
+/* Engine performance monitor counters (see XDMA_EnginePerfRead()) */
+typedef struct {
+    UINT64 u64Cycles;       /* Engine clock cycles counted */
+    UINT64 u64DataBeats;    /* Clock cycles with a data path transfer */
+    BOOL fMaxed;            /* A counter reached its maximum and stopped */
+    DWORD dwBeatBytes;      /* Bytes per data path transfer (PCIe data
+                               width) */
+} XDMA_PERF_COUNTERS;
+
+/* Statistics of the last XDMA_DmaPollCompletion() */
+typedef struct {
+    UINT64 u64Iterations;   /* Number of polls */
+    UINT64 u64ElapsedNs;    /* Time until completion */
+} XDMA_POLL_STATS;
+
+/* SG DMA buffers pool size classes: Powers of two from
+ * 2^XDMA_SG_POOL_MIN_SHIFT (4KB) bytes to 2^(XDMA_SG_POOL_MIN_SHIFT +
+ * XDMA_SG_POOL_CLASSES - 1) (16MB) bytes */
+#define XDMA_SG_POOL_MIN_SHIFT 12
+#define XDMA_SG_POOL_CLASSES 13
+
+/* Watermarks of the SG DMA buffers pool (see XDMA_SGPoolCreate()). Once a
+ * size class has more than dwHighWatermark free buffers, its free buffers
+ * are unlocked and freed down to dwLowWatermark */
+typedef struct {
+    DWORD dwLowWatermark;
+    DWORD dwHighWatermark;
+} XDMA_SG_POOL_CFG;
+
+/* SG DMA buffers pool statistics, of a size class or of the whole pool */
+typedef struct {
+    UINT64 u64Hits;         /* DMA handles opened with a free pooled buffer */
+    UINT64 u64Misses;       /* DMA handles that allocated and locked a new
+                               buffer */
+    UINT64 u64Trimmed;      /* Buffers unlocked and freed above the high
+                               watermark */
+    DWORD dwFree;           /* Free locked buffers */
+    DWORD dwInUse;          /* Buffers of open DMA handles */
+} XDMA_SG_POOL_STATS;
+
+/* Register addresses of an engine in the mapped configuration BAR, resolved
+ * once when the device is initialized. pControl NULL - the BAR is not
+ * directly accessible, and the registers are accessed through WDC */
+typedef struct {
+    volatile UINT32 *pControl;
+    volatile UINT32 *pStatus;
+    volatile UINT32 *pStatusRC;
+    volatile UINT32 *pCompletedDescs;
+    volatile UINT32 *pIntEnableMask;
+    volatile UINT32 *pChannelIntEnableW1S; /* IRQ block registers */
+    volatile UINT32 *pChannelIntRequest;
+} XDMA_ENGINE_REGS;
+
 typedef struct {
     WDC_DEVICE_HANDLE hDev; /* Device handle */
     WD_DMA *pDma;           /* S/G DMA buffer for data transfer */
@@ -159,6 +427,63 @@ typedef struct {
     UINT32 u32IrqBitMask;   /* Engine interrupt request bit(s) */
     BOOL fIsInitialized;    /* Is the engine struct (this struct) initialized */
     BOOL fIsEnabled;        /* Is the engine enabled on the card */
+    DWORD dwDescs;          /* Number of descriptors in the descriptors chain */
+    BOOL fRing;             /* Continuous C2H capture ring (see
+                               XDMA_DmaRingOpen()) */
+    DWORD dwRingSlots;      /* Number of ring slots */
+    DWORD dwRingSlotBytes;  /* Size of a single ring slot in bytes */
+    DWORD dwRingHead;       /* Index of the next ring slot to consume */
+    UINT32 u32RingDescsDone; /* Descriptors consumed by the ring reader */
+    DWORD *pdwRingSlotDescs; /* Number of descriptors of each ring slot */
+    DWORD dwOptions;        /* XDMA_DMA_OPT_XXX options */
+    DWORD dwDescsAlloc;     /* Number of descriptors the descriptors buffer
+                               can hold */
+    UINT32 u32AddrAlign;    /* Engine address alignment in bytes */
+    DWORD dwBufPageSize;    /* Size of the pages that back pBuf */
+    BOOL fExtBuf;           /* pBuf is owned by the striped handle */
+    PVOID pStripe;          /* Striped DMA handle this engine belongs to */
+    BOOL fQueued;           /* Opened with XDMA_DMA_OPT_QUEUED */
+    BOOL fInQueue;          /* Submitted and not yet reaped */
+    UINT32 u32DescAdjacent; /* Adjacent descriptors count of the first
+                               descriptor */
+    PVOID pQueue;           /* Submission queue that owns the engine */
+    HANDLE hQueueMutex;     /* Keeps pQueue valid while the engine's
+                               interrupt is dispatched to it */
+    DWORD *pdwPageOffsets;  /* Buffer offset of each SG page (batches) */
+    BOOL fIsTransaction;    /* Opened for DMA transactions */
+    BOOL fBatchChain;       /* The descriptors chain holds a batch */
+    BOOL fDmaIntsEnabled;   /* Engine interrupts mask set by a batch */
+    XDMA_POLL_POLICY pollPolicy; /* XDMA_DmaPollCompletion() policy */
+    XDMA_POLL_STATS pollStats;   /* Last XDMA_DmaPollCompletion() stats */
+    BOOL fHybrid;           /* Opened with XDMA_DMA_OPT_HYBRID. fPolling holds
+                               the current completion mode */
+    XDMA_HYBRID_POLICY hybridPolicy;
+    DWORD dwHybridBusy;     /* Consecutive transfers started under load */
+    UINT64 u64LastDoneNs;   /* Timestamp of the last completion */
+    HANDLE hHybridEvent;    /* Signaled by the interrupt handler */
+    UINT32 u32HybridDmaStatus; /* Engine status of the last interrupt */
+    XDMA_ENGINE_REGS regs;  /* Engine registers */
+    XDMA_MMIO_STATS mmioStats; /* Register accesses of the handle */
+    BOOL fIntMaskSet;       /* Engine interrupt enable mask programmed
+                               (XDMA_DMA_OPT_FAST_START). Kept by the
+                               engine (pEnginesArr), for all its handles */
+    DWORD dwXferBytes;      /* Transfer length: The first dwXferBytes bytes
+                               of the buffer (see XDMA_DmaRetarget()) */
+    DWORD dwChainDescs;     /* Number of descriptors describing the whole
+                               buffer. dwDescs of them are transferred */
+    DWORD dwStopDescBytes;  /* Original byte count of the last transferred
+                               descriptor */
+    DMA_ADDR pDescPhysAddr; /* Physical address of pDescBuf */
+    DWORD dwDescPoolBlocks; /* Device DMA pool blocks of pDescBuf, which is
+                               then carved out of the pool buffer pDmaDesc.
+                               0 - pDescBuf is locked on its own */
+    DMA_ADDR pWBPhysAddr;   /* Physical address of pWBBuf */
+    BOOL fWBPooled;         /* pWBBuf is the engine's slot of the device DMA
+                               pool */
+    PVOID pSGPoolBuf;       /* SG DMA buffers pool buffer of pBuf and pDma,
+                               which then cover the buffer's whole size
+                               class. NULL - pBuf and pDma are the handle's
+                               own */
 } XDMA_DMA_STRUCT;
 
 /* XDMA device information struct */
@@ -173,6 +498,30 @@ typedef struct {
                                                 INTERRUPT_MESSAGE,
                                                 INTERRUPT_LEVEL_SENSITIVE */
     WD_TRANSFER *pTrans;                     /* Interrupt transfer commands */
+    DWORD dwIntOptions;                      /* XDMA_INT_OPT_XXX options */
+    PVOID pEngineThreads;                    /* Per-engine interrupt threads
+                                                (XDMA_INT_OPT_PER_ENGINE) */
+    WD_KERNEL_BUFFER *pKpSharedBuf;          /* Kernel PlugIn completion
+                                                records buffer */
+    KP_XDMA_SHARED *pKpShared;               /* User mapping of pKpSharedBuf.
+                                                NULL - completions are not
+                                                handled by the Kernel PlugIn */
+    UINT32 u32KpCompletions[XDMA_CHANNELS_NUM * 2]; /* Completions reported
+                                                       so far, per engine */
+    BOOL fKpRegBatch;                        /* Register access batches are
+                                                run by the Kernel PlugIn */
+    PVOID pDmaPool;                          /* Contiguous DMA memory of the
+                                                descriptors and write-back
+                                                buffers. NULL - each DMA
+                                                handle locks its own */
+    PVOID pSGPool;                           /* SG DMA buffers pool (see
+                                                XDMA_SGPoolCreate()) */
+    DWORD dwSGPoolGeneration;                /* Number of pools created so
+                                                far. Identifies pSGPool */
+    HANDLE hSGPoolMutex;                     /* Protects pSGPool,
+                                                dwSGPoolGeneration and the
+                                                pool's free lists and
+                                                statistics */
 
     XDMA_DMA_STRUCT pEnginesArr[XDMA_CHANNELS_NUM * 2]; /* Array of active XDMA
                                                             engines. */
@@ -198,7 +547,9 @@ enum {
     XDMA_H2C_CHANNEL_INT_ENABLE_MASK_W1C_OFFSET         = 0x0098,
     XDMA_H2C_CHANNEL_PERFORMANCE_MONITOR_CONTROL_OFFSET = 0x00C0,
     XDMA_H2C_CHANNEL_PERFORMANCE_CYCLE_COUNT_OFFSET     = 0x00C4,
+    XDMA_H2C_CHANNEL_PERFORMANCE_CYCLE_COUNT_HIGH_OFFSET = 0x00C8,
     XDMA_H2C_CHANNEL_PERFORMANCE_DATA_COUNT_OFFSET      = 0x00CC,
+    XDMA_H2C_CHANNEL_PERFORMANCE_DATA_COUNT_HIGH_OFFSET = 0x00D0,
 
     /* C2H Channel Registers. Up to 4 channels with 0x100 bytes spacing */
     XDMA_C2H_CHANNEL_IDENTIFIER_OFFSET                  = 0x1000,
@@ -217,7 +568,9 @@ enum {
     XDMA_C2H_CHANNEL_INT_ENABLE_MASK_W1C_OFFSET         = 0x1098,
     XDMA_C2H_CHANNEL_PERFORMANCE_MONITOR_CONTROL_OFFSET = 0x10C0,
     XDMA_C2H_CHANNEL_PERFORMANCE_CYCLE_COUNT_OFFSET     = 0x10C4,
+    XDMA_C2H_CHANNEL_PERFORMANCE_CYCLE_COUNT_HIGH_OFFSET = 0x10C8,
     XDMA_C2H_CHANNEL_PERFORMANCE_DATA_COUNT_OFFSET      = 0x10CC,
+    XDMA_C2H_CHANNEL_PERFORMANCE_DATA_COUNT_HIGH_OFFSET = 0x10D0,
 
     /* IRQ Block Registers */
     XDMA_IRQ_BLOCK_IDENTIFIER_OFFSET                    = 0x2000,
@@ -276,6 +629,9 @@ enum {
 DWORD XDMA_LibInit(const CHAR *sLicense);
 /* Uninitialize the Xilinx XDMA and WDC libraries */
 DWORD XDMA_LibUninit(void);
+/* Run a batch of register accesses. Read values are returned in the
+ * operations' u32Val */
+DWORD XDMA_RegBatchExec(WDC_DEVICE_HANDLE hDev, KP_XDMA_REG_BATCH *pBatch);
 
 #if !defined(__KERNEL__)
 /* -----------------------------------------------
@@ -293,6 +649,11 @@ BOOL XDMA_DeviceClose(WDC_DEVICE_HANDLE hDev);
    ----------------------------------------------- */
 /* Enable interrupts */
 DWORD XDMA_IntEnable(WDC_DEVICE_HANDLE hDev, XDMA_INT_HANDLER funcIntHandler);
+/* Enable interrupts with XDMA_INT_OPT_XXX options. With
+ * XDMA_INT_OPT_PER_ENGINE funcIntHandler may be called concurrently for
+ * different engines */
+DWORD XDMA_IntEnableEx(WDC_DEVICE_HANDLE hDev, XDMA_INT_HANDLER funcIntHandler,
+    DWORD dwOptions);
 /* Disable interrupts */
 DWORD XDMA_IntDisable(WDC_DEVICE_HANDLE hDev);
 /* Check whether interrupts are enabled for the given device */
@@ -315,6 +676,11 @@ DWORD XDMA_ChannelInterruptsDisable(WDC_DEVICE_HANDLE hDev, UINT32 mask);
 DWORD XDMA_DmaOpen(WDC_DEVICE_HANDLE hDev, XDMA_DMA_HANDLE *phDma,
     DWORD dwBytes, UINT64 u64FPGAOffset, BOOL fToDevice, DWORD dwChannel,
     BOOL fPolling, BOOL fNonIncMode, PVOID pData, BOOL fIsTransaction);
+/* Open a DMA handle with XDMA_DMA_OPT_XXX options (see XDMA_DmaOpen()).
+ * Transactions are not supported */
+DWORD XDMA_DmaOpenEx(WDC_DEVICE_HANDLE hDev, XDMA_DMA_HANDLE *phDma,
+    DWORD dwBytes, UINT64 u64FPGAOffset, BOOL fToDevice, DWORD dwChannel,
+    BOOL fPolling, BOOL fNonIncMode, PVOID pData, DWORD dwOptions);
 /* Close DMA handle */
 DWORD XDMA_DmaClose(XDMA_DMA_HANDLE hDma);
 /* Start DMA transfer */
@@ -323,18 +689,203 @@ DWORD XDMA_DmaTransferStart(XDMA_DMA_HANDLE hDma);
 DWORD XDMA_DmaTransferStop(XDMA_DMA_HANDLE hDma);
 /* Poll for DMA transfer completion */
 DWORD XDMA_DmaPollCompletion(XDMA_DMA_HANDLE hDma);
+/* Set the polling policy of XDMA_DmaPollCompletion(). The default policy
+ * spins for 20 usec, yields for 200 usec, then sleeps 50 usec between polls,
+ * with a 10 sec timeout */
+DWORD XDMA_DmaPollPolicySet(XDMA_DMA_HANDLE hDma,
+    const XDMA_POLL_POLICY *pPolicy);
+/* Get the polling statistics of the last XDMA_DmaPollCompletion() */
+DWORD XDMA_DmaPollStatsGet(XDMA_DMA_HANDLE hDma, XDMA_POLL_STATS *pStats);
+/* Returns a monotonic timestamp in nanoseconds */
+UINT64 XDMA_TimestampNsGet(void);
+/* Get the register access counters of a DMA handle */
+DWORD XDMA_DmaMmioStatsGet(XDMA_DMA_HANDLE hDma, XDMA_MMIO_STATS *pStats);
+/* Read an engine register, to make sure all the preceding register writes
+ * of a XDMA_DMA_OPT_FAST_START handle have reached the device */
+DWORD XDMA_DmaFlush(XDMA_DMA_HANDLE hDma);
+/* Wait for the completion of a XDMA_DMA_OPT_HYBRID or polling DMA handle's
+ * transfer, either by polling or by waiting for the completion interrupt,
+ * depending on the handle's current mode. The timeout is that of the
+ * handle's polling policy. The diagnostics interrupt handler is not called
+ * for hybrid handles */
+DWORD XDMA_DmaWaitCompletion(XDMA_DMA_HANDLE hDma);
+/* Set the hybrid completion policy of a XDMA_DMA_OPT_HYBRID DMA handle. The
+ * default policy switches to polling after 8 transfers started within
+ * 50 usec of the previous completion */
+DWORD XDMA_DmaHybridPolicySet(XDMA_DMA_HANDLE hDma,
+    const XDMA_HYBRID_POLICY *pPolicy);
+/* Returns TRUE if the DMA handle's completions are currently polled */
+BOOL XDMA_DmaIsPolling(XDMA_DMA_HANDLE hDma);
 /* Read XDMA engine status */
 DWORD XDMA_EngineStatusRead(XDMA_DMA_HANDLE hDma, BOOL fClear, UINT32 *pStatus);
+/* Clear the engine performance monitor counters and start counting.
+ * fAuto - count only while the engine runs */
+DWORD XDMA_EnginePerfArm(XDMA_DMA_HANDLE hDma, BOOL fAuto);
+/* Stop the engine performance monitor counters, keeping their values */
+DWORD XDMA_EnginePerfFreeze(XDMA_DMA_HANDLE hDma);
+/* Read the engine performance monitor counters */
+DWORD XDMA_EnginePerfRead(XDMA_DMA_HANDLE hDma, XDMA_PERF_COUNTERS *pCounters);
 /* Returns DMA direction. TRUE - host to device, FALSE - device to host */
 BOOL XDMA_DmaIsToDevice(XDMA_DMA_HANDLE hDma);
 /* Returns pointer to the allocated virtual buffer and buffer size in bytes */
 PVOID XDMA_DmaBufferGet(XDMA_DMA_HANDLE hDma, DWORD *pBytes);
+/* Returns the number of descriptors in the DMA handle's descriptors chain */
+DWORD XDMA_DmaDescCountGet(XDMA_DMA_HANDLE hDma);
+/* Returns TRUE if the DMA handle's descriptors buffer was taken from the
+ * device DMA pool, FALSE if it was locked on its own (the pool is full or
+ * was not created) */
+BOOL XDMA_DmaDescIsPooled(XDMA_DMA_HANDLE hDma);
+/* Re-target the transfers of an idle DMA handle to the FPGA offset
+ * u64FPGAOffset, transferring the first dwBytes bytes of its buffer
+ * (1 - the buffer size). Only the FPGA address fields of the descriptors, and
+ * the descriptors around the old and new end of the transfer, are patched:
+ * The chain is not rebuilt. Not supported for ring and transaction handles,
+ * and for queued handles that are in their queue. Returns WD_TRY_AGAIN,
+ * without retargeting, while a transfer of the handle is pending (its engine
+ * is busy) */
+DWORD XDMA_DmaRetarget(XDMA_DMA_HANDLE hDma, UINT64 u64FPGAOffset,
+    DWORD dwBytes);
+/* Returns the size of the pages that back the DMA buffer: The huge page size
+ * if the handle was opened with XDMA_DMA_OPT_HUGE_PAGES and huge pages were
+ * available, the system page size otherwise */
+DWORD XDMA_DmaBufPageSizeGet(XDMA_DMA_HANDLE hDma);
 
 DWORD XDMA_DmaTransactionTransferEnded(XDMA_DMA_HANDLE hDma);
 DWORD XDMA_DmaTransactionExecute(XDMA_DMA_HANDLE hDma, BOOL fNewContext,
     PVOID pData);
 DWORD XDMA_DmaTransactionRelease(XDMA_DMA_HANDLE hDma);
 
+/* -----------------------------------------------
+    Continuous C2H capture ring
+   ----------------------------------------------- */
+/* Open a device-to-host DMA handle whose descriptors form a ring over
+ * dwSlots host buffer slots of dwSlotBytes each. Once started with
+ * XDMA_DmaTransferStart() the engine keeps cycling through the slots until
+ * XDMA_DmaTransferStop() is called. Close the handle with XDMA_DmaClose() */
+DWORD XDMA_DmaRingOpen(WDC_DEVICE_HANDLE hDev, XDMA_DMA_HANDLE *phDma,
+    DWORD dwSlotBytes, DWORD dwSlots, UINT64 u64FPGAOffset, DWORD dwChannel,
+    PVOID pData);
+/* Get the oldest filled ring slot. Returns WD_TRY_AGAIN if the engine has not
+ * filled it yet. *pdwLost (optional) receives the number of slots that were
+ * overwritten by the engine before being consumed */
+DWORD XDMA_DmaRingSlotGet(XDMA_DMA_HANDLE hDma, PVOID *ppSlot, DWORD *pdwSlot,
+    DWORD *pdwLost);
+/* Return the slot obtained by XDMA_DmaRingSlotGet() to the engine */
+DWORD XDMA_DmaRingSlotRelease(XDMA_DMA_HANDLE hDma);
+
+/* -----------------------------------------------
+    Multi-channel striped DMA
+   ----------------------------------------------- */
+/* Open a striped DMA handle: Allocate a dwBytes buffer and split it, together
+ * with the FPGA address range at u64FPGAOffset, into page aligned disjoint
+ * stripes, one per free enabled engine of the given direction.
+ * dwOptions are XDMA_DMA_OPT_XXX options. In interrupt mode the interrupt
+ * handler is called once, when all the stripes are completed, with
+ * XDMA_INT_RESULT.hStripe set to the striped handle and pData to pData */
+DWORD XDMA_DmaStripeOpen(WDC_DEVICE_HANDLE hDev,
+    XDMA_DMA_STRIPE_HANDLE *phStripe, DWORD dwBytes, UINT64 u64FPGAOffset,
+    BOOL fToDevice, BOOL fPolling, PVOID pData, DWORD dwOptions);
+/* Close a striped DMA handle */
+DWORD XDMA_DmaStripeClose(XDMA_DMA_STRIPE_HANDLE hStripe);
+/* Start a striped DMA transfer */
+DWORD XDMA_DmaStripeTransferStart(XDMA_DMA_STRIPE_HANDLE hStripe);
+/* Stop a striped DMA transfer */
+DWORD XDMA_DmaStripeTransferStop(XDMA_DMA_STRIPE_HANDLE hStripe);
+/* Poll for striped DMA transfer completion */
+DWORD XDMA_DmaStripePollCompletion(XDMA_DMA_STRIPE_HANDLE hStripe);
+/* Returns pointer to the striped handle's virtual buffer and buffer size in
+ * bytes */
+PVOID XDMA_DmaStripeBufferGet(XDMA_DMA_STRIPE_HANDLE hStripe, DWORD *pBytes);
+/* Returns the number of stripes (engines) of a striped DMA handle */
+DWORD XDMA_DmaStripeCountGet(XDMA_DMA_STRIPE_HANDLE hStripe);
+
+/* -----------------------------------------------
+    Batched DMA transfers
+   ----------------------------------------------- */
+/* Link dwEntries ranges of the DMA handle's buffer into a single descriptors
+ * chain and start it with a single control register write. Completion of the
+ * whole batch is reported as for XDMA_DmaTransferStart() (polling or
+ * interrupt). The next XDMA_DmaTransferStart() transfers the whole buffer
+ * again */
+DWORD XDMA_DmaBatchStart(XDMA_DMA_HANDLE hDma,
+    const XDMA_DMA_BATCH_ENTRY *pEntries, DWORD dwEntries);
+
+/* -----------------------------------------------
+    DMA submission queue
+   ----------------------------------------------- */
+/* Open a submission queue on the engine of dwChannel/fToDevice. The queue owns
+ * the engine and chains up to dwDepth transfers back-to-back. Transfers are
+ * DMA handles opened by XDMA_DmaOpenEx() with XDMA_DMA_OPT_QUEUED on the same
+ * channel and direction.
+ * funcCompletion (optional) is called for every completed request: From
+ * XDMA_DmaQueueProcess() for a polled queue (fPolling), or from the interrupt
+ * handler thread for an interrupt driven queue (requires XDMA_IntEnable()).
+ * funcCompletion must not close the queue.
+ * Without funcCompletion, completions are retrieved by XDMA_DmaQueueReap() */
+DWORD XDMA_DmaQueueOpen(WDC_DEVICE_HANDLE hDev, XDMA_DMA_QUEUE_HANDLE *phQueue,
+    DWORD dwChannel, BOOL fToDevice, DWORD dwDepth, BOOL fPolling,
+    XDMA_DMA_COMPLETION_HANDLER funcCompletion);
+/* Close a DMA submission queue. Transfers still in flight are aborted */
+DWORD XDMA_DmaQueueClose(XDMA_DMA_QUEUE_HANDLE hQueue);
+/* Submit a transfer to the queue without waiting for it. *pu64Token
+ * (optional) receives the request token, reported back on completion with
+ * pCtx. Returns WD_TRY_AGAIN if the queue is full */
+DWORD XDMA_DmaQueueSubmit(XDMA_DMA_QUEUE_HANDLE hQueue, XDMA_DMA_HANDLE hDma,
+    PVOID pCtx, UINT64 *pu64Token);
+/* Reap the oldest request of the queue, in submission order. Returns
+ * WD_TRY_AGAIN if it has not completed yet */
+DWORD XDMA_DmaQueueReap(XDMA_DMA_QUEUE_HANDLE hQueue,
+    XDMA_DMA_COMPLETION *pCompletion);
+/* Reap all the completed requests of a polled queue and call the completion
+ * callback for each of them. Returns the number of completed requests */
+DWORD XDMA_DmaQueueProcess(XDMA_DMA_QUEUE_HANDLE hQueue);
+/* Set the interrupt coalescing of a DMA submission queue: Only every
+ * dwCoalesce-th chained transfer, and the queue tail, raise a completion
+ * interrupt, which reports all the transfers completed since the previous
+ * one. A transfer chained dwMaxDelayUsec after the last interrupting
+ * transfer always interrupts, and the completions of an interrupt driven
+ * queue with a completion callback are also delivered every dwMaxDelayUsec
+ * by a timer thread, so that they are not held back while the engine runs
+ * a long chain. dwMaxDelayUsec 0 - no delay limit: Held back completions
+ * are reported with the next interrupting transfer (at the latest, the
+ * queue tail). dwCoalesce 0 or 1 - interrupt on every transfer (default) */
+DWORD XDMA_DmaQueueCoalesceSet(XDMA_DMA_QUEUE_HANDLE hQueue,
+    DWORD dwCoalesce, DWORD dwMaxDelayUsec);
+/* Returns the number of requests in flight in the queue */
+DWORD XDMA_DmaQueueCountGet(XDMA_DMA_QUEUE_HANDLE hQueue);
+/* Open a submission queue with XDMA_QUEUE_OPT_XXX options */
+DWORD XDMA_DmaQueueOpenEx(WDC_DEVICE_HANDLE hDev,
+    XDMA_DMA_QUEUE_HANDLE *phQueue, DWORD dwChannel, BOOL fToDevice,
+    DWORD dwDepth, BOOL fPolling, XDMA_DMA_COMPLETION_HANDLER funcCompletion,
+    DWORD dwOptions);
+
+/* -----------------------------------------------
+    SG DMA buffers pool
+   ----------------------------------------------- */
+/* Create the SG DMA buffers pool of the device. XDMA_DmaOpen() and
+ * XDMA_DmaOpenEx() then take the DMA buffer from the pool, instead of
+ * allocating and locking a new one, and XDMA_DmaClose() returns it to the
+ * pool. Pooled buffers are grouped in size classes (XDMA_SG_POOL_CLASSES):
+ * A handle gets a buffer of the smallest size class that fits dwBytes, and
+ * transfers its first dwBytes bytes. Rings, transactions, striped handles,
+ * handles larger than the largest size class and handles opened with
+ * XDMA_DMA_OPT_MERGE_PAGES or XDMA_DMA_OPT_HUGE_PAGES do not use the pool.
+ * pCfg NULL - use the default watermarks (2 and 8 free buffers) */
+DWORD XDMA_SGPoolCreate(WDC_DEVICE_HANDLE hDev, const XDMA_SG_POOL_CFG *pCfg);
+/* Destroy the SG DMA buffers pool: Unlock and free its free buffers. Buffers
+ * of open DMA handles are freed when the handles are closed. Called by
+ * XDMA_DeviceClose(). The pool may be created and destroyed while other
+ * threads open and close DMA handles of the device */
+DWORD XDMA_SGPoolDestroy(WDC_DEVICE_HANDLE hDev);
+/* Lock dwBuffers free buffers of the size class of dwBytes in advance, up
+ * to the high watermark */
+DWORD XDMA_SGPoolFill(WDC_DEVICE_HANDLE hDev, DWORD dwBytes, DWORD dwBuffers);
+/* Get the SG DMA buffers pool statistics: Of the whole pool into *pTotal
+ * (optional) and of each size class into pClassesArr (optional, of
+ * XDMA_SG_POOL_CLASSES entries) */
+DWORD XDMA_SGPoolStatsGet(WDC_DEVICE_HANDLE hDev, XDMA_SG_POOL_STATS *pTotal,
+    XDMA_SG_POOL_STATS *pClassesArr);
+
 /* -----------------------------------------------
     Plug-and-play and power management events
    ----------------------------------------------- */
@@ -363,6 +914,12 @@ DWORD XDMA_ConfigBarNumGet(WDC_DEVICE_HANDLE hDev);
 /* -----------------------------------------------
     Debugging and error handling
    ----------------------------------------------- */
+/* Enable/disable tracing of the descriptors of every built transfer. The
+ * descriptors are dumped only in DEBUG builds, and only when enabled: Dumping
+ * is costly, and in transaction mode transfers are built on the transfer
+ * critical path. Disabled by default. Enabling fails with
+ * WD_NOT_IMPLEMENTED in non-DEBUG builds */
+DWORD XDMA_DescDumpEnable(BOOL fEnable);
 /* Get last error */
 const char *XDMA_GetLastErr(void);
 
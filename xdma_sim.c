@@ -0,0 +1,928 @@
+/* Jungo Connectivity Confidential. Copyright (c) 2023 Jungo Connectivity Ltd.  https://www.jungo.com */
+
+/****************************************************************************
+*  File: xdma_sim.c
+*
+*  Software model of an XDMA device (see xdma_sim.h).
+*
+*  Host buffers are "locked" with their virtual addresses as their DMA
+*  addresses, so the model accesses the descriptors, the data and the
+*  write-back buffers directly through the addresses the library programs.
+*
+*  Note: This code sample is provided AS-IS and as a guiding sample only.
+*****************************************************************************/
+
+#define XDMA_SIM_IMPL
+#include <stddef.h>
+#include "utils.h"
+#include "xdma_lib.h"
+#include "xdma_sim.h"
+
+/*************************************************************
+  Internal definitions
+ *************************************************************/
+#define XDMA_SIM_BAR_SIZE 0x10000
+#define XDMA_SIM_REGS_NUM (XDMA_SIM_BAR_SIZE / sizeof(UINT32))
+#define XDMA_SIM_MAX_DESCS 0x100000 /* Guard against looped chains */
+#define XDMA_SIM_CONTIG_ALIGN 0x1000
+
+/* Identifier registers: [31:20] XDMA ID, [19:16] block, [11:8] channel,
+ * [7:0] version */
+#define XDMA_SIM_ID(block, channel) \
+    (XDMA_ID | ((block) << 16) | ((channel) << 8) | 0x06)
+enum {
+    XDMA_SIM_BLOCK_H2C = 0,
+    XDMA_SIM_BLOCK_C2H = 1,
+    XDMA_SIM_BLOCK_IRQ = 2,
+    XDMA_SIM_BLOCK_CONFIG = 3,
+    XDMA_SIM_BLOCK_H2C_SGDMA = 4,
+    XDMA_SIM_BLOCK_C2H_SGDMA = 5,
+};
+
+/* Alignments register: Byte aligned addresses and lengths, 64 bit
+ * addresses */
+#define XDMA_SIM_ALIGNMENTS 0x00010140
+#define XDMA_SIM_PCIE_DATA_WIDTH 2 /* 128 bit */
+
+/* Engine register offsets within the engine's channel registers */
+#define ENGINE_REG_MASK 0xFF
+
+typedef struct {
+    WDC_DEVICE dev;             /* Must be first: The device handle */
+    WDC_ADDR_DESC addrDesc;     /* The configuration BAR */
+    UINT32 regs[XDMA_SIM_REGS_NUM];
+    BYTE *pCardMem;
+    /* Error status of the next run of each engine (see
+     * XDMA_SimEngineErrorInject()) */
+    UINT32 u32InjectedErrArr[XDMA_SIM_CHANNELS * 2];
+    HANDLE hMutex;              /* Protects regs, pCardMem and
+                                   u32InjectedErrArr */
+
+    /* Interrupts */
+    BOOL fIntEnabled;
+    INT_HANDLER funcIntHandler;
+    PVOID pIntData;
+    WD_TRANSFER *pTransCmds;
+    DWORD dwNumCmds;
+    HANDLE hIntEvent;
+    HANDLE hIntThread;
+    BOOL fIntStop;
+} XDMA_SIM_DEV;
+
+/* Locked DMA buffer. The WD_DMA is followed by the rest of its pages */
+typedef struct {
+    PVOID pAlloc;               /* Contiguous buffer allocation */
+    WD_DMA_PAGE *pPages;        /* Transaction: All the pages of the buffer */
+    DWORD dwTotalPages;
+    DWORD dwNextPage;           /* Transaction: First page of the current
+                                   transfer */
+    DWORD dwMaxTransferSize;
+    DMA_TRANSACTION_CALLBACK funcCallback;
+    PVOID pCallbackCtx;
+    WD_DMA dma;                 /* Must be last */
+} XDMA_SIM_DMA;
+
+#define SIM_DMA(pDma) \
+    ((XDMA_SIM_DMA *)((BYTE *)(pDma) - offsetof(XDMA_SIM_DMA, dma)))
+
+#define REG(pSim, dwOffset) ((pSim)->regs[(dwOffset) / sizeof(UINT32)])
+
+/*************************************************************
+  Registers model
+ *************************************************************/
+/* Returns the interrupt request bit of an engine, numbered as the enabled
+ * engines are: All the H2C engines, then all the C2H engines */
+static UINT32 SimEngineIrqBit(BOOL fToDevice, DWORD dwChannel)
+{
+    return 1 << (fToDevice ? dwChannel : XDMA_SIM_CHANNELS + dwChannel);
+}
+
+/* Returns the channel interrupt requests that are asserted: An engine
+ * requests an interrupt while any of its status bits that are enabled in
+ * its interrupt enable mask is set */
+static UINT32 SimChannelIntPending(XDMA_SIM_DEV *pSim)
+{
+    UINT32 u32Pending = 0;
+    DWORD i;
+
+    for (i = 0; i < XDMA_SIM_CHANNELS * 2; i++)
+    {
+        BOOL fToDevice = i < XDMA_SIM_CHANNELS;
+        DWORD dwChannel = i % XDMA_SIM_CHANNELS;
+        DWORD dwBase = XDMA_CHANNEL_OFFSET(dwChannel, fToDevice ?
+            XDMA_H2C_CHANNEL_IDENTIFIER_OFFSET :
+            XDMA_C2H_CHANNEL_IDENTIFIER_OFFSET);
+
+        if (REG(pSim, dwBase + XDMA_H2C_CHANNEL_STATUS_OFFSET) &
+            REG(pSim, dwBase + XDMA_H2C_CHANNEL_INT_ENABLE_MASK_OFFSET) &
+            ~XDMA_STAT_BUSY)
+        {
+            u32Pending |= SimEngineIrqBit(fToDevice, dwChannel);
+        }
+    }
+
+    return u32Pending;
+}
+
+static UINT32 SimChannelIntRequest(XDMA_SIM_DEV *pSim)
+{
+    return SimChannelIntPending(pSim) &
+        REG(pSim, XDMA_IRQ_BLOCK_CHANNEL_INT_ENABLE_MASK_OFFSET);
+}
+
+/* Raise an interrupt if a channel interrupt request is asserted */
+static void SimIntUpdate(XDMA_SIM_DEV *pSim)
+{
+    if (pSim->fIntEnabled && SimChannelIntRequest(pSim))
+        OsEventSignal(pSim->hIntEvent);
+}
+
+static void SimCardMemCopy(XDMA_SIM_DEV *pSim, BOOL fToDevice, BYTE *pHost,
+    UINT64 u64CardAddr, UINT32 u32Bytes)
+{
+    while (u32Bytes)
+    {
+        UINT32 u32Offset = (UINT32)(u64CardAddr % XDMA_SIM_CARD_MEM_SIZE);
+        UINT32 u32Chunk = XDMA_SIM_CARD_MEM_SIZE - u32Offset;
+
+        if (u32Chunk > u32Bytes)
+            u32Chunk = u32Bytes;
+
+        if (fToDevice)
+            memcpy(pSim->pCardMem + u32Offset, pHost, u32Chunk);
+        else
+            memcpy(pHost, pSim->pCardMem + u32Offset, u32Chunk);
+
+        pHost += u32Chunk;
+        u64CardAddr += u32Chunk;
+        u32Bytes -= u32Chunk;
+    }
+}
+
+/* Run an engine's descriptors chain, from the SGDMA descriptor address
+ * registers until a descriptor with the stop bit. An injected error stops
+ * the engine before its first descriptor */
+static void SimEngineRun(XDMA_SIM_DEV *pSim, BOOL fToDevice, DWORD dwChannel)
+{
+    DWORD dwBase = XDMA_CHANNEL_OFFSET(dwChannel, fToDevice ?
+        XDMA_H2C_CHANNEL_IDENTIFIER_OFFSET :
+        XDMA_C2H_CHANNEL_IDENTIFIER_OFFSET);
+    DWORD dwSgdma = XDMA_CHANNEL_OFFSET(dwChannel, fToDevice ?
+        XDMA_H2C_SGDMA_DESC_LOW_OFFSET : XDMA_C2H_SGDMA_DESC_LOW_OFFSET);
+    UINT64 u64Desc = ((UINT64)REG(pSim, dwSgdma + 4) << 32) |
+        REG(pSim, dwSgdma);
+    UINT32 *pu32InjectedErr = &pSim->u32InjectedErrArr[fToDevice ?
+        dwChannel : XDMA_SIM_CHANNELS + dwChannel];
+    UINT32 u32Status = *pu32InjectedErr, u32Count = 0;
+    UINT64 u64WB;
+
+    *pu32InjectedErr = 0;
+    while (!(u32Status & XDMA_STAT_ERR_MASK) && u32Count < XDMA_SIM_MAX_DESCS)
+    {
+        XDMA_DMA_DESC *pDesc = (XDMA_DMA_DESC *)(UPTR)u64Desc;
+
+        if (!pDesc || (pDesc->u32Control & 0xFFFF0000) != XDMA_DESC_MAGIC)
+        {
+            u32Status |= XDMA_STAT_MAGIC_STOPPED;
+            break;
+        }
+
+        if (fToDevice)
+        {
+            SimCardMemCopy(pSim, TRUE, (BYTE *)(UPTR)pDesc->u64SrcAddr,
+                pDesc->u64DstAddr, pDesc->u32Bytes);
+        }
+        else
+        {
+            SimCardMemCopy(pSim, FALSE, (BYTE *)(UPTR)pDesc->u64DstAddr,
+                pDesc->u64SrcAddr, pDesc->u32Bytes);
+        }
+        u32Count++;
+
+        if (pDesc->u32Control & XDMA_DESC_COMPLETED)
+            u32Status |= XDMA_STAT_DESC_COMPLETED;
+        if (pDesc->u32Control & XDMA_DESC_STOPPED)
+        {
+            u32Status |= XDMA_STAT_DESC_STOPPED;
+            break;
+        }
+        u64Desc = pDesc->u64NextDesc;
+    }
+
+    REG(pSim, dwBase + XDMA_H2C_CHANNEL_COMPLETED_DESC_COUNT_OFFSET) =
+        u32Count;
+    REG(pSim, dwBase + XDMA_H2C_CHANNEL_STATUS_OFFSET) |= u32Status;
+
+    /* Poll mode write-back */
+    u64WB = ((UINT64)REG(pSim,
+        dwBase + XDMA_H2C_CHANNEL_POLL_HIGH_WRITE_BACK_ADDR_OFFSET) << 32) |
+        REG(pSim, dwBase + XDMA_H2C_CHANNEL_POLL_LOW_WRITE_BACK_ADDR_OFFSET);
+    if ((REG(pSim, dwBase + XDMA_H2C_CHANNEL_CONTROL_OFFSET) &
+        XDMA_CTRL_POLL_MODE_WB) && u64WB)
+    {
+        *(volatile UINT32 *)(UPTR)u64WB = u32Count |
+            ((u32Status & XDMA_STAT_ERR_MASK) ? XDMA_WB_ERR_MASK : 0);
+    }
+
+    SimIntUpdate(pSim);
+}
+
+/* Engine control register write: Setting the run bit starts the engine */
+static void SimEngineControlSet(XDMA_SIM_DEV *pSim, BOOL fToDevice,
+    DWORD dwChannel, UINT32 u32Control)
+{
+    DWORD dwOffset = XDMA_CHANNEL_OFFSET(dwChannel, fToDevice ?
+        XDMA_H2C_CHANNEL_CONTROL_OFFSET : XDMA_C2H_CHANNEL_CONTROL_OFFSET);
+    UINT32 u32Old = REG(pSim, dwOffset);
+
+    REG(pSim, dwOffset) = u32Control;
+    if (!(u32Old & XDMA_CTRL_RUN_STOP) && (u32Control & XDMA_CTRL_RUN_STOP))
+        SimEngineRun(pSim, fToDevice, dwChannel);
+}
+
+static UINT32 SimRegRead(XDMA_SIM_DEV *pSim, DWORD dwOffset)
+{
+    DWORD dwChannel = (dwOffset >> 8) & 0xF;
+    UINT32 val;
+
+    if (dwOffset < XDMA_IRQ_BLOCK_IDENTIFIER_OFFSET)
+    {
+        BOOL fToDevice = dwOffset < XDMA_C2H_CHANNEL_IDENTIFIER_OFFSET;
+
+        if (dwChannel >= XDMA_SIM_CHANNELS)
+            return 0;
+
+        switch (dwOffset & ENGINE_REG_MASK)
+        {
+        case XDMA_H2C_CHANNEL_IDENTIFIER_OFFSET:
+            return XDMA_SIM_ID(fToDevice ? XDMA_SIM_BLOCK_H2C :
+                XDMA_SIM_BLOCK_C2H, dwChannel);
+        case XDMA_H2C_CHANNEL_CONTROL_W1S_OFFSET:
+        case XDMA_H2C_CHANNEL_CONTROL_W1C_OFFSET:
+            return REG(pSim, (dwOffset & ~ENGINE_REG_MASK) |
+                XDMA_H2C_CHANNEL_CONTROL_OFFSET);
+        case XDMA_H2C_CHANNEL_STATUS_RC_OFFSET:
+            /* Reading clears the status */
+            dwOffset = (dwOffset & ~ENGINE_REG_MASK) |
+                XDMA_H2C_CHANNEL_STATUS_OFFSET;
+            val = REG(pSim, dwOffset);
+            REG(pSim, dwOffset) &= XDMA_STAT_BUSY;
+            return val;
+        case XDMA_H2C_CHANNEL_ALIGNMENTS_OFFSET:
+            return XDMA_SIM_ALIGNMENTS;
+        case XDMA_H2C_CHANNEL_INT_ENABLE_MASK_W1S_OFFSET:
+        case XDMA_H2C_CHANNEL_INT_ENABLE_MASK_W1C_OFFSET:
+            return REG(pSim, (dwOffset & ~ENGINE_REG_MASK) |
+                XDMA_H2C_CHANNEL_INT_ENABLE_MASK_OFFSET);
+        }
+
+        return REG(pSim, dwOffset);
+    }
+
+    switch (dwOffset)
+    {
+    case XDMA_IRQ_BLOCK_IDENTIFIER_OFFSET:
+        return XDMA_SIM_ID(XDMA_SIM_BLOCK_IRQ, 0);
+    case XDMA_IRQ_BLOCK_CHANNEL_INT_REQUEST_OFFSET:
+        return SimChannelIntRequest(pSim);
+    case XDMA_IRQ_BLOCK_CHANNEL_INT_PENDING_OFFSET:
+        return SimChannelIntPending(pSim);
+    case XDMA_CONFIG_BLOCK_IDENTIFIER_OFFSET:
+        return XDMA_SIM_ID(XDMA_SIM_BLOCK_CONFIG, 0);
+    }
+
+    if ((dwOffset & ~0xF00) == XDMA_H2C_SGDMA_IDENTIFIER_OFFSET ||
+        (dwOffset & ~0xF00) == XDMA_C2H_SGDMA_IDENTIFIER_OFFSET)
+    {
+        if (dwChannel >= XDMA_SIM_CHANNELS)
+            return 0;
+
+        return XDMA_SIM_ID((dwOffset & ~0xF00) ==
+            XDMA_H2C_SGDMA_IDENTIFIER_OFFSET ? XDMA_SIM_BLOCK_H2C_SGDMA :
+            XDMA_SIM_BLOCK_C2H_SGDMA, dwChannel);
+    }
+
+    return REG(pSim, dwOffset);
+}
+
+static void SimRegWrite(XDMA_SIM_DEV *pSim, DWORD dwOffset, UINT32 val)
+{
+    DWORD dwChannel = (dwOffset >> 8) & 0xF;
+
+    if (dwOffset < XDMA_IRQ_BLOCK_IDENTIFIER_OFFSET)
+    {
+        BOOL fToDevice = dwOffset < XDMA_C2H_CHANNEL_IDENTIFIER_OFFSET;
+        DWORD dwBase = dwOffset & ~ENGINE_REG_MASK;
+        UINT32 u32Control = REG(pSim, dwBase +
+            XDMA_H2C_CHANNEL_CONTROL_OFFSET);
+
+        if (dwChannel >= XDMA_SIM_CHANNELS)
+            return;
+
+        switch (dwOffset & ENGINE_REG_MASK)
+        {
+        case XDMA_H2C_CHANNEL_CONTROL_OFFSET:
+            SimEngineControlSet(pSim, fToDevice, dwChannel, val);
+            break;
+        case XDMA_H2C_CHANNEL_CONTROL_W1S_OFFSET:
+            SimEngineControlSet(pSim, fToDevice, dwChannel, u32Control | val);
+            break;
+        case XDMA_H2C_CHANNEL_CONTROL_W1C_OFFSET:
+            SimEngineControlSet(pSim, fToDevice, dwChannel,
+                u32Control & ~val);
+            break;
+        case XDMA_H2C_CHANNEL_INT_ENABLE_MASK_W1S_OFFSET:
+            REG(pSim, dwBase + XDMA_H2C_CHANNEL_INT_ENABLE_MASK_OFFSET) |=
+                val;
+            break;
+        case XDMA_H2C_CHANNEL_INT_ENABLE_MASK_W1C_OFFSET:
+            REG(pSim, dwBase + XDMA_H2C_CHANNEL_INT_ENABLE_MASK_OFFSET) &=
+                ~val;
+            break;
+        case XDMA_H2C_CHANNEL_IDENTIFIER_OFFSET:
+        case XDMA_H2C_CHANNEL_STATUS_OFFSET:
+        case XDMA_H2C_CHANNEL_STATUS_RC_OFFSET:
+        case XDMA_H2C_CHANNEL_COMPLETED_DESC_COUNT_OFFSET:
+        case XDMA_H2C_CHANNEL_ALIGNMENTS_OFFSET:
+            /* Read only */
+            break;
+        default:
+            REG(pSim, dwOffset) = val;
+            break;
+        }
+    }
+    else
+    {
+        switch (dwOffset)
+        {
+        case XDMA_IRQ_BLOCK_USER_INT_ENABLE_MASK_W1S_OFFSET:
+            REG(pSim, XDMA_IRQ_BLOCK_USER_INT_ENABLE_MASK_OFFSET) |= val;
+            break;
+        case XDMA_IRQ_BLOCK_USER_INT_ENABLE_MASK_W1C_OFFSET:
+            REG(pSim, XDMA_IRQ_BLOCK_USER_INT_ENABLE_MASK_OFFSET) &= ~val;
+            break;
+        case XDMA_IRQ_BLOCK_CHANNEL_INT_ENABLE_MASK_W1S_OFFSET:
+            REG(pSim, XDMA_IRQ_BLOCK_CHANNEL_INT_ENABLE_MASK_OFFSET) |= val;
+            break;
+        case XDMA_IRQ_BLOCK_CHANNEL_INT_ENABLE_MASK_W1C_OFFSET:
+            REG(pSim, XDMA_IRQ_BLOCK_CHANNEL_INT_ENABLE_MASK_OFFSET) &= ~val;
+            break;
+        case XDMA_IRQ_BLOCK_IDENTIFIER_OFFSET:
+        case XDMA_IRQ_BLOCK_CHANNEL_INT_REQUEST_OFFSET:
+        case XDMA_IRQ_BLOCK_CHANNEL_INT_PENDING_OFFSET:
+        case XDMA_CONFIG_BLOCK_IDENTIFIER_OFFSET:
+            /* Read only */
+            break;
+        default:
+            REG(pSim, dwOffset) = val;
+            break;
+        }
+    }
+
+    /* Enabling an interrupt that is already requested raises it */
+    SimIntUpdate(pSim);
+}
+
+/*************************************************************
+  Interrupts
+ *************************************************************/
+/* Simulated interrupt thread: Runs the interrupt transfer commands and the
+ * interrupt handler for every raised interrupt, as the WinDriver interrupt
+ * thread does */
+static void SimIntThread(void *pData)
+{
+    XDMA_SIM_DEV *pSim = (XDMA_SIM_DEV *)pData;
+    DWORD i;
+
+    for (;;)
+    {
+        OsEventWait(pSim->hIntEvent, INFINITE);
+        if (pSim->fIntStop)
+            break;
+
+        OsMutexLock(pSim->hMutex);
+        if (!SimChannelIntRequest(pSim))
+        {
+            /* Already handled */
+            OsMutexUnlock(pSim->hMutex);
+            continue;
+        }
+
+        for (i = 0; i < pSim->dwNumCmds; i++)
+        {
+            WD_TRANSFER *pTrans = &pSim->pTransCmds[i];
+            DWORD dwOffset = (DWORD)(pTrans->pPort - pSim->addrDesc.pAddr);
+
+            switch (pTrans->cmdTrans)
+            {
+            case RM_DWORD:
+            case RP_DWORD:
+                pTrans->Data.Dword = SimRegRead(pSim, dwOffset);
+                break;
+            case WM_DWORD:
+            case WP_DWORD:
+                SimRegWrite(pSim, dwOffset, pTrans->Data.Dword);
+                break;
+            default:
+                break;
+            }
+        }
+        OsMutexUnlock(pSim->hMutex);
+
+        pSim->funcIntHandler(pSim->pIntData);
+    }
+}
+
+DWORD XDMA_SimIntEnable(WDC_DEVICE_HANDLE hDev, WD_TRANSFER *pTransCmds,
+    DWORD dwNumCmds, DWORD dwOptions, INT_HANDLER funcIntHandler,
+    PVOID pData, BOOL fUseKP)
+{
+    XDMA_SIM_DEV *pSim = (XDMA_SIM_DEV *)hDev;
+    DWORD dwStatus;
+
+    if (!pSim || !funcIntHandler)
+        return WD_INVALID_PARAMETER;
+    if (pSim->fIntEnabled)
+        return WD_OPERATION_ALREADY_DONE;
+
+    pSim->pTransCmds = pTransCmds;
+    pSim->dwNumCmds = dwNumCmds;
+    pSim->funcIntHandler = funcIntHandler;
+    pSim->pIntData = pData;
+    pSim->fIntStop = FALSE;
+
+    dwStatus = OsEventCreate(&pSim->hIntEvent);
+    if (dwStatus != WD_STATUS_SUCCESS)
+        return dwStatus;
+
+    dwStatus = ThreadStart(&pSim->hIntThread, SimIntThread, pSim);
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        OsEventClose(pSim->hIntEvent);
+        return dwStatus;
+    }
+
+    pSim->dev.Int.dwEnabledIntType = INTERRUPT_MESSAGE;
+    pSim->fIntEnabled = TRUE;
+
+    UNUSED_VAR(dwOptions);
+    UNUSED_VAR(fUseKP);
+
+    return WD_STATUS_SUCCESS;
+}
+
+DWORD XDMA_SimIntDisable(WDC_DEVICE_HANDLE hDev)
+{
+    XDMA_SIM_DEV *pSim = (XDMA_SIM_DEV *)hDev;
+
+    if (!pSim)
+        return WD_INVALID_PARAMETER;
+    if (!pSim->fIntEnabled)
+        return WD_INTERRUPT_NOT_ENABLED;
+
+    pSim->fIntEnabled = FALSE;
+    pSim->fIntStop = TRUE;
+    OsEventSignal(pSim->hIntEvent);
+    ThreadWait(pSim->hIntThread);
+    OsEventClose(pSim->hIntEvent);
+    pSim->hIntThread = NULL;
+    pSim->hIntEvent = NULL;
+
+    return WD_STATUS_SUCCESS;
+}
+
+BOOL XDMA_SimIntIsEnabled(WDC_DEVICE_HANDLE hDev)
+{
+    return hDev && ((XDMA_SIM_DEV *)hDev)->fIntEnabled;
+}
+
+/*************************************************************
+  Device
+ *************************************************************/
+DWORD XDMA_SimDriverOpen(DWORD dwOptions, const CHAR *sLicense)
+{
+    UNUSED_VAR(dwOptions);
+    UNUSED_VAR(sLicense);
+
+    return WD_STATUS_SUCCESS;
+}
+
+DWORD XDMA_SimDriverClose(void)
+{
+    return WD_STATUS_SUCCESS;
+}
+
+DWORD XDMA_SimSetDebugOptions(DWORD dwLevel, const CHAR *sDbgFile)
+{
+    UNUSED_VAR(dwLevel);
+    UNUSED_VAR(sDbgFile);
+
+    return WD_STATUS_SUCCESS;
+}
+
+WDC_DEVICE_HANDLE XDMA_SimDeviceOpen(DWORD dwVendorId, DWORD dwDeviceId,
+    const CHAR *sKpName, DWORD dwDevCtxSize)
+{
+    XDMA_SIM_DEV *pSim;
+
+    UNUSED_VAR(dwVendorId);
+    UNUSED_VAR(dwDeviceId);
+    UNUSED_VAR(sKpName);
+
+    pSim = (XDMA_SIM_DEV *)calloc(1, sizeof(XDMA_SIM_DEV));
+    if (!pSim)
+        return NULL;
+
+    pSim->dev.pCtx = calloc(1, dwDevCtxSize);
+    pSim->pCardMem = (BYTE *)calloc(1, XDMA_SIM_CARD_MEM_SIZE);
+    if (!pSim->dev.pCtx || !pSim->pCardMem ||
+        OsMutexCreate(&pSim->hMutex) != WD_STATUS_SUCCESS)
+    {
+        goto Error;
+    }
+
+    /* Registers are accessed only through XDMA_SimReadAddr32() and
+     * XDMA_SimWriteAddr32(): The BAR has no direct user mode mapping, see
+     * the limitations in xdma_sim.h */
+    pSim->addrDesc.dwAddrSpace = 0;
+    pSim->addrDesc.fIsMemory = TRUE;
+    pSim->addrDesc.qwBytes = XDMA_SIM_BAR_SIZE;
+    pSim->dev.dwNumAddrSpaces = 1;
+    pSim->dev.pAddrDesc = &pSim->addrDesc;
+
+    REG(pSim, XDMA_CONFIG_BLOCK_PCIE_DATA_WIDTH_OFFSET) =
+        XDMA_SIM_PCIE_DATA_WIDTH;
+
+    return (WDC_DEVICE_HANDLE)pSim;
+
+Error:
+    free(pSim->pCardMem);
+    free(pSim->dev.pCtx);
+    free(pSim);
+
+    return NULL;
+}
+
+BOOL XDMA_SimDeviceClose(WDC_DEVICE_HANDLE hDev)
+{
+    XDMA_SIM_DEV *pSim = (XDMA_SIM_DEV *)hDev;
+
+    if (!pSim)
+        return FALSE;
+
+    if (pSim->fIntEnabled)
+        XDMA_SimIntDisable(hDev);
+
+    OsMutexClose(pSim->hMutex);
+    free(pSim->pCardMem);
+    free(pSim->dev.pCtx);
+    free(pSim);
+
+    return TRUE;
+}
+
+DWORD XDMA_SimGetNumAddrSpaces(WDC_DEVICE_HANDLE hDev)
+{
+    return hDev ? ((PWDC_DEVICE)hDev)->dwNumAddrSpaces : 0;
+}
+
+BOOL XDMA_SimAddrSpaceIsActive(WDC_DEVICE_HANDLE hDev, DWORD dwAddrSpace)
+{
+    return hDev && dwAddrSpace < ((PWDC_DEVICE)hDev)->dwNumAddrSpaces;
+}
+
+DWORD XDMA_SimPciReadCfg8(WDC_DEVICE_HANDLE hDev, DWORD dwOffset, BYTE *val)
+{
+    UNUSED_VAR(hDev);
+    UNUSED_VAR(dwOffset);
+
+    *val = 0;
+
+    return WD_STATUS_SUCCESS;
+}
+
+DWORD XDMA_SimReadAddr32(WDC_DEVICE_HANDLE hDev, DWORD dwAddrSpace,
+    KPTR dwOffset, UINT32 *val)
+{
+    XDMA_SIM_DEV *pSim = (XDMA_SIM_DEV *)hDev;
+
+    if (!pSim || dwAddrSpace || dwOffset >= XDMA_SIM_BAR_SIZE ||
+        (dwOffset & 3))
+    {
+        return WD_INVALID_PARAMETER;
+    }
+
+    OsMutexLock(pSim->hMutex);
+    *val = SimRegRead(pSim, (DWORD)dwOffset);
+    OsMutexUnlock(pSim->hMutex);
+
+    return WD_STATUS_SUCCESS;
+}
+
+DWORD XDMA_SimWriteAddr32(WDC_DEVICE_HANDLE hDev, DWORD dwAddrSpace,
+    KPTR dwOffset, UINT32 val)
+{
+    XDMA_SIM_DEV *pSim = (XDMA_SIM_DEV *)hDev;
+
+    if (!pSim || dwAddrSpace || dwOffset >= XDMA_SIM_BAR_SIZE ||
+        (dwOffset & 3))
+    {
+        return WD_INVALID_PARAMETER;
+    }
+
+    OsMutexLock(pSim->hMutex);
+    SimRegWrite(pSim, (DWORD)dwOffset, val);
+    OsMutexUnlock(pSim->hMutex);
+
+    return WD_STATUS_SUCCESS;
+}
+
+DWORD XDMA_SimEngineErrorInject(WDC_DEVICE_HANDLE hDev, BOOL fToDevice,
+    DWORD dwChannel, UINT32 u32Status)
+{
+    XDMA_SIM_DEV *pSim = (XDMA_SIM_DEV *)hDev;
+
+    if (!pSim || dwChannel >= XDMA_SIM_CHANNELS || !u32Status ||
+        (u32Status & ~XDMA_STAT_ERR_MASK))
+    {
+        return WD_INVALID_PARAMETER;
+    }
+
+    OsMutexLock(pSim->hMutex);
+    pSim->u32InjectedErrArr[fToDevice ? dwChannel :
+        XDMA_SIM_CHANNELS + dwChannel] = u32Status;
+    OsMutexUnlock(pSim->hMutex);
+
+    return WD_STATUS_SUCCESS;
+}
+
+DWORD XDMA_SimCallKerPlug(WDC_DEVICE_HANDLE hDev, DWORD dwMsg,
+    PVOID pData, DWORD *pdwResult)
+{
+    UNUSED_VAR(hDev);
+    UNUSED_VAR(dwMsg);
+    UNUSED_VAR(pData);
+
+    if (pdwResult)
+        *pdwResult = KP_XDMA_STATUS_MSG_NO_IMPL;
+
+    return WD_NOT_IMPLEMENTED;
+}
+
+DWORD XDMA_SimEventRegister(WDC_DEVICE_HANDLE hDev, DWORD dwActions,
+    EVENT_HANDLER funcEventHandler, PVOID pData, BOOL fUseKP)
+{
+    UNUSED_VAR(hDev);
+    UNUSED_VAR(dwActions);
+    UNUSED_VAR(funcEventHandler);
+    UNUSED_VAR(pData);
+    UNUSED_VAR(fUseKP);
+
+    return WD_NOT_IMPLEMENTED;
+}
+
+DWORD XDMA_SimEventUnregister(WDC_DEVICE_HANDLE hDev)
+{
+    UNUSED_VAR(hDev);
+
+    return WD_NOT_IMPLEMENTED;
+}
+
+BOOL XDMA_SimEventIsRegistered(WDC_DEVICE_HANDLE hDev)
+{
+    UNUSED_VAR(hDev);
+
+    return FALSE;
+}
+
+/*************************************************************
+  DMA buffers
+ *************************************************************/
+static XDMA_SIM_DMA *SimDmaAlloc(PVOID pBuf, DWORD dwBytes, DWORD dwOptions,
+    DWORD dwPages)
+{
+    XDMA_SIM_DMA *pSimDma = (XDMA_SIM_DMA *)calloc(1,
+        sizeof(XDMA_SIM_DMA) + dwPages * sizeof(WD_DMA_PAGE));
+
+    if (!pSimDma)
+        return NULL;
+
+    pSimDma->dma.pUserAddr = pBuf;
+    pSimDma->dma.pKernelAddr = (KPTR)(UPTR)pBuf;
+    pSimDma->dma.dwBytes = dwBytes;
+    pSimDma->dma.dwOptions = dwOptions;
+
+    return pSimDma;
+}
+
+/* Splits a buffer to its pages, with the virtual addresses as the DMA
+ * addresses. Returns the number of pages */
+static DWORD SimPagesGet(PVOID pBuf, DWORD dwBytes, BOOL fMerge,
+    WD_DMA_PAGE *pPages)
+{
+    UPTR pAddr = (UPTR)pBuf;
+    DWORD dwPageSize = GetPageSize(), dwPages = 0;
+
+    while (dwBytes)
+    {
+        DWORD dwChunk = fMerge ? dwBytes :
+            dwPageSize - (DWORD)(pAddr % dwPageSize);
+
+        if (dwChunk > dwBytes)
+            dwChunk = dwBytes;
+        if (pPages)
+        {
+            pPages[dwPages].pPhysicalAddr = (DMA_ADDR)pAddr;
+            pPages[dwPages].dwBytes = dwChunk;
+        }
+
+        pAddr += dwChunk;
+        dwBytes -= dwChunk;
+        dwPages++;
+    }
+
+    return dwPages;
+}
+
+DWORD XDMA_SimDMASGBufLock(WDC_DEVICE_HANDLE hDev, PVOID pBuf,
+    DWORD dwOptions, DWORD dwBytes, WD_DMA **ppDma)
+{
+    /* The buffer is virtually contiguous: Merging adjacent pages results in
+     * a single page */
+    BOOL fMerge = !(dwOptions & DMA_DISABLE_MERGE_ADJACENT_PAGES);
+    XDMA_SIM_DMA *pSimDma;
+
+    if (!hDev || !pBuf || !dwBytes || !ppDma)
+        return WD_INVALID_PARAMETER;
+
+    pSimDma = SimDmaAlloc(pBuf, dwBytes, dwOptions,
+        SimPagesGet(pBuf, dwBytes, fMerge, NULL));
+    if (!pSimDma)
+        return WD_INSUFFICIENT_RESOURCES;
+
+    pSimDma->dma.dwPages = SimPagesGet(pBuf, dwBytes, fMerge,
+        pSimDma->dma.Page);
+    *ppDma = &pSimDma->dma;
+
+    return WD_STATUS_SUCCESS;
+}
+
+DWORD XDMA_SimDMAContigBufLock(WDC_DEVICE_HANDLE hDev, PVOID *ppBuf,
+    DWORD dwOptions, DWORD dwBytes, WD_DMA **ppDma)
+{
+    XDMA_SIM_DMA *pSimDma;
+    PVOID pAlloc;
+    UPTR pBuf;
+
+    if (!hDev || !ppBuf || !dwBytes || !ppDma)
+        return WD_INVALID_PARAMETER;
+
+    pAlloc = calloc(1, dwBytes + XDMA_SIM_CONTIG_ALIGN);
+    if (!pAlloc)
+        return WD_INSUFFICIENT_RESOURCES;
+    pBuf = __ALIGN_UP((UPTR)pAlloc, XDMA_SIM_CONTIG_ALIGN);
+
+    pSimDma = SimDmaAlloc((PVOID)pBuf, dwBytes, dwOptions, 1);
+    if (!pSimDma)
+    {
+        free(pAlloc);
+        return WD_INSUFFICIENT_RESOURCES;
+    }
+
+    pSimDma->pAlloc = pAlloc;
+    pSimDma->dma.dwPages = 1;
+    pSimDma->dma.Page[0].pPhysicalAddr = (DMA_ADDR)pBuf;
+    pSimDma->dma.Page[0].dwBytes = dwBytes;
+    *ppBuf = (PVOID)pBuf;
+    *ppDma = &pSimDma->dma;
+
+    return WD_STATUS_SUCCESS;
+}
+
+DWORD XDMA_SimDMABufUnlock(WD_DMA *pDma)
+{
+    XDMA_SIM_DMA *pSimDma;
+
+    if (!pDma)
+        return WD_INVALID_PARAMETER;
+
+    pSimDma = SIM_DMA(pDma);
+    free(pSimDma->pAlloc);
+    free(pSimDma->pPages);
+    free(pSimDma);
+
+    return WD_STATUS_SUCCESS;
+}
+
+/* Host buffers are accessed by the CPU, so they are always coherent */
+DWORD XDMA_SimDMASync(WD_DMA *pDma)
+{
+    return pDma ? WD_STATUS_SUCCESS : WD_INVALID_PARAMETER;
+}
+
+/* Sets the pages of the current transaction transfer, up to the maximal
+ * transfer size */
+static void SimTransferPagesSet(XDMA_SIM_DMA *pSimDma)
+{
+    DWORD dwBytes = 0, i = pSimDma->dwNextPage;
+
+    pSimDma->dma.dwPages = 0;
+    for (; i < pSimDma->dwTotalPages; i++)
+    {
+        if (pSimDma->dma.dwPages &&
+            dwBytes + pSimDma->pPages[i].dwBytes >
+            pSimDma->dwMaxTransferSize)
+        {
+            break;
+        }
+
+        pSimDma->dma.Page[pSimDma->dma.dwPages++] = pSimDma->pPages[i];
+        dwBytes += pSimDma->pPages[i].dwBytes;
+    }
+}
+
+DWORD XDMA_SimDMATransactionSGInit(WDC_DEVICE_HANDLE hDev, PVOID pBuf,
+    DWORD dwOptions, DWORD dwBytes, WD_DMA **ppDma, PVOID pTransactionCtx,
+    DWORD dwMaxTransferSize, DWORD dwTransferElementSize)
+{
+    XDMA_SIM_DMA *pSimDma;
+    DWORD dwPages;
+
+    if (!hDev || !pBuf || !dwBytes || !ppDma || !dwMaxTransferSize)
+        return WD_INVALID_PARAMETER;
+
+    dwPages = SimPagesGet(pBuf, dwBytes, FALSE, NULL);
+    pSimDma = SimDmaAlloc(pBuf, dwBytes, dwOptions, dwPages);
+    if (!pSimDma)
+        return WD_INSUFFICIENT_RESOURCES;
+
+    pSimDma->pPages = (WD_DMA_PAGE *)malloc(dwPages * sizeof(WD_DMA_PAGE));
+    if (!pSimDma->pPages)
+    {
+        free(pSimDma);
+        return WD_INSUFFICIENT_RESOURCES;
+    }
+    pSimDma->dwTotalPages = SimPagesGet(pBuf, dwBytes, FALSE,
+        pSimDma->pPages);
+    pSimDma->dwMaxTransferSize = dwMaxTransferSize;
+    *ppDma = &pSimDma->dma;
+
+    UNUSED_VAR(pTransactionCtx);
+    UNUSED_VAR(dwTransferElementSize);
+
+    return WD_STATUS_SUCCESS;
+}
+
+DWORD XDMA_SimDMATransactionExecute(WD_DMA *pDma,
+    DMA_TRANSACTION_CALLBACK funcDMATransactionCallback,
+    PVOID DMATransactionCallbackCtx)
+{
+    XDMA_SIM_DMA *pSimDma;
+
+    if (!pDma || !funcDMATransactionCallback)
+        return WD_INVALID_PARAMETER;
+
+    pSimDma = SIM_DMA(pDma);
+    pSimDma->funcCallback = funcDMATransactionCallback;
+    pSimDma->pCallbackCtx = DMATransactionCallbackCtx;
+    pSimDma->dwNextPage = 0;
+    SimTransferPagesSet(pSimDma);
+
+    pSimDma->funcCallback(pSimDma->pCallbackCtx);
+
+    return WD_STATUS_SUCCESS;
+}
+
+DWORD XDMA_SimDMATransferCompletedAndCheck(WD_DMA *pDma, BOOL fRunCallback)
+{
+    XDMA_SIM_DMA *pSimDma;
+
+    if (!pDma)
+        return WD_INVALID_PARAMETER;
+
+    pSimDma = SIM_DMA(pDma);
+    pSimDma->dwNextPage += pDma->dwPages;
+    if (pSimDma->dwNextPage >= pSimDma->dwTotalPages)
+        return WD_STATUS_SUCCESS;
+
+    SimTransferPagesSet(pSimDma);
+    if (fRunCallback && pSimDma->funcCallback)
+        pSimDma->funcCallback(pSimDma->pCallbackCtx);
+
+    return WD_MORE_PROCESSING_REQUIRED;
+}
+
+DWORD XDMA_SimDMATransactionRelease(WD_DMA *pDma)
+{
+    XDMA_SIM_DMA *pSimDma;
+
+    if (!pDma)
+        return WD_INVALID_PARAMETER;
+
+    pSimDma = SIM_DMA(pDma);
+    pSimDma->dwNextPage = 0;
+    pSimDma->funcCallback = NULL;
+    pDma->dwPages = 0;
+
+    return WD_STATUS_SUCCESS;
+}
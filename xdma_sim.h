@@ -0,0 +1,165 @@
+/* Jungo Connectivity Confidential. Copyright (c) 2023 Jungo Connectivity Ltd.  https://www.jungo.com */
+
+/****************************************************************************
+*  File: xdma_sim.h
+*
+*  Software model of an XDMA device, for running the XDMA library and its
+*  DMA performance tests without a card (XDMA_SIM builds).
+*
+*  When XDMA_SIM is defined, xdma_lib.c includes this header, and the WDC
+*  device, DMA and interrupt calls of the library are redirected to the
+*  model. The model has a single memory BAR with the H2C/C2H channel, IRQ
+*  block, config block and SGDMA registers. Setting the run bit of an engine
+*  walks its descriptors chain, copies the data to/from a card memory
+*  buffer, updates the engine status, the completed descriptors count and
+*  the poll mode write-back buffer, and raises the engine's interrupt from a
+*  simulated interrupt thread. Engine errors are injected with
+*  XDMA_SimEngineErrorInject().
+*
+*  Limitations: Only memory mapped (not streaming) engines are modeled, a
+*  chain runs to its end at once when its engine is started, the
+*  non-incrementing address mode is not modeled, and the Kernel PlugIn and
+*  the performance monitor are not available. The register access menus of
+*  xdma_diag use WinDriver directly and cannot be used with the model.
+*  The BAR has no direct user mode mapping: The model acts on register
+*  accesses (read-to-clear status, W1S/W1C, starting an engine), which plain
+*  memory cannot trap. So the library's direct register access path
+*  (XDMA_ENGINE_REGS, used when the configuration BAR is mapped to user
+*  mode) is not exercised by the model; its register batches path is used
+*  instead. Measure the direct path on a card.
+*
+*  Note: This code sample is provided AS-IS and as a guiding sample only.
+*****************************************************************************/
+
+#ifndef _XDMA_SIM_H_
+#define _XDMA_SIM_H_
+
+#include "wdc_lib.h"
+#include "wdc_defs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Number of H2C and C2H channels of the model */
+#ifndef XDMA_SIM_CHANNELS
+    #define XDMA_SIM_CHANNELS 4
+#endif
+
+/* Card memory size of the model. FPGA offsets wrap around it */
+#ifndef XDMA_SIM_CARD_MEM_SIZE
+    #define XDMA_SIM_CARD_MEM_SIZE (64 * 1024 * 1024)
+#endif
+
+DWORD XDMA_SimDriverOpen(DWORD dwOptions, const CHAR *sLicense);
+DWORD XDMA_SimDriverClose(void);
+DWORD XDMA_SimSetDebugOptions(DWORD dwLevel, const CHAR *sDbgFile);
+
+WDC_DEVICE_HANDLE XDMA_SimDeviceOpen(DWORD dwVendorId, DWORD dwDeviceId,
+    const CHAR *sKpName, DWORD dwDevCtxSize);
+BOOL XDMA_SimDeviceClose(WDC_DEVICE_HANDLE hDev);
+DWORD XDMA_SimGetNumAddrSpaces(WDC_DEVICE_HANDLE hDev);
+BOOL XDMA_SimAddrSpaceIsActive(WDC_DEVICE_HANDLE hDev, DWORD dwAddrSpace);
+DWORD XDMA_SimPciReadCfg8(WDC_DEVICE_HANDLE hDev, DWORD dwOffset, BYTE *val);
+
+DWORD XDMA_SimReadAddr32(WDC_DEVICE_HANDLE hDev, DWORD dwAddrSpace,
+    KPTR dwOffset, UINT32 *val);
+DWORD XDMA_SimWriteAddr32(WDC_DEVICE_HANDLE hDev, DWORD dwAddrSpace,
+    KPTR dwOffset, UINT32 val);
+
+DWORD XDMA_SimDMASGBufLock(WDC_DEVICE_HANDLE hDev, PVOID pBuf,
+    DWORD dwOptions, DWORD dwBytes, WD_DMA **ppDma);
+DWORD XDMA_SimDMAContigBufLock(WDC_DEVICE_HANDLE hDev, PVOID *ppBuf,
+    DWORD dwOptions, DWORD dwBytes, WD_DMA **ppDma);
+DWORD XDMA_SimDMABufUnlock(WD_DMA *pDma);
+DWORD XDMA_SimDMASync(WD_DMA *pDma);
+DWORD XDMA_SimDMATransactionSGInit(WDC_DEVICE_HANDLE hDev, PVOID pBuf,
+    DWORD dwOptions, DWORD dwBytes, WD_DMA **ppDma, PVOID pTransactionCtx,
+    DWORD dwMaxTransferSize, DWORD dwTransferElementSize);
+DWORD XDMA_SimDMATransactionExecute(WD_DMA *pDma,
+    DMA_TRANSACTION_CALLBACK funcDMATransactionCallback,
+    PVOID DMATransactionCallbackCtx);
+DWORD XDMA_SimDMATransferCompletedAndCheck(WD_DMA *pDma,
+    BOOL fRunCallback);
+DWORD XDMA_SimDMATransactionRelease(WD_DMA *pDma);
+
+DWORD XDMA_SimIntEnable(WDC_DEVICE_HANDLE hDev, WD_TRANSFER *pTransCmds,
+    DWORD dwNumCmds, DWORD dwOptions, INT_HANDLER funcIntHandler,
+    PVOID pData, BOOL fUseKP);
+DWORD XDMA_SimIntDisable(WDC_DEVICE_HANDLE hDev);
+BOOL XDMA_SimIntIsEnabled(WDC_DEVICE_HANDLE hDev);
+
+DWORD XDMA_SimCallKerPlug(WDC_DEVICE_HANDLE hDev, DWORD dwMsg,
+    PVOID pData, DWORD *pdwResult);
+DWORD XDMA_SimEventRegister(WDC_DEVICE_HANDLE hDev, DWORD dwActions,
+    EVENT_HANDLER funcEventHandler, PVOID pData, BOOL fUseKP);
+DWORD XDMA_SimEventUnregister(WDC_DEVICE_HANDLE hDev);
+BOOL XDMA_SimEventIsRegistered(WDC_DEVICE_HANDLE hDev);
+
+/* Fail the next run of the engine of dwChannel/fToDevice: The engine stops
+ * before its first descriptor, with the u32Status error bits
+ * (XDMA_STAT_ERR_MASK) set in its status */
+DWORD XDMA_SimEngineErrorInject(WDC_DEVICE_HANDLE hDev, BOOL fToDevice,
+    DWORD dwChannel, UINT32 u32Status);
+
+#if defined(XDMA_SIM) && !defined(XDMA_SIM_IMPL)
+    #undef WDC_DriverOpen
+    #define WDC_DriverOpen XDMA_SimDriverOpen
+    #undef WDC_DriverClose
+    #define WDC_DriverClose XDMA_SimDriverClose
+    #undef WDC_SetDebugOptions
+    #define WDC_SetDebugOptions XDMA_SimSetDebugOptions
+    #undef WDC_DIAG_DeviceFindAndOpen
+    #define WDC_DIAG_DeviceFindAndOpen XDMA_SimDeviceOpen
+    #undef WDC_DIAG_DeviceClose
+    #define WDC_DIAG_DeviceClose XDMA_SimDeviceClose
+    #undef WDC_DIAG_GetNumAddrSpaces
+    #define WDC_DIAG_GetNumAddrSpaces XDMA_SimGetNumAddrSpaces
+    #undef WDC_AddrSpaceIsActive
+    #define WDC_AddrSpaceIsActive XDMA_SimAddrSpaceIsActive
+    #undef WDC_PciReadCfg8
+    #define WDC_PciReadCfg8 XDMA_SimPciReadCfg8
+    #undef WDC_ReadAddr32
+    #define WDC_ReadAddr32 XDMA_SimReadAddr32
+    #undef WDC_WriteAddr32
+    #define WDC_WriteAddr32 XDMA_SimWriteAddr32
+    #undef WDC_DMASGBufLock
+    #define WDC_DMASGBufLock XDMA_SimDMASGBufLock
+    #undef WDC_DMAContigBufLock
+    #define WDC_DMAContigBufLock XDMA_SimDMAContigBufLock
+    #undef WDC_DMABufUnlock
+    #define WDC_DMABufUnlock XDMA_SimDMABufUnlock
+    #undef WDC_DMASyncCpu
+    #define WDC_DMASyncCpu XDMA_SimDMASync
+    #undef WDC_DMASyncIo
+    #define WDC_DMASyncIo XDMA_SimDMASync
+    #undef WDC_DMATransactionSGInit
+    #define WDC_DMATransactionSGInit XDMA_SimDMATransactionSGInit
+    #undef WDC_DMATransactionExecute
+    #define WDC_DMATransactionExecute XDMA_SimDMATransactionExecute
+    #undef WDC_DMATransferCompletedAndCheck
+    #define WDC_DMATransferCompletedAndCheck \
+        XDMA_SimDMATransferCompletedAndCheck
+    #undef WDC_DMATransactionRelease
+    #define WDC_DMATransactionRelease XDMA_SimDMATransactionRelease
+    #undef WDC_IntEnable
+    #define WDC_IntEnable XDMA_SimIntEnable
+    #undef WDC_IntDisable
+    #define WDC_IntDisable XDMA_SimIntDisable
+    #undef WDC_IntIsEnabled
+    #define WDC_IntIsEnabled XDMA_SimIntIsEnabled
+    #undef WDC_CallKerPlug
+    #define WDC_CallKerPlug XDMA_SimCallKerPlug
+    #undef WDC_EventRegister
+    #define WDC_EventRegister XDMA_SimEventRegister
+    #undef WDC_EventUnregister
+    #define WDC_EventUnregister XDMA_SimEventUnregister
+    #undef WDC_EventIsRegistered
+    #define WDC_EventIsRegistered XDMA_SimEventIsRegistered
+#endif /* defined(XDMA_SIM) && !defined(XDMA_SIM_IMPL) */
+
+#ifdef __cplusplus
+}
+#endif /* C */
+
+#endif /* _XDMA_SIM_H_ */
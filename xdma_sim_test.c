@@ -0,0 +1,504 @@
+/* Jungo Connectivity Confidential. Copyright (c) 2023 Jungo Connectivity Ltd.  https://www.jungo.com */
+
+/****************************************************************************
+*  File: xdma_sim_test.c
+*
+*  Functional tests of the XDMA library, run on the software model of the
+*  XDMA device (xdma_sim_test, an XDMA_SIM build - see xdma_sim.h). Each test
+*  opens its own DMA handles on channel TEST_CHANNEL of the model:
+*    - retarget: XDMA_DmaRetarget() of a host to device and a device to host
+*      DMA handle to part of their buffers at another FPGA offset
+*    - desc-pool-full: Transfers of DMA handles that lock their own
+*      descriptors buffers, because the device DMA pool is full
+*    - sg-pool: Reuse of the SG DMA buffers pool's buffers, and closing a DMA
+*      handle after its pool was destroyed and another pool was created
+*    - queue-error: An engine error of a request of an interrupt driven
+*      submission queue (injected by XDMA_SimEngineErrorInject())
+*
+*  Usage: xdma_sim_test [test ...] (default: all the tests)
+*
+*  Note: This code sample is provided AS-IS and as a guiding sample only.
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "utils.h"
+#include "status_strings.h"
+#include "xdma_lib.h"
+#include "xdma_sim.h"
+
+#define TEST_CHANNEL 0
+
+/* Buffer size and FPGA offset of the tests' transfers */
+#define TEST_BYTES (64 * 1024)
+#define TEST_OFFSET 0x10000
+
+/* Retargeted transfer size. Not a multiple of the page size, so the
+ * retargeted chain ends inside a descriptor */
+#define TEST_RETARGET_BYTES (3 * 4096 + 64)
+
+/* Maximal number of single page DMA handles that fill the device DMA pool */
+#define TEST_POOL_HANDLES 4096
+
+/* Open/close cycles of the SG DMA buffers pool test */
+#define TEST_SG_POOL_CYCLES 16
+
+/* Time to wait for the completion of a queued request, in seconds */
+#define TEST_COMPLETION_TIMEOUT_SEC 5
+
+typedef struct {
+    const char *sName;
+    BOOL (*funcTest)(WDC_DEVICE_HANDLE hDev);
+} XDMA_SIM_TEST;
+
+static const char *gsTest; /* Name of the running test */
+
+/* Report a failure of the running test */
+static void TestErr(const char *sFormat, ...)
+{
+    va_list args;
+
+    printf("%s: ", gsTest);
+    va_start(args, sFormat);
+    vprintf(sFormat, args);
+    va_end(args);
+}
+
+/* Open a polling DMA handle of TEST_BYTES bytes */
+static BOOL TestDmaOpen(WDC_DEVICE_HANDLE hDev, XDMA_DMA_HANDLE *phDma,
+    BOOL fToDevice)
+{
+    DWORD dwStatus;
+
+    dwStatus = XDMA_DmaOpen(hDev, phDma, TEST_BYTES, 0, fToDevice,
+        TEST_CHANNEL, TRUE, FALSE, NULL, FALSE);
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        *phDma = NULL;
+        TestErr("Failed opening a DMA handle. Error 0x%x - %s\n", dwStatus,
+            Stat2Str(dwStatus));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Transfer the first dwBytes bytes of a DMA handle's buffer at TEST_OFFSET,
+ * and wait for the transfer to complete */
+static BOOL TestTransfer(XDMA_DMA_HANDLE hDma, DWORD dwBytes)
+{
+    DWORD dwStatus;
+
+    dwStatus = XDMA_DmaRetarget(hDma, TEST_OFFSET, dwBytes);
+    if (dwStatus == WD_STATUS_SUCCESS)
+        dwStatus = XDMA_DmaTransferStart(hDma);
+    if (dwStatus == WD_STATUS_SUCCESS)
+        dwStatus = XDMA_DmaPollCompletion(hDma);
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        TestErr("Transfer of %d bytes failed. Error 0x%x - %s\n", dwBytes,
+            dwStatus, Stat2Str(dwStatus));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Write a pattern through the first dwBytes bytes of hToDev, read it back
+ * through hFromDev, and check that exactly dwBytes bytes were transferred */
+static BOOL TestRoundTrip(XDMA_DMA_HANDLE hToDev, XDMA_DMA_HANDLE hFromDev,
+    DWORD dwBytes)
+{
+    BYTE *pToDev, *pFromDev;
+    DWORD i, dwBufBytes;
+
+    pToDev = (BYTE *)XDMA_DmaBufferGet(hToDev, &dwBufBytes);
+    for (i = 0; i < dwBufBytes; i++)
+        pToDev[i] = (BYTE)(i * 7 + 1);
+    pFromDev = (BYTE *)XDMA_DmaBufferGet(hFromDev, &dwBufBytes);
+    memset(pFromDev, 0, dwBufBytes);
+
+    if (!TestTransfer(hToDev, dwBytes) || !TestTransfer(hFromDev, dwBytes))
+        return FALSE;
+
+    for (i = 0; i < dwBufBytes; i++)
+    {
+        BYTE bExpected = i < dwBytes ? pToDev[i] : 0;
+
+        if (pFromDev[i] != bExpected)
+        {
+            TestErr("Byte %d is 0x%x, expected 0x%x\n", i, pFromDev[i],
+                bExpected);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/* Retarget a host to device and a device to host DMA handle to part of
+ * their buffers at another FPGA offset, check that exactly that part is
+ * transferred, and retarget back to the whole buffer */
+static BOOL TestRetarget(WDC_DEVICE_HANDLE hDev)
+{
+    XDMA_DMA_HANDLE hToDev = NULL, hFromDev = NULL;
+    BOOL fPassed = FALSE;
+
+    if (!TestDmaOpen(hDev, &hToDev, TRUE) ||
+        !TestDmaOpen(hDev, &hFromDev, FALSE))
+    {
+        goto Exit;
+    }
+
+    fPassed = TestRoundTrip(hToDev, hFromDev, TEST_RETARGET_BYTES) &&
+        TestTransfer(hFromDev, TEST_BYTES);
+
+Exit:
+    if (hFromDev)
+        XDMA_DmaClose(hFromDev);
+    if (hToDev)
+        XDMA_DmaClose(hToDev);
+
+    return fPassed;
+}
+
+/* Fill the device DMA pool with queued single page DMA handles, so that the
+ * next DMA handles lock their descriptors buffers on their own, and check a
+ * round trip through such handles */
+static BOOL TestDescPoolFull(WDC_DEVICE_HANDLE hDev)
+{
+    XDMA_DMA_HANDLE *pFillers, hToDev = NULL, hFromDev = NULL;
+    DWORD i, dwFillers = 0, dwStatus;
+    BOOL fPassed = FALSE;
+
+    pFillers = (XDMA_DMA_HANDLE *)calloc(TEST_POOL_HANDLES,
+        sizeof(XDMA_DMA_HANDLE));
+    if (!pFillers)
+    {
+        TestErr("Failed allocating memory\n");
+        return FALSE;
+    }
+
+    /* Each handle takes one pool block. The first handle that is not pooled
+     * found the pool full */
+    do {
+        dwStatus = XDMA_DmaOpenEx(hDev, &pFillers[dwFillers], GetPageSize(),
+            0, TRUE, TEST_CHANNEL, TRUE, FALSE, NULL, XDMA_DMA_OPT_QUEUED);
+        if (dwStatus != WD_STATUS_SUCCESS)
+        {
+            TestErr("Failed opening a queued DMA handle. Error 0x%x - %s\n",
+                dwStatus, Stat2Str(dwStatus));
+            goto Exit;
+        }
+    } while (XDMA_DmaDescIsPooled(pFillers[dwFillers++]) &&
+        dwFillers < TEST_POOL_HANDLES);
+
+    if (XDMA_DmaDescIsPooled(pFillers[dwFillers - 1]))
+    {
+        TestErr("The pool is not full after %d handles\n", dwFillers);
+        goto Exit;
+    }
+
+    if (!TestDmaOpen(hDev, &hToDev, TRUE) ||
+        !TestDmaOpen(hDev, &hFromDev, FALSE))
+    {
+        goto Exit;
+    }
+
+    if (XDMA_DmaDescIsPooled(hToDev) || XDMA_DmaDescIsPooled(hFromDev))
+    {
+        TestErr("A DMA handle was pooled\n");
+        goto Exit;
+    }
+
+    fPassed = TestRoundTrip(hToDev, hFromDev, TEST_BYTES);
+
+Exit:
+    if (hFromDev)
+        XDMA_DmaClose(hFromDev);
+    if (hToDev)
+        XDMA_DmaClose(hToDev);
+    for (i = 0; i < dwFillers; i++)
+        XDMA_DmaClose(pFillers[i]);
+    free(pFillers);
+
+    return fPassed;
+}
+
+static void TestSGPoolStatsWrite(const char *sStage,
+    XDMA_SG_POOL_STATS *pStats)
+{
+    printf("%s: %s: hits %llu, misses %llu, trimmed %llu, free %u, in use "
+        "%u\n", gsTest, sStage, pStats->u64Hits, pStats->u64Misses,
+        pStats->u64Trimmed, pStats->dwFree, pStats->dwInUse);
+}
+
+/* Open and close a DMA handle with the SG DMA buffers pool, which must reuse
+ * its buffer. Then re-create the pool while a handle is open, in a loop, so
+ * that new pools may be allocated at the address of destroyed ones: The
+ * handle's buffer, of the destroyed pool, must not be returned to the new
+ * pool. Only a pool that the test created is destroyed */
+static BOOL TestSGPool(WDC_DEVICE_HANDLE hDev)
+{
+    XDMA_DMA_HANDLE hDma = NULL;
+    XDMA_SG_POOL_STATS stats;
+    DWORD i, dwStatus;
+    BOOL fCreated = FALSE, fPassed = FALSE;
+
+    dwStatus = XDMA_SGPoolCreate(hDev, NULL);
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        TestErr("Failed creating the pool. Error 0x%x - %s\n", dwStatus,
+            Stat2Str(dwStatus));
+        return FALSE;
+    }
+    fCreated = TRUE;
+
+    for (i = 0; i < TEST_SG_POOL_CYCLES; i++)
+    {
+        if (!TestDmaOpen(hDev, &hDma, TRUE))
+            goto Exit;
+        XDMA_DmaClose(hDma);
+        hDma = NULL;
+    }
+    if (!TestDmaOpen(hDev, &hDma, TRUE))
+        goto Exit;
+
+    /* The last handle is open */
+    XDMA_SGPoolStatsGet(hDev, &stats, NULL);
+    if (stats.u64Misses != 1 || stats.u64Hits != TEST_SG_POOL_CYCLES ||
+        stats.dwFree || stats.dwInUse != 1)
+    {
+        TestSGPoolStatsWrite("open/close cycles", &stats);
+        TestErr("The buffer was not reused\n");
+        goto Exit;
+    }
+
+    for (i = 0; i < TEST_SG_POOL_CYCLES; i++)
+    {
+        XDMA_SGPoolDestroy(hDev);
+        fCreated = FALSE;
+        dwStatus = XDMA_SGPoolCreate(hDev, NULL);
+        if (dwStatus != WD_STATUS_SUCCESS)
+        {
+            TestErr("Failed re-creating the pool. Error 0x%x - %s\n",
+                dwStatus, Stat2Str(dwStatus));
+            goto Exit;
+        }
+        fCreated = TRUE;
+
+        XDMA_DmaClose(hDma);
+        hDma = NULL;
+
+        XDMA_SGPoolStatsGet(hDev, &stats, NULL);
+        if (stats.dwFree || stats.dwInUse)
+        {
+            TestSGPoolStatsWrite("re-created pool", &stats);
+            TestErr("A buffer of the destroyed pool was returned to the new "
+                "pool\n");
+            goto Exit;
+        }
+
+        if (!TestDmaOpen(hDev, &hDma, TRUE))
+            goto Exit;
+    }
+
+    fPassed = TRUE;
+
+Exit:
+    if (hDma)
+        XDMA_DmaClose(hDma);
+    if (fCreated)
+        XDMA_SGPoolDestroy(hDev);
+
+    return fPassed;
+}
+
+/* Last completion of the queue-error test's queue, and its signal */
+static XDMA_DMA_COMPLETION gCompletion;
+static HANDLE ghCompletionEvent;
+
+static void TestIntHandler(WDC_DEVICE_HANDLE hDev,
+    XDMA_INT_RESULT *pIntResult)
+{
+    UNUSED_VAR(hDev);
+    UNUSED_VAR(pIntResult);
+}
+
+static void TestQueueCompletion(XDMA_DMA_COMPLETION *pCompletion)
+{
+    gCompletion = *pCompletion;
+    OsEventSignal(ghCompletionEvent);
+}
+
+/* Submit a DMA handle to an interrupt driven queue and wait for its
+ * completion */
+static BOOL TestQueueTransfer(XDMA_DMA_QUEUE_HANDLE hQueue,
+    XDMA_DMA_HANDLE hDma)
+{
+    DWORD dwStatus;
+
+    dwStatus = XDMA_DmaQueueSubmit(hQueue, hDma, NULL, NULL);
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        TestErr("Failed submitting a request. Error 0x%x - %s\n", dwStatus,
+            Stat2Str(dwStatus));
+        return FALSE;
+    }
+
+    if (OsEventWait(ghCompletionEvent, TEST_COMPLETION_TIMEOUT_SEC) !=
+        WD_STATUS_SUCCESS)
+    {
+        TestErr("The request did not complete\n");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Fail a request of an interrupt driven queue with an engine error. The
+ * interrupt handler's status read clears the error bits of the engine
+ * status, and the request must still complete with the error. The next
+ * request must complete successfully */
+static BOOL TestQueueError(WDC_DEVICE_HANDLE hDev)
+{
+    XDMA_DMA_QUEUE_HANDLE hQueue = NULL;
+    XDMA_DMA_HANDLE hDma = NULL;
+    DWORD dwStatus;
+    BOOL fPassed = FALSE;
+
+    dwStatus = OsEventCreate(&ghCompletionEvent);
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        TestErr("Failed creating an event. Error 0x%x - %s\n", dwStatus,
+            Stat2Str(dwStatus));
+        return FALSE;
+    }
+
+    dwStatus = XDMA_IntEnable(hDev, TestIntHandler);
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        TestErr("Failed enabling interrupts. Error 0x%x - %s\n", dwStatus,
+            Stat2Str(dwStatus));
+        OsEventClose(ghCompletionEvent);
+        return FALSE;
+    }
+
+    dwStatus = XDMA_DmaQueueOpen(hDev, &hQueue, TEST_CHANNEL, TRUE, 1, FALSE,
+        TestQueueCompletion);
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        hQueue = NULL;
+        TestErr("Failed opening a queue. Error 0x%x - %s\n", dwStatus,
+            Stat2Str(dwStatus));
+        goto Exit;
+    }
+
+    dwStatus = XDMA_DmaOpenEx(hDev, &hDma, TEST_BYTES, TEST_OFFSET, TRUE,
+        TEST_CHANNEL, FALSE, FALSE, NULL, XDMA_DMA_OPT_QUEUED);
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        hDma = NULL;
+        TestErr("Failed opening a queued DMA handle. Error 0x%x - %s\n",
+            dwStatus, Stat2Str(dwStatus));
+        goto Exit;
+    }
+
+    XDMA_SimEngineErrorInject(hDev, TRUE, TEST_CHANNEL, XDMA_STAT_READ_ERROR);
+    if (!TestQueueTransfer(hQueue, hDma))
+        goto Exit;
+
+    if (gCompletion.dwStatus != WD_OPERATION_FAILED ||
+        !(gCompletion.u32DmaStatus & XDMA_STAT_READ_ERROR))
+    {
+        TestErr("The failed request completed with status 0x%x, DMA status "
+            "0x%08x\n", gCompletion.dwStatus, gCompletion.u32DmaStatus);
+        goto Exit;
+    }
+
+    if (!TestQueueTransfer(hQueue, hDma))
+        goto Exit;
+
+    if (gCompletion.dwStatus != WD_STATUS_SUCCESS)
+    {
+        TestErr("The request after the failed one completed with status "
+            "0x%x, DMA status 0x%08x\n", gCompletion.dwStatus,
+            gCompletion.u32DmaStatus);
+        goto Exit;
+    }
+
+    fPassed = TRUE;
+
+Exit:
+    if (hQueue)
+        XDMA_DmaQueueClose(hQueue);
+    if (hDma)
+        XDMA_DmaClose(hDma);
+    XDMA_IntDisable(hDev);
+    OsEventClose(ghCompletionEvent);
+
+    return fPassed;
+}
+
+static const XDMA_SIM_TEST gTests[] = {
+    { "retarget", TestRetarget },
+    { "desc-pool-full", TestDescPoolFull },
+    { "sg-pool", TestSGPool },
+    { "queue-error", TestQueueError },
+};
+
+#define TESTS_NUM (sizeof(gTests) / sizeof(gTests[0]))
+
+/* Returns TRUE if the test is selected by the command line */
+static BOOL TestSelected(const char *sName, int argc, char *argv[])
+{
+    int i;
+
+    for (i = 1; i < argc && strcmp(argv[i], sName); i++)
+        ;
+
+    return argc == 1 || i < argc;
+}
+
+int main(int argc, char *argv[])
+{
+    WDC_DEVICE_HANDLE hDev;
+    DWORD i, dwStatus, dwFailures = 0;
+
+    dwStatus = XDMA_LibInit(NULL);
+    if (dwStatus != WD_STATUS_SUCCESS)
+    {
+        printf("Failed initializing the XDMA library. Error 0x%x - %s\n",
+            dwStatus, Stat2Str(dwStatus));
+        return EXIT_FAILURE;
+    }
+
+    hDev = XDMA_DeviceOpen(XDMA_DEFAULT_VENDOR_ID, XDMA_DEFAULT_DEVICE_ID);
+    if (!hDev)
+    {
+        printf("Failed opening the XDMA device\n");
+        XDMA_LibUninit();
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < TESTS_NUM; i++)
+    {
+        BOOL fPassed;
+
+        if (!TestSelected(gTests[i].sName, argc, argv))
+            continue;
+
+        gsTest = gTests[i].sName;
+        fPassed = gTests[i].funcTest(hDev);
+        printf("%s: %s\n", gsTest, fPassed ? "passed" : "FAILED");
+        if (!fPassed)
+            dwFailures++;
+    }
+
+    XDMA_DeviceClose(hDev);
+    XDMA_LibUninit();
+
+    return dwFailures ? EXIT_FAILURE : EXIT_SUCCESS;
+}